@@ -0,0 +1,62 @@
+#include <cstdio>
+#include <cstring>
+
+#include "benches.h"
+
+namespace
+{
+    struct Benchmark
+    {
+        const char *name;
+        int (*run)(int argc, char *argv[]);
+        bool runByDefault;
+    };
+
+    const Benchmark Benchmarks[] = {
+        {"search", search_bench, true},
+        {"walk", walk_bench, true},
+        {"output", output_bench, true},
+        {"end_to_end", end_to_end_bench, true},
+        {"large_file", large_file_bench, true},
+        {"scheduler", scheduler_bench, true},
+        {"result_layout", result_layout_bench, true},
+        {"corpus", corpus_command, false},
+    };
+}
+
+// GrepBench [name [args...]], runs every benchmark with its defaults when no name is given.
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        for (const auto &benchmark : Benchmarks)
+        {
+            if (!benchmark.runByDefault)
+            {
+                continue;
+            }
+            char *args[] = {const_cast<char *>(benchmark.name), nullptr};
+            if (benchmark.run(1, args) != 0)
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    for (const auto &benchmark : Benchmarks)
+    {
+        if (std::strcmp(argv[1], benchmark.name) == 0)
+        {
+            return benchmark.run(argc - 1, argv + 1);
+        }
+    }
+
+    std::fprintf(stderr, "Unknown benchmark %s, available:", argv[1]);
+    for (const auto &benchmark : Benchmarks)
+    {
+        std::fprintf(stderr, " %s", benchmark.name);
+    }
+    std::fprintf(stderr, "\n");
+    return 1;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+namespace grep_bench
+{
+    // Runs fn repeatedly and returns the best wall time in seconds, which filters out scheduler noise.
+    template <typename Function>
+    double best_of(int repetitions, Function &&fn)
+    {
+        double best = 1e300;
+        for (int i = 0; i < repetitions; ++i)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            fn();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = elapsed.count() < best ? elapsed.count() : best;
+        }
+        return best;
+    }
+
+    // Mean wall time in seconds, for benchmarks where occasional stalls are part of what is measured.
+    template <typename Function>
+    double mean_of(int repetitions, Function &&fn)
+    {
+        double total = 0;
+        for (int i = 0; i < repetitions; ++i)
+        {
+            total += best_of(1, fn);
+        }
+        return total / repetitions;
+    }
+
+    inline void print_header(const std::string &title)
+    {
+        std::printf("\n%s\n", title.c_str());
+        std::printf("%-40s %14s %14s\n", "benchmark", "seconds", "rate");
+    }
+
+    inline void print_rate(const std::string &name, double seconds, double units, const char *unit)
+    {
+        std::printf("%-40s %14.6f %11.2f %s\n", name.c_str(), seconds, units / seconds, unit);
+    }
+
+    inline void print_throughput_header(const std::string &title)
+    {
+        std::printf("\n%s\n", title.c_str());
+        std::printf("%-40s %14s %14s %16s\n", "benchmark", "seconds", "MB/s", "files/s");
+    }
+
+    inline void print_throughput(const std::string &name, double seconds, double bytes, double files)
+    {
+        std::printf("%-40s %14.6f %14.1f %16.0f\n", name.c_str(), seconds, bytes / seconds / 1e6, files / seconds);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Entry points of the GrepBench suite, argv[0] is the benchmark name followed by its own arguments.
+int scheduler_bench(int argc, char *argv[]);
+int result_layout_bench(int argc, char *argv[]);
+int search_bench(int argc, char *argv[]);
+int walk_bench(int argc, char *argv[]);
+int output_bench(int argc, char *argv[]);
+int end_to_end_bench(int argc, char *argv[]);
+int large_file_bench(int argc, char *argv[]);
+
+// Writes a corpus to a directory for manual runs, not a benchmark.
+int corpus_command(int argc, char *argv[]);
@@ -0,0 +1,190 @@
+#include "corpus.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+namespace grep_bench
+{
+    namespace
+    {
+        // splitmix64 with hand written distributions, the standard library ones differ between implementations.
+        class Random
+        {
+        public:
+            explicit Random(uint64_t seed)
+                : m_state(seed)
+            {
+            }
+
+            uint64_t next()
+            {
+                uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                return z ^ (z >> 31);
+            }
+
+            // Uniform in [0, bound).
+            size_t below(size_t bound) { return bound == 0 ? 0 : static_cast<size_t>(next() % bound); }
+
+            // Uniform in [0, 1).
+            double unit() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+            double normal()
+            {
+                const double u = 1.0 - unit();
+                return std::sqrt(-2.0 * std::log(u)) * std::cos(6.283185307179586 * unit());
+            }
+
+        private:
+            uint64_t m_state;
+        };
+
+        const char *const Words[] = {
+            "the", "of", "request", "thread", "buffer", "value", "return", "config", "while", "static",
+            "error", "index", "count", "string", "vector", "result", "const", "data", "file", "search",
+            "queue", "lock", "match", "line", "size", "offset", "pattern", "output", "input", "status"};
+
+        size_t file_size(Random &random, const CorpusOptions &options)
+        {
+            // Log-normal with the requested mean, clamped so one file can not dominate the corpus.
+            const double sigma = options.fileSizeSigma;
+            const double factor = std::exp(sigma * random.normal() - sigma * sigma / 2);
+            const double size = static_cast<double>(options.meanFileBytes) * factor;
+            return std::clamp<size_t>(static_cast<size_t>(size), 1, 64 * std::max<size_t>(options.meanFileBytes, 1));
+        }
+
+        fs::path directory_for(Random &random, const CorpusOptions &options)
+        {
+            fs::path directory;
+            const unsigned level = static_cast<unsigned>(random.below(options.depth + 1));
+            for (unsigned i = 0; i < level; ++i)
+            {
+                directory /= "d" + std::to_string(random.below(std::max(1u, options.fanout)));
+            }
+            return directory;
+        }
+
+        void append_line(Random &random, const CorpusOptions &options, std::string &content, size_t &matchingLines)
+        {
+            const size_t target = options.lineLength / 2 + random.below(options.lineLength + 1);
+            const size_t lineStart = content.size();
+            while (content.size() - lineStart < target)
+            {
+                if (content.size() != lineStart)
+                {
+                    content.push_back(' ');
+                }
+                content.append(Words[random.below(sizeof(Words) / sizeof(Words[0]))]);
+            }
+
+            if (random.unit() < options.matchDensity)
+            {
+                const size_t at = lineStart + random.below(content.size() - lineStart + 1);
+                content.insert(at, options.needle);
+                ++matchingLines;
+            }
+            content.push_back('\n');
+        }
+    }
+
+    Corpus generate_corpus(const fs::path &root, const CorpusOptions &options)
+    {
+        Random random(options.seed);
+        Corpus corpus;
+        corpus.root = root;
+
+        std::string content;
+        for (size_t i = 0; i < options.files; ++i)
+        {
+            const size_t size = file_size(random, options);
+            const fs::path directory = root / directory_for(random, options);
+            fs::create_directories(directory);
+
+            content.clear();
+            while (content.size() < size)
+            {
+                append_line(random, options, content, corpus.matchingLines);
+            }
+
+            std::ofstream file(directory / ("f" + std::to_string(i) + ".txt"), std::ios::binary);
+            file.write(content.data(), static_cast<std::streamsize>(content.size()));
+            ++corpus.files;
+            corpus.bytes += content.size();
+        }
+        return corpus;
+    }
+
+    bool parse_corpus_option(const std::string &arg, CorpusOptions &options)
+    {
+        const size_t equals = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || equals == std::string::npos)
+        {
+            return false;
+        }
+        const std::string name = arg.substr(2, equals - 2);
+        const char *value = arg.c_str() + equals + 1;
+        char *end = nullptr;
+
+        if (name == "density" || name == "size-sigma")
+        {
+            (name == "density" ? options.matchDensity : options.fileSizeSigma) = std::strtod(value, &end);
+        }
+        else
+        {
+            const unsigned long long number = std::strtoull(value, &end, 10);
+            if (name == "files")
+            {
+                options.files = number;
+            }
+            else if (name == "size")
+            {
+                options.meanFileBytes = number;
+            }
+            else if (name == "depth")
+            {
+                options.depth = static_cast<unsigned>(number);
+            }
+            else if (name == "fanout")
+            {
+                options.fanout = static_cast<unsigned>(number);
+            }
+            else if (name == "line-length")
+            {
+                options.lineLength = number;
+            }
+            else if (name == "seed")
+            {
+                options.seed = number;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return end != value && *end == '\0';
+    }
+
+    const char *corpus_usage()
+    {
+        return "[--files=N] [--size=BYTES] [--size-sigma=X] [--depth=N] [--fanout=N] [--density=X] [--line-length=N] [--seed=N]";
+    }
+
+    TemporaryCorpus::TemporaryCorpus(const CorpusOptions &options)
+    {
+        const fs::path root = fs::temp_directory_path() / ("grep_bench_corpus_" + std::to_string(::getpid()));
+        fs::remove_all(root);
+        m_corpus = generate_corpus(root, options);
+    }
+
+    TemporaryCorpus::~TemporaryCorpus()
+    {
+        std::error_code error;
+        fs::remove_all(m_corpus.root, error);
+    }
+}
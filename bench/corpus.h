@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace grep_bench
+{
+    namespace fs = std::filesystem;
+
+    struct CorpusOptions
+    {
+        size_t files = 2000;
+        size_t meanFileBytes = 16 * 1024;
+        double fileSizeSigma = 1.0; // spread of the log-normal file sizes, 0 gives equally sized files
+        unsigned depth = 3;         // deepest directory level below the root
+        unsigned fanout = 4;        // subdirectories per directory
+        double matchDensity = 0.01; // fraction of lines that contain the needle
+        size_t lineLength = 80;     // mean line length, lines vary between half and one and a half of it
+        uint64_t seed = 1;
+        std::string needle = "needle";
+    };
+
+    struct Corpus
+    {
+        fs::path root;
+        size_t files = 0;
+        size_t bytes = 0;
+        size_t matchingLines = 0;
+    };
+
+    // Writes a tree of text files below root that only depends on options, so runs on different
+    // machines and builds search the same bytes.
+    Corpus generate_corpus(const fs::path &root, const CorpusOptions &options);
+
+    // Reads --files=, --size=, --size-sigma=, --depth=, --fanout=, --density=, --line-length= and --seed=.
+    // Returns false for an unknown or malformed argument.
+    bool parse_corpus_option(const std::string &arg, CorpusOptions &options);
+    const char *corpus_usage();
+
+    // Corpus in a fresh temporary directory that is removed again on destruction.
+    class TemporaryCorpus
+    {
+    public:
+        explicit TemporaryCorpus(const CorpusOptions &options);
+        ~TemporaryCorpus();
+
+        TemporaryCorpus(const TemporaryCorpus &) = delete;
+        TemporaryCorpus &operator=(const TemporaryCorpus &) = delete;
+
+        const Corpus &corpus() const { return m_corpus; }
+
+    private:
+        Corpus m_corpus;
+    };
+}
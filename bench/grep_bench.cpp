@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_utils.h"
+#include "benches.h"
+#include "corpus.h"
+#include "grep_utils.h"
+#include "output_writer.h"
+#include "threadmanager.h"
+
+namespace
+{
+    using grep_bench::Corpus;
+    using grep_bench::CorpusOptions;
+
+    // Discards everything written to it, so output benchmarks measure formatting and not the terminal.
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int c) override { return c; }
+        std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
+    };
+
+    bool read_corpus_options(int argc, char *argv[], CorpusOptions &options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            if (!grep_bench::parse_corpus_option(argv[i], options))
+            {
+                std::fprintf(stderr, "Usage: GrepBench %s %s\n", argv[0], grep_bench::corpus_usage());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<grep::fs::path> corpus_files(const Corpus &corpus)
+    {
+        std::vector<grep::fs::path> files;
+        grep::find_files(corpus.root, [&files](grep::fs::path path)
+                         { files.push_back(std::move(path)); });
+        return files;
+    }
+
+    std::string describe(const Corpus &corpus)
+    {
+        return std::to_string(corpus.files) + " files, " + std::to_string(corpus.bytes / (1024 * 1024)) + " MiB, " +
+               std::to_string(corpus.matchingLines) + " matching lines";
+    }
+
+    // Searches every file like a worker does, chunks go straight back to the pool.
+    size_t search_all(const grep::Matcher &matcher, const std::vector<grep::fs::path> &files, grep::ResultPool &pool)
+    {
+        size_t lines = 0;
+        for (const auto &file : files)
+        {
+            grep::search_in_file(matcher, file, grep::SearchOptions{256 * 1024, grep::BinaryPolicy::Report, true}, pool, [&](grep::Result chunk, bool)
+                                 {
+                                     lines += chunk.line_count();
+                                     pool.release(std::move(chunk)); });
+        }
+        return lines;
+    }
+
+    // ThreadManager::search over the corpus for 1, 2, 4, ... up to all cores.
+    void search_per_thread_count(const Corpus &corpus, const std::string &needle, size_t splitBytes, const std::string &label)
+    {
+        const int devNull = ::open("/dev/null", O_WRONLY);
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1;; threads = std::min(threads * 2, cores))
+        {
+            const double seconds = grep_bench::best_of(3, [&]
+                                                       {
+                                                           grep::GrepOptions grepOptions;
+                                                           grepOptions.patterns = {needle};
+                                                           grepOptions.path = corpus.root.string();
+                                                           grepOptions.threads = threads;
+                                                           grepOptions.color = grep::ColorMode::Never;
+                                                           grepOptions.splitBytes = splitBytes;
+                                                           grep::OutputWriter writer(devNull);
+                                                           grep::ThreadManager(std::move(grepOptions), writer).search(); });
+            grep_bench::print_throughput(label + std::to_string(threads) + " threads", seconds,
+                                         static_cast<double>(corpus.bytes), static_cast<double>(corpus.files));
+            if (threads == cores)
+            {
+                break;
+            }
+        }
+        ::close(devNull);
+    }
+}
+
+int search_bench(int argc, char *argv[])
+{
+    CorpusOptions options;
+    if (!read_corpus_options(argc, argv, options))
+    {
+        return 1;
+    }
+    const grep_bench::TemporaryCorpus temporary(options);
+    const Corpus &corpus = temporary.corpus();
+    const auto files = corpus_files(corpus);
+
+    struct Case
+    {
+        const char *name;
+        std::vector<std::string> patterns;
+        grep::MatcherKind kind;
+    };
+    const Case cases[] = {
+        {"search_in_file, literal", {options.needle}, grep::MatcherKind::Auto},
+        {"search_in_file, 4 literals", {options.needle, "zebra", "quartz", "vortex"}, grep::MatcherKind::Auto},
+        {"search_in_file, 16 literals", {options.needle, "zebra", "quartz", "vortex", "amber", "blaze", "cobalt", "dune", "ember", "fjord", "glyph", "haze", "ivory", "jolt", "kiosk", "lumen"}, grep::MatcherKind::Auto},
+        {"search_in_file, -E with literal", {options.needle + " [a-z]+"}, grep::MatcherKind::Regex},
+        {"search_in_file, -E without literal", {"[a-z]{12}"}, grep::MatcherKind::Regex},
+    };
+
+    grep_bench::print_throughput_header("search_in_file, " + describe(corpus) + ", one thread, best of 3 runs");
+    for (const auto &benchCase : cases)
+    {
+        const auto matcher = grep::make_matcher(benchCase.patterns, benchCase.kind);
+        grep::ResultPool pool;
+        const double seconds = grep_bench::best_of(3, [&]
+                                                   { search_all(*matcher, files, pool); });
+        grep_bench::print_throughput(benchCase.name, seconds, static_cast<double>(corpus.bytes), static_cast<double>(files.size()));
+    }
+    return 0;
+}
+
+int walk_bench(int argc, char *argv[])
+{
+    CorpusOptions options;
+    options.meanFileBytes = 64; // the walk never reads the files, many small ones make the tree large cheaply
+    options.files = 20000;
+    if (!read_corpus_options(argc, argv, options))
+    {
+        return 1;
+    }
+    const grep_bench::TemporaryCorpus temporary(options);
+    const Corpus &corpus = temporary.corpus();
+
+    grep_bench::print_throughput_header("find_files, " + describe(corpus) + ", best of 5 runs");
+    size_t found = 0;
+    const double seconds = grep_bench::best_of(5, [&]
+                                               {
+                                                   found = 0;
+                                                   grep::find_files(corpus.root, [&found](grep::fs::path)
+                                                                    { ++found; }); });
+    grep_bench::print_throughput("find_files", seconds, static_cast<double>(corpus.bytes), static_cast<double>(found));
+    return 0;
+}
+
+int output_bench(int argc, char *argv[])
+{
+    CorpusOptions options;
+    options.matchDensity = 0.2; // enough results to make formatting measurable
+    if (!read_corpus_options(argc, argv, options))
+    {
+        return 1;
+    }
+    const grep_bench::TemporaryCorpus temporary(options);
+    const Corpus &corpus = temporary.corpus();
+
+    const auto matcher = grep::make_matcher({options.needle});
+    std::vector<grep::Result> results;
+    for (const auto &file : corpus_files(corpus))
+    {
+        grep::Result result = grep::search_in_file(*matcher, file);
+        if (!result.empty())
+        {
+            results.push_back(std::move(result));
+        }
+    }
+
+    std::string formatted;
+    for (const auto &result : results)
+    {
+        grep::format_result(result, formatted, true);
+    }
+    const double outputBytes = static_cast<double>(formatted.size());
+
+    // MB/s is formatted output, files/s are results of one file.
+    grep_bench::print_throughput_header("output, " + std::to_string(results.size()) + " results, " +
+                                        std::to_string(static_cast<size_t>(outputBytes) / 1024) + " KiB colored output, best of 5 runs");
+
+    NullBuffer null;
+    std::streambuf *original = std::cout.rdbuf(&null);
+    const double colored = grep_bench::best_of(5, [&]
+                                               {
+                                                   for (const auto &result : results)
+                                                   {
+                                                       grep::output_colored_result(result);
+                                                   } });
+    std::cout.rdbuf(original);
+    grep_bench::print_throughput("output_colored_result", colored, outputBytes, static_cast<double>(results.size()));
+
+    const double buffered = grep_bench::best_of(5, [&]
+                                                {
+                                                    formatted.clear();
+                                                    for (const auto &result : results)
+                                                    {
+                                                        grep::format_result(result, formatted, true);
+                                                    } });
+    grep_bench::print_throughput("format_result into one buffer", buffered, outputBytes, static_cast<double>(results.size()));
+    return 0;
+}
+
+int end_to_end_bench(int argc, char *argv[])
+{
+    CorpusOptions options;
+    if (!read_corpus_options(argc, argv, options))
+    {
+        return 1;
+    }
+    const grep_bench::TemporaryCorpus temporary(options);
+    const Corpus &corpus = temporary.corpus();
+
+    grep_bench::print_throughput_header("ThreadManager::search, " + describe(corpus) + ", best of 3 runs");
+    search_per_thread_count(corpus, options.needle, grep::GrepOptions().splitBytes, "search, ");
+    return 0;
+}
+
+int large_file_bench(int argc, char *argv[])
+{
+    CorpusOptions options;
+    options.files = 1;
+    options.meanFileBytes = 256 << 20;
+    options.fileSizeSigma = 0;
+    options.depth = 0;
+    if (!read_corpus_options(argc, argv, options))
+    {
+        return 1;
+    }
+    const grep_bench::TemporaryCorpus temporary(options);
+    const Corpus &corpus = temporary.corpus();
+
+    // Whole, one worker searches the file no matter how many there are. Split, the ranges are spread over all of them.
+    grep_bench::print_throughput_header("ThreadManager::search of one file, " + describe(corpus) + ", best of 3 runs");
+    search_per_thread_count(corpus, options.needle, SIZE_MAX, "whole, ");
+    search_per_thread_count(corpus, options.needle, grep::GrepOptions().splitBytes, "split, ");
+    return 0;
+}
+
+int corpus_command(int argc, char *argv[])
+{
+    CorpusOptions options;
+    bool valid = argc >= 2;
+    for (int i = 2; i < argc && valid; ++i)
+    {
+        valid = grep_bench::parse_corpus_option(argv[i], options);
+    }
+    if (!valid)
+    {
+        std::fprintf(stderr, "Usage: GrepBench corpus <directory> %s\n", grep_bench::corpus_usage());
+        return 1;
+    }
+    const Corpus corpus = grep_bench::generate_corpus(argv[1], options);
+    std::printf("%s: %s\n", corpus.root.c_str(), describe(corpus).c_str());
+    return 0;
+}
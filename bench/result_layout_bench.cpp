@@ -0,0 +1,110 @@
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "bench_utils.h"
+#include "benches.h"
+#include "result.h"
+#include "result_pool.h"
+
+// Counts every allocation of the calling thread, the layouts are compared by what they cost the heap.
+namespace
+{
+    thread_local size_t allocations = 0;
+}
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *memory = std::malloc(size == 0 ? 1 : size))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    using LineMatchResults = std::vector<std::pair<std::string, std::vector<grep::MatchPosition>>>;
+
+    // The layout before the arena: one string and one match vector per line, a fresh result per file.
+    size_t build_nested(const std::vector<std::string> &lines, size_t files)
+    {
+        size_t checksum = 0;
+        for (size_t file = 0; file < files; ++file)
+        {
+            LineMatchResults results;
+            for (const auto &line : lines)
+            {
+                std::vector<grep::MatchPosition> matches;
+                matches.emplace_back(4, 9);
+                results.emplace_back(line, std::move(matches));
+            }
+            std::pair<std::string, LineMatchResults> result("./corpus/file" + std::to_string(file) + ".log", std::move(results));
+            checksum += result.second.size();
+        }
+        return checksum;
+    }
+
+    size_t build_flat(const std::vector<std::string> &lines, size_t files, grep::ResultPool &pool)
+    {
+        size_t checksum = 0;
+        for (size_t file = 0; file < files; ++file)
+        {
+            grep::Result result = pool.acquire();
+            result.file_name = "./corpus/file" + std::to_string(file) + ".log";
+            for (const auto &line : lines)
+            {
+                result.add_line(line);
+                result.add_match(grep::MatchPosition(4, 9));
+            }
+            checksum += result.line_count();
+            pool.release(std::move(result));
+        }
+        return checksum;
+    }
+}
+
+int result_layout_bench(int argc, char *argv[])
+{
+    const size_t files = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    const size_t linesPerFile = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+
+    // Long enough to defeat the small string optimization, like most real lines.
+    const std::vector<std::string> lines(linesPerFile, "2024-01-01 12:00:00 worker needle found in a moderately long log line");
+
+    grep_bench::print_header("result layout, " + std::to_string(files) + " files with " + std::to_string(linesPerFile) +
+                             " matching lines, best of 5 runs");
+
+    size_t before = allocations;
+    build_nested(lines, files);
+    const size_t nestedAllocations = allocations - before;
+    const double nested = grep_bench::best_of(5, [&]
+                                              { build_nested(lines, files); });
+
+    grep::ResultPool pool;
+    before = allocations;
+    build_flat(lines, files, pool);
+    const size_t flatAllocations = allocations - before;
+    const double flat = grep_bench::best_of(5, [&]
+                                            { build_flat(lines, files, pool); });
+
+    grep_bench::print_rate("nested vectors", nested, files, "files/s");
+    grep_bench::print_rate("arena + pool", flat, files, "files/s");
+    std::printf("%-40s %14.2f\n", "nested vectors, allocations per file", static_cast<double>(nestedAllocations) / files);
+    std::printf("%-40s %14.2f\n", "arena + pool, allocations per file", static_cast<double>(flatAllocations) / files);
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_utils.h"
+#include "benches.h"
+#include "work_stealing_scheduler.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    constexpr size_t FileBatchSize = 64;
+
+    // Stand-in for searching a tiny file, so that the queue overhead dominates.
+    size_t process(const fs::path &path)
+    {
+        size_t hash = 0;
+        for (char c : path.native())
+        {
+            hash = hash * 31 + static_cast<unsigned char>(c);
+        }
+        return hash;
+    }
+
+    std::vector<fs::path> make_paths(size_t count)
+    {
+        std::vector<fs::path> paths;
+        paths.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            paths.emplace_back("./corpus/dir" + std::to_string(i % 97) + "/file" + std::to_string(i) + ".log");
+        }
+        return paths;
+    }
+
+    // The single mutex and condition variable queue ThreadManager used before the scheduler.
+    size_t run_locked_queue(const std::vector<fs::path> &paths, unsigned workers)
+    {
+        std::queue<fs::path> fileQueue;
+        std::mutex fileQueueMutex;
+        std::condition_variable cvInput;
+        std::atomic<bool> stopCollectFlag{false};
+        std::atomic<size_t> checksum{0};
+
+        std::vector<std::thread> threadPool;
+        for (unsigned i = 0; i < workers; ++i)
+        {
+            threadPool.emplace_back([&]
+                                    {
+                                        size_t local = 0;
+                                        while (true)
+                                        {
+                                            fs::path filepath;
+                                            {
+                                                std::unique_lock<std::mutex> lock(fileQueueMutex);
+                                                cvInput.wait(lock, [&]
+                                                             { return !fileQueue.empty() || stopCollectFlag; });
+                                                if (fileQueue.empty())
+                                                {
+                                                    break;
+                                                }
+                                                filepath = std::move(fileQueue.front());
+                                                fileQueue.pop();
+                                            }
+                                            local += process(filepath);
+                                        }
+                                        checksum += local;
+                                    });
+        }
+
+        for (const auto &path : paths)
+        {
+            std::unique_lock<std::mutex> lock(fileQueueMutex);
+            fileQueue.push(path);
+            cvInput.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(fileQueueMutex);
+            stopCollectFlag = true;
+        }
+        cvInput.notify_all();
+
+        for (auto &thread : threadPool)
+        {
+            thread.join();
+        }
+        return checksum;
+    }
+
+    size_t run_work_stealing(const std::vector<fs::path> &paths, unsigned workers)
+    {
+        grep::WorkStealingScheduler<fs::path> scheduler(workers);
+        std::atomic<size_t> checksum{0};
+
+        std::vector<std::thread> threadPool;
+        for (unsigned i = 0; i < workers; ++i)
+        {
+            threadPool.emplace_back([&, i]
+                                    {
+                                        size_t local = 0;
+                                        fs::path filepath;
+                                        while (scheduler.pop(i, filepath))
+                                        {
+                                            local += process(filepath);
+                                        }
+                                        checksum += local;
+                                    });
+        }
+
+        std::vector<fs::path> batch;
+        for (const auto &path : paths)
+        {
+            batch.push_back(path);
+            if (batch.size() == FileBatchSize)
+            {
+                scheduler.push_batch(std::move(batch));
+                batch.clear();
+            }
+        }
+        scheduler.push_batch(std::move(batch));
+        scheduler.close();
+
+        for (auto &thread : threadPool)
+        {
+            thread.join();
+        }
+        return checksum;
+    }
+}
+
+int scheduler_bench(int argc, char *argv[])
+{
+    const size_t fileCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000;
+    const auto paths = make_paths(fileCount);
+
+    // Mean instead of best time: the stalls of the old queue under a thundering herd are the point.
+    grep_bench::print_header("file queue scaling, " + std::to_string(fileCount) + " files, mean of 5 runs");
+    for (unsigned workers = 1; workers <= 64; workers *= 2)
+    {
+        const double locked = grep_bench::mean_of(5, [&]
+                                                  { run_locked_queue(paths, workers); });
+        const double stealing = grep_bench::mean_of(5, [&]
+                                                    { run_work_stealing(paths, workers); });
+        grep_bench::print_rate("mutex queue, " + std::to_string(workers) + " workers", locked, fileCount, "files/s");
+        grep_bench::print_rate("work stealing, " + std::to_string(workers) + " workers", stealing, fileCount, "files/s");
+    }
+    return 0;
+}
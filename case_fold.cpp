@@ -0,0 +1,153 @@
+#include "case_fold.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace grep
+{
+    namespace
+    {
+        // Code points first to last fold by adding delta. With stride 2 only every other one does, starting with first,
+        // the ones in between are the lower case letters of the pairs.
+        struct FoldRange
+        {
+            char32_t first;
+            char32_t last;
+            int32_t delta;
+            unsigned stride;
+        };
+
+        constexpr FoldRange FoldRanges[] = {
+            {0x0041, 0x005A, 32, 1},
+            {0x00C0, 0x00D6, 32, 1},
+            {0x00D8, 0x00DE, 32, 1},
+            {0x0100, 0x012F, 1, 2},
+            {0x0132, 0x0137, 1, 2},
+            {0x0139, 0x0148, 1, 2},
+            {0x014A, 0x0177, 1, 2},
+            {0x0178, 0x0178, -121, 1}, // Ÿ
+            {0x0179, 0x017E, 1, 2},
+            {0x017F, 0x017F, -268, 1}, // long s
+            {0x0386, 0x0386, 38, 1},
+            {0x0388, 0x038A, 37, 1},
+            {0x038C, 0x038C, 64, 1},
+            {0x038E, 0x038F, 63, 1},
+            {0x0391, 0x03A1, 32, 1},
+            {0x03A3, 0x03AB, 32, 1},
+            {0x03C2, 0x03C2, 1, 1}, // final sigma
+            {0x0400, 0x040F, 80, 1},
+            {0x0410, 0x042F, 32, 1},
+            {0x0460, 0x0481, 1, 2},
+            {0x048A, 0x04BF, 1, 2},
+            {0x0531, 0x0556, 48, 1},
+            {0x1E00, 0x1E95, 1, 2},
+            {0x1EA0, 0x1EFF, 1, 2},
+            {0x212A, 0x212A, -8383, 1}, // Kelvin sign
+            {0x212B, 0x212B, -8262, 1}, // Angstrom sign
+            {0xFF21, 0xFF3A, 32, 1},
+        };
+    }
+
+    char32_t simple_fold(char32_t c)
+    {
+        for (const auto &range : FoldRanges)
+        {
+            if (c >= range.first && c <= range.last)
+            {
+                return (c - range.first) % range.stride == 0 ? static_cast<char32_t>(static_cast<int32_t>(c) + range.delta) : c;
+            }
+        }
+        return c;
+    }
+
+    std::vector<char32_t> case_variants(char32_t c)
+    {
+        const char32_t folded = simple_fold(c);
+        std::vector<char32_t> variants{folded};
+        for (const auto &range : FoldRanges)
+        {
+            const char32_t from = static_cast<char32_t>(static_cast<int32_t>(folded) - range.delta);
+            if (from >= range.first && from <= range.last && (from - range.first) % range.stride == 0)
+            {
+                variants.push_back(from);
+            }
+        }
+        std::sort(variants.begin(), variants.end());
+        variants.erase(std::unique(variants.begin(), variants.end()), variants.end());
+        return variants;
+    }
+
+    bool decode_utf8(std::string_view text, size_t &pos, char32_t &c)
+    {
+        const unsigned char lead = static_cast<unsigned char>(text[pos]);
+        size_t length = lead < 0x80 ? 1 : (lead & 0xE0) == 0xC0 ? 2
+                                      : (lead & 0xF0) == 0xE0   ? 3
+                                      : (lead & 0xF8) == 0xF0   ? 4
+                                                                : 0;
+        if (length == 0 || pos + length > text.size())
+        {
+            return false;
+        }
+        c = length == 1 ? lead : lead & (0x7F >> length);
+        for (size_t i = 1; i < length; ++i)
+        {
+            const unsigned char next = static_cast<unsigned char>(text[pos + i]);
+            if ((next & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            c = (c << 6) | (next & 0x3F);
+        }
+        pos += length;
+        return true;
+    }
+
+    void append_utf8(std::string &out, char32_t c)
+    {
+        if (c < 0x80)
+        {
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (c >> 6));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (c >> 12));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | (c >> 18));
+            out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+
+    bool has_unicode_case(std::string_view text)
+    {
+        for (size_t pos = 0; pos < text.size();)
+        {
+            if (static_cast<unsigned char>(text[pos]) < 0x80)
+            {
+                ++pos;
+                continue;
+            }
+            char32_t c = 0;
+            if (!decode_utf8(text, pos, c))
+            {
+                ++pos;
+                continue;
+            }
+            if (case_variants(c).size() > 1)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace grep
+{
+    inline unsigned char ascii_lower(unsigned char c)
+    {
+        return c >= 'A' && c <= 'Z' ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+    }
+
+    inline bool is_ascii_letter(unsigned char c)
+    {
+        return ascii_lower(c) >= 'a' && ascii_lower(c) <= 'z';
+    }
+
+    // Simple case folding (one code point to one code point) for Latin-1, Latin Extended-A and Additional,
+    // Greek, Cyrillic, Armenian and the fullwidth Latin letters. Other code points fold to themselves.
+    char32_t simple_fold(char32_t c);
+
+    // Every code point with the same simple fold as c, c included.
+    std::vector<char32_t> case_variants(char32_t c);
+
+    // Decodes the UTF-8 sequence at text[pos] and advances pos past it, false for a malformed sequence.
+    bool decode_utf8(std::string_view text, size_t &pos, char32_t &c);
+    void append_utf8(std::string &out, char32_t c);
+
+    // True if text holds a non-ASCII character that has another case, which ASCII folding alone would miss.
+    bool has_unicode_case(std::string_view text);
+}
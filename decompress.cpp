@@ -0,0 +1,325 @@
+#include "decompress.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#ifdef GREP_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef GREP_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef GREP_WITH_LZMA
+#include <lzma.h>
+#endif
+
+namespace grep
+{
+    namespace
+    {
+        bool starts_with(std::string_view head, const char *magic, size_t length)
+        {
+            return head.size() >= length && std::memcmp(head.data(), magic, length) == 0;
+        }
+
+#ifdef GREP_WITH_ZLIB
+        class GzipDecoder : public Decoder
+        {
+        public:
+            GzipDecoder()
+            {
+                // 15 window bits plus 16: gzip framing only.
+                m_ok = ::inflateInit2(&m_stream, 15 + 16) == Z_OK;
+            }
+            ~GzipDecoder() override
+            {
+                ::inflateEnd(&m_stream);
+            }
+
+            bool decode(std::string_view &in, std::string &out, size_t capacity, bool &done) override
+            {
+                done = false;
+                if (!m_ok)
+                {
+                    return false;
+                }
+                const size_t start = out.size();
+                out.resize(start + capacity);
+
+                // zlib counts in 32 bits, larger inputs are fed over several calls.
+                const bool clamped = in.size() > UINT_MAX;
+                m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+                m_stream.avail_in = static_cast<uInt>(clamped ? UINT_MAX : in.size());
+                m_stream.next_out = reinterpret_cast<Bytef *>(&out[start]);
+                m_stream.avail_out = static_cast<uInt>(std::min<size_t>(capacity, UINT_MAX));
+
+                bool ok = true;
+                while (m_stream.avail_out > 0)
+                {
+                    const int status = ::inflate(&m_stream, Z_NO_FLUSH);
+                    if (status == Z_STREAM_END)
+                    {
+                        if (m_stream.avail_in == 0 && !clamped)
+                        {
+                            done = true;
+                            break;
+                        }
+                        ::inflateReset(&m_stream); // the next member of a concatenated file
+                    }
+                    else if (status != Z_OK)
+                    {
+                        // Out of input before the end of the stream: truncated, unless more is still to be fed.
+                        ok = status == Z_BUF_ERROR && clamped && m_stream.avail_in == 0;
+                        break;
+                    }
+                }
+
+                in.remove_prefix(reinterpret_cast<const char *>(m_stream.next_in) - in.data());
+                out.resize(reinterpret_cast<char *>(m_stream.next_out) - out.data());
+                return ok;
+            }
+
+        private:
+            z_stream m_stream{};
+            bool m_ok = false;
+        };
+#endif
+
+#ifdef GREP_WITH_ZSTD
+        class ZstdDecoder : public Decoder
+        {
+        public:
+            ZstdDecoder()
+                : m_stream(::ZSTD_createDStream())
+            {
+            }
+            ~ZstdDecoder() override
+            {
+                ::ZSTD_freeDStream(m_stream);
+            }
+
+            bool decode(std::string_view &in, std::string &out, size_t capacity, bool &done) override
+            {
+                done = false;
+                if (m_stream == nullptr)
+                {
+                    return false;
+                }
+                const size_t start = out.size();
+                out.resize(start + capacity);
+                ZSTD_inBuffer input{in.data(), in.size(), 0};
+                ZSTD_outBuffer output{&out[start], capacity, 0};
+
+                bool ok = true;
+                while (output.pos < output.size)
+                {
+                    const size_t status = ::ZSTD_decompressStream(m_stream, &output, &input);
+                    if (::ZSTD_isError(status))
+                    {
+                        ok = false;
+                        break;
+                    }
+                    if (input.pos == input.size)
+                    {
+                        // 0 once the last frame is complete and flushed, anything else with space left is a truncated frame.
+                        done = status == 0;
+                        ok = done || output.pos == output.size;
+                        break;
+                    }
+                }
+
+                in.remove_prefix(input.pos);
+                out.resize(start + output.pos);
+                return ok;
+            }
+
+        private:
+            ZSTD_DStream *m_stream;
+        };
+#endif
+
+#ifdef GREP_WITH_LZMA
+        class XzDecoder : public Decoder
+        {
+        public:
+            XzDecoder()
+            {
+                m_ok = ::lzma_stream_decoder(&m_stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+            }
+            ~XzDecoder() override
+            {
+                ::lzma_end(&m_stream);
+            }
+
+            bool decode(std::string_view &in, std::string &out, size_t capacity, bool &done) override
+            {
+                done = false;
+                if (!m_ok)
+                {
+                    return false;
+                }
+                const size_t start = out.size();
+                out.resize(start + capacity);
+                m_stream.next_in = reinterpret_cast<const uint8_t *>(in.data());
+                m_stream.avail_in = in.size();
+                m_stream.next_out = reinterpret_cast<uint8_t *>(&out[start]);
+                m_stream.avail_out = capacity;
+
+                // The whole file is always available, so every call may finish the stream.
+                bool ok = true;
+                while (m_stream.avail_out > 0)
+                {
+                    const lzma_ret status = ::lzma_code(&m_stream, LZMA_FINISH);
+                    if (status == LZMA_STREAM_END)
+                    {
+                        done = true;
+                        break;
+                    }
+                    if (status != LZMA_OK)
+                    {
+                        ok = false;
+                        break;
+                    }
+                }
+
+                in.remove_prefix(reinterpret_cast<const char *>(m_stream.next_in) - in.data());
+                out.resize(reinterpret_cast<char *>(m_stream.next_out) - out.data());
+                return ok;
+            }
+
+        private:
+            lzma_stream m_stream = LZMA_STREAM_INIT;
+            bool m_ok = false;
+        };
+#endif
+    }
+
+    Compression detect_compression(std::string_view head)
+    {
+        if (starts_with(head, "\x1f\x8b", 2))
+        {
+            return Compression::Gzip;
+        }
+        if (starts_with(head, "\x28\xb5\x2f\xfd", 4))
+        {
+            return Compression::Zstd;
+        }
+        if (starts_with(head, "\xfd\x37\x7a\x58\x5a\x00", 6))
+        {
+            return Compression::Xz;
+        }
+        return Compression::None;
+    }
+
+    bool can_decompress(Compression compression)
+    {
+        switch (compression)
+        {
+#ifdef GREP_WITH_ZLIB
+        case Compression::Gzip:
+            return true;
+#endif
+#ifdef GREP_WITH_ZSTD
+        case Compression::Zstd:
+            return true;
+#endif
+#ifdef GREP_WITH_LZMA
+        case Compression::Xz:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    std::unique_ptr<Decoder> make_decoder(Compression compression)
+    {
+        switch (compression)
+        {
+#ifdef GREP_WITH_ZLIB
+        case Compression::Gzip:
+            return std::make_unique<GzipDecoder>();
+#endif
+#ifdef GREP_WITH_ZSTD
+        case Compression::Zstd:
+            return std::make_unique<ZstdDecoder>();
+#endif
+#ifdef GREP_WITH_LZMA
+        case Compression::Xz:
+            return std::make_unique<XzDecoder>();
+#endif
+        default:
+            return nullptr;
+        }
+    }
+
+    std::string BlockQueue::acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.empty())
+        {
+            return std::string();
+        }
+        std::string block = std::move(m_free.back());
+        m_free.pop_back();
+        block.clear();
+        return block;
+    }
+
+    bool BlockQueue::push(std::string block)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]
+                       { return m_full.size() < m_capacity || m_cancelled; });
+        if (m_cancelled)
+        {
+            return false;
+        }
+        m_full.push_back(std::move(block));
+        m_changed.notify_all();
+        return true;
+    }
+
+    void BlockQueue::close(bool failed)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_failed = failed;
+        m_changed.notify_all();
+    }
+
+    bool BlockQueue::pop(std::string &block)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]
+                       { return !m_full.empty() || m_closed; });
+        if (m_full.empty())
+        {
+            return false;
+        }
+        block = std::move(m_full.front());
+        m_full.pop_front();
+        m_changed.notify_all();
+        return true;
+    }
+
+    void BlockQueue::release(std::string block)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(std::move(block));
+    }
+
+    void BlockQueue::cancel()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        m_changed.notify_all();
+    }
+
+    bool BlockQueue::failed() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_failed;
+    }
+}
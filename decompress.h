@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace grep
+{
+    enum class Compression
+    {
+        None,
+        Gzip,
+        Zstd,
+        Xz
+    };
+
+    // Recognizes the magic bytes at the start of a file, the file name does not matter.
+    Compression detect_compression(std::string_view head);
+
+    // True if the codec was compiled in (GREP_WITH_ZLIB, GREP_WITH_ZSTD, GREP_WITH_LZMA).
+    bool can_decompress(Compression compression);
+
+    // Streaming decoder of one compressed file, concatenated streams are decoded one after the other.
+    class Decoder
+    {
+    public:
+        virtual ~Decoder() = default;
+
+        // Consumes input from the front of in and appends at most capacity decoded bytes to out.
+        // Returns false for corrupt or truncated input, done is set once all of the input is decoded.
+        virtual bool decode(std::string_view &in, std::string &out, size_t capacity, bool &done) = 0;
+    };
+
+    // nullptr for Compression::None or a codec that was not compiled in.
+    std::unique_ptr<Decoder> make_decoder(Compression compression);
+
+    // Bounded queue of decoded blocks between the decoding stage and the search of one file.
+    // Blocks are recycled through the queue, so a file of any size is decoded into the same few buffers.
+    class BlockQueue
+    {
+    public:
+        explicit BlockQueue(size_t capacity)
+            : m_capacity(capacity)
+        {
+        }
+
+        // Producer side: an empty buffer to decode into, and handing it over once full.
+        // push returns false once the consumer cancelled, the producer is expected to stop.
+        std::string acquire();
+        bool push(std::string block);
+        // Ends the stream, failed if the input turned out to be corrupt.
+        void close(bool failed);
+
+        // Consumer side: waits for the next block, false once the stream ended.
+        bool pop(std::string &block);
+        void release(std::string block);
+        void cancel();
+        bool failed() const;
+
+    private:
+        const size_t m_capacity;
+        mutable std::mutex m_mutex;
+        std::condition_variable m_changed;
+        std::deque<std::string> m_full;
+        std::vector<std::string> m_free;
+        bool m_closed = false;
+        bool m_failed = false;
+        bool m_cancelled = false;
+    };
+}
@@ -0,0 +1,118 @@
+#include "file_buffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+namespace grep
+{
+    namespace
+    {
+        constexpr size_t ReadChunkSize = 1 << 20;
+
+        bool read_all(int fd, std::vector<char> &storage)
+        {
+            size_t used = 0;
+            while (true)
+            {
+                storage.resize(used + ReadChunkSize);
+                ssize_t count = ::read(fd, storage.data() + used, ReadChunkSize);
+                if (count < 0)
+                {
+                    return false;
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                used += static_cast<size_t>(count);
+            }
+            storage.resize(used);
+            return true;
+        }
+    }
+
+    FileBuffer::FileBuffer(const fs::path &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *mapped = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                ::madvise(mapped, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+                m_data = static_cast<const char *>(mapped);
+                m_size = static_cast<size_t>(st.st_size);
+                m_mapped = true;
+                m_open = true;
+            }
+        }
+
+        if (!m_open && read_all(fd, m_storage))
+        {
+            m_data = m_storage.data();
+            m_size = m_storage.size();
+            m_open = true;
+        }
+
+        ::close(fd);
+    }
+
+    FileBuffer::FileBuffer(std::vector<char> content)
+        : m_open(true),
+          m_storage(std::move(content))
+    {
+        m_data = m_storage.data();
+        m_size = m_storage.size();
+    }
+
+    FileBuffer::~FileBuffer()
+    {
+        release();
+    }
+
+    FileBuffer::FileBuffer(FileBuffer &&other) noexcept
+        : m_data(std::exchange(other.m_data, nullptr)),
+          m_size(std::exchange(other.m_size, 0)),
+          m_mapped(std::exchange(other.m_mapped, false)),
+          m_open(std::exchange(other.m_open, false)),
+          m_storage(std::move(other.m_storage))
+    {
+    }
+
+    FileBuffer &FileBuffer::operator=(FileBuffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            m_data = std::exchange(other.m_data, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+            m_mapped = std::exchange(other.m_mapped, false);
+            m_open = std::exchange(other.m_open, false);
+            m_storage = std::move(other.m_storage);
+        }
+        return *this;
+    }
+
+    void FileBuffer::release()
+    {
+        if (m_mapped)
+        {
+            ::munmap(const_cast<char *>(m_data), m_size);
+        }
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_open = false;
+        m_storage.clear();
+    }
+}
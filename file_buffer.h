@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+namespace grep
+{
+    namespace fs = std::filesystem;
+
+    // Read-only view over the whole content of a file.
+    // Regular files are memory mapped, anything mmap refuses (empty or special files)
+    // is read in large chunks into an owned buffer instead.
+    class FileBuffer
+    {
+    public:
+        FileBuffer() = default;
+        explicit FileBuffer(const fs::path &path);
+        // Takes over content that was already read, e.g. by the FileReader.
+        explicit FileBuffer(std::vector<char> content);
+        ~FileBuffer();
+
+        FileBuffer(FileBuffer &&other) noexcept;
+        FileBuffer &operator=(FileBuffer &&other) noexcept;
+        FileBuffer(const FileBuffer &) = delete;
+        FileBuffer &operator=(const FileBuffer &) = delete;
+
+    public:
+        bool is_open() const { return m_open; }
+        const char *data() const { return m_data; }
+        size_t size() const { return m_size; }
+        std::string_view view() const { return std::string_view(m_data, m_size); }
+
+    private:
+        void release();
+
+    private:
+        const char *m_data = nullptr;
+        size_t m_size = 0;
+        bool m_mapped = false;
+        bool m_open = false;
+        std::vector<char> m_storage;
+    };
+}
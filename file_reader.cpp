@@ -0,0 +1,507 @@
+#include "file_reader.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef GREP_WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace grep
+{
+    namespace
+    {
+        constexpr size_t MaxReadBytes = 1 << 30; // per read call, larger files take several
+
+        // Size of a regular file, false for anything that is read by the caller instead.
+        bool regular_size(int fd, size_t maxFileBytes, size_t &size)
+        {
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) > maxFileBytes)
+            {
+                return false;
+            }
+            size = static_cast<size_t>(st.st_size);
+            return true;
+        }
+    }
+
+#ifdef GREP_WITH_IO_URING
+    // Minimal io_uring on the raw system calls, one thread submits and reaps.
+    class FileReader::Ring
+    {
+    public:
+        // nullptr if the kernel has no io_uring, forbids it or lacks asynchronous openat and read.
+        static std::unique_ptr<Ring> create(unsigned entries)
+        {
+            io_uring_params params{};
+            const int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+            {
+                return nullptr;
+            }
+            std::unique_ptr<Ring> ring(new Ring(fd));
+            if (!ring->supports(IORING_OP_OPENAT) || !ring->supports(IORING_OP_READ) || !ring->map(params))
+            {
+                return nullptr;
+            }
+            return ring;
+        }
+
+        ~Ring()
+        {
+            if (m_sqes != nullptr)
+            {
+                ::munmap(m_sqes, m_sqesBytes);
+            }
+            if (m_cqRing != nullptr && m_cqRing != m_sqRing)
+            {
+                ::munmap(m_cqRing, m_cqRingBytes);
+            }
+            if (m_sqRing != nullptr)
+            {
+                ::munmap(m_sqRing, m_sqRingBytes);
+            }
+            ::close(m_fd);
+        }
+
+        // A cleared entry that is submitted with the next call to submit_and_wait.
+        io_uring_sqe &next_entry(uint64_t userData)
+        {
+            const unsigned tail = *m_sqTail;
+            const unsigned index = tail & *m_sqMask;
+            io_uring_sqe &entry = m_sqes[index];
+            std::memset(&entry, 0, sizeof(entry));
+            entry.user_data = userData;
+            m_sqArray[index] = index;
+            __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++m_unsubmitted;
+            return entry;
+        }
+
+        void submit_and_wait(unsigned completions)
+        {
+            while (true)
+            {
+                const long submitted = ::syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, completions, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (submitted >= 0)
+                {
+                    m_unsubmitted -= static_cast<unsigned>(submitted);
+                    return;
+                }
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+                }
+            }
+        }
+
+        template <typename Handle>
+        void for_each_completion(Handle &&handle)
+        {
+            unsigned head = *m_cqHead;
+            const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head)
+            {
+                const io_uring_cqe &completion = m_cqes[head & *m_cqMask];
+                handle(completion.user_data, completion.res);
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        }
+
+    private:
+        explicit Ring(int fd)
+            : m_fd(fd)
+        {
+        }
+
+        bool supports(unsigned opcode) const
+        {
+            std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+            auto *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+            return ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+                   opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+
+        bool map(const io_uring_params &params)
+        {
+            m_sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+            {
+                m_sqRingBytes = m_cqRingBytes = std::max(m_sqRingBytes, m_cqRingBytes);
+            }
+
+            void *sq = ::mmap(nullptr, m_sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (sq == MAP_FAILED)
+            {
+                return false;
+            }
+            m_sqRing = static_cast<char *>(sq);
+            void *cq = single ? sq : ::mmap(nullptr, m_cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED)
+            {
+                return false;
+            }
+            m_cqRing = static_cast<char *>(cq);
+            m_sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+            void *sqes = ::mmap(nullptr, m_sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+            {
+                return false;
+            }
+            m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+            m_sqTail = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.tail);
+            m_sqMask = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.ring_mask);
+            m_sqArray = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.array);
+            m_cqHead = reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.head);
+            m_cqTail = reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.tail);
+            m_cqMask = reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe *>(m_cqRing + params.cq_off.cqes);
+            return true;
+        }
+
+    private:
+        int m_fd;
+        char *m_sqRing = nullptr;
+        char *m_cqRing = nullptr;
+        size_t m_sqRingBytes = 0;
+        size_t m_cqRingBytes = 0;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sqesBytes = 0;
+        unsigned *m_sqTail = nullptr;
+        unsigned *m_sqMask = nullptr;
+        unsigned *m_sqArray = nullptr;
+        unsigned *m_cqHead = nullptr;
+        unsigned *m_cqTail = nullptr;
+        unsigned *m_cqMask = nullptr;
+        io_uring_cqe *m_cqes = nullptr;
+        unsigned m_unsubmitted = 0;
+    };
+#else
+    class FileReader::Ring
+    {
+    };
+#endif
+
+    FileReader::FileReader(unsigned depth, size_t maxFileBytes, Deliver deliver, bool allowIoUring)
+        : m_depth(std::max(depth, 1u)),
+          m_maxFileBytes(maxFileBytes),
+          m_deliver(std::move(deliver))
+    {
+#ifdef GREP_WITH_IO_URING
+        if (allowIoUring)
+        {
+            m_ring = Ring::create(m_depth);
+        }
+#else
+        (void)allowIoUring;
+#endif
+        if (m_ring)
+        {
+            m_threads.emplace_back(&FileReader::read_with_ring, this);
+            return;
+        }
+        for (unsigned i = 0; i < m_depth; ++i)
+        {
+            m_threads.emplace_back(&FileReader::read_with_pread, this);
+        }
+    }
+
+    FileReader::~FileReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+        }
+        m_changed.notify_all();
+        for (auto &thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    FileReader::Clock::Clock(FileReader &reader)
+        : m_reader(reader),
+          m_since(std::chrono::steady_clock::now())
+    {
+    }
+
+    void FileReader::Clock::lap(std::atomic<uint64_t> &nanos)
+    {
+        if (!m_reader.m_collectStats.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        // Time before the last take_stats() belongs to the previous search.
+        const auto since = std::max(m_since, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(m_reader.m_statsSince.load(std::memory_order_relaxed))));
+        if (now > since)
+        {
+            nanos.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count()), std::memory_order_relaxed);
+        }
+        m_since = now;
+    }
+
+    void FileReader::count_read(size_t bytes)
+    {
+        if (m_collectStats.load(std::memory_order_relaxed))
+        {
+            m_files.fetch_add(1, std::memory_order_relaxed);
+            m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    ThreadStats FileReader::take_stats()
+    {
+        m_statsSince.store(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(),
+                           std::memory_order_relaxed);
+        ThreadStats stats;
+        stats.nanos[static_cast<unsigned>(Phase::Read)] = m_readNanos.exchange(0, std::memory_order_relaxed);
+        stats.nanos[static_cast<unsigned>(Phase::Idle)] = m_idleNanos.exchange(0, std::memory_order_relaxed);
+        stats.counters[static_cast<unsigned>(Counter::Files)] = m_files.exchange(0, std::memory_order_relaxed);
+        stats.counters[static_cast<unsigned>(Counter::Bytes)] = m_bytes.exchange(0, std::memory_order_relaxed);
+        return stats;
+    }
+
+    void FileReader::submit(fs::path path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(std::move(path));
+        }
+        m_changed.notify_one();
+    }
+
+    void FileReader::drop_pending()
+    {
+        std::deque<fs::path> dropped;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            dropped.swap(m_pending);
+        }
+        for (auto &path : dropped)
+        {
+            m_deliver(std::move(path), nullptr);
+        }
+    }
+
+    bool FileReader::next_path(fs::path &path, bool wait)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto ready = [this]
+        { return !m_pending.empty() && m_loaded < 2 * size_t(m_depth); };
+        if (wait)
+        {
+            m_changed.wait(lock, [&]
+                           { return ready() || (m_stopped && m_pending.empty()); });
+        }
+        if (!ready())
+        {
+            return false;
+        }
+        path = std::move(m_pending.front());
+        m_pending.pop_front();
+        ++m_loaded;
+        return true;
+    }
+
+    void FileReader::release_buffer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_loaded;
+        }
+        m_changed.notify_all();
+    }
+
+    void FileReader::deliver(fs::path path, std::vector<char> content)
+    {
+        // The deleter gives the slot back, whoever drops the last reference to the file.
+        std::shared_ptr<const FileBuffer> file(new FileBuffer(std::move(content)), [this](const FileBuffer *buffer)
+                                               {
+                                                   delete buffer;
+                                                   release_buffer(); });
+        m_deliver(std::move(path), std::move(file));
+    }
+
+    void FileReader::read_with_pread()
+    {
+        Clock clock(*this);
+        fs::path path;
+        while (true)
+        {
+            clock.lap(m_readNanos);
+            const bool next = next_path(path, true);
+            clock.lap(m_idleNanos);
+            if (!next)
+            {
+                break;
+            }
+
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            size_t size = 0;
+            bool read = fd >= 0 && regular_size(fd, m_maxFileBytes, size);
+            std::vector<char> content(read ? size : 0);
+            size_t offset = 0;
+            while (read && offset < size)
+            {
+                const ssize_t count = ::pread(fd, content.data() + offset, std::min(size - offset, MaxReadBytes), static_cast<off_t>(offset));
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                read = count >= 0;
+                if (count <= 0)
+                {
+                    break; // a file that shrank ends early
+                }
+                offset += static_cast<size_t>(count);
+            }
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+
+            if (read)
+            {
+                content.resize(offset);
+                count_read(offset);
+                deliver(std::move(path), std::move(content));
+            }
+            else
+            {
+                release_buffer();
+                m_deliver(std::move(path), nullptr);
+            }
+        }
+    }
+
+#ifdef GREP_WITH_IO_URING
+    void FileReader::read_with_ring()
+    {
+        // Every read is an openat followed by as many reads as the file needs, one request per slot at a time.
+        struct Slot
+        {
+            fs::path path;
+            int fd = -1;
+            std::vector<char> content;
+            size_t offset = 0;
+        };
+        std::vector<Slot> slots(m_depth);
+        std::vector<uint64_t> idle(m_depth);
+        for (unsigned i = 0; i < m_depth; ++i)
+        {
+            idle[i] = m_depth - 1 - i;
+        }
+
+        auto queue_read = [&](uint64_t id)
+        {
+            Slot &slot = slots[id];
+            io_uring_sqe &entry = m_ring->next_entry(id);
+            entry.opcode = IORING_OP_READ;
+            entry.fd = slot.fd;
+            entry.addr = reinterpret_cast<uint64_t>(slot.content.data() + slot.offset);
+            entry.len = static_cast<uint32_t>(std::min(slot.content.size() - slot.offset, MaxReadBytes));
+            entry.off = slot.offset;
+        };
+        auto finish = [&](uint64_t id, bool read)
+        {
+            Slot &slot = slots[id];
+            if (slot.fd >= 0)
+            {
+                ::close(slot.fd);
+                slot.fd = -1;
+            }
+            if (read)
+            {
+                slot.content.resize(slot.offset);
+                count_read(slot.offset);
+                deliver(std::move(slot.path), std::move(slot.content));
+            }
+            else
+            {
+                release_buffer();
+                m_deliver(std::move(slot.path), nullptr);
+            }
+            slot = Slot();
+            idle.push_back(id);
+        };
+
+        // Waiting for a path with nothing in flight is Idle, everything else, submitting and waiting for completions, is Read.
+        Clock clock(*this);
+        fs::path path;
+        while (true)
+        {
+            clock.lap(m_readNanos);
+            while (!idle.empty() && next_path(path, idle.size() == m_depth))
+            {
+                clock.lap(idle.size() == m_depth ? m_idleNanos : m_readNanos);
+                const uint64_t id = idle.back();
+                idle.pop_back();
+                Slot &slot = slots[id];
+                slot.path = std::move(path);
+                io_uring_sqe &entry = m_ring->next_entry(id);
+                entry.opcode = IORING_OP_OPENAT;
+                entry.fd = AT_FDCWD;
+                entry.addr = reinterpret_cast<uint64_t>(slot.path.c_str());
+                entry.open_flags = O_RDONLY | O_CLOEXEC;
+            }
+            if (idle.size() == m_depth)
+            {
+                return; // stopped with nothing pending
+            }
+
+            m_ring->submit_and_wait(1);
+            m_ring->for_each_completion([&](uint64_t id, int result)
+                                        {
+                                            Slot &slot = slots[id];
+                                            if (result < 0)
+                                            {
+                                                finish(id, false);
+                                            }
+                                            else if (slot.fd < 0)
+                                            {
+                                                slot.fd = result;
+                                                size_t size = 0;
+                                                if (!regular_size(slot.fd, m_maxFileBytes, size))
+                                                {
+                                                    finish(id, false);
+                                                    return;
+                                                }
+                                                slot.content.resize(size);
+                                                if (size == 0)
+                                                {
+                                                    finish(id, true);
+                                                    return;
+                                                }
+                                                queue_read(id);
+                                            }
+                                            else
+                                            {
+                                                slot.offset += static_cast<size_t>(result);
+                                                if (result == 0 || slot.offset == slot.content.size())
+                                                {
+                                                    finish(id, true); // a file that shrank ends early
+                                                    return;
+                                                }
+                                                queue_read(id);
+                                            } });
+        }
+    }
+#else
+    void FileReader::read_with_ring()
+    {
+    }
+#endif
+}
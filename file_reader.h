@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "file_buffer.h"
+#include "search_stats.h"
+
+namespace grep
+{
+    namespace fs = std::filesystem;
+
+    // I/O stage in front of the search workers: reads whole files into memory with up to depth reads in flight,
+    // so workers on cold caches or slow storage find their files already loaded instead of waiting on page faults.
+    // Reads go through one io_uring (GREP_WITH_IO_URING) where the kernel offers it and through depth threads
+    // doing open and pread otherwise. At most twice depth files are loaded and not yet released at any time,
+    // a buffer is released when the last shared_ptr to it goes away.
+    class FileReader
+    {
+    public:
+        // Called on an I/O thread. file is nullptr for files larger than maxFileBytes, special files and files that
+        // can not be read, the caller opens those itself.
+        using Deliver = std::function<void(fs::path path, std::shared_ptr<const FileBuffer> file)>;
+
+        FileReader(unsigned depth, size_t maxFileBytes, Deliver deliver, bool allowIoUring = true);
+        ~FileReader(); // delivers every submitted file before returning
+
+        FileReader(const FileReader &) = delete;
+        FileReader &operator=(const FileReader &) = delete;
+
+    public:
+        void submit(fs::path path);
+        // Delivers every file not being read yet as nullptr on the calling thread, for a search that was cancelled.
+        void drop_pending();
+        bool uses_io_uring() const { return m_ring != nullptr; }
+
+        // Times and counts the I/O threads from now on, needs GREP_WITH_STATS.
+        void collect_stats() { m_collectStats.store(StatsCompiledIn, std::memory_order_relaxed); }
+        // The totals of all I/O threads since the last call: Read and Idle time, Files and Bytes read.
+        ThreadStats take_stats();
+
+    private:
+        class Ring;
+
+        // Charges the time of an I/O thread to Read or Idle while stats are collected.
+        class Clock
+        {
+        public:
+            explicit Clock(FileReader &reader);
+            // Adds the time since the last lap, from the last take_stats() on, to nanos.
+            void lap(std::atomic<uint64_t> &nanos);
+
+        private:
+            FileReader &m_reader;
+            std::chrono::steady_clock::time_point m_since;
+        };
+        void count_read(size_t bytes);
+
+        // Waits for a path while fewer than the allowed files are loaded, false once stopped and nothing is pending.
+        bool next_path(fs::path &path, bool wait);
+        void release_buffer();
+        void deliver(fs::path path, std::vector<char> content);
+        void read_with_pread();
+        void read_with_ring();
+
+    private:
+        const unsigned m_depth;
+        const size_t m_maxFileBytes;
+        const Deliver m_deliver;
+        std::unique_ptr<Ring> m_ring;
+
+        std::mutex m_mutex;
+        std::condition_variable m_changed;
+        std::deque<fs::path> m_pending;
+        size_t m_loaded = 0; // reads in flight and loaded files not yet released
+        bool m_stopped = false;
+
+        std::atomic<bool> m_collectStats{false};
+        std::atomic<int64_t> m_statsSince{0}; // steady clock ns of the last take_stats()
+        std::atomic<uint64_t> m_readNanos{0};
+        std::atomic<uint64_t> m_idleNanos{0};
+        std::atomic<uint64_t> m_files{0};
+        std::atomic<uint64_t> m_bytes{0};
+
+        std::vector<std::thread> m_threads;
+    };
+}
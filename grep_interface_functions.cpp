@@ -1,39 +1,104 @@
 #include "grep_interface_functions.h"
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 #include "grep_utils.h"
+#include "output_writer.h"
 #include "threadmanager.h"
+#include "trigram_index.h"
 #include "result.h"
 
 namespace grep
 {
-    void grep(int argc, char *argv[])
+    int grep(int argc, char *argv[])
     {
-
-        auto [pattern, path] = grep::read_grep_arguments(argc, argv);
-        if (pattern.empty())
+        auto options = grep::read_grep_arguments(argc, argv);
+        if (!options.buildIndex.empty())
         {
-            return;
+            return grep::build_index(options) ? 0 : 2;
+        }
+        if (options.patterns.empty())
+        {
+            return 2;
         }
 
-        grep::grep(std::move(pattern), std::move(path));
+        return grep::grep(std::move(options));
     }
 
-    void grep(std::string pattern, std::string path)
+    int grep(std::string pattern, std::string path)
     {
-        try
+        GrepOptions options;
+        options.patterns.push_back(std::move(pattern));
+        options.path = std::move(path);
+        options.color = ColorMode::Always;
+        return grep::grep(std::move(options), std::cout);
+    }
+
+    namespace
+    {
+        int run(GrepOptions options, OutputWriter &writer)
         {
-            ThreadManager threadManager(std::move(path), std::move(pattern));
-            threadManager.search();
+            try
+            {
+                const StatsFormat statsFormat = options.stats;
+                if (statsFormat != StatsFormat::None && !StatsCompiledIn)
+                {
+                    std::cerr << "Warning: --stats needs a build with GREP_WITH_STATS" << std::endl;
+                }
+                ThreadManager threadManager(std::move(options), writer);
+                const bool matched = threadManager.search();
+                if (statsFormat == StatsFormat::Text && StatsCompiledIn)
+                {
+                    threadManager.stats().print(std::cerr);
+                }
+                else if (statsFormat == StatsFormat::Json && StatsCompiledIn)
+                {
+                    threadManager.stats().print_json(std::cerr);
+                }
+                return matched ? 0 : 1;
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Exception caught in grep: " << e.what() << std::endl;
+            }
+            catch (...)
+            {
+                std::cerr << "Unknown exception caught in grep." << std::endl;
+            }
+            return 2;
         }
-        catch (const std::exception &e)
+    }
+
+    bool build_index(const GrepOptions &options)
+    {
+        try
         {
-            std::cerr << "Exception caught in grep: " << e.what() << std::endl;
+            const unsigned threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+            const IndexUpdate update = update_index(options.buildIndex, threads);
+            std::cout << "Indexed " << update.files << " files in " << options.buildIndex << ", " << update.reindexed
+                      << " read, " << update.removed << " removed" << std::endl;
+            return true;
         }
-        catch (...)
+        catch (const std::exception &e)
         {
-            std::cerr << "Unknown exception caught in grep." << std::endl;
+            std::cerr << "Error: " << e.what() << std::endl;
         }
+        return false;
+    }
+
+    int grep(GrepOptions options)
+    {
+        OutputWriter writer(STDOUT_FILENO);
+        return run(std::move(options), writer);
+    }
+
+    int grep(GrepOptions options, std::ostream &out)
+    {
+        OutputWriter writer(out);
+        return run(std::move(options), writer);
     }
 }
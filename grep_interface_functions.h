@@ -1,11 +1,20 @@
 #pragma once
 
+#include <iosfwd>
 #include <string>
 
+#include "options.h"
+
 namespace grep
 {    
-    void grep(int argc, char *argv[]);
-    void grep(std::string pattern, std::string path);
+    // The exit status of grep: 0 if a line matched, 1 if none did, 2 for invalid arguments or an error.
+    int grep(int argc, char *argv[]);
+    int grep(std::string pattern, std::string path);
+    // Writes to the stdout file descriptor, colors are only used for a terminal unless options.color says otherwise.
+    int grep(GrepOptions options);
+    int grep(GrepOptions options, std::ostream &out);
+    // Creates or updates the trigram index of options.buildIndex, false if it could not be built or written.
+    bool build_index(const GrepOptions &options);
 }
 
 
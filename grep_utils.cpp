@@ -1,116 +1,1087 @@
 #include "grep_utils.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <iostream>
+#include <thread>
+
+#include "decompress.h"
+#include "file_buffer.h"
+#include "literal_search.h"
+#include "result_cache.h"
 
 namespace grep
 {
-    std::pair<std::string, std::string> read_grep_arguments(int argc, char *argv[])
+    namespace
     {
-        if (argc != 3)
+        constexpr size_t BinaryProbeBytes = 32 * 1024;
+        constexpr size_t DecodeBlockBytes = 256 * 1024;
+        constexpr size_t DecodeQueueBlocks = 4;
+        constexpr size_t InlineDecodeBytes = 64 * 1024; // smaller compressed files are not worth a thread
+        constexpr size_t MinRangeBytes = 1 << 20;
+        constexpr size_t CancelCheckBytes = 1 << 20; // a cancellable search looks at the flag at least this often
+
+        void print_usage()
         {
-            std::cerr << "Error: Invalid input. Please provide exactly two arguments:\n"
-                         "1. A search pattern (string).\n"
+            std::cerr << "Error: Invalid input. Please provide a search pattern and a path:\n"
+                         "1. A search pattern (string), or one or more -e PATTERN / -f PATTERN_FILE options.\n"
                          "2. A path to a file or directory.\n"
-                         "Usage: grep_test <pattern> <file_or_directory_path>"
+                         "Usage: grep_test [-E] [-i] [-l|-c|-q] [-m num] [-A num] [-B num] [-C num] [-n] [-b] [--sort=path|none] [--json|--binary-output] [--index] [--cache] [--cache-dir=dir] [--cache-size=bytes] [-j threads] [--color=auto|always|never] [--result-budget=bytes] [--split-size=bytes] [--io-depth=n] [--stats[=json]] [--include=glob]... [--exclude=glob]... [--exclude-dir=glob]... [--no-ignore] [--binary-files=binary|without-match|text] [-I] [-a] [--no-decompress] [-e pattern]... [-f pattern_file]... [pattern] <file_or_directory_path>\n"
+                         "       grep_test [-j threads] --build-index <directory>"
                       << std::endl;
-            return {"", ""};
         }
-        return {std::string(argv[1]), std::string(argv[2])};
+
+        // A whole decimal number that fits value, anything else (signs, trailing characters, nothing at all) is rejected.
+        template <typename T>
+        bool parse_number(const char *text, T &value)
+        {
+            const char *end = text + std::strlen(text);
+            const auto parsed = std::from_chars(text, end, value);
+            return text != end && parsed.ec == std::errc() && parsed.ptr == end;
+        }
+
+        GrepOptions invalid_number(const std::string &option, const char *text)
+        {
+            std::cerr << "Error: Invalid number for " << option << ": '" << text << "'" << std::endl;
+            print_usage();
+            return GrepOptions();
+        }
+
+        bool read_pattern_file(const std::string &filename, std::vector<std::string> &patterns)
+        {
+            std::ifstream file(filename);
+            if (!file.is_open())
+            {
+                std::cerr << "Error: Can not read pattern file: " << filename << std::endl;
+                return false;
+            }
+            // An empty line is an empty pattern, which matches every line, as in GNU grep.
+            std::string line;
+            while (std::getline(file, line))
+            {
+                patterns.push_back(std::move(line));
+            }
+            return true;
+        }
+
+        // Collects the matching lines of one file into chunks of about options.chunkBytes line text and hands them over.
+        // A binary file only gets a single result that reports the first match. In the counting modes (-l, -c, -q)
+        // no line is collected at all and a single counted result is handed over at the end.
+        // Context lines (-A, -B) are located like the matching lines, around the hits only: the lines after a match
+        // are taken as the scan moves on, the ones before it by looking back from the hit, never past the last line
+        // already collected, so overlapping windows merge by themselves. Only the lines before a hit that belong to
+        // an earlier buffer (a decoded block or a slice) are gone by then, the last beforeContext of those are kept copied.
+        // Line numbers (-n) are counted lazily as well: the line breaks between the last collected line and the next one
+        // are only counted once there is a next one, a file without a match is never counted at all.
+        class LineCollector
+        {
+        public:
+            LineCollector(const Matcher &matcher, const fs::path &filepath, const SearchOptions &options, ResultPool &pool,
+                          const std::function<void(Result, bool)> &submit_chunk, bool binary)
+                : m_matcher(matcher), m_filepath(filepath), m_chunkBytes(options.chunkBytes), m_pool(pool), m_submit(submit_chunk),
+                  m_binary(binary && options.mode == OutputMode::Lines), m_mode(options.mode), m_maxCount(options.maxCount),
+                  m_before(options.mode == OutputMode::Lines ? options.beforeContext : 0),
+                  m_after(options.mode == OutputMode::Lines ? options.afterContext : 0),
+                  m_contextLines(options.mode == OutputMode::Lines && (m_before > 0 || m_after > 0 || options.contextGroups)),
+                  m_lineNumbers(options.mode == OutputMode::Lines && options.lineNumbers),
+                  m_byteOffsets(options.mode == OutputMode::Lines && options.byteOffsets), m_cancelled(options.cancelled), m_kept(m_before)
+            {
+            }
+
+            // Searches whole lines, end is either just past a line break or the end of the file. The inner ranges of
+            // search_file_range end at a line break instead, they are never searched with context lines or line numbers.
+            // offset is the position of begin in the file. Returns false once nothing more is needed from the file.
+            bool search(const char *begin, const char *end, size_t offset = 0)
+            {
+                if (m_maxCount == 0)
+                {
+                    return false;
+                }
+                m_bufferBegin = begin;
+                m_bufferEnd = end;
+                m_bufferOffset = offset;
+                if (m_cancelled == nullptr)
+                {
+                    return search_lines(begin, end);
+                }
+                // Line aligned slices, so a cancelled search does not run to the end of a large file.
+                while (!m_cancelled->load(std::memory_order_relaxed))
+                {
+                    if (static_cast<size_t>(end - begin) <= CancelCheckBytes)
+                    {
+                        return search_lines(begin, end);
+                    }
+                    const char *lineBreak = static_cast<const char *>(memchr(begin + CancelCheckBytes, '\n', end - begin - CancelCheckBytes));
+                    if (lineBreak == nullptr)
+                    {
+                        return search_lines(begin, end);
+                    }
+                    if (!search_lines(begin, lineBreak + 1))
+                    {
+                        return false;
+                    }
+                    begin = lineBreak + 1;
+                }
+                return false;
+            }
+
+            // The buffer of the last search is about to be overwritten, its line breaks are counted while it is still there.
+            void release()
+            {
+                if (m_lineNumbers)
+                {
+                    line_number(m_bufferEnd);
+                    m_counted = nullptr;
+                }
+            }
+
+            // Submits the final chunk, nothing for a file without a match, except for its count with -c.
+            void finish()
+            {
+                if (m_mode != OutputMode::Lines)
+                {
+                    if (m_count > 0 || m_mode == OutputMode::Count)
+                    {
+                        Result counted = m_pool.acquire();
+                        counted.file_name = m_filepath.string();
+                        counted.counted = true;
+                        counted.count = m_count;
+                        m_submit(std::move(counted), true);
+                    }
+                    return;
+                }
+                if (m_started || m_submitted)
+                {
+                    if (!m_started)
+                    {
+                        m_chunk = m_pool.acquire();
+                        m_chunk.file_name = m_filepath.string();
+                    }
+                    m_submit(std::move(m_chunk), true);
+                }
+            }
+
+        private:
+            bool search_lines(const char *begin, const char *end)
+            {
+                if (m_mode != OutputMode::Lines)
+                {
+                    return count_lines(begin, end);
+                }
+                if (m_binary)
+                {
+                    MatchSpan match;
+                    if (m_matcher.find(begin, end, match))
+                    {
+                        // Taken from the pool like any chunk, so the output thread gives it back.
+                        m_chunk = m_pool.acquire();
+                        m_chunk.file_name = m_filepath.string();
+                        m_chunk.binary = true;
+                        m_started = true;
+                        return false;
+                    }
+                    return true;
+                }
+
+                // The whole range is scanned for the patterns, line boundaries are only located around hits.
+                const char *from = begin;
+                m_next = begin;
+                MatchSpan match;
+                while (m_matcher.find(from, end, match))
+                {
+                    const char *lineStart = static_cast<const char *>(memrchr(from, '\n', match.begin - from));
+                    lineStart = lineStart ? lineStart + 1 : from;
+                    const char *lineEnd = static_cast<const char *>(memchr(match.begin, '\n', end - match.begin));
+                    lineEnd = lineEnd ? lineEnd : end;
+
+                    if (m_contextLines)
+                    {
+                        add_context_before(begin, lineStart);
+                    }
+                    add_line(std::string_view(lineStart, lineEnd - lineStart), 0);
+                    const char *next = nullptr;
+                    do
+                    {
+                        // Empty regex matches select the line but have nothing to highlight, the search resumes one byte later.
+                        if (match.end != match.begin)
+                        {
+                            m_chunk.add_match(MatchPosition(match.begin - lineStart, match.end - lineStart - 1, match.pattern));
+                        }
+                        next = match.end != match.begin ? match.end : match.end + 1;
+                    } while (next < lineEnd && m_matcher.find_in_line(lineStart, lineEnd, next, match));
+
+                    if (m_contextLines)
+                    {
+                        m_next = lineEnd == end ? end : lineEnd + 1;
+                        m_afterLeft = m_after;
+                    }
+                    if (++m_count == m_maxCount)
+                    {
+                        if (m_contextLines)
+                        {
+                            add_context_after(end, end);
+                        }
+                        return false;
+                    }
+                    if (lineEnd == end)
+                    {
+                        break;
+                    }
+                    from = lineEnd + 1;
+                }
+                if (m_contextLines)
+                {
+                    end_buffer(end);
+                }
+                return true;
+            }
+
+            // Adds a line of the current buffer to the current chunk.
+            void add_line(std::string_view text, uint32_t flags)
+            {
+                add_line(text, flags, line_number(text.data()), byte_offset(text.data()));
+            }
+
+            // Adds a line to the current chunk. Full chunks are handed over before the file is done, so a dense file
+            // is never held as a whole. The first line collected and the first one after lines that were left out
+            // start a group of context lines.
+            void add_line(std::string_view text, uint32_t flags, size_t lineNumber, size_t byteOffset)
+            {
+                if (m_started && !m_chunk.empty() && m_chunk.text.size() + text.size() > m_chunkBytes)
+                {
+                    m_submit(std::move(m_chunk), false);
+                    m_submitted = true;
+                    m_started = false;
+                }
+                if (!m_started)
+                {
+                    m_chunk = m_pool.acquire();
+                    m_chunk.file_name = m_filepath.string();
+                    m_started = true;
+                }
+                if (m_contextLines && (m_gap || !m_collected))
+                {
+                    flags |= Result::Line::Separated;
+                }
+                m_chunk.add_line(text, flags, lineNumber, byteOffset);
+                m_gap = false;
+                m_collected = true;
+            }
+
+            // Adds the lines after the last match the after context still asks for, those starting before until.
+            void add_context_after(const char *until, const char *end)
+            {
+                while (m_afterLeft > 0 && m_next < until)
+                {
+                    const char *lineEnd = static_cast<const char *>(memchr(m_next, '\n', end - m_next));
+                    lineEnd = lineEnd ? lineEnd : end;
+                    add_line(std::string_view(m_next, lineEnd - m_next), Result::Line::Context);
+                    m_next = lineEnd == end ? end : lineEnd + 1;
+                    --m_afterLeft;
+                }
+            }
+
+            // Adds the context lines before the matching line at lineStart, after those still owed to the previous match.
+            void add_context_before(const char *begin, const char *lineStart)
+            {
+                add_context_after(lineStart, lineStart);
+
+                // Looks back from the match, at most m_before lines and not into the lines collected already.
+                const char *first = lineStart;
+                size_t taken = 0;
+                for (; taken < m_before && first > m_next; ++taken)
+                {
+                    first = previous_line(first);
+                }
+                if (first > m_next)
+                {
+                    m_gap = true;
+                }
+                else if (m_next == begin)
+                {
+                    // Nothing of this buffer was collected, the kept lines of the earlier ones come right before it.
+                    const size_t used = std::min(m_keptCount, m_before - taken);
+                    m_gap = m_gap || used < m_keptCount;
+                    for (size_t i = m_keptCount - used; i < m_keptCount; ++i)
+                    {
+                        const KeptLine &kept = m_kept[(m_keptFirst + i) % m_kept.size()];
+                        add_line(kept.text, Result::Line::Context, kept.lineNumber, kept.byteOffset);
+                    }
+                }
+                m_keptCount = 0;
+
+                while (first < lineStart)
+                {
+                    const char *lineEnd = static_cast<const char *>(memchr(first, '\n', lineStart - first));
+                    add_line(std::string_view(first, lineEnd - first), Result::Line::Context);
+                    first = lineEnd + 1;
+                }
+                m_next = lineStart;
+            }
+
+            // Finishes the after context within the buffer and copies its last lines not collected, up to m_before,
+            // the next buffer may need them as context before its first match.
+            void end_buffer(const char *end)
+            {
+                add_context_after(end, end);
+                // Only the last buffer of a file ends without a line break, nothing comes after it.
+                if (m_next == end || end[-1] != '\n')
+                {
+                    return;
+                }
+
+                // The empty line after the final line break is no line, end is where the next buffer starts.
+                const char *first = end;
+                for (size_t taken = 0; taken < m_before && first > m_next; ++taken)
+                {
+                    first = previous_line(first);
+                }
+                if (first > m_next)
+                {
+                    m_gap = true;
+                    m_keptCount = 0;
+                }
+                while (first < end)
+                {
+                    const char *lineEnd = static_cast<const char *>(memchr(first, '\n', end - first));
+                    keep(std::string_view(first, lineEnd - first));
+                    first = lineEnd + 1;
+                }
+            }
+
+            // Start of the line before the one at lineStart, nothing before m_next is looked at.
+            const char *previous_line(const char *lineStart) const
+            {
+                const char *lineBreak = static_cast<const char *>(memrchr(m_next, '\n', lineStart - 1 - m_next));
+                return lineBreak ? lineBreak + 1 : m_next;
+            }
+
+            // Copies a line to the kept ones, the oldest is dropped once m_before are kept.
+            void keep(std::string_view text)
+            {
+                if (m_keptCount == m_kept.size())
+                {
+                    m_keptFirst = (m_keptFirst + 1) % m_kept.size();
+                    --m_keptCount;
+                    m_gap = true;
+                }
+                KeptLine &kept = m_kept[(m_keptFirst + m_keptCount++) % m_kept.size()];
+                kept.text.assign(text);
+                kept.lineNumber = line_number(text.data());
+                kept.byteOffset = byte_offset(text.data());
+            }
+
+            // Number of the line starting at lineStart, 0 without -n. Counts the line breaks since the last line asked for,
+            // lines are asked for in file order.
+            size_t line_number(const char *lineStart)
+            {
+                if (!m_lineNumbers)
+                {
+                    return 0;
+                }
+                if (m_counted == nullptr)
+                {
+                    m_counted = m_bufferBegin;
+                }
+                m_lineNumber += count_newlines(m_counted, lineStart);
+                m_counted = lineStart;
+                return m_lineNumber;
+            }
+
+            size_t byte_offset(const char *lineStart) const
+            {
+                return m_byteOffsets ? m_bufferOffset + static_cast<size_t>(lineStart - m_bufferBegin) : 0;
+            }
+
+            // Only counts, the first hit of a line is enough and the rest of the line is skipped.
+            bool count_lines(const char *from, const char *end)
+            {
+                MatchSpan match;
+                while (m_matcher.find(from, end, match))
+                {
+                    if (++m_count == m_maxCount || m_mode != OutputMode::Count)
+                    {
+                        return false;
+                    }
+                    const char *lineEnd = static_cast<const char *>(memchr(match.begin, '\n', end - match.begin));
+                    if (lineEnd == nullptr)
+                    {
+                        break;
+                    }
+                    from = lineEnd + 1;
+                }
+                return true;
+            }
+
+        private:
+            const Matcher &m_matcher;
+            const fs::path &m_filepath;
+            const size_t m_chunkBytes;
+            ResultPool &m_pool;
+            const std::function<void(Result, bool)> &m_submit;
+            const bool m_binary;
+            const OutputMode m_mode;
+            const size_t m_maxCount;
+            const size_t m_before;
+            const size_t m_after;
+            const bool m_contextLines; // context lines or at least the groups they would form are asked for
+            const bool m_lineNumbers;
+            const bool m_byteOffsets;
+            const std::atomic<bool> *m_cancelled;
+            size_t m_count = 0; // matching lines so far
+
+            // Context lines
+            const char *m_next = nullptr; // start of the first line of the buffer not collected yet, its end once there is none
+            size_t m_afterLeft = 0;       // lines of after context still owed to the last match
+            bool m_gap = false;           // lines were left out since the last line collected
+            bool m_collected = false;     // a line of the file was collected
+            struct KeptLine
+            {
+                std::string text;
+                size_t lineNumber;
+                size_t byteOffset;
+            };
+            std::vector<KeptLine> m_kept; // ring of the last lines of earlier buffers that were not collected
+            size_t m_keptFirst = 0;
+            size_t m_keptCount = 0;
+
+            // The buffer of the last search, its offset in the file and how far its line breaks are counted.
+            const char *m_bufferBegin = nullptr;
+            const char *m_bufferEnd = nullptr;
+            size_t m_bufferOffset = 0;
+            const char *m_counted = nullptr; // a line start, nullptr if nothing of the buffer is counted yet
+            size_t m_lineNumber = 1;         // of the line at m_counted
+
+            // Taken from the pool on the first hit only, files without a match cost no result at all.
+            Result m_chunk;
+            bool m_started = false;
+            bool m_submitted = false;
+        };
+
+        // Decodes a compressed file in blocks and searches the lines of each block as it arrives. Large files are
+        // decoded on a separate thread, so decompression and matching overlap instead of taking turns on one worker.
+        void search_compressed(const Matcher &matcher, const fs::path &filepath, const FileBuffer &file, Compression compression,
+                               const SearchOptions &options, ResultPool &pool, const std::function<void(Result, bool)> &submit_chunk)
+        {
+            const std::unique_ptr<Decoder> decoder = make_decoder(compression);
+            BlockQueue queue(DecodeQueueBlocks);
+            std::string_view input = file.view();
+
+            // Decodes the next block into the queue, false once the stream ended or the search stopped.
+            // Decoders only return a partial block at the end of the stream.
+            auto decode_block = [&]
+            {
+                std::string block = queue.acquire();
+                bool done = false;
+                const bool ok = decoder->decode(input, block, DecodeBlockBytes, done);
+                if (!block.empty() && !queue.push(std::move(block)))
+                {
+                    return false;
+                }
+                if (!ok || done)
+                {
+                    queue.close(!ok);
+                    return false;
+                }
+                return true;
+            };
+
+            std::thread stage;
+            bool decoding = true;
+            if (file.size() > InlineDecodeBytes)
+            {
+                stage = std::thread([&]
+                                    { while (decode_block()) {} });
+            }
+            auto next_block = [&](std::string &block)
+            {
+                if (!stage.joinable() && decoding)
+                {
+                    decoding = decode_block();
+                }
+                return queue.pop(block);
+            };
+
+            std::unique_ptr<LineCollector> collector;
+            std::string carry; // start of a line that continues in the next block
+            size_t carryOffset = 0;
+            size_t blockOffset = 0; // of the block in the decoded file
+            std::string block;
+            bool searching = true;
+            while (searching && next_block(block))
+            {
+                if (!collector)
+                {
+                    const bool binary = options.binary != BinaryPolicy::Text && is_binary(block);
+                    if (binary && options.binary == BinaryPolicy::Skip)
+                    {
+                        break;
+                    }
+                    collector = std::make_unique<LineCollector>(matcher, filepath, options, pool, submit_chunk, binary);
+                }
+
+                // Only whole lines are searched, the line cut by the block boundary waits for the rest of it.
+                const char *begin = block.data();
+                const char *end = begin + block.size();
+                const char *lastBreak = static_cast<const char *>(memrchr(begin, '\n', block.size()));
+                if (lastBreak == nullptr)
+                {
+                    carry.append(begin, end);
+                }
+                else
+                {
+                    const char *firstBreak = static_cast<const char *>(memchr(begin, '\n', block.size()));
+                    carry.append(begin, firstBreak + 1);
+                    searching = collector->search(carry.data(), carry.data() + carry.size(), carryOffset);
+                    collector->release();
+                    if (searching && firstBreak != lastBreak)
+                    {
+                        const size_t offset = blockOffset + static_cast<size_t>(firstBreak + 1 - begin);
+                        searching = collector->search(firstBreak + 1, lastBreak + 1, offset);
+                        collector->release();
+                    }
+                    carry.assign(lastBreak + 1, end);
+                    carryOffset = blockOffset + static_cast<size_t>(lastBreak + 1 - begin);
+                }
+                blockOffset += block.size();
+                queue.release(std::move(block));
+            }
+            if (searching && collector && !carry.empty())
+            {
+                collector->search(carry.data(), carry.data() + carry.size(), carryOffset);
+            }
+
+            queue.cancel();
+            if (stage.joinable())
+            {
+                stage.join();
+            }
+            if (queue.failed())
+            {
+                std::cerr << "Warning: Can not decompress " << filepath << ", it is corrupt or truncated" << std::endl;
+            }
+            if (collector)
+            {
+                collector->finish();
+            }
+        }
     }
 
-    void find_files(fs::path startPath, std::function<void(fs::path)> submit_to_queue)
+    GrepOptions read_grep_arguments(int argc, char *argv[])
+    {
+        GrepOptions options;
+        std::vector<std::string> positional;
+        bool explicitPatterns = false;
+        // -A and -B take precedence over -C whatever their order
+        size_t context = 0;
+        size_t beforeContext = SIZE_MAX;
+        size_t afterContext = SIZE_MAX;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg.rfind("--color=", 0) == 0)
+            {
+                const std::string mode = arg.substr(8);
+                options.color = mode == "always" ? ColorMode::Always : mode == "never" ? ColorMode::Never
+                                                                                       : ColorMode::Auto;
+            }
+            else if (arg.rfind("--result-budget=", 0) == 0)
+            {
+                if (!parse_number(arg.c_str() + 16, options.resultBudget))
+                {
+                    return invalid_number("--result-budget", arg.c_str() + 16);
+                }
+            }
+            else if (arg.rfind("--split-size=", 0) == 0)
+            {
+                // ranges are at least this large, 0 would divide the file into nothing
+                if (!parse_number(arg.c_str() + 13, options.splitBytes) || options.splitBytes == 0)
+                {
+                    return invalid_number("--split-size", arg.c_str() + 13);
+                }
+            }
+            else if (arg.rfind("--io-depth=", 0) == 0)
+            {
+                if (!parse_number(arg.c_str() + 11, options.ioDepth))
+                {
+                    return invalid_number("--io-depth", arg.c_str() + 11);
+                }
+            }
+            else if (arg.rfind("--binary-files=", 0) == 0)
+            {
+                const std::string policy = arg.substr(15);
+                options.binary = policy == "without-match" ? BinaryPolicy::Skip : policy == "text" ? BinaryPolicy::Text
+                                                                                                   : BinaryPolicy::Report;
+            }
+            else if (arg == "-I" || arg == "-a")
+            {
+                options.binary = arg == "-I" ? BinaryPolicy::Skip : BinaryPolicy::Text;
+            }
+            else if (arg == "--build-index" && i + 1 < argc)
+            {
+                options.buildIndex = argv[++i];
+            }
+            else if (arg == "--cache" || arg.rfind("--cache-dir=", 0) == 0)
+            {
+                options.cacheDirectory = arg == "--cache" ? default_cache_directory().string() : arg.substr(12);
+            }
+            else if (arg.rfind("--cache-size=", 0) == 0)
+            {
+                if (!parse_number(arg.c_str() + 13, options.cacheBytes))
+                {
+                    return invalid_number("--cache-size", arg.c_str() + 13);
+                }
+            }
+            else if (arg == "--stats" || arg == "--stats=json")
+            {
+                options.stats = arg == "--stats" ? StatsFormat::Text : StatsFormat::Json;
+            }
+            else if (arg.rfind("--include=", 0) == 0)
+            {
+                options.includeGlobs.push_back(arg.substr(10));
+            }
+            else if (arg.rfind("--exclude=", 0) == 0)
+            {
+                options.excludeGlobs.push_back(arg.substr(10));
+            }
+            else if (arg.rfind("--exclude-dir=", 0) == 0)
+            {
+                options.excludeDirectoryGlobs.push_back(arg.substr(14));
+            }
+            else if (arg.rfind("--sort=", 0) == 0)
+            {
+                options.sort = arg.substr(7) == "path" ? SortOrder::Path : SortOrder::None;
+            }
+            else if (arg == "--json" || arg == "--binary-output")
+            {
+                options.format = arg == "--json" ? OutputFormat::Json : OutputFormat::Binary;
+            }
+            else if (arg == "--no-ignore")
+            {
+                options.ignoreFiles = false;
+            }
+            else if (arg == "--no-decompress")
+            {
+                options.decompress = false;
+            }
+            else if (arg == "--index")
+            {
+                options.useIndex = true;
+            }
+            else if (arg == "-l" || arg == "-c" || arg == "-q")
+            {
+                options.mode = arg == "-l" ? OutputMode::FilesWithMatches : arg == "-c" ? OutputMode::Count
+                                                                                       : OutputMode::Quiet;
+            }
+            else if ((arg == "-m" && i + 1 < argc) || arg.rfind("--max-count=", 0) == 0)
+            {
+                const char *text = arg == "-m" ? argv[++i] : arg.c_str() + 12;
+                if (!parse_number(text, options.maxCount))
+                {
+                    return invalid_number("-m", text);
+                }
+            }
+            else if (((arg == "-A" || arg == "-B" || arg == "-C") && i + 1 < argc) || arg.rfind("--after-context=", 0) == 0 ||
+                     arg.rfind("--before-context=", 0) == 0 || arg.rfind("--context=", 0) == 0)
+            {
+                const bool separate = arg.size() == 2;
+                const char *text = separate ? argv[++i] : arg.c_str() + arg.find('=') + 1;
+                const char which = separate ? arg[1] : arg[2] == 'a' ? 'A' : arg[2] == 'b' ? 'B' : 'C';
+                size_t lines = 0;
+                if (!parse_number(text, lines))
+                {
+                    return invalid_number(std::string("-") + which, text);
+                }
+                (which == 'A' ? afterContext : which == 'B' ? beforeContext : context) = lines;
+                options.contextGroups = true;
+            }
+            else if (arg == "-E")
+            {
+                options.extendedRegex = true;
+            }
+            else if (arg == "-n" || arg == "--line-number")
+            {
+                options.lineNumbers = true;
+            }
+            else if (arg == "-b" || arg == "--byte-offset")
+            {
+                options.byteOffsets = true;
+            }
+            else if (arg == "-i" || arg == "--ignore-case")
+            {
+                options.ignoreCase = true;
+            }
+            else if (arg == "-j" && i + 1 < argc)
+            {
+                if (!parse_number(argv[++i], options.threads))
+                {
+                    return invalid_number("-j", argv[i]);
+                }
+            }
+            else if ((arg == "-e" || arg == "-f") && i + 1 < argc)
+            {
+                explicitPatterns = true;
+                if (arg == "-e")
+                {
+                    options.patterns.emplace_back(argv[++i]);
+                }
+                else if (!read_pattern_file(argv[++i], options.patterns))
+                {
+                    return GrepOptions();
+                }
+            }
+            else
+            {
+                positional.push_back(arg);
+            }
+        }
+
+        options.beforeContext = beforeContext != SIZE_MAX ? beforeContext : context;
+        options.afterContext = afterContext != SIZE_MAX ? afterContext : context;
+
+        if (!options.buildIndex.empty())
+        {
+            if (!positional.empty() || explicitPatterns)
+            {
+                print_usage();
+                return GrepOptions();
+            }
+            return options;
+        }
+
+        if (positional.size() != (explicitPatterns ? 1u : 2u))
+        {
+            print_usage();
+            return GrepOptions();
+        }
+
+        if (!explicitPatterns)
+        {
+            options.patterns.push_back(positional.front());
+        }
+        options.path = positional.back();
+        return options;
+    }
+
+    bool resolve_start_path(const fs::path &startPath, bool &isDirectory)
     {
         if (!fs::exists(startPath))
         {
             std::cerr << "Error: Path does not exist: " << startPath << std::endl;
-            return;
+            return false;
         }
 
         if (fs::is_regular_file(startPath))
         {
-            submit_to_queue(startPath);
-            return;
+            isDirectory = false;
+            return true;
         }
 
         if (fs::is_directory(startPath) && !fs::is_symlink(startPath))
         {
-            for (const auto &entry : fs::recursive_directory_iterator(startPath, fs::directory_options::skip_permission_denied))
+            isDirectory = true;
+            return true;
+        }
+
+        std::cerr << "Error: Path is not a file or directory: " << startPath << std::endl;
+        return false;
+    }
+
+    void list_directory(const fs::path &directory, const std::function<void(fs::path, bool)> &submit_entry)
+    {
+        DIR *dir = ::opendir(directory.c_str());
+        if (dir == nullptr)
+        {
+            return; // like skip_permission_denied, unreadable directories are left out
+        }
+
+        while (const dirent *entry = ::readdir(dir))
+        {
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN)
             {
-                if (!fs::is_symlink(entry) && fs::is_regular_file(entry))
+                // Only file systems without d_type support pay for a stat call.
+                struct stat st;
+                if (::fstatat(::dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
                 {
-                    submit_to_queue(entry.path());
+                    continue;
                 }
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR
+                                                                          : DT_UNKNOWN;
+            }
+
+            // Symbolic links and special files are skipped.
+            if (type == DT_REG || type == DT_DIR)
+            {
+                submit_entry(directory / name, type == DT_DIR);
             }
         }
-        else
+        ::closedir(dir);
+    }
+
+    void list_directory(const fs::path &directory, const PathFilter &filter, size_t rootPrefix, const std::shared_ptr<const IgnoreLevel> &ignore,
+                        const std::function<void(fs::path, bool, const std::shared_ptr<const IgnoreLevel> &)> &submit_entry)
+    {
+        if (filter.empty())
+        {
+            list_directory(directory, [&](fs::path path, bool isDirectory)
+                           { submit_entry(std::move(path), isDirectory, ignore); });
+            return;
+        }
+
+        // The ignore files of a directory apply to its own entries, so all of them are known before the first is judged.
+        std::vector<std::pair<fs::path, bool>> entries;
+        bool hasIgnoreFile = false;
+        list_directory(directory, [&](fs::path path, bool isDirectory)
+                       {
+                           hasIgnoreFile = hasIgnoreFile || (!isDirectory && filter.is_ignore_file(path.filename().native()));
+                           entries.emplace_back(std::move(path), isDirectory); });
+        const std::shared_ptr<const IgnoreLevel> inside = hasIgnoreFile ? filter.enter(directory, ignore) : ignore;
+        for (auto &entry : entries)
         {
-            std::cerr << "Error: Path is not a file or directory: " << startPath << std::endl;
+            if (filter.allows(entry.first.native(), rootPrefix, entry.second, inside.get()))
+            {
+                submit_entry(std::move(entry.first), entry.second, inside);
+            }
         }
     }
 
-    void output_colored_result(const Result &res)
+    void find_files(fs::path startPath, std::function<void(fs::path)> submit_to_queue)
+    {
+        find_files(std::move(startPath), std::move(submit_to_queue), PathFilter());
+    }
+
+    void find_files(fs::path startPath, std::function<void(fs::path)> submit_to_queue, const PathFilter &filter,
+                    const std::atomic<bool> *cancelled)
+    {
+        bool isDirectory = false;
+        if (!resolve_start_path(startPath, isDirectory))
+        {
+            return;
+        }
+
+        if (!isDirectory)
+        {
+            submit_to_queue(startPath);
+            return;
+        }
+
+        // Depth first, the files of a directory are submitted before descending into its subdirectories.
+        using Directory = std::pair<fs::path, std::shared_ptr<const IgnoreLevel>>;
+        const size_t rootPrefix = path_prefix(startPath);
+        std::vector<Directory> pending{Directory{startPath, nullptr}};
+        std::vector<Directory> subdirectories;
+        while (!pending.empty() && (cancelled == nullptr || !cancelled->load(std::memory_order_relaxed)))
+        {
+            Directory directory = std::move(pending.back());
+            pending.pop_back();
+
+            list_directory(directory.first, filter, rootPrefix, directory.second, [&](fs::path path, bool isSubdirectory, const std::shared_ptr<const IgnoreLevel> &ignore)
+                           {
+                               if (isSubdirectory)
+                               {
+                                   subdirectories.emplace_back(std::move(path), ignore);
+                               }
+                               else
+                               {
+                                   submit_to_queue(std::move(path));
+                               } });
+
+            pending.insert(pending.end(), std::make_move_iterator(subdirectories.rbegin()), std::make_move_iterator(subdirectories.rend()));
+            subdirectories.clear();
+        }
+    }
+
+    void format_result(const Result &res, std::string &out, bool color, bool continued, LineLabels labels)
     {
-        for (const auto &r : res.results)
+        if (res.binary)
+        {
+            out.append("Binary file ").append(res.file_name).append(" matches\n");
+            return;
+        }
+
+        for (size_t line = 0; line < res.line_count(); ++line)
         {
-            const std::string &text = r.first;
-            const std::vector<MatchPosition> &matchPositions = r.second;
+            const std::string_view text = res.line_text(line);
 
             size_t lastPos = 0;
-            std::string_view lineView(text);
 
-            std::cout << res.file_name << ": "; // Print file name
+            if (res.is_separated(line) && (continued || line > 0))
+            {
+                out.append("--\n");
+            }
+            // Print file name and labels, context lines like GNU grep with a dash
+            const char separator = res.is_context(line) ? '-' : ':';
+            out.append(res.file_name).push_back(separator);
+            auto append_label = [&out, separator](size_t value)
+            {
+                char digits[20];
+                out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr).push_back(separator);
+            };
+            if (labels.lineNumber)
+            {
+                append_label(res.lines[line].lineNumber);
+            }
+            if (labels.byteOffset)
+            {
+                append_label(res.lines[line].byteOffset);
+            }
+            out.push_back(' ');
+
+            if (!color)
+            {
+                out.append(text).push_back('\n');
+                continue;
+            }
 
-            for (const auto &matchPosition : matchPositions)
+            for (const auto &matchPosition : res.line_matches(line))
             {
                 if (matchPosition.start > lastPos)
                 {
-                    std::cout << lineView.substr(lastPos, matchPosition.start - lastPos);
+                    out.append(text.substr(lastPos, matchPosition.start - lastPos));
                 }
-                std::cout << ColorStart
-                          << lineView.substr(matchPosition.start, matchPosition.end - matchPosition.start + 1)
-                          << ColorEnd;
+                out.append(ColorStart)
+                    .append(text.substr(matchPosition.start, matchPosition.end - matchPosition.start + 1))
+                    .append(ColorEnd);
 
                 lastPos = matchPosition.end + 1;
             }
 
             if (lastPos < text.size())
             {
-                std::cout << lineView.substr(lastPos);
+                out.append(text.substr(lastPos));
             }
-            std::cout << std::endl;
+            out.push_back('\n');
         }
     }
 
+    void output_colored_result(const Result &res)
+    {
+        std::string out;
+        format_result(res, out, true);
+        std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+    }
+
     Result search_in_file(const std::string &m_pattern, const fs::path &filepath)
     {
-        std::ifstream file(filepath);
-        Result::LineMatchResults results;
+        return search_in_file(*make_matcher({m_pattern}), filepath);
+    }
+
+    Result search_in_file(const Matcher &matcher, const fs::path &filepath)
+    {
+        Result result;
+        ResultPool pool;
+        const bool opened = search_in_file(matcher, filepath, SearchOptions(), pool, [&result](Result chunk, bool)
+                                           { result = std::move(chunk); });
+        if (opened && result.file_name.empty())
+        {
+            result.file_name = filepath.string();
+        }
+        return result;
+    }
 
+    bool is_binary(std::string_view data)
+    {
+        // Like GNU grep, only the start is looked at: deciding must not cost a pass over the file.
+        return memchr(data.data(), '\0', std::min(data.size(), BinaryProbeBytes)) != nullptr;
+    }
+
+    bool search_in_file(const Matcher &matcher, const fs::path &filepath, const SearchOptions &options, ResultPool &pool,
+                        const std::function<void(Result, bool)> &submit_chunk)
+    {
+        FileBuffer file(filepath);
         if (!file.is_open())
         {
-            return Result();
+            return false;
+        }
+        search_in_file(matcher, file, filepath, options, pool, submit_chunk);
+        return true;
+    }
+
+    void search_in_file(const Matcher &matcher, const FileBuffer &file, const fs::path &filepath, const SearchOptions &options,
+                        ResultPool &pool, const std::function<void(Result, bool)> &submit_chunk)
+    {
+        const Compression compression = options.decompress ? detect_compression(file.view()) : Compression::None;
+        if (can_decompress(compression))
+        {
+            search_compressed(matcher, filepath, file, compression, options, pool, submit_chunk);
+            return;
         }
 
-        std::string line;
-        while (std::getline(file, line))
+        // Only the probed pages of a skipped binary file are ever read from disk.
+        const bool binary = options.binary != BinaryPolicy::Text && is_binary(file.view());
+        if (binary && options.binary == BinaryPolicy::Skip)
         {
-            size_t pos = 0;
-            std::vector<MatchPosition> matchPositions;
+            return;
+        }
 
-            while ((pos = line.find(m_pattern, pos)) != std::string::npos)
-            {
-                size_t end_pos = pos + m_pattern.length() - 1;
-                matchPositions.emplace_back(pos, end_pos);
-                pos += m_pattern.length();
-            }
-            if (!matchPositions.empty())
+        LineCollector collector(matcher, filepath, options, pool, submit_chunk, binary);
+        collector.search(file.data(), file.data() + file.size());
+        collector.finish();
+    }
+
+    size_t split_count(const FileBuffer &file, const SearchOptions &options)
+    {
+        // -m and the counting modes stop early or count per file, which ranges can not, context lines cross their boundaries
+        // and the line numbers of a range depend on all lines before it.
+        if (file.size() <= options.splitBytes || options.splitRanges <= 1 || options.mode != OutputMode::Lines || options.maxCount != SIZE_MAX ||
+            options.beforeContext > 0 || options.afterContext > 0 || options.contextGroups || options.lineNumbers ||
+            (options.decompress && can_decompress(detect_compression(file.view()))) ||
+            (options.binary != BinaryPolicy::Text && is_binary(file.view())))
+        {
+            return 1;
+        }
+        return std::clamp<size_t>(file.size() / std::clamp<size_t>(options.splitBytes, 1, MinRangeBytes), 1, options.splitRanges);
+    }
+
+    void search_file_range(const Matcher &matcher, const FileBuffer &file, const fs::path &filepath, size_t part, size_t count,
+                           const SearchOptions &options, ResultPool &pool, const std::function<void(Result, bool)> &submit_chunk)
+    {
+        // Both neighbours move a shared boundary to the same line start, so every line belongs to exactly one range.
+        const size_t size = file.size();
+        auto line_start = [&file, size](size_t nominal) -> size_t
+        {
+            if (nominal == 0 || nominal >= size)
             {
-                results.emplace_back(std::move(line), std::move(matchPositions));
+                return std::min(nominal, size);
             }
-        }
+            const char *lineBreak = static_cast<const char *>(memchr(file.data() + nominal - 1, '\n', size - nominal + 1));
+            return lineBreak ? static_cast<size_t>(lineBreak - file.data()) + 1 : size;
+        };
+        const size_t begin = line_start(size * part / count);
+        const size_t end = line_start(size * (part + 1) / count);
 
-        return Result(filepath.string(), std::move(results));
+        bool submittedLast = false;
+        const std::function<void(Result, bool)> submit = [&](Result chunk, bool last)
+        {
+            submittedLast = submittedLast || last;
+            submit_chunk(std::move(chunk), last);
+        };
+        if (begin < end)
+        {
+            // The line break ending an inner range is left out, like the one ending a line in the middle of the file.
+            LineCollector collector(matcher, filepath, options, pool, submit, false);
+            collector.search(file.data() + begin, file.data() + (end < size ? end - 1 : end), begin);
+            collector.finish();
+        }
+        if (!submittedLast)
+        {
+            submit_chunk(pool.acquire(), true);
+        }
     }
 }
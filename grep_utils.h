@@ -1,17 +1,58 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <filesystem>
+#include <string_view>
 
+#include "file_buffer.h"
+#include "matcher.h"
+#include "options.h"
+#include "path_filter.h"
 #include "result.h"
+#include "result_pool.h"
 
 namespace grep
 {
     namespace fs = std::filesystem;
     const std::string ColorStart = "\033[1;31m"; // ANSI escape code for red text
     const std::string ColorEnd = "\033[0m";      // ANSI escape code to reset color
-    std::pair<std::string, std::string> read_grep_arguments(int argc, char *argv[]);
+    GrepOptions read_grep_arguments(int argc, char *argv[]);
+    bool resolve_start_path(const fs::path &startPath, bool &isDirectory);
+    void list_directory(const fs::path &directory, const std::function<void(fs::path, bool)> &submit_entry);
+    // Lists directory like list_directory, leaving out what filter rejects. Entries are handed on with the ignore rules in
+    // effect inside directory, the scope a subdirectory is listed with. rootPrefix is path_prefix of the start directory.
+    void list_directory(const fs::path &directory, const PathFilter &filter, size_t rootPrefix, const std::shared_ptr<const IgnoreLevel> &ignore,
+                        const std::function<void(fs::path, bool, const std::shared_ptr<const IgnoreLevel> &)> &submit_entry);
     void find_files(fs::path startPath, std::function<void(fs::path)> submit_to_queue);
+    // Stops listing once cancelled is set.
+    void find_files(fs::path startPath, std::function<void(fs::path)> submit_to_queue, const PathFilter &filter,
+                    const std::atomic<bool> *cancelled = nullptr);
+    // continued is set if output came before res, so the "--" that separates groups of context lines is written before its first line.
+    // labels are printed after the file name, they have to be in the result, see SearchOptions::lineNumbers and byteOffsets.
+    void format_result(const Result &res, std::string &out, bool color, bool continued = false, LineLabels labels = {});
     void output_colored_result(const Result &res);
     Result search_in_file(const std::string &pattern, const fs::path &filepath);
+    Result search_in_file(const Matcher &matcher, const fs::path &filepath);
+    // True if the first block of data contains a NUL byte.
+    bool is_binary(std::string_view data);
+    // Streams the matching lines in chunks of about options.chunkBytes line text, the final chunk is submitted with last set.
+    // Nothing is submitted for files without a match, false is returned if the file can not be read.
+    // Binary files are handled by options.binary, a reported one is a single result with binary set.
+    // Chunks are taken from pool, the consumer is expected to give them back once they are written.
+    // With options.mode other than Lines a single counted result is submitted instead, with -c also for files without a match.
+    // options.beforeContext and afterContext add the lines around the matching ones, flagged as context, the first line of
+    // every group is flagged Separated, with options.contextGroups also when there are no context lines.
+    // Once options.cancelled is set the search stops within about a MiB and submits what it has.
+    bool search_in_file(const Matcher &matcher, const fs::path &filepath, const SearchOptions &options, ResultPool &pool,
+                        const std::function<void(Result chunk, bool last)> &submit_chunk);
+    void search_in_file(const Matcher &matcher, const FileBuffer &file, const fs::path &filepath, const SearchOptions &options,
+                        ResultPool &pool, const std::function<void(Result chunk, bool last)> &submit_chunk);
+    // Number of line aligned ranges file should be searched in by different workers: 1 up to options.splitBytes, for
+    // binary or compressed files and with -m, context lines or a counting mode, otherwise ranges of at least 1 MiB, or splitBytes if smaller, up to options.splitRanges.
+    size_t split_count(const FileBuffer &file, const SearchOptions &options);
+    // Searches the lines starting in range part of count equally sized ranges of file. Matches are found as in search_in_file,
+    // every range submits a last chunk, an empty one if it has no match.
+    void search_file_range(const Matcher &matcher, const FileBuffer &file, const fs::path &filepath, size_t part, size_t count,
+                           const SearchOptions &options, ResultPool &pool, const std::function<void(Result chunk, bool last)> &submit_chunk);
 }
@@ -0,0 +1,334 @@
+#include "literal_search.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "case_fold.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GREP_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace grep
+{
+    namespace
+    {
+        const char *find_scalar(const std::string &pattern, const char *first, const char *last)
+        {
+            if (pattern.empty())
+            {
+                return first;
+            }
+            return static_cast<const char *>(memmem(first, last - first, pattern.data(), pattern.size()));
+        }
+
+        // Inlined into the kernels, so the AVX2 kernel runs it VEX encoded instead of calling SSE code with dirty
+        // upper halves, which costs a state transition on every candidate.
+        __attribute__((always_inline)) inline bool fold_equal(const char *text, const char *folded, size_t n)
+        {
+            size_t i = 0;
+#ifdef GREP_HAS_X86_KERNELS
+            // Upper case letters get the case bit, everything else stays, then 16 bytes are compared at once.
+            // Bytes from 0x80 are negative as signed bytes and never in 'A'..'Z'.
+            const __m128i beforeA = _mm_set1_epi8('A' - 1);
+            const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+            const __m128i caseBit = _mm_set1_epi8(0x20);
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+                const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, beforeA), _mm_cmpgt_epi8(afterZ, block));
+                const __m128i lowered = _mm_or_si128(block, _mm_and_si128(upper, caseBit));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(lowered, _mm_loadu_si128(reinterpret_cast<const __m128i *>(folded + i)))) != 0xFFFF)
+                {
+                    return false;
+                }
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                if (ascii_lower(static_cast<unsigned char>(text[i])) != static_cast<unsigned char>(folded[i]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Byte by byte, only used where the vector kernels do not apply.
+        const char *find_folded_scalar(const std::string &pattern, const char *first, const char *last)
+        {
+            const size_t n = pattern.size();
+            if (n == 0)
+            {
+                return first;
+            }
+            const unsigned char head = static_cast<unsigned char>(pattern.front());
+            for (const char *p = first; static_cast<size_t>(last - p) >= n; ++p)
+            {
+                if (ascii_lower(static_cast<unsigned char>(*p)) == head && fold_equal(p + 1, pattern.data() + 1, n - 1))
+                {
+                    return p;
+                }
+            }
+            return nullptr;
+        }
+
+        template <bool Fold>
+        const char *find_remainder(const std::string &pattern, const char *first, const char *last)
+        {
+            return Fold ? find_folded_scalar(pattern, first, last) : find_scalar(pattern, first, last);
+        }
+
+        // Verifies the bytes between the first and the last one of a candidate.
+        template <bool Fold>
+        __attribute__((always_inline)) inline bool verify_inner(const char *candidate, const std::string &pattern)
+        {
+            const size_t n = pattern.size() >= 2 ? pattern.size() - 2 : 0;
+            return Fold ? fold_equal(candidate + 1, pattern.data() + 1, n) : memcmp(candidate + 1, pattern.data() + 1, n) == 0;
+        }
+
+        // ORed into a text byte before comparing it to the pattern byte c, which folds upper case letters only.
+        char case_bit(char c)
+        {
+            return is_ascii_letter(static_cast<unsigned char>(c)) ? 0x20 : 0;
+        }
+
+#ifdef GREP_HAS_X86_KERNELS
+        template <bool Fold>
+        const char *find_sse2(const std::string &pattern, const char *first, const char *last)
+        {
+            const size_t n = pattern.size();
+            if (n < (Fold ? 1 : 2) || static_cast<size_t>(last - first) < n + 15)
+            {
+                return find_remainder<Fold>(pattern, first, last);
+            }
+
+            const __m128i head = _mm_set1_epi8(pattern.front());
+            const __m128i tail = _mm_set1_epi8(pattern.back());
+            const __m128i headCase = _mm_set1_epi8(case_bit(pattern.front()));
+            const __m128i tailCase = _mm_set1_epi8(case_bit(pattern.back()));
+            const char *p = first;
+            for (; static_cast<size_t>(last - p) >= n + 15; p += 16)
+            {
+                __m128i blockHead = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+                __m128i blockTail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + n - 1));
+                if constexpr (Fold)
+                {
+                    blockHead = _mm_or_si128(blockHead, headCase);
+                    blockTail = _mm_or_si128(blockTail, tailCase);
+                }
+                unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+                    _mm_and_si128(_mm_cmpeq_epi8(blockHead, head), _mm_cmpeq_epi8(blockTail, tail))));
+                while (mask != 0)
+                {
+                    const unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+                    if (verify_inner<Fold>(p + bit, pattern))
+                    {
+                        return p + bit;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+            return find_remainder<Fold>(pattern, p, last);
+        }
+
+        template <bool Fold>
+        __attribute__((target("avx2"))) const char *find_avx2(const std::string &pattern, const char *first, const char *last)
+        {
+            const size_t n = pattern.size();
+            if (n < (Fold ? 1 : 2) || static_cast<size_t>(last - first) < n + 31)
+            {
+                return find_sse2<Fold>(pattern, first, last);
+            }
+
+            const __m256i head = _mm256_set1_epi8(pattern.front());
+            const __m256i tail = _mm256_set1_epi8(pattern.back());
+            const __m256i headCase = _mm256_set1_epi8(case_bit(pattern.front()));
+            const __m256i tailCase = _mm256_set1_epi8(case_bit(pattern.back()));
+            const char *p = first;
+            for (; static_cast<size_t>(last - p) >= n + 31; p += 32)
+            {
+                __m256i blockHead = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+                __m256i blockTail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + n - 1));
+                if constexpr (Fold)
+                {
+                    blockHead = _mm256_or_si256(blockHead, headCase);
+                    blockTail = _mm256_or_si256(blockTail, tailCase);
+                }
+                unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+                    _mm256_and_si256(_mm256_cmpeq_epi8(blockHead, head), _mm256_cmpeq_epi8(blockTail, tail))));
+                while (mask != 0)
+                {
+                    const unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+                    if (verify_inner<Fold>(p + bit, pattern))
+                    {
+                        return p + bit;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+            return find_sse2<Fold>(pattern, p, last);
+        }
+#endif
+
+        __attribute__((always_inline)) inline size_t count_newlines_scalar(const char *first, const char *last)
+        {
+            size_t count = 0;
+            for (; first != last; ++first)
+            {
+                count += *first == '\n';
+            }
+            return count;
+        }
+
+#ifdef GREP_HAS_X86_KERNELS
+        // Every compare yields 0 or -1 per byte, subtracting it counts up to 255 hits per byte lane before the lanes
+        // have to be summed into the 64 bit halves with a SAD against zero. Inlined into the AVX2 kernel for its tail,
+        // like fold_equal, to stay clear of the AVX-SSE transition on every short span between two matches.
+        __attribute__((always_inline)) inline size_t count_newlines_sse2(const char *first, const char *last)
+        {
+            const __m128i newline = _mm_set1_epi8('\n');
+            const __m128i zero = _mm_setzero_si128();
+            __m128i total = zero;
+            const char *p = first;
+            while (static_cast<size_t>(last - p) >= 16)
+            {
+                __m128i counts = zero;
+                for (int blocks = 0; blocks < 255 && static_cast<size_t>(last - p) >= 16; ++blocks, p += 16)
+                {
+                    const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+                    counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(block, newline));
+                }
+                total = _mm_add_epi64(total, _mm_sad_epu8(counts, zero));
+            }
+            return static_cast<size_t>(_mm_cvtsi128_si64(total) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total))) +
+                   count_newlines_scalar(p, last);
+        }
+
+        __attribute__((target("avx2"))) size_t count_newlines_avx2(const char *first, const char *last)
+        {
+            const __m256i newline = _mm256_set1_epi8('\n');
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i total = zero;
+            const char *p = first;
+            while (static_cast<size_t>(last - p) >= 32)
+            {
+                __m256i counts = zero;
+                for (int blocks = 0; blocks < 255 && static_cast<size_t>(last - p) >= 32; ++blocks, p += 32)
+                {
+                    const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+                    counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(block, newline));
+                }
+                total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+            }
+            alignas(32) uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), total);
+            return static_cast<size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + count_newlines_sse2(p, last);
+        }
+#endif
+
+        const char *find_single_byte(const std::string &pattern, const char *first, const char *last)
+        {
+            return static_cast<const char *>(memchr(first, pattern.front(), last - first));
+        }
+
+        LiteralSearcher::Kernel best_kernel()
+        {
+#ifdef GREP_HAS_X86_KERNELS
+            static const LiteralSearcher::Kernel kernel = __builtin_cpu_supports("avx2")
+                                                              ? LiteralSearcher::Kernel::Avx2
+                                                              : LiteralSearcher::Kernel::Sse2;
+            return kernel;
+#else
+            return LiteralSearcher::Kernel::Scalar;
+#endif
+        }
+    }
+
+    LiteralSearcher::LiteralSearcher(std::string pattern, Kernel kernel, bool ignoreCase)
+        : m_pattern(std::move(pattern)), m_kernel(kernel == Kernel::Auto ? best_kernel() : kernel)
+    {
+        if (!is_supported(m_kernel))
+        {
+            m_kernel = Kernel::Scalar;
+        }
+
+        // Patterns without a letter are the same in every case and keep the exact kernels.
+        const bool fold = ignoreCase && std::any_of(m_pattern.begin(), m_pattern.end(), [](char c)
+                                                    { return is_ascii_letter(static_cast<unsigned char>(c)); });
+        if (fold)
+        {
+            std::transform(m_pattern.begin(), m_pattern.end(), m_pattern.begin(), [](char c)
+                           { return static_cast<char>(ascii_lower(static_cast<unsigned char>(c))); });
+        }
+
+        switch (m_kernel)
+        {
+#ifdef GREP_HAS_X86_KERNELS
+        case Kernel::Avx2:
+            m_find = fold ? &find_avx2<true> : &find_avx2<false>;
+            break;
+        case Kernel::Sse2:
+            m_find = fold ? &find_sse2<true> : &find_sse2<false>;
+            break;
+#endif
+        default:
+            m_find = fold ? &find_folded_scalar : &find_scalar;
+            break;
+        }
+
+        // memchr is already vectorised by the C library.
+        if (m_pattern.size() == 1 && !fold)
+        {
+            m_find = &find_single_byte;
+        }
+    }
+
+    size_t count_newlines(const char *first, const char *last, LiteralSearcher::Kernel kernel)
+    {
+        if (kernel == LiteralSearcher::Kernel::Auto)
+        {
+            kernel = best_kernel();
+        }
+        switch (kernel)
+        {
+#ifdef GREP_HAS_X86_KERNELS
+        case LiteralSearcher::Kernel::Avx2:
+            if (LiteralSearcher::is_supported(kernel))
+            {
+                return count_newlines_avx2(first, last);
+            }
+            return count_newlines_sse2(first, last);
+        case LiteralSearcher::Kernel::Sse2:
+            return count_newlines_sse2(first, last);
+#endif
+        default:
+            return count_newlines_scalar(first, last);
+        }
+    }
+
+    bool equal_ignoring_case(const char *text, const char *folded, size_t n)
+    {
+        return fold_equal(text, folded, n);
+    }
+
+    bool LiteralSearcher::is_supported(Kernel kernel)
+    {
+        switch (kernel)
+        {
+        case Kernel::Auto:
+        case Kernel::Scalar:
+            return true;
+#ifdef GREP_HAS_X86_KERNELS
+        case Kernel::Sse2:
+            return true;
+        case Kernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace grep
+{
+    // Finds occurrences of a fixed string.
+    // On x86-64 candidates are filtered by comparing the first and the last byte of the pattern
+    // over 16 (SSE2) or 32 (AVX2) positions at once and verified with memcmp.
+    // The kernel is picked once at runtime from CPUID, other platforms use the scalar memmem.
+    // With ignoreCase ASCII letters match either case: the compared bytes are ORed with 0x20 where the pattern has a
+    // letter, and candidates are verified with equal_ignoring_case, so the text is never copied or lowercased.
+    class LiteralSearcher
+    {
+    public:
+        enum class Kernel
+        {
+            Auto,
+            Scalar,
+            Sse2,
+            Avx2
+        };
+
+        explicit LiteralSearcher(std::string pattern, Kernel kernel = Kernel::Auto, bool ignoreCase = false);
+
+    public:
+        // Returns the start of the first occurrence in [first, last) or nullptr.
+        const char *find(const char *first, const char *last) const
+        {
+            return m_find(m_pattern, first, last);
+        }
+
+        const std::string &pattern() const { return m_pattern; } // lower case with ignoreCase
+        size_t size() const { return m_pattern.size(); }
+        Kernel kernel() const { return m_kernel; }
+
+        static bool is_supported(Kernel kernel);
+
+    private:
+        using FindFunction = const char *(*)(const std::string &, const char *, const char *);
+
+        std::string m_pattern;
+        Kernel m_kernel;
+        FindFunction m_find;
+    };
+
+    // Number of line breaks in [first, last), for line numbers. The SSE2 and AVX2 kernels compare a block at a time and
+    // add the hits up in byte counters that are only widened every 255 blocks.
+    size_t count_newlines(const char *first, const char *last, LiteralSearcher::Kernel kernel = LiteralSearcher::Kernel::Auto);
+
+    // Compares n bytes of text to folded, which is already ASCII lower case, ignoring the case of ASCII letters in text.
+    bool equal_ignoring_case(const char *text, const char *folded, size_t n);
+}
@@ -2,6 +2,5 @@
 
 int main(int argc, char *argv[])
 {
-    grep::grep(argc, argv);
-    return 0;
+    return grep::grep(argc, argv);
 }
\ No newline at end of file
@@ -0,0 +1,426 @@
+#include "matcher.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+
+#include "case_fold.h"
+#include "literal_search.h"
+#include "regex_matcher.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GREP_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace grep
+{
+    namespace
+    {
+        constexpr size_t MaxPackedPatterns = 8;
+
+        struct IndexedPattern
+        {
+            std::string text;
+            size_t index;
+        };
+
+        class LiteralMatcher : public Matcher
+        {
+        public:
+            LiteralMatcher(IndexedPattern pattern, bool ignoreCase)
+                : m_searcher(std::move(pattern.text), LiteralSearcher::Kernel::Auto, ignoreCase), m_index(pattern.index)
+            {
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                const char *hit = m_searcher.find(first, last);
+                if (hit == nullptr)
+                {
+                    return false;
+                }
+                match = MatchSpan{hit, hit + m_searcher.size(), m_index};
+                return true;
+            }
+
+        private:
+            LiteralSearcher m_searcher;
+            size_t m_index;
+        };
+
+        class NeverMatcher : public Matcher
+        {
+        public:
+            bool find(const char *, const char *, MatchSpan &) const override { return false; }
+        };
+
+        // Adds an empty pattern to the others: every line matches, with an empty match at its start unless one of the others
+        // is found in it. Empty matches have nothing to highlight, so find_in_line only reports those of the others.
+        class EmptyPatternMatcher : public Matcher
+        {
+        public:
+            EmptyPatternMatcher(std::unique_ptr<Matcher> others, size_t index)
+                : m_others(std::move(others)), m_index(index)
+            {
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                if (first == last)
+                {
+                    return false;
+                }
+                const char *lineEnd = static_cast<const char *>(memchr(first, '\n', last - first));
+                lineEnd = lineEnd ? lineEnd : last;
+                if (!m_others->find(first, lineEnd, match))
+                {
+                    match = MatchSpan{first, first, m_index};
+                }
+                return true;
+            }
+
+            bool find_in_line(const char *lineBegin, const char *lineEnd, const char *from, MatchSpan &match) const override
+            {
+                return m_others->find_in_line(lineBegin, lineEnd, from, match);
+            }
+
+        private:
+            std::unique_ptr<Matcher> m_others;
+            size_t m_index;
+        };
+
+        // Verifies all patterns at one position, longest first so the first hit is the leftmost-longest match.
+        // With ignoreCase the patterns are lower case already.
+        bool verify_at(const std::vector<IndexedPattern> &byLength, const char *pos, const char *last, bool ignoreCase, MatchSpan &match)
+        {
+            const size_t remaining = static_cast<size_t>(last - pos);
+            for (const auto &pattern : byLength)
+            {
+                if (pattern.text.size() <= remaining &&
+                    (ignoreCase ? equal_ignoring_case(pos, pattern.text.data(), pattern.text.size())
+                                : memcmp(pos, pattern.text.data(), pattern.text.size()) == 0))
+                {
+                    match = MatchSpan{pos, pos + pattern.text.size(), pattern.index};
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Compares 16 positions at once against the first two bytes of every pattern (only the first byte
+        // for one byte patterns) and verifies the candidates with memcmp. With ignoreCase the text bytes are
+        // ORed with 0x20 where the pattern byte is a letter before comparing.
+        class PackedCompareMatcher : public Matcher
+        {
+        public:
+            PackedCompareMatcher(std::vector<IndexedPattern> patterns, bool ignoreCase)
+                : m_patterns(std::move(patterns)), m_ignoreCase(ignoreCase)
+            {
+                std::stable_sort(m_patterns.begin(), m_patterns.end(), [](const auto &a, const auto &b)
+                                 { return a.text.size() > b.text.size(); });
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                const char *p = first;
+#ifdef GREP_HAS_X86_KERNELS
+                __m128i heads[MaxPackedPatterns];
+                __m128i seconds[MaxPackedPatterns];
+                __m128i headCases[MaxPackedPatterns];
+                __m128i secondCases[MaxPackedPatterns];
+                auto case_bit = [this](char c)
+                { return static_cast<char>(m_ignoreCase && is_ascii_letter(static_cast<unsigned char>(c)) ? 0x20 : 0); };
+                for (size_t i = 0; i < m_patterns.size(); ++i)
+                {
+                    const std::string &text = m_patterns[i].text;
+                    heads[i] = _mm_set1_epi8(text[0]);
+                    seconds[i] = _mm_set1_epi8(text.size() > 1 ? text[1] : 0);
+                    headCases[i] = _mm_set1_epi8(case_bit(text[0]));
+                    secondCases[i] = _mm_set1_epi8(text.size() > 1 ? case_bit(text[1]) : 0);
+                }
+
+                for (; last - p >= 17; p += 16)
+                {
+                    const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+                    const __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+                    __m128i any = _mm_setzero_si128();
+                    for (size_t i = 0; i < m_patterns.size(); ++i)
+                    {
+                        __m128i hit = _mm_cmpeq_epi8(_mm_or_si128(block, headCases[i]), heads[i]);
+                        if (m_patterns[i].text.size() > 1)
+                        {
+                            hit = _mm_and_si128(hit, _mm_cmpeq_epi8(_mm_or_si128(next, secondCases[i]), seconds[i]));
+                        }
+                        any = _mm_or_si128(any, hit);
+                    }
+
+                    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(any));
+                    while (mask != 0)
+                    {
+                        const unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+                        if (verify_at(m_patterns, p + bit, last, m_ignoreCase, match))
+                        {
+                            return true;
+                        }
+                        mask &= mask - 1;
+                    }
+                }
+#endif
+                for (; p < last; ++p)
+                {
+                    if (verify_at(m_patterns, p, last, m_ignoreCase, match))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+        private:
+            std::vector<IndexedPattern> m_patterns;
+            bool m_ignoreCase;
+        };
+
+        // Aho-Corasick automaton compiled into a dense DFA over byte classes.
+        // Every state remembers the longest pattern that is a suffix of it, which is all that is needed
+        // for leftmost-longest matching since a longer suffix always starts further left.
+        // With ignoreCase the patterns are lower case and upper case letters share the class of their lower case letter,
+        // so folding costs nothing while scanning.
+        class AhoCorasickMatcher : public Matcher
+        {
+        public:
+            AhoCorasickMatcher(const std::vector<IndexedPattern> &patterns, bool ignoreCase)
+            {
+                build_byte_classes(patterns);
+                if (ignoreCase)
+                {
+                    for (unsigned c = 'A'; c <= 'Z'; ++c)
+                    {
+                        m_byteClass[c] = m_byteClass[ascii_lower(static_cast<unsigned char>(c))];
+                    }
+                }
+                build_automaton(patterns);
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                const uint8_t *text = reinterpret_cast<const uint8_t *>(first);
+                const size_t size = static_cast<size_t>(last - first);
+                bool found = false;
+                size_t bestStart = 0;
+                size_t bestLength = 0;
+                size_t bestPattern = 0;
+
+                uint32_t state = 0;
+                for (size_t i = 0; i < size; ++i)
+                {
+                    // A match ending here or later can not start at or before bestStart.
+                    if (found && i >= bestStart + m_maxLength)
+                    {
+                        break;
+                    }
+                    state = m_transitions[state * m_classCount + m_byteClass[text[i]]];
+                    const Output &output = m_outputs[state];
+                    if (output.length == 0)
+                    {
+                        continue;
+                    }
+                    const size_t start = i + 1 - output.length;
+                    if (!found || start < bestStart || (start == bestStart && output.length > bestLength))
+                    {
+                        found = true;
+                        bestStart = start;
+                        bestLength = output.length;
+                        bestPattern = output.pattern;
+                    }
+                }
+
+                if (found)
+                {
+                    match = MatchSpan{first + bestStart, first + bestStart + bestLength, bestPattern};
+                }
+                return found;
+            }
+
+        private:
+            struct Output
+            {
+                uint32_t length = 0;
+                size_t pattern = 0;
+            };
+
+            void build_byte_classes(const std::vector<IndexedPattern> &patterns)
+            {
+                std::fill(std::begin(m_byteClass), std::end(m_byteClass), 0);
+                m_classCount = 1;
+                for (const auto &pattern : patterns)
+                {
+                    for (unsigned char c : pattern.text)
+                    {
+                        if (m_byteClass[c] == 0)
+                        {
+                            m_byteClass[c] = static_cast<uint16_t>(m_classCount++);
+                        }
+                    }
+                }
+            }
+
+            void build_automaton(const std::vector<IndexedPattern> &patterns)
+            {
+                constexpr uint32_t NoState = UINT32_MAX;
+                m_transitions.assign(m_classCount, NoState);
+                m_outputs.assign(1, Output());
+
+                for (const auto &pattern : patterns)
+                {
+                    uint32_t state = 0;
+                    for (unsigned char c : pattern.text)
+                    {
+                        uint32_t &next = m_transitions[state * m_classCount + m_byteClass[c]];
+                        if (next == NoState)
+                        {
+                            next = static_cast<uint32_t>(m_outputs.size());
+                            m_outputs.emplace_back();
+                            m_transitions.resize(m_transitions.size() + m_classCount, NoState);
+                        }
+                        state = m_transitions[state * m_classCount + m_byteClass[c]];
+                    }
+                    // Duplicates keep the first index.
+                    if (m_outputs[state].length == 0)
+                    {
+                        m_outputs[state] = Output{static_cast<uint32_t>(pattern.text.size()), pattern.index};
+                    }
+                    m_maxLength = std::max(m_maxLength, pattern.text.size());
+                }
+
+                // Breadth-first completion of the goto function into a DFA.
+                std::vector<uint32_t> fail(m_outputs.size(), 0);
+                std::queue<uint32_t> pending;
+                for (size_t c = 0; c < m_classCount; ++c)
+                {
+                    uint32_t &next = m_transitions[c];
+                    if (next == NoState)
+                    {
+                        next = 0;
+                    }
+                    else
+                    {
+                        pending.push(next);
+                    }
+                }
+
+                while (!pending.empty())
+                {
+                    const uint32_t state = pending.front();
+                    pending.pop();
+                    for (size_t c = 0; c < m_classCount; ++c)
+                    {
+                        uint32_t &next = m_transitions[state * m_classCount + c];
+                        const uint32_t fallback = m_transitions[fail[state] * m_classCount + c];
+                        if (next == NoState)
+                        {
+                            next = fallback;
+                            continue;
+                        }
+                        fail[next] = fallback;
+                        if (m_outputs[next].length == 0)
+                        {
+                            m_outputs[next] = m_outputs[fallback];
+                        }
+                        pending.push(next);
+                    }
+                }
+            }
+
+        private:
+            uint16_t m_byteClass[256];
+            size_t m_classCount = 1;
+            size_t m_maxLength = 0;
+            std::vector<uint32_t> m_transitions;
+            std::vector<Output> m_outputs;
+        };
+
+        // Picks the kernel for kind, Auto by the number of patterns.
+        std::unique_ptr<Matcher> make_fixed_string_matcher(std::vector<IndexedPattern> usable, MatcherKind kind, bool foldAscii)
+        {
+            if (usable.empty())
+            {
+                return std::make_unique<NeverMatcher>();
+            }
+
+            if (kind == MatcherKind::Auto)
+            {
+#ifdef GREP_HAS_X86_KERNELS
+                const bool packedAvailable = true;
+#else
+                const bool packedAvailable = false;
+#endif
+                kind = usable.size() == 1                                     ? MatcherKind::Literal
+                       : usable.size() <= MaxPackedPatterns && packedAvailable ? MatcherKind::PackedCompare
+                                                                               : MatcherKind::AhoCorasick;
+            }
+
+            if (kind == MatcherKind::Literal && usable.size() == 1)
+            {
+                return std::make_unique<LiteralMatcher>(std::move(usable.front()), foldAscii);
+            }
+            if (kind == MatcherKind::PackedCompare && usable.size() <= MaxPackedPatterns)
+            {
+                return std::make_unique<PackedCompareMatcher>(std::move(usable), foldAscii);
+            }
+            return std::make_unique<AhoCorasickMatcher>(usable, foldAscii);
+        }
+    }
+
+    std::unique_ptr<Matcher> make_matcher(const std::vector<std::string> &patterns, MatcherKind kind, bool ignoreCase)
+    {
+        if (kind == MatcherKind::Regex)
+        {
+            return make_regex_matcher(patterns, ignoreCase);
+        }
+        // Letters beyond ASCII have case variants of other byte sequences, the regex compiler spells them out.
+        if (ignoreCase && std::any_of(patterns.begin(), patterns.end(), [](const std::string &pattern)
+                                      { return has_unicode_case(pattern); }))
+        {
+            std::vector<std::string> escaped;
+            for (const auto &pattern : patterns)
+            {
+                escaped.push_back(regex_escape(pattern));
+            }
+            return make_regex_matcher(escaped, true);
+        }
+        return make_literal_matcher(patterns, kind, ignoreCase);
+    }
+
+    std::unique_ptr<Matcher> make_literal_matcher(const std::vector<std::string> &patterns, MatcherKind kind, bool foldAscii)
+    {
+        std::vector<IndexedPattern> usable;
+        size_t empty = patterns.size();
+        for (size_t i = 0; i < patterns.size(); ++i)
+        {
+            if (patterns[i].empty())
+            {
+                empty = std::min(empty, i);
+            }
+            else if (patterns[i].find('\n') == std::string::npos)
+            {
+                usable.push_back(IndexedPattern{patterns[i], i});
+                if (foldAscii)
+                {
+                    std::string &text = usable.back().text;
+                    std::transform(text.begin(), text.end(), text.begin(), [](char c)
+                                   { return static_cast<char>(ascii_lower(static_cast<unsigned char>(c))); });
+                }
+            }
+        }
+
+        std::unique_ptr<Matcher> matcher = make_fixed_string_matcher(std::move(usable), kind, foldAscii);
+        if (empty != patterns.size())
+        {
+            return std::make_unique<EmptyPatternMatcher>(std::move(matcher), empty);
+        }
+        return matcher;
+    }
+}
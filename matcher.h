@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace grep
+{
+    struct MatchSpan
+    {
+        const char *begin = nullptr;
+        const char *end = nullptr; // one past the last matched byte
+        size_t pattern = 0;        // index of the pattern that matched
+    };
+
+    // Finds leftmost-longest matches of a pattern set. Matches never span a line break.
+    class Matcher
+    {
+    public:
+        virtual ~Matcher() = default;
+
+        // Finds the leftmost match in [first, last), first has to be the start of a line.
+        virtual bool find(const char *first, const char *last, MatchSpan &match) const = 0;
+
+        // Finds the next match at or after from inside the line [lineBegin, lineEnd).
+        virtual bool find_in_line(const char *lineBegin, const char *lineEnd, const char *from, MatchSpan &match) const
+        {
+            (void)lineBegin;
+            return find(from, lineEnd, match);
+        }
+    };
+
+    enum class MatcherKind
+    {
+        Auto,
+        Literal,
+        PackedCompare,
+        AhoCorasick,
+        Regex // patterns are extended regular expressions, see make_regex_matcher
+    };
+
+    // Auto uses LiteralSearcher for a single pattern, a SIMD packed compare for small sets and Aho-Corasick otherwise.
+    // Patterns containing a line break can never match and are ignored, an empty pattern matches every line, as in GNU grep.
+    // Regex throws std::invalid_argument for a pattern that is not a valid regular expression.
+    // With ignoreCase (-i) ASCII letters match either case inside the kernels. Fixed strings holding letters beyond ASCII
+    // (é, Σ, Ж) are compiled like regular expressions that alternate the simple case fold variants of those letters.
+    std::unique_ptr<Matcher> make_matcher(const std::vector<std::string> &patterns, MatcherKind kind = MatcherKind::Auto, bool ignoreCase = false);
+
+    // The fixed string matchers of make_matcher without the detour for other letters, foldAscii only folds ASCII.
+    std::unique_ptr<Matcher> make_literal_matcher(const std::vector<std::string> &patterns, MatcherKind kind, bool foldAscii);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace grep
+{
+    enum class ColorMode
+    {
+        Auto, // colors only when writing to a terminal
+        Always,
+        Never
+    };
+
+    // What happens to files with a NUL byte in their first block.
+    enum class BinaryPolicy
+    {
+        Report, // "Binary file NAME matches" instead of the matching lines
+        Skip,
+        Text
+    };
+
+    // What is reported for each file.
+    enum class OutputMode
+    {
+        Lines,
+        FilesWithMatches, // -l, the name of every matching file, its search stops at the first hit
+        Count,            // -c, the number of matching lines of every file, no line text is collected
+        Quiet             // -q, nothing, the whole search stops at the first hit
+    };
+
+    // Order in which files are written.
+    enum class SortOrder
+    {
+        None, // as the workers finish them
+        Path  // --sort=path, the order of a walk with the entries of every directory sorted by name
+    };
+
+    // How the results are written, see structured_output.h for the machine-readable ones.
+    enum class OutputFormat
+    {
+        Text,  // lines like GNU grep, colored on a terminal
+        Json,  // --json, one JSON object per line
+        Binary // --binary-output, length prefixed records
+    };
+
+    enum class StatsFormat
+    {
+        None,
+        Text, // --stats, a table per thread
+        Json  // --stats=json
+    };
+
+    // What format_result prints between the file name and the text of a line.
+    struct LineLabels
+    {
+        bool lineNumber = false;
+        bool byteOffset = false;
+    };
+
+    struct GrepOptions
+    {
+        std::vector<std::string> patterns;
+        bool extendedRegex = false; // -E, patterns are extended regular expressions instead of fixed strings
+        bool ignoreCase = false;    // -i, letters match in either case, see make_matcher
+        OutputMode mode = OutputMode::Lines;
+        size_t maxCount = SIZE_MAX; // -m N, the search of a file stops after N matching lines
+        size_t beforeContext = 0;   // -B N or -C N, lines printed before each matching line
+        size_t afterContext = 0;    // -A N or -C N, lines printed after each matching line
+        bool contextGroups = false; // -A, -B or -C was given, even as 0: "--" separates lines that are not adjacent, like GNU grep
+        bool lineNumbers = false;   // -n, every line is printed with its line number
+        bool byteOffsets = false;   // -b, every line is printed with the byte offset of its start
+        SortOrder sort = SortOrder::None;
+        OutputFormat format = OutputFormat::Text; // the other formats always carry line numbers and byte offsets
+        std::string path;
+        unsigned threads = 0; // search workers, 0 uses one per CPU core
+        ColorMode color = ColorMode::Auto;
+        BinaryPolicy binary = BinaryPolicy::Report;
+        bool decompress = true;         // gzip, zstd and xz files are searched decompressed, --no-decompress turns it off
+        size_t resultBudget = 64 << 20; // bytes of results queued for output before the workers wait
+        size_t splitBytes = 32 << 20;   // --split-size=BYTES, larger files are searched in ranges by several workers
+        unsigned ioDepth = 0;           // --io-depth=N, files are read ahead with up to N reads in flight, 0 maps them on demand
+        std::string buildIndex;         // --build-index DIR, updates the trigram index of DIR instead of searching
+        bool useIndex = false;          // --index, only searches the files the index of path names as candidates
+        std::string cacheDirectory;     // --cache or --cache-dir=DIR, unchanged files are answered from earlier results
+        size_t cacheBytes = 256 << 20;  // --cache-size=BYTES, the cache directory is kept below it
+        std::vector<std::string> includeGlobs;          // --include=GLOB, only matching files are searched
+        std::vector<std::string> excludeGlobs;          // --exclude=GLOB
+        std::vector<std::string> excludeDirectoryGlobs; // --exclude-dir=GLOB, matching directories are not entered
+        bool ignoreFiles = true;                        // .gitignore and .ignore are honoured unless --no-ignore
+        StatsFormat stats = StatsFormat::None; // printed to stderr after the search, needs GREP_WITH_STATS
+    };
+
+    // Settings of the search in a single file, derived from GrepOptions by the thread manager.
+    struct SearchOptions
+    {
+        size_t chunkBytes = SIZE_MAX; // line text per result chunk
+        BinaryPolicy binary = BinaryPolicy::Text;
+        bool decompress = false; // compressed files with a compiled in codec are decoded
+        size_t splitBytes = SIZE_MAX; // larger files are split into ranges, see split_count
+        unsigned splitRanges = 1;     // most ranges per file
+        OutputMode mode = OutputMode::Lines;
+        size_t maxCount = SIZE_MAX;
+        size_t beforeContext = 0; // only with mode Lines
+        size_t afterContext = 0;
+        bool contextGroups = false; // non-adjacent lines are flagged Separated even without context lines
+        bool lineNumbers = false; // Line::lineNumber is counted
+        bool byteOffsets = false; // Line::byteOffset is set
+        const std::atomic<bool> *cancelled = nullptr; // set once the rest of the search is not needed
+    };
+}
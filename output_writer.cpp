@@ -0,0 +1,109 @@
+#include "output_writer.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ostream>
+
+namespace grep
+{
+    OutputWriter::OutputWriter(int fd)
+        : m_fd(fd), m_terminal(::isatty(fd) == 1), m_buffers(BufferCount)
+    {
+        for (auto &buffer : m_buffers)
+        {
+            buffer.reserve(BufferSize);
+        }
+    }
+
+    OutputWriter::OutputWriter(std::ostream &stream)
+        : m_stream(&stream), m_buffers(BufferCount)
+    {
+        for (auto &buffer : m_buffers)
+        {
+            buffer.reserve(BufferSize);
+        }
+    }
+
+    OutputWriter::~OutputWriter()
+    {
+        flush();
+    }
+
+    void OutputWriter::commit()
+    {
+        if (m_buffers[m_current].size() < BufferSize)
+        {
+            return;
+        }
+        if (++m_current == m_buffers.size())
+        {
+            flush();
+        }
+    }
+
+    void OutputWriter::flush()
+    {
+        const size_t count = m_current + (m_current < m_buffers.size() && !m_buffers[m_current].empty() ? 1 : 0);
+        if (m_stream != nullptr)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_stream->write(m_buffers[i].data(), static_cast<std::streamsize>(m_buffers[i].size()));
+            }
+            m_stream->flush();
+        }
+        else
+        {
+            write_fd(count);
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_buffers[i].clear(); // keeps the capacity for reuse
+        }
+        m_current = 0;
+    }
+
+    void OutputWriter::write_fd(size_t count)
+    {
+        iovec vectors[BufferCount];
+        size_t used = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!m_buffers[i].empty())
+            {
+                vectors[used++] = iovec{m_buffers[i].data(), m_buffers[i].size()};
+            }
+        }
+
+        iovec *next = vectors;
+        while (used > 0)
+        {
+            ssize_t written = ::writev(m_fd, next, static_cast<int>(used));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return; // e.g. a closed pipe, there is nobody left to report to
+            }
+
+            // Skip what was written, a partial write can end inside a buffer.
+            size_t remaining = static_cast<size_t>(written);
+            while (used > 0 && remaining >= next->iov_len)
+            {
+                remaining -= next->iov_len;
+                ++next;
+                --used;
+            }
+            if (used > 0)
+            {
+                next->iov_base = static_cast<char *>(next->iov_base) + remaining;
+                next->iov_len -= remaining;
+            }
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace grep
+{
+    // Collects formatted output in large reusable buffers and hands all of them to one writev call
+    // once they are full, on flush or on destruction.
+    // Formatting appends to buffer(), a caller ends each unit that must not be split (the lines of one file)
+    // with commit(). Buffers are only switched between units, so a unit is never interleaved with another one.
+    class OutputWriter
+    {
+    public:
+        explicit OutputWriter(int fd);
+        // Writes through a stream instead, for callers that capture or redirect the output.
+        explicit OutputWriter(std::ostream &stream);
+        ~OutputWriter();
+
+        OutputWriter(const OutputWriter &) = delete;
+        OutputWriter &operator=(const OutputWriter &) = delete;
+
+    public:
+        std::string &buffer() { return m_buffers[m_current]; }
+        void commit();
+        void flush();
+
+        // True if the output goes to a terminal, used to decide about colors and interactive flushing.
+        bool is_terminal() const { return m_terminal; }
+
+    private:
+        static constexpr size_t BufferSize = 64 * 1024;
+        static constexpr size_t BufferCount = 16;
+
+        void write_fd(size_t count);
+
+    private:
+        int m_fd = -1;
+        std::ostream *m_stream = nullptr;
+        bool m_terminal = false;
+        std::vector<std::string> m_buffers;
+        size_t m_current = 0;
+    };
+}
@@ -0,0 +1,433 @@
+#include "path_filter.h"
+
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+
+namespace grep
+{
+    namespace
+    {
+        bool has_wildcard(std::string_view pattern)
+        {
+            return pattern.find_first_of("*?[\\") != std::string_view::npos;
+        }
+
+        std::string_view file_name(std::string_view path)
+        {
+            const size_t slash = path.rfind('/');
+            return slash == std::string_view::npos ? path : path.substr(slash + 1);
+        }
+
+        // Appends the rules of one ignore file in git's syntax.
+        void read_ignore_file(const fs::path &file, std::vector<IgnoreLevel::Rule> &rules)
+        {
+            std::ifstream in(file);
+            std::string line;
+            while (std::getline(in, line))
+            {
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                // Trailing spaces are dropped unless escaped.
+                while (!line.empty() && line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\'))
+                {
+                    line.pop_back();
+                }
+                if (line.empty() || line[0] == '#')
+                {
+                    continue;
+                }
+
+                std::string_view pattern = line;
+                const bool negated = pattern[0] == '!';
+                if (negated)
+                {
+                    pattern.remove_prefix(1);
+                }
+                const bool directoryOnly = !pattern.empty() && pattern.back() == '/';
+                if (directoryOnly)
+                {
+                    pattern.remove_suffix(1);
+                }
+                const bool anchored = pattern.find('/') != std::string_view::npos;
+                if (!pattern.empty() && pattern[0] == '/')
+                {
+                    pattern.remove_prefix(1);
+                }
+                if (!pattern.empty())
+                {
+                    rules.push_back(IgnoreLevel::Rule{Glob(pattern), negated, directoryOnly, anchored});
+                }
+            }
+        }
+    }
+
+    Glob::Glob(std::string_view pattern)
+    {
+        auto literal = [this](char c)
+        {
+            if (m_tokens.empty() || m_tokens.back().op != Op::Literal)
+            {
+                m_tokens.push_back(Token{Op::Literal, std::string(), {}});
+            }
+            m_tokens.back().literal.push_back(c);
+        };
+
+        const size_t n = pattern.size();
+        for (size_t i = 0; i < n;)
+        {
+            const char c = pattern[i];
+            if (c == '\\' && i + 1 < n)
+            {
+                literal(pattern[i + 1]);
+                i += 2;
+            }
+            else if (c == '*')
+            {
+                size_t end = i + 1;
+                while (end < n && pattern[end] == '*')
+                {
+                    ++end;
+                }
+                const bool segmentStart = i == 0 || pattern[i - 1] == '/';
+                const bool segmentEnd = end == n || pattern[end] == '/';
+                if (end - i >= 2 && segmentStart && segmentEnd)
+                {
+                    m_tokens.push_back(Token{end == n ? Op::DoubleStar : Op::DoubleStarSlash, std::string(), {}});
+                    i = end == n ? end : end + 1;
+                }
+                else
+                {
+                    m_tokens.push_back(Token{Op::Star, std::string(), {}});
+                    i = end;
+                }
+            }
+            else if (c == '?')
+            {
+                m_tokens.push_back(Token{Op::Any, std::string(), {}});
+                ++i;
+            }
+            else if (c == '[')
+            {
+                Token token{Op::Class, std::string(), {}};
+                size_t j = i + 1;
+                const bool negated = j < n && (pattern[j] == '!' || pattern[j] == '^');
+                if (negated)
+                {
+                    ++j;
+                }
+                bool closed = false;
+                for (bool first = true; j < n; first = false)
+                {
+                    unsigned char from = static_cast<unsigned char>(pattern[j]);
+                    if (from == ']' && !first)
+                    {
+                        closed = true;
+                        ++j;
+                        break;
+                    }
+                    if (from == '\\' && j + 1 < n)
+                    {
+                        from = static_cast<unsigned char>(pattern[++j]);
+                    }
+                    unsigned char to = from;
+                    if (j + 2 < n && pattern[j + 1] == '-' && pattern[j + 2] != ']')
+                    {
+                        to = static_cast<unsigned char>(pattern[j + 2]);
+                        j += 2;
+                    }
+                    for (unsigned value = from; value <= to; ++value)
+                    {
+                        token.set.set(value);
+                    }
+                    ++j;
+                }
+                if (!closed)
+                {
+                    literal('['); // an unterminated class is taken literally
+                    ++i;
+                    continue;
+                }
+                if (negated)
+                {
+                    token.set.flip();
+                }
+                token.set.reset('/');
+                m_tokens.push_back(std::move(token));
+                i = j;
+            }
+            else
+            {
+                literal(c);
+                ++i;
+            }
+        }
+
+        // The common shapes skip the token matcher.
+        auto plain = [](const Token &token)
+        { return token.op == Op::Literal && token.literal.find('/') == std::string::npos; };
+        if (m_tokens.empty() || (m_tokens.size() == 1 && m_tokens[0].op == Op::Literal))
+        {
+            m_kind = Kind::Literal;
+            m_literal = m_tokens.empty() ? std::string() : m_tokens[0].literal;
+        }
+        else if (m_tokens.size() == 2 && m_tokens[0].op == Op::Star && plain(m_tokens[1]))
+        {
+            m_kind = Kind::Suffix;
+            m_literal = m_tokens[1].literal;
+        }
+        else if (m_tokens.size() == 2 && plain(m_tokens[0]) && m_tokens[1].op == Op::Star)
+        {
+            m_kind = Kind::Prefix;
+            m_literal = m_tokens[0].literal;
+        }
+    }
+
+    bool Glob::matches(std::string_view text) const
+    {
+        switch (m_kind)
+        {
+        case Kind::Literal:
+            return text == m_literal;
+        case Kind::Suffix:
+            return text.size() >= m_literal.size() && text.compare(text.size() - m_literal.size(), m_literal.size(), m_literal) == 0 &&
+                   text.substr(0, text.size() - m_literal.size()).find('/') == std::string_view::npos;
+        case Kind::Prefix:
+            return text.compare(0, m_literal.size(), m_literal) == 0 && text.find('/', m_literal.size()) == std::string_view::npos;
+        default:
+            return match_from(0, text);
+        }
+    }
+
+    bool Glob::match_from(size_t token, std::string_view text) const
+    {
+        for (; token < m_tokens.size(); ++token)
+        {
+            const Token &current = m_tokens[token];
+            switch (current.op)
+            {
+            case Op::Literal:
+                if (text.compare(0, current.literal.size(), current.literal) != 0)
+                {
+                    return false;
+                }
+                text.remove_prefix(current.literal.size());
+                break;
+            case Op::Any:
+            case Op::Class:
+                if (text.empty() || text[0] == '/' ||
+                    (current.op == Op::Class && !current.set.test(static_cast<unsigned char>(text[0]))))
+                {
+                    return false;
+                }
+                text.remove_prefix(1);
+                break;
+            case Op::Star:
+                for (size_t skip = 0;; ++skip)
+                {
+                    if (match_from(token + 1, text.substr(skip)))
+                    {
+                        return true;
+                    }
+                    if (skip == text.size() || text[skip] == '/')
+                    {
+                        return false;
+                    }
+                }
+            case Op::DoubleStar:
+                for (size_t skip = 0; skip <= text.size(); ++skip)
+                {
+                    if (match_from(token + 1, text.substr(skip)))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            case Op::DoubleStarSlash:
+                if (match_from(token + 1, text))
+                {
+                    return true;
+                }
+                for (size_t slash = text.find('/'); slash != std::string_view::npos; slash = text.find('/', slash + 1))
+                {
+                    if (match_from(token + 1, text.substr(slash + 1)))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+        }
+        return text.empty();
+    }
+
+    void GlobSet::add(std::string_view pattern)
+    {
+        if (pattern.find('/') != std::string_view::npos)
+        {
+            if (pattern[0] == '/')
+            {
+                pattern.remove_prefix(1);
+            }
+            m_pathGlobs.emplace_back(pattern);
+        }
+        else if (!has_wildcard(pattern))
+        {
+            m_names.emplace(pattern);
+        }
+        else if (pattern.size() > 2 && pattern.compare(0, 2, "*.") == 0 && !has_wildcard(pattern.substr(2)) &&
+                 pattern.find('.', 2) == std::string_view::npos)
+        {
+            m_extensions.emplace(pattern.substr(2));
+        }
+        else
+        {
+            m_nameGlobs.emplace_back(pattern);
+        }
+    }
+
+    bool GlobSet::matches(std::string_view name, std::string_view relative) const
+    {
+        if (!m_names.empty() && m_names.count(std::string(name)) != 0)
+        {
+            return true;
+        }
+        const size_t dot = name.rfind('.');
+        if (!m_extensions.empty() && dot != std::string_view::npos && m_extensions.count(std::string(name.substr(dot + 1))) != 0)
+        {
+            return true;
+        }
+        return std::any_of(m_nameGlobs.begin(), m_nameGlobs.end(), [name](const Glob &glob)
+                           { return glob.matches(name); }) ||
+               std::any_of(m_pathGlobs.begin(), m_pathGlobs.end(), [relative](const Glob &glob)
+                           { return glob.matches(relative); });
+    }
+
+    PathFilter::PathFilter(const GrepOptions &options)
+        : m_ignoreFiles(options.ignoreFiles)
+    {
+        for (const auto &glob : options.includeGlobs)
+        {
+            m_include.add(glob);
+        }
+        for (const auto &glob : options.excludeGlobs)
+        {
+            m_exclude.add(glob);
+        }
+        for (const auto &glob : options.excludeDirectoryGlobs)
+        {
+            m_excludeDirectories.add(glob);
+        }
+    }
+
+    bool PathFilter::is_ignore_file(std::string_view name) const
+    {
+        return m_ignoreFiles && (name == ".gitignore" || name == ".ignore");
+    }
+
+    std::shared_ptr<const IgnoreLevel> PathFilter::enter(const fs::path &directory, std::shared_ptr<const IgnoreLevel> parent) const
+    {
+        if (!m_ignoreFiles)
+        {
+            return parent;
+        }
+        // .ignore is read last, so its rules override those of .gitignore.
+        std::vector<IgnoreLevel::Rule> rules;
+        read_ignore_file(directory / ".gitignore", rules);
+        read_ignore_file(directory / ".ignore", rules);
+        if (rules.empty())
+        {
+            return parent;
+        }
+        auto level = std::make_shared<IgnoreLevel>();
+        level->parent = std::move(parent);
+        level->prefix = path_prefix(directory);
+        level->rules = std::move(rules);
+        return level;
+    }
+
+    bool PathFilter::allows(std::string_view path, size_t rootPrefix, bool isDirectory, const IgnoreLevel *ignore) const
+    {
+        const std::string_view name = file_name(path);
+        const std::string_view relative = path.substr(std::min(rootPrefix, path.size()));
+        if (isDirectory)
+        {
+            // Git never tracks its own directory.
+            if ((m_ignoreFiles && name == ".git") || (!m_excludeDirectories.empty() && m_excludeDirectories.matches(name, relative)))
+            {
+                return false;
+            }
+        }
+        else if ((!m_include.empty() && !m_include.matches(name, relative)) || (!m_exclude.empty() && m_exclude.matches(name, relative)))
+        {
+            return false;
+        }
+
+        // The innermost ignore file and within it the last matching line decides.
+        for (const IgnoreLevel *level = ignore; level != nullptr; level = level->parent.get())
+        {
+            const std::string_view below = path.substr(std::min(level->prefix, path.size()));
+            for (auto rule = level->rules.rbegin(); rule != level->rules.rend(); ++rule)
+            {
+                if ((isDirectory || !rule->directoryOnly) && rule->glob.matches(rule->anchored ? below : name))
+                {
+                    return rule->negated;
+                }
+            }
+        }
+        return true;
+    }
+
+    void PathFilter::retain_allowed(const fs::path &root, std::vector<std::string> &relatives) const
+    {
+        if (empty())
+        {
+            return;
+        }
+        const size_t rootPrefix = path_prefix(root);
+
+        // Directories are looked at once no matter how many candidates they hold, nullptr scope marks a pruned one.
+        struct Scope
+        {
+            bool allowed;
+            std::shared_ptr<const IgnoreLevel> ignore;
+        };
+        std::unordered_map<std::string, Scope> scopes;
+        const fs::path rootDirectory = (root / "x").parent_path(); // without a trailing separator, as parent_path returns it
+        const Scope &rootScope = scopes.emplace(rootDirectory.string(), Scope{true, enter(root, nullptr)}).first->second;
+        auto scope_of = [&](const fs::path &directory, auto &self) -> const Scope &
+        {
+            const std::string key = directory.string();
+            auto found = scopes.find(key);
+            if (found != scopes.end())
+            {
+                return found->second;
+            }
+            if (key.size() <= rootDirectory.string().size())
+            {
+                return rootScope; // not below root, only happens for paths the index does not produce
+            }
+            const Scope &parent = self(directory.parent_path(), self);
+            Scope scope{parent.allowed && allows(key, rootPrefix, true, parent.ignore.get()), nullptr};
+            if (scope.allowed)
+            {
+                scope.ignore = enter(directory, parent.ignore);
+            }
+            return scopes.emplace(key, std::move(scope)).first->second;
+        };
+
+        relatives.erase(std::remove_if(relatives.begin(), relatives.end(), [&](const std::string &relative)
+                                       {
+                                           const fs::path path = root / relative;
+                                           const Scope &scope = scope_of(path.parent_path(), scope_of);
+                                           return !scope.allowed || !allows(path.string(), rootPrefix, false, scope.ignore.get()); }),
+                        relatives.end());
+    }
+
+    size_t path_prefix(const fs::path &directory)
+    {
+        return (directory / "").string().size();
+    }
+}
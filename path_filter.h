@@ -0,0 +1,124 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "options.h"
+
+namespace grep
+{
+    namespace fs = std::filesystem;
+
+    // A shell glob as used by --include and ignore files: * and ? never match a slash, [a-z] and [!a-z] are classes,
+    // \ escapes, and ** as a whole path segment matches any number of directories (**/x, x/**, x/**/y).
+    // Globs that are a plain name, a name with a * before or after it are compared without running the general matcher.
+    class Glob
+    {
+    public:
+        explicit Glob(std::string_view pattern);
+
+        bool matches(std::string_view text) const;
+
+    private:
+        enum class Kind
+        {
+            Literal, // text equals m_literal
+            Suffix,  // *m_literal
+            Prefix,  // m_literal*
+            General
+        };
+        enum class Op
+        {
+            Literal,
+            Any,             // ?
+            Class,           // [...]
+            Star,            // * within one segment
+            DoubleStar,      // trailing /**, anything
+            DoubleStarSlash  // **/ , nothing or whole directories
+        };
+        struct Token
+        {
+            Op op;
+            std::string literal;
+            std::bitset<256> set; // for Class, already negated
+        };
+
+        bool match_from(size_t token, std::string_view text) const;
+
+    private:
+        Kind m_kind = Kind::General;
+        std::string m_literal;
+        std::vector<Token> m_tokens;
+    };
+
+    // Any number of globs checked in one call. Plain names and *.ext globs, the usual bulk of a set,
+    // are answered by hash lookups, only the rest run the glob matcher.
+    // Globs without a slash match the file name, globs with one the path relative to the search root.
+    class GlobSet
+    {
+    public:
+        void add(std::string_view pattern);
+        bool empty() const { return m_names.empty() && m_extensions.empty() && m_nameGlobs.empty() && m_pathGlobs.empty(); }
+        bool matches(std::string_view name, std::string_view relative) const;
+
+    private:
+        std::unordered_set<std::string> m_names;
+        std::unordered_set<std::string> m_extensions; // without the dot
+        std::vector<Glob> m_nameGlobs;
+        std::vector<Glob> m_pathGlobs;
+    };
+
+    // The rules of the ignore files of one directory, linked to those of its parent directories.
+    struct IgnoreLevel
+    {
+        struct Rule
+        {
+            Glob glob;
+            bool negated;       // !pattern re-includes
+            bool directoryOnly; // pattern/
+            bool anchored;      // has a slash, matches the path relative to the directory instead of the name
+        };
+
+        std::shared_ptr<const IgnoreLevel> parent;
+        size_t prefix = 0; // length of the directory path with separator, entries below it are matched without it
+        std::vector<Rule> rules;
+    };
+
+    // Decides during the walk which entries are searched: --include, --exclude and --exclude-dir globs and,
+    // unless --no-ignore, the rules of .gitignore and .ignore files (git's syntax, deeper files and later lines win).
+    // A directory that is left out is never listed, so its whole subtree costs nothing.
+    class PathFilter
+    {
+    public:
+        PathFilter() = default; // lets everything through
+        explicit PathFilter(const GrepOptions &options);
+
+        bool empty() const { return !m_ignoreFiles && m_include.empty() && m_exclude.empty() && m_excludeDirectories.empty(); }
+        bool is_ignore_file(std::string_view name) const;
+
+        // The rules in effect inside directory: parent plus those of the directory's own ignore files, if any.
+        std::shared_ptr<const IgnoreLevel> enter(const fs::path &directory, std::shared_ptr<const IgnoreLevel> parent) const;
+
+        // path is an entry found below the start directory, rootPrefix the length of the start directory with separator.
+        bool allows(std::string_view path, size_t rootPrefix, bool isDirectory, const IgnoreLevel *ignore) const;
+
+        // For files that were not found by walking, e.g. index candidates: keeps the paths relative to root whose
+        // directories on the way down and the file itself the walk would have let through.
+        void retain_allowed(const fs::path &root, std::vector<std::string> &relatives) const;
+
+    private:
+        GlobSet m_include;
+        GlobSet m_exclude;
+        GlobSet m_excludeDirectories;
+        bool m_ignoreFiles = false;
+    };
+
+    // Length of directory as a prefix of the paths of its entries.
+    size_t path_prefix(const fs::path &directory);
+}
@@ -0,0 +1,1319 @@
+#include "regex_matcher.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+
+#include "case_fold.h"
+
+namespace grep
+{
+    namespace
+    {
+        using ByteSet = std::bitset<256>;
+
+        constexpr unsigned Unbounded = UINT_MAX;
+        constexpr unsigned MaxRepeat = 1000;
+        constexpr size_t MaxNfaStates = 100000;
+        constexpr size_t MaxExactStrings = 16;
+        constexpr size_t MaxExactLength = 64;
+        constexpr size_t MaxRequiredStrings = 64;
+
+        struct RegexNode
+        {
+            enum class Kind
+            {
+                Empty,
+                Bytes,
+                Concat,
+                Alternate,
+                Repeat,
+                LineStart,
+                LineEnd
+            };
+
+            Kind kind = Kind::Empty;
+            ByteSet bytes;
+            std::vector<RegexNode> children;
+            unsigned min = 0;
+            unsigned max = 0;
+        };
+
+        RegexNode bytes_node(ByteSet bytes)
+        {
+            bytes.reset('\n'); // matches never span a line break
+            RegexNode node;
+            node.kind = RegexNode::Kind::Bytes;
+            node.bytes = bytes;
+            return node;
+        }
+
+        RegexNode literal_node(unsigned char c)
+        {
+            ByteSet bytes;
+            bytes.set(c);
+            return bytes_node(bytes);
+        }
+
+        // Adds the other case of every ASCII letter in bytes.
+        ByteSet fold_ascii(ByteSet bytes)
+        {
+            for (unsigned c = 'a'; c <= 'z'; ++c)
+            {
+                if (bytes.test(c) || bytes.test(c - ('a' - 'A')))
+                {
+                    bytes.set(c);
+                    bytes.set(c - ('a' - 'A'));
+                }
+            }
+            return bytes;
+        }
+
+        template <typename Predicate>
+        ByteSet ascii_class(Predicate predicate)
+        {
+            ByteSet bytes;
+            for (int c = 0; c < 128; ++c)
+            {
+                if (predicate(c))
+                {
+                    bytes.set(static_cast<size_t>(c));
+                }
+            }
+            return bytes;
+        }
+
+        // Recursive descent parser for the ERE syntax of GNU grep -E. Like GNU grep, a quantifier without
+        // an operand, a brace that does not start a valid bound and an unmatched ')' are literals.
+        // With ignoreCase letters and bracket expressions get both ASCII cases, and a UTF-8 encoded letter outside
+        // brackets becomes an alternation of its simple case fold variants.
+        class Parser
+        {
+        public:
+            Parser(const std::string &pattern, bool ignoreCase)
+                : m_pattern(pattern), m_ignoreCase(ignoreCase)
+            {
+            }
+
+            RegexNode parse()
+            {
+                return parse_alternation();
+            }
+
+        private:
+            [[noreturn]] void fail(const std::string &reason) const
+            {
+                throw std::invalid_argument("Invalid regular expression '" + m_pattern + "': " + reason);
+            }
+
+            bool at_end() const { return m_pos == m_pattern.size(); }
+            char peek() const { return m_pattern[m_pos]; }
+
+            RegexNode parse_alternation()
+            {
+                RegexNode first = parse_concatenation();
+                if (at_end() || peek() != '|')
+                {
+                    return first;
+                }
+                RegexNode node;
+                node.kind = RegexNode::Kind::Alternate;
+                node.children.push_back(std::move(first));
+                while (!at_end() && peek() == '|')
+                {
+                    ++m_pos;
+                    node.children.push_back(parse_concatenation());
+                }
+                return node;
+            }
+
+            RegexNode parse_concatenation()
+            {
+                RegexNode node;
+                node.kind = RegexNode::Kind::Concat;
+                while (!at_end() && peek() != '|' && !(peek() == ')' && m_depth > 0))
+                {
+                    node.children.push_back(parse_repetition());
+                }
+                if (node.children.size() == 1)
+                {
+                    RegexNode only = std::move(node.children.front());
+                    return only;
+                }
+                return node.children.empty() ? RegexNode() : node;
+            }
+
+            RegexNode parse_repetition()
+            {
+                RegexNode node = parse_atom();
+                while (!at_end())
+                {
+                    unsigned min = 0;
+                    unsigned max = Unbounded;
+                    const char c = peek();
+                    if (c == '*' || c == '+' || c == '?')
+                    {
+                        min = c == '+' ? 1 : 0;
+                        max = c == '?' ? 1 : Unbounded;
+                        ++m_pos;
+                    }
+                    else if (c != '{' || !parse_bounds(min, max))
+                    {
+                        break;
+                    }
+
+                    RegexNode repeat;
+                    repeat.kind = RegexNode::Kind::Repeat;
+                    repeat.min = min;
+                    repeat.max = max;
+                    repeat.children.push_back(std::move(node));
+                    node = std::move(repeat);
+                }
+                return node;
+            }
+
+            // {n}, {n,}, {,m} and {n,m}.
+            bool parse_bounds(unsigned &min, unsigned &max)
+            {
+                size_t pos = m_pos + 1;
+                auto read_number = [this, &pos](unsigned &value)
+                {
+                    const size_t start = pos;
+                    value = 0;
+                    while (pos < m_pattern.size() && std::isdigit(static_cast<unsigned char>(m_pattern[pos])))
+                    {
+                        value = value * 10 + static_cast<unsigned>(m_pattern[pos++] - '0');
+                        if (value > MaxRepeat)
+                        {
+                            fail("repetition count too large");
+                        }
+                    }
+                    return pos > start;
+                };
+
+                const bool hasMin = read_number(min);
+                if (pos < m_pattern.size() && m_pattern[pos] == ',')
+                {
+                    ++pos;
+                    if (!read_number(max))
+                    {
+                        max = Unbounded;
+                    }
+                }
+                else if (hasMin)
+                {
+                    max = min;
+                }
+                else
+                {
+                    return false;
+                }
+
+                if (pos == m_pattern.size() || m_pattern[pos] != '}')
+                {
+                    return false;
+                }
+                if (max < min)
+                {
+                    fail("invalid repetition bounds");
+                }
+                m_pos = pos + 1;
+                return true;
+            }
+
+            RegexNode parse_atom()
+            {
+                const char c = m_pattern[m_pos++];
+                switch (c)
+                {
+                case '(':
+                {
+                    ++m_depth;
+                    RegexNode inner = parse_alternation();
+                    if (at_end())
+                    {
+                        fail("unmatched (");
+                    }
+                    ++m_pos;
+                    --m_depth;
+                    return inner;
+                }
+                case '[':
+                    return parse_bracket();
+                case '.':
+                    return bytes_node(ByteSet().set());
+                case '^':
+                {
+                    RegexNode node;
+                    node.kind = RegexNode::Kind::LineStart;
+                    return node;
+                }
+                case '$':
+                {
+                    RegexNode node;
+                    node.kind = RegexNode::Kind::LineEnd;
+                    return node;
+                }
+                case '\\':
+                    return parse_escape();
+                default:
+                    if (m_ignoreCase && static_cast<unsigned char>(c) >= 0x80)
+                    {
+                        return parse_multibyte();
+                    }
+                    return literal(static_cast<unsigned char>(c));
+                }
+            }
+
+            RegexNode literal(unsigned char c) const
+            {
+                return m_ignoreCase && is_ascii_letter(c) ? bytes_node(fold_ascii(ByteSet().set(c))) : literal_node(c);
+            }
+
+            // The character starting one byte before m_pos, as its case variants.
+            RegexNode parse_multibyte()
+            {
+                size_t pos = m_pos - 1;
+                char32_t c = 0;
+                if (!decode_utf8(m_pattern, pos, c))
+                {
+                    return literal_node(static_cast<unsigned char>(m_pattern[m_pos - 1]));
+                }
+                m_pos = pos;
+                RegexNode node;
+                node.kind = RegexNode::Kind::Alternate;
+                for (char32_t variant : case_variants(c))
+                {
+                    std::string encoded;
+                    append_utf8(encoded, variant);
+                    RegexNode sequence;
+                    sequence.kind = RegexNode::Kind::Concat;
+                    for (unsigned char byte : encoded)
+                    {
+                        sequence.children.push_back(literal(byte));
+                    }
+                    node.children.push_back(sequence.children.size() == 1 ? std::move(sequence.children.front()) : std::move(sequence));
+                }
+                if (node.children.size() == 1)
+                {
+                    RegexNode only = std::move(node.children.front());
+                    return only;
+                }
+                return node;
+            }
+
+            RegexNode parse_escape()
+            {
+                if (at_end())
+                {
+                    fail("trailing backslash");
+                }
+                const char c = m_pattern[m_pos++];
+                switch (c)
+                {
+                case 'w':
+                case 'W':
+                {
+                    const ByteSet word = ascii_class([](int b)
+                                                     { return std::isalnum(b) || b == '_'; });
+                    return bytes_node(c == 'w' ? word : ~word);
+                }
+                case 's':
+                case 'S':
+                {
+                    const ByteSet space = ascii_class([](int b)
+                                                      { return std::isspace(b); });
+                    return bytes_node(c == 's' ? space : ~space);
+                }
+                case 'd':
+                case 'D':
+                {
+                    const ByteSet digit = ascii_class([](int b)
+                                                      { return std::isdigit(b); });
+                    return bytes_node(c == 'd' ? digit : ~digit);
+                }
+                case 'b':
+                case 'B':
+                case '<':
+                case '>':
+                    fail("word boundaries are not supported");
+                default:
+                    if (c >= '1' && c <= '9')
+                    {
+                        fail("back-references are not supported");
+                    }
+                    return literal(static_cast<unsigned char>(c));
+                }
+            }
+
+            ByteSet named_class(const std::string &name) const
+            {
+                static const std::pair<const char *, int (*)(int)> classes[] = {
+                    {"alpha", std::isalpha}, {"digit", std::isdigit}, {"alnum", std::isalnum}, {"upper", std::isupper}, {"lower", std::islower}, {"space", std::isspace}, {"blank", std::isblank}, {"punct", std::ispunct}, {"print", std::isprint}, {"graph", std::isgraph}, {"cntrl", std::iscntrl}, {"xdigit", std::isxdigit}};
+                for (const auto &entry : classes)
+                {
+                    if (name == entry.first)
+                    {
+                        return ascii_class(entry.second);
+                    }
+                }
+                fail("unknown character class [:" + name + ":]");
+            }
+
+            RegexNode parse_bracket()
+            {
+                ByteSet bytes;
+                bool negate = false;
+                if (!at_end() && peek() == '^')
+                {
+                    negate = true;
+                    ++m_pos;
+                }
+
+                for (bool first = true;; first = false)
+                {
+                    if (at_end())
+                    {
+                        fail("unmatched [");
+                    }
+                    const unsigned char c = static_cast<unsigned char>(peek());
+                    if (c == ']' && !first)
+                    {
+                        ++m_pos;
+                        break;
+                    }
+
+                    if (c == '[' && m_pos + 1 < m_pattern.size() &&
+                        (m_pattern[m_pos + 1] == ':' || m_pattern[m_pos + 1] == '=' || m_pattern[m_pos + 1] == '.'))
+                    {
+                        const char kind = m_pattern[m_pos + 1];
+                        const size_t close = m_pattern.find(std::string{kind, ']'}, m_pos + 2);
+                        if (close == std::string::npos)
+                        {
+                            fail("unmatched [");
+                        }
+                        const std::string name = m_pattern.substr(m_pos + 2, close - m_pos - 2);
+                        m_pos = close + 2;
+                        if (kind == ':')
+                        {
+                            bytes |= named_class(name);
+                        }
+                        else if (name.size() == 1)
+                        {
+                            bytes.set(static_cast<unsigned char>(name[0]));
+                        }
+                        else
+                        {
+                            fail("multi-character collating elements are not supported");
+                        }
+                        continue;
+                    }
+
+                    ++m_pos;
+                    unsigned high = c;
+                    if (m_pos + 1 < m_pattern.size() && peek() == '-' && m_pattern[m_pos + 1] != ']')
+                    {
+                        high = static_cast<unsigned char>(m_pattern[m_pos + 1]);
+                        m_pos += 2;
+                        if (high < c)
+                        {
+                            fail("invalid range end");
+                        }
+                    }
+                    for (unsigned b = c; b <= high; ++b)
+                    {
+                        bytes.set(b);
+                    }
+                }
+                if (m_ignoreCase)
+                {
+                    bytes = fold_ascii(bytes);
+                }
+                return bytes_node(negate ? ~bytes : bytes);
+            }
+
+        private:
+            const std::string &m_pattern;
+            const bool m_ignoreCase;
+            size_t m_pos = 0;
+            unsigned m_depth = 0;
+        };
+
+        // What the prefilter knows about a subexpression: either the complete, small set of strings it matches,
+        // or a set of strings of which every match contains at least one (empty if nothing is required).
+        struct LiteralInfo
+        {
+            bool exact = false;
+            std::vector<std::string> strings;
+        };
+
+        LiteralInfo exact_info(std::vector<std::string> strings)
+        {
+            std::sort(strings.begin(), strings.end());
+            strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+            return LiteralInfo{true, std::move(strings)};
+        }
+
+        // Required strings of info, a set containing the empty string requires nothing.
+        std::vector<std::string> required(const LiteralInfo &info)
+        {
+            for (const auto &text : info.strings)
+            {
+                if (text.empty())
+                {
+                    return {};
+                }
+            }
+            return info.strings;
+        }
+
+        // Longer shortest strings filter better, at equal length fewer strings are cheaper to search.
+        std::vector<std::string> better(std::vector<std::string> a, std::vector<std::string> b)
+        {
+            auto shortest = [](const std::vector<std::string> &strings)
+            {
+                size_t length = SIZE_MAX;
+                for (const auto &text : strings)
+                {
+                    length = std::min(length, text.size());
+                }
+                return strings.empty() ? 0 : length;
+            };
+            const size_t lengthA = shortest(a);
+            const size_t lengthB = shortest(b);
+            if (lengthA != lengthB)
+            {
+                return lengthA > lengthB ? a : b;
+            }
+            return a.size() <= b.size() ? a : b;
+        }
+
+        bool cross_product(const std::vector<std::string> &left, const std::vector<std::string> &right, std::vector<std::string> &product)
+        {
+            if (left.size() * right.size() > MaxExactStrings)
+            {
+                return false;
+            }
+            product.clear();
+            for (const auto &a : left)
+            {
+                for (const auto &b : right)
+                {
+                    if (a.size() + b.size() > MaxExactLength)
+                    {
+                        return false;
+                    }
+                    product.push_back(a + b);
+                }
+            }
+            return true;
+        }
+
+        // With ignoreCase the strings are lower case and meant for a matcher that folds ASCII, which is exact
+        // because the parser gave every letter both cases.
+        LiteralInfo analyze(const RegexNode &node, bool ignoreCase)
+        {
+            switch (node.kind)
+            {
+            case RegexNode::Kind::Empty:
+                return exact_info({""});
+            case RegexNode::Kind::Bytes:
+            {
+                ByteSet bytes = node.bytes;
+                if (ignoreCase)
+                {
+                    for (unsigned c = 'A'; c <= 'Z'; ++c)
+                    {
+                        bytes.reset(c);
+                    }
+                }
+                if (bytes.count() > 4)
+                {
+                    return LiteralInfo();
+                }
+                std::vector<std::string> strings;
+                for (size_t c = 0; c < 256; ++c)
+                {
+                    if (bytes.test(c))
+                    {
+                        strings.emplace_back(1, static_cast<char>(c));
+                    }
+                }
+                return exact_info(std::move(strings));
+            }
+            case RegexNode::Kind::LineStart:
+            case RegexNode::Kind::LineEnd:
+                return LiteralInfo();
+            case RegexNode::Kind::Concat:
+            {
+                // Consecutive exact children are multiplied out, the best run or inexact child is required.
+                std::vector<std::string> run{""};
+                std::vector<std::string> best;
+                bool exact = true;
+                std::vector<std::string> product;
+                for (const auto &child : node.children)
+                {
+                    LiteralInfo info = analyze(child, ignoreCase);
+                    if (!info.exact)
+                    {
+                        exact = false;
+                        best = better(std::move(best), required(exact_info(std::move(run))));
+                        best = better(std::move(best), std::move(info.strings));
+                        run = {""};
+                    }
+                    else if (cross_product(run, info.strings, product))
+                    {
+                        run = exact_info(std::move(product)).strings;
+                    }
+                    else
+                    {
+                        exact = false;
+                        best = better(std::move(best), required(exact_info(std::move(run))));
+                        run = std::move(info.strings);
+                    }
+                }
+                if (exact)
+                {
+                    return exact_info(std::move(run));
+                }
+                return LiteralInfo{false, better(std::move(best), required(exact_info(std::move(run))))};
+            }
+            case RegexNode::Kind::Alternate:
+            {
+                std::vector<LiteralInfo> infos;
+                bool allExact = true;
+                size_t total = 0;
+                for (const auto &child : node.children)
+                {
+                    infos.push_back(analyze(child, ignoreCase));
+                    allExact = allExact && infos.back().exact;
+                    total += infos.back().strings.size();
+                }
+                std::vector<std::string> strings;
+                if (allExact && total <= MaxExactStrings)
+                {
+                    for (auto &info : infos)
+                    {
+                        strings.insert(strings.end(), info.strings.begin(), info.strings.end());
+                    }
+                    return exact_info(std::move(strings));
+                }
+                for (auto &info : infos)
+                {
+                    std::vector<std::string> needed = required(info);
+                    if (needed.empty())
+                    {
+                        return LiteralInfo();
+                    }
+                    strings.insert(strings.end(), needed.begin(), needed.end());
+                }
+                if (strings.size() > MaxRequiredStrings)
+                {
+                    return LiteralInfo();
+                }
+                return LiteralInfo{false, exact_info(std::move(strings)).strings};
+            }
+            case RegexNode::Kind::Repeat:
+            {
+                LiteralInfo child = analyze(node.children.front(), ignoreCase);
+                if (node.max == 0)
+                {
+                    return exact_info({""});
+                }
+                if (node.min == 0)
+                {
+                    if (node.max == 1 && child.exact && child.strings.size() < MaxExactStrings)
+                    {
+                        child.strings.emplace_back();
+                        return exact_info(std::move(child.strings));
+                    }
+                    return LiteralInfo();
+                }
+                if (child.exact && node.min == node.max)
+                {
+                    std::vector<std::string> run{""};
+                    std::vector<std::string> product;
+                    bool fits = true;
+                    for (unsigned i = 0; i < node.min && fits; ++i)
+                    {
+                        fits = cross_product(run, child.strings, product);
+                        run = product;
+                    }
+                    if (fits)
+                    {
+                        return exact_info(std::move(run));
+                    }
+                }
+                return LiteralInfo{false, required(child)};
+            }
+            }
+            return LiteralInfo();
+        }
+
+        // Thompson NFA over all patterns. Byte sets are translated to classes of bytes that no pattern
+        // distinguishes, which keeps the DFA rows short.
+        class Nfa
+        {
+        public:
+            struct State
+            {
+                enum class Op : uint8_t
+                {
+                    Bytes,
+                    Split,
+                    LineStart,
+                    LineEnd,
+                    Match
+                };
+
+                Op op;
+                uint32_t out = 0;
+                uint32_t out1 = 0; // second branch of a split, pattern index of a match
+                ByteSet classes;   // byte classes a Bytes state consumes
+            };
+
+            Nfa(const std::vector<RegexNode> &patterns, const std::vector<size_t> &indices)
+            {
+                std::vector<uint32_t> entries;
+                for (size_t i = 0; i < patterns.size(); ++i)
+                {
+                    const uint32_t match = add_state(State{State::Op::Match, 0, static_cast<uint32_t>(indices[i]), {}});
+                    entries.push_back(compile(patterns[i], match));
+                }
+
+                m_start = entries.back();
+                for (size_t i = entries.size() - 1; i-- > 0;)
+                {
+                    m_start = add_state(State{State::Op::Split, entries[i], m_start, {}});
+                }
+                build_byte_classes();
+            }
+
+        public:
+            uint32_t start() const { return m_start; }
+            size_t class_count() const { return m_classCount; }
+            uint8_t byte_class(unsigned char c) const { return m_byteClass[c]; }
+
+            // States reachable from seeds without consuming a byte. Only Bytes, LineEnd and Match states are kept,
+            // line starts are passed if atLineStart, line ends if atLineEnd.
+            std::vector<uint32_t> closure(const std::vector<uint32_t> &seeds, bool atLineStart, bool atLineEnd) const
+            {
+                std::vector<uint32_t> result;
+                std::vector<bool> visited(m_states.size(), false);
+                std::vector<uint32_t> stack(seeds.rbegin(), seeds.rend());
+                while (!stack.empty())
+                {
+                    const uint32_t id = stack.back();
+                    stack.pop_back();
+                    if (visited[id])
+                    {
+                        continue;
+                    }
+                    visited[id] = true;
+
+                    const State &state = m_states[id];
+                    switch (state.op)
+                    {
+                    case State::Op::Split:
+                        stack.push_back(state.out1);
+                        stack.push_back(state.out);
+                        break;
+                    case State::Op::LineStart:
+                        if (atLineStart)
+                        {
+                            stack.push_back(state.out);
+                        }
+                        break;
+                    case State::Op::LineEnd:
+                        if (atLineEnd)
+                        {
+                            stack.push_back(state.out);
+                        }
+                        else
+                        {
+                            result.push_back(id);
+                        }
+                        break;
+                    default:
+                        result.push_back(id);
+                        break;
+                    }
+                }
+                std::sort(result.begin(), result.end());
+                return result;
+            }
+
+            // Successors of the Bytes states of set that consume a byte of class byteClass.
+            std::vector<uint32_t> step(const std::vector<uint32_t> &set, size_t byteClass) const
+            {
+                std::vector<uint32_t> seeds;
+                for (uint32_t id : set)
+                {
+                    const State &state = m_states[id];
+                    if (state.op == State::Op::Bytes && state.classes.test(byteClass))
+                    {
+                        seeds.push_back(state.out);
+                    }
+                }
+                return seeds;
+            }
+
+            // Lowest pattern index matched by set plus one, 0 if none. At a line end pending $ are passed.
+            uint32_t accept(const std::vector<uint32_t> &set, bool atLineStart, bool atLineEnd) const
+            {
+                uint32_t best = 0;
+                std::vector<uint32_t> pending;
+                for (uint32_t id : set)
+                {
+                    const State &state = m_states[id];
+                    if (state.op == State::Op::Match)
+                    {
+                        best = best == 0 ? state.out1 + 1 : std::min(best, state.out1 + 1);
+                    }
+                    else if (state.op == State::Op::LineEnd && atLineEnd)
+                    {
+                        pending.push_back(state.out);
+                    }
+                }
+                if (!pending.empty())
+                {
+                    const uint32_t atEnd = accept(closure(pending, atLineStart, true), atLineStart, false);
+                    best = best == 0 ? atEnd : (atEnd == 0 ? best : std::min(best, atEnd));
+                }
+                return best;
+            }
+
+        private:
+            uint32_t add_state(State state)
+            {
+                if (m_states.size() == MaxNfaStates)
+                {
+                    throw std::invalid_argument("Regular expression is too big");
+                }
+                m_states.push_back(state);
+                return static_cast<uint32_t>(m_states.size() - 1);
+            }
+
+            // Returns the entry of node's states, which continue to next.
+            uint32_t compile(const RegexNode &node, uint32_t next)
+            {
+                switch (node.kind)
+                {
+                case RegexNode::Kind::Empty:
+                    return next;
+                case RegexNode::Kind::Bytes:
+                    m_byteSets.push_back(node.bytes);
+                    return add_state(State{State::Op::Bytes, next, static_cast<uint32_t>(m_byteSets.size() - 1), {}});
+                case RegexNode::Kind::LineStart:
+                    return add_state(State{State::Op::LineStart, next, 0, {}});
+                case RegexNode::Kind::LineEnd:
+                    return add_state(State{State::Op::LineEnd, next, 0, {}});
+                case RegexNode::Kind::Concat:
+                    for (auto child = node.children.rbegin(); child != node.children.rend(); ++child)
+                    {
+                        next = compile(*child, next);
+                    }
+                    return next;
+                case RegexNode::Kind::Alternate:
+                {
+                    uint32_t entry = compile(node.children.back(), next);
+                    for (size_t i = node.children.size() - 1; i-- > 0;)
+                    {
+                        entry = add_state(State{State::Op::Split, compile(node.children[i], next), entry, {}});
+                    }
+                    return entry;
+                }
+                case RegexNode::Kind::Repeat:
+                {
+                    const RegexNode &child = node.children.front();
+                    uint32_t entry = next;
+                    if (node.max == Unbounded)
+                    {
+                        const uint32_t loop = add_state(State{State::Op::Split, 0, next, {}});
+                        m_states[loop].out = compile(child, loop);
+                        entry = loop;
+                    }
+                    else
+                    {
+                        // x{0,k} as (x(x(...)?)?)?, every optional copy can leave directly to next.
+                        for (unsigned i = node.min; i < node.max; ++i)
+                        {
+                            entry = add_state(State{State::Op::Split, compile(child, entry), next, {}});
+                        }
+                    }
+                    for (unsigned i = 0; i < node.min; ++i)
+                    {
+                        entry = compile(child, entry);
+                    }
+                    return entry;
+                }
+                }
+                return next;
+            }
+
+            void build_byte_classes()
+            {
+                std::fill(std::begin(m_byteClass), std::end(m_byteClass), 0);
+                m_classCount = 1;
+                for (const ByteSet &bytes : m_byteSets)
+                {
+                    // Splits every class into the bytes inside and outside of the set.
+                    int split[256];
+                    std::fill(std::begin(split), std::end(split), -1);
+                    const size_t before = m_classCount;
+                    std::vector<bool> hasOutside(before, false);
+                    std::vector<bool> hasInside(before, false);
+                    for (size_t c = 0; c < 256; ++c)
+                    {
+                        (bytes.test(c) ? hasInside : hasOutside)[m_byteClass[c]] = true;
+                    }
+                    for (size_t cls = 0; cls < before; ++cls)
+                    {
+                        if (hasInside[cls] && hasOutside[cls])
+                        {
+                            split[cls] = static_cast<int>(m_classCount++);
+                        }
+                    }
+                    for (size_t c = 0; c < 256; ++c)
+                    {
+                        if (bytes.test(c) && split[m_byteClass[c]] >= 0)
+                        {
+                            m_byteClass[c] = static_cast<uint8_t>(split[m_byteClass[c]]);
+                        }
+                    }
+                }
+
+                for (State &state : m_states)
+                {
+                    if (state.op == State::Op::Bytes)
+                    {
+                        const ByteSet &bytes = m_byteSets[state.out1];
+                        for (size_t c = 0; c < 256; ++c)
+                        {
+                            if (bytes.test(c))
+                            {
+                                state.classes.set(m_byteClass[c]);
+                            }
+                        }
+                    }
+                }
+            }
+
+        private:
+            std::vector<State> m_states;
+            std::vector<ByteSet> m_byteSets;
+            uint32_t m_start = 0;
+            uint8_t m_byteClass[256];
+            size_t m_classCount = 1;
+        };
+
+        // Held by a search for as long as it uses state ids of the DFAs of a matcher. Shared until a full cache
+        // has to be flushed, which makes it exclusive for the rest of the search, like RE2's RWLocker.
+        class CacheLock
+        {
+        public:
+            explicit CacheLock(std::shared_mutex &mutex)
+                : m_mutex(mutex)
+            {
+                m_mutex.lock_shared();
+            }
+            ~CacheLock()
+            {
+                if (m_exclusive)
+                {
+                    m_mutex.unlock();
+                }
+                else
+                {
+                    m_mutex.unlock_shared();
+                }
+            }
+            CacheLock(const CacheLock &) = delete;
+            CacheLock &operator=(const CacheLock &) = delete;
+
+            void make_exclusive()
+            {
+                if (!m_exclusive)
+                {
+                    m_mutex.unlock_shared();
+                    m_mutex.lock();
+                    m_exclusive = true;
+                }
+            }
+
+        private:
+            std::shared_mutex &m_mutex;
+            bool m_exclusive = false;
+        };
+
+        // DFA whose states are built from NFA state sets the first time a transition needs them.
+        // Matchers are shared by all search workers: transitions are published with release stores and read
+        // without a lock, only building a missing state takes the mutex. The table is allocated up front, once
+        // it is full, next() returns Failed and the caller flushes it under an exclusive CacheLock.
+        class LazyDfa
+        {
+        public:
+            static constexpr uint32_t Dead = 0;
+            static constexpr uint32_t Failed = UINT32_MAX;
+            using StateSet = std::pair<std::vector<uint32_t>, bool>; // NFA states, at line start
+
+            // An unanchored DFA restarts the NFA at every position, an anchored one only at the start.
+            LazyDfa(const Nfa &nfa, bool unanchored)
+                : m_nfa(nfa),
+                  m_unanchored(unanchored),
+                  m_classCount(nfa.class_count()),
+                  m_maxStates(std::clamp<size_t>(CacheBytes / (m_classCount * sizeof(uint32_t)), 16, 1 << 16)),
+                  m_transitions(new std::atomic<uint32_t>[m_maxStates * m_classCount]),
+                  m_accept(m_maxStates)
+            {
+                reset();
+            }
+
+        public:
+            uint32_t start(bool atLineStart) const { return m_start[atLineStart ? 1 : 0]; }
+
+            uint32_t next(uint32_t state, unsigned char byte) const
+            {
+                const size_t slot = state * m_classCount + m_nfa.byte_class(byte);
+                const uint32_t next = m_transitions[slot].load(std::memory_order_acquire);
+                return next != Unknown ? next : build(state, slot);
+            }
+
+            // Lowest matching pattern index plus one, 0 if state does not match.
+            uint32_t accept(uint32_t state) const { return m_accept[state].anywhere; }
+            uint32_t accept_at_line_end(uint32_t state) const { return m_accept[state].atLineEnd; }
+
+            // The NFA states of state, what a search keeps of it across a flush by another search.
+            StateSet state_set(uint32_t state) const
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                return m_sets[state];
+            }
+
+            // Empties the cache, no other search may hold a state id. Returns the id of set in the new cache.
+            uint32_t flush(const StateSet &set) const
+            {
+                reset();
+                return intern(set.first, set.second);
+            }
+
+        private:
+            static constexpr uint32_t Unknown = UINT32_MAX - 1;
+            static constexpr size_t CacheBytes = 1 << 20;
+
+            struct Accept
+            {
+                uint32_t anywhere = 0;
+                uint32_t atLineEnd = 0;
+            };
+
+            void reset() const
+            {
+                for (size_t i = 0; i < m_maxStates * m_classCount; ++i)
+                {
+                    m_transitions[i].store(Unknown, std::memory_order_relaxed);
+                }
+                m_sets.clear();
+                m_ids.clear();
+                intern(std::vector<uint32_t>(), false);
+                for (size_t c = 0; c < m_classCount; ++c)
+                {
+                    m_transitions[c].store(Dead, std::memory_order_relaxed);
+                }
+                m_start[0] = intern(m_nfa.closure({m_nfa.start()}, false, false), false);
+                m_start[1] = intern(m_nfa.closure({m_nfa.start()}, true, false), true);
+            }
+
+            uint32_t build(uint32_t state, size_t slot) const
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                const uint32_t existing = m_transitions[slot].load(std::memory_order_relaxed);
+                if (existing != Unknown)
+                {
+                    return existing;
+                }
+
+                std::vector<uint32_t> seeds = m_nfa.step(m_sets[state].first, slot % m_classCount);
+                if (m_unanchored)
+                {
+                    seeds.push_back(m_nfa.start());
+                }
+                const uint32_t next = intern(m_nfa.closure(seeds, false, false), false);
+                if (next != Failed)
+                {
+                    m_transitions[slot].store(next, std::memory_order_release);
+                }
+                return next;
+            }
+
+            uint32_t intern(std::vector<uint32_t> set, bool atLineStart) const
+            {
+                auto key = std::make_pair(std::move(set), atLineStart);
+                const auto it = m_ids.find(key);
+                if (it != m_ids.end())
+                {
+                    return it->second;
+                }
+                if (m_sets.size() == m_maxStates)
+                {
+                    return Failed;
+                }
+
+                const uint32_t id = static_cast<uint32_t>(m_sets.size());
+                m_accept[id] = Accept{m_nfa.accept(key.first, atLineStart, false), m_nfa.accept(key.first, atLineStart, true)};
+                m_sets.push_back(key);
+                m_ids.emplace(std::move(key), id);
+                return id;
+            }
+
+        private:
+            const Nfa &m_nfa;
+            const bool m_unanchored;
+            const size_t m_classCount;
+            const size_t m_maxStates;
+            std::unique_ptr<std::atomic<uint32_t>[]> m_transitions;
+            mutable std::vector<Accept> m_accept; // sized up front, written before a state is published
+            mutable uint32_t m_start[2];
+
+            mutable std::mutex m_mutex;
+            mutable std::vector<std::pair<std::vector<uint32_t>, bool>> m_sets;
+            mutable std::map<std::pair<std::vector<uint32_t>, bool>, uint32_t> m_ids;
+        };
+
+        class RegexMatcher : public Matcher
+        {
+        public:
+            RegexMatcher(std::unique_ptr<Nfa> nfa, std::unique_ptr<Matcher> prefilter)
+                : m_nfa(std::move(nfa)),
+                  m_forward(*m_nfa, true),
+                  m_anchored(*m_nfa, false),
+                  m_prefilter(std::move(prefilter))
+            {
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                CacheLock lock(m_cacheMutex);
+                const char *pos = first;
+                while (pos < last)
+                {
+                    const char *lineBegin = pos;
+                    const char *lineEnd = nullptr;
+                    if (m_prefilter)
+                    {
+                        // Only lines holding a required literal can match.
+                        MatchSpan candidate;
+                        if (!m_prefilter->find(pos, last, candidate))
+                        {
+                            return false;
+                        }
+                        lineBegin = static_cast<const char *>(memrchr(pos, '\n', candidate.begin - pos));
+                        lineBegin = lineBegin ? lineBegin + 1 : pos;
+                        lineEnd = static_cast<const char *>(memchr(candidate.begin, '\n', last - candidate.begin));
+                    }
+                    else
+                    {
+                        lineEnd = static_cast<const char *>(memchr(pos, '\n', last - pos));
+                    }
+                    lineEnd = lineEnd ? lineEnd : last;
+
+                    if (search_line(lineBegin, lineEnd, lineBegin, match, lock))
+                    {
+                        return true;
+                    }
+                    pos = lineEnd + 1;
+                }
+                return false;
+            }
+
+            bool find_in_line(const char *lineBegin, const char *lineEnd, const char *from, MatchSpan &match) const override
+            {
+                CacheLock lock(m_cacheMutex);
+                return search_line(lineBegin, lineEnd, from, match, lock);
+            }
+
+        private:
+            bool search_line(const char *lineBegin, const char *lineEnd, const char *from, MatchSpan &match, CacheLock &lock) const
+            {
+                // The leftmost match starts at or before the earliest position any match ends at.
+                const char *earliestEnd = nullptr;
+                if (!earliest_end(lineBegin, lineEnd, from, earliestEnd, lock))
+                {
+                    return false;
+                }
+                for (const char *start = from; start <= earliestEnd; ++start)
+                {
+                    if (longest_at(lineBegin, lineEnd, start, match, lock))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Next state of dfa after byte. A full cache is flushed, as in RE2 the search goes on from the NFA states of
+            // state, since another search may flush as well while the lock is switched to exclusive.
+            static uint32_t step(const LazyDfa &dfa, uint32_t state, unsigned char byte, CacheLock &lock)
+            {
+                const uint32_t next = dfa.next(state, byte);
+                if (next != LazyDfa::Failed)
+                {
+                    return next;
+                }
+                const LazyDfa::StateSet set = dfa.state_set(state);
+                lock.make_exclusive();
+                return dfa.next(dfa.flush(set), byte);
+            }
+
+            bool earliest_end(const char *lineBegin, const char *lineEnd, const char *from, const char *&end, CacheLock &lock) const
+            {
+                uint32_t state = m_forward.start(from == lineBegin);
+                for (const char *p = from;; ++p)
+                {
+                    if (m_forward.accept(state) != 0 || (p == lineEnd && m_forward.accept_at_line_end(state) != 0))
+                    {
+                        end = p;
+                        return true;
+                    }
+                    if (p == lineEnd)
+                    {
+                        return false;
+                    }
+                    state = step(m_forward, state, static_cast<unsigned char>(*p), lock);
+                }
+            }
+
+            bool longest_at(const char *lineBegin, const char *lineEnd, const char *start, MatchSpan &match, CacheLock &lock) const
+            {
+                uint32_t state = m_anchored.start(start == lineBegin);
+                uint32_t best = 0;
+                const char *bestEnd = nullptr;
+                for (const char *p = start;; ++p)
+                {
+                    const uint32_t accepted = p == lineEnd ? m_anchored.accept_at_line_end(state) : m_anchored.accept(state);
+                    if (accepted != 0)
+                    {
+                        best = accepted;
+                        bestEnd = p;
+                    }
+                    if (p == lineEnd)
+                    {
+                        break;
+                    }
+                    state = step(m_anchored, state, static_cast<unsigned char>(*p), lock);
+                    if (state == LazyDfa::Dead)
+                    {
+                        break;
+                    }
+                }
+                if (best == 0)
+                {
+                    return false;
+                }
+                match = MatchSpan{start, bestEnd, best - 1};
+                return true;
+            }
+
+        private:
+            std::unique_ptr<Nfa> m_nfa;
+            LazyDfa m_forward;
+            LazyDfa m_anchored;
+            mutable std::shared_mutex m_cacheMutex; // see CacheLock
+            std::unique_ptr<Matcher> m_prefilter;
+        };
+
+        // Patterns whose complete languages are small sets of non-empty strings are searched as literals only.
+        class ExactLiteralMatcher : public Matcher
+        {
+        public:
+            ExactLiteralMatcher(std::unique_ptr<Matcher> literals, std::vector<size_t> patternOf)
+                : m_literals(std::move(literals)), m_patternOf(std::move(patternOf))
+            {
+            }
+
+            bool find(const char *first, const char *last, MatchSpan &match) const override
+            {
+                if (!m_literals->find(first, last, match))
+                {
+                    return false;
+                }
+                match.pattern = m_patternOf[match.pattern];
+                return true;
+            }
+
+        private:
+            std::unique_ptr<Matcher> m_literals;
+            std::vector<size_t> m_patternOf; // literal index to pattern index
+        };
+    }
+
+    std::unique_ptr<Matcher> make_regex_matcher(const std::vector<std::string> &patterns, bool ignoreCase)
+    {
+        std::vector<RegexNode> nodes;
+        std::vector<size_t> indices;
+        std::vector<LiteralInfo> infos;
+        for (size_t i = 0; i < patterns.size(); ++i)
+        {
+            if (patterns[i].find('\n') == std::string::npos)
+            {
+                nodes.push_back(Parser(patterns[i], ignoreCase).parse());
+                indices.push_back(i);
+                infos.push_back(analyze(nodes.back(), ignoreCase));
+            }
+        }
+        if (nodes.empty())
+        {
+            return make_matcher({});
+        }
+
+        std::vector<std::string> literals;
+        std::vector<size_t> patternOf;
+        bool allExact = true;
+        bool allRequire = true;
+        for (size_t i = 0; i < infos.size(); ++i)
+        {
+            const std::vector<std::string> needed = required(infos[i]);
+            allExact = allExact && infos[i].exact && !needed.empty();
+            allRequire = allRequire && !needed.empty();
+            for (const auto &text : needed)
+            {
+                literals.push_back(text);
+                patternOf.push_back(indices[i]);
+            }
+        }
+
+        if (allExact)
+        {
+            return std::make_unique<ExactLiteralMatcher>(make_literal_matcher(literals, MatcherKind::Auto, ignoreCase), std::move(patternOf));
+        }
+        std::unique_ptr<Matcher> prefilter = allRequire ? make_literal_matcher(literals, MatcherKind::Auto, ignoreCase) : nullptr;
+        return std::make_unique<RegexMatcher>(std::make_unique<Nfa>(nodes, indices), std::move(prefilter));
+    }
+
+    std::vector<std::string> required_literals(const std::string &pattern, bool ignoreCase)
+    {
+        return required(analyze(Parser(pattern, ignoreCase).parse(), ignoreCase));
+    }
+
+    std::string regex_escape(const std::string &text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (std::strchr(".[]()*+?{}|^$\\", c) != nullptr && c != '\0')
+            {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+}
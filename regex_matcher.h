@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matcher.h"
+
+namespace grep
+{
+    // Compiles POSIX extended regular expressions (plus \w, \s, \d and their negations) into one lazily built DFA.
+    // Literals every match has to contain are searched with the literal matchers first, so only lines holding
+    // one of them are run through the automaton. Throws std::invalid_argument for invalid patterns.
+    // With ignoreCase letters match in either case, see Parser.
+    std::unique_ptr<Matcher> make_regex_matcher(const std::vector<std::string> &patterns, bool ignoreCase = false);
+
+    // Strings of which every match of pattern contains at least one, empty if no such set is known.
+    // With ignoreCase they are ASCII lower case and stand for all their ASCII case variants.
+    std::vector<std::string> required_literals(const std::string &pattern, bool ignoreCase = false);
+
+    // text with the ERE special characters escaped, so it matches itself as a fixed string.
+    std::string regex_escape(const std::string &text);
+}
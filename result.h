@@ -1,18 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace grep
 {
     struct MatchPosition
     {
-        MatchPosition(size_t start, size_t end)
-            : start(start), end(end){};
+        MatchPosition(size_t start, size_t end, size_t pattern = 0)
+            : start(start), end(end), pattern(pattern){};
 
         bool operator==(const MatchPosition &other) const
         {
-            return start == other.start && end == other.end;
+            return start == other.start && end == other.end && pattern == other.pattern;
         }
 
         bool operator!=(const MatchPosition &other) const
@@ -22,33 +26,79 @@ namespace grep
 
         size_t start;
         size_t end;
+        size_t pattern; // index of the pattern that matched
     };
 
+    struct MatchRange
+    {
+        const MatchPosition *first;
+        const MatchPosition *last;
+
+        const MatchPosition *begin() const { return first; }
+        const MatchPosition *end() const { return last; }
+        size_t size() const { return static_cast<size_t>(last - first); }
+    };
+
+    // Matching lines of one file in a flat layout: the text of all lines is stored back to back in one
+    // arena and lines and matches are contiguous arrays, so a result costs a handful of allocations no matter
+    // how many lines it holds, and none at all once it is reused after clear().
     struct Result
     {
         using LineMatchResults = std::vector<std::pair<std::string, std::vector<MatchPosition>>>;
-        Result() = default;
-        Result(const std::string &file_name, LineMatchResults results)
-            : file_name(std::move(file_name)), results(std::move(results))
+
+        struct Line
         {
-        }
-        Result(Result &&other)
-            : file_name(std::move(other.file_name)), results(std::move(other.results))
+            // flags
+            static constexpr uint32_t Context = 1;   // a line around a match (-A, -B, -C), it has no matches
+            static constexpr uint32_t Separated = 2; // a group of context lines starts here, "--" goes before it
+
+            size_t textOffset;
+            size_t textLength;
+            size_t firstMatch;
+            uint32_t matchCount;
+            uint32_t flags;
+            size_t lineNumber; // 1-based, only counted with -n, otherwise 0
+            size_t byteOffset; // of the line start in the file (decompressed), only with -b
+        };
+
+        Result() = default;
+        explicit Result(std::string file_name)
+            : file_name(std::move(file_name))
         {
         }
-        Result &operator=(Result &&other)
+        Result(const std::string &file_name, const LineMatchResults &results)
+            : file_name(file_name)
         {
-            if (this != &other)
+            for (const auto &line : results)
             {
-                file_name = std::move(other.file_name);
-                results = std::move(other.results);
+                add_line(line.first);
+                for (const auto &match : line.second)
+                {
+                    add_match(match);
+                }
             }
-            return *this;
         }
+        Result(Result &&other) = default;
+        Result &operator=(Result &&other) = default;
 
         bool operator==(const Result &other) const
         {
-            return file_name == other.file_name && results == other.results; // Vectors compare element-wise
+            if (file_name != other.file_name || binary != other.binary || counted != other.counted || count != other.count ||
+                line_count() != other.line_count())
+            {
+                return false;
+            }
+            for (size_t i = 0; i < line_count(); ++i)
+            {
+                if (line_text(i) != other.line_text(i) || lines[i].flags != other.lines[i].flags ||
+                    lines[i].lineNumber != other.lines[i].lineNumber || lines[i].byteOffset != other.lines[i].byteOffset ||
+                    !std::equal(line_matches(i).begin(), line_matches(i).end(),
+                                other.line_matches(i).begin(), other.line_matches(i).end()))
+                {
+                    return false;
+                }
+            }
+            return true;
         }
 
         bool operator!=(const Result &other) const
@@ -56,8 +106,56 @@ namespace grep
             return !(*this == other);
         }
 
+        // Starts a new line, the matches added afterwards belong to it.
+        void add_line(std::string_view text, uint32_t flags = 0, size_t lineNumber = 0, size_t byteOffset = 0)
+        {
+            lines.push_back(Line{this->text.size(), text.size(), matches.size(), 0, flags, lineNumber, byteOffset});
+            this->text.append(text);
+        }
+        void add_match(const MatchPosition &match)
+        {
+            matches.push_back(match);
+            ++lines.back().matchCount;
+        }
+
+        size_t line_count() const { return lines.size(); }
+        bool empty() const { return lines.empty(); }
+        std::string_view line_text(size_t line) const
+        {
+            return std::string_view(text.data() + lines[line].textOffset, lines[line].textLength);
+        }
+        bool is_context(size_t line) const { return (lines[line].flags & Line::Context) != 0; }
+        bool is_separated(size_t line) const { return (lines[line].flags & Line::Separated) != 0; }
+        MatchRange line_matches(size_t line) const
+        {
+            const MatchPosition *first = matches.data() + lines[line].firstMatch;
+            return MatchRange{first, first + lines[line].matchCount};
+        }
+
+        // Bytes held by the arena and the arrays.
+        size_t bytes() const
+        {
+            return file_name.size() + text.size() + lines.size() * sizeof(Line) + matches.size() * sizeof(MatchPosition);
+        }
+
+        // Drops the content but keeps the capacity for reuse.
+        void clear()
+        {
+            file_name.clear();
+            binary = false;
+            counted = false;
+            count = 0;
+            text.clear();
+            lines.clear();
+            matches.clear();
+        }
+
         std::string file_name;
-        LineMatchResults results;
-        bool empty() { return results.empty(); }
+        bool binary = false; // a binary file that matches, it has no lines
+        bool counted = false; // searched with -l, -c or -q: only count is set, there are no lines
+        size_t count = 0;     // matching lines, up to the first one for -l and -q
+        std::string text;
+        std::vector<Line> lines;
+        std::vector<MatchPosition> matches;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,463 @@
+#include "result_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace grep
+{
+    namespace
+    {
+        constexpr char Magic[8] = {'G', 'R', 'E', 'P', 'R', 'C', 'H', '2'};
+        constexpr int64_t RacyNanoseconds = 1000000000;
+        const std::string CacheExtension = ".cache";
+
+        struct Header
+        {
+            char magic[8];
+            uint64_t generation;
+            uint64_t entryCount;
+            uint64_t signatureLength;
+        };
+
+        struct EntryHeader
+        {
+            uint64_t device;
+            uint64_t inode;
+            int64_t mtime;
+            uint64_t size;
+            uint64_t generation;
+            uint64_t payloadLength;
+        };
+
+        struct PayloadHeader
+        {
+            uint32_t binary;
+            uint32_t lineCount;
+            uint32_t matchCount;
+            uint32_t textLength;
+        };
+
+        struct PayloadLine
+        {
+            uint32_t textLength;
+            uint32_t matchCount;
+            uint64_t lineNumber;
+            uint64_t byteOffset;
+        };
+
+        struct PayloadMatch
+        {
+            uint32_t start;
+            uint32_t end;
+            uint32_t pattern;
+        };
+
+        template <typename T>
+        void append(std::string &out, const T &value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        bool read(std::string_view &in, T &value)
+        {
+            if (in.size() < sizeof(value))
+            {
+                return false;
+            }
+            std::memcpy(&value, in.data(), sizeof(value));
+            in.remove_prefix(sizeof(value));
+            return true;
+        }
+
+        uint64_t fnv1a(std::string_view data)
+        {
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for (unsigned char c : data)
+            {
+                hash = (hash ^ c) * 0x100000001b3ULL;
+            }
+            return hash;
+        }
+
+        int64_t now_nanoseconds()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        // Results too large for 32 bit counts are not worth keeping anyway.
+        bool encode(const Result &result, std::string &out)
+        {
+            if (result.text.size() > UINT32_MAX || result.lines.size() > UINT32_MAX || result.matches.size() > UINT32_MAX)
+            {
+                return false;
+            }
+            append(out, PayloadHeader{result.binary ? 1u : 0u, static_cast<uint32_t>(result.lines.size()),
+                                      static_cast<uint32_t>(result.matches.size()), static_cast<uint32_t>(result.text.size())});
+            for (const auto &line : result.lines)
+            {
+                append(out, PayloadLine{static_cast<uint32_t>(line.textLength), line.matchCount, line.lineNumber, line.byteOffset});
+            }
+            for (const auto &match : result.matches)
+            {
+                append(out, PayloadMatch{static_cast<uint32_t>(match.start), static_cast<uint32_t>(match.end), static_cast<uint32_t>(match.pattern)});
+            }
+            out.append(result.text);
+            return true;
+        }
+
+        bool decode(std::string_view payload, Result &result)
+        {
+            PayloadHeader header;
+            if (!read(payload, header) ||
+                payload.size() != uint64_t(header.lineCount) * sizeof(PayloadLine) + uint64_t(header.matchCount) * sizeof(PayloadMatch) + header.textLength)
+            {
+                return false;
+            }
+            std::string_view lines = payload.substr(0, header.lineCount * sizeof(PayloadLine));
+            std::string_view matches = payload.substr(lines.size(), header.matchCount * sizeof(PayloadMatch));
+            std::string_view text = payload.substr(lines.size() + matches.size());
+
+            result.binary = header.binary != 0;
+            size_t textOffset = 0;
+            size_t matchesLeft = header.matchCount;
+            PayloadLine line;
+            while (read(lines, line))
+            {
+                if (line.textLength > text.size() - textOffset || line.matchCount > matchesLeft)
+                {
+                    return false;
+                }
+                result.add_line(text.substr(textOffset, line.textLength), 0, static_cast<size_t>(line.lineNumber), static_cast<size_t>(line.byteOffset));
+                textOffset += line.textLength;
+                matchesLeft -= line.matchCount;
+                for (uint32_t i = 0; i < line.matchCount; ++i)
+                {
+                    PayloadMatch match;
+                    if (!read(matches, match))
+                    {
+                        return false;
+                    }
+                    result.add_match(MatchPosition(match.start, match.end, match.pattern));
+                }
+            }
+            return true;
+        }
+
+        // Exclusive lock on the cache directory for the lifetime of the object, shared with other processes.
+        class DirectoryLock
+        {
+        public:
+            explicit DirectoryLock(const fs::path &directory)
+                : m_fd(::open((directory / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+            {
+                if (m_fd < 0 || ::flock(m_fd, LOCK_EX) != 0)
+                {
+                    throw std::runtime_error("Can not lock cache directory " + directory.string());
+                }
+            }
+            ~DirectoryLock()
+            {
+                ::close(m_fd); // releases the lock
+            }
+
+            DirectoryLock(const DirectoryLock &) = delete;
+            DirectoryLock &operator=(const DirectoryLock &) = delete;
+
+        private:
+            int m_fd;
+        };
+
+        // Removes the least recently written signature files until the directory fits capacity.
+        void evict_files(const fs::path &directory, const fs::path &keep, size_t capacity)
+        {
+            struct CacheFile
+            {
+                fs::path path;
+                int64_t mtime;
+                uint64_t size;
+            };
+            std::vector<CacheFile> files;
+            uint64_t total = 0;
+            std::error_code error;
+            for (const auto &entry : fs::directory_iterator(directory, error))
+            {
+                struct stat st;
+                if (entry.path().extension() != CacheExtension || ::stat(entry.path().c_str(), &st) != 0)
+                {
+                    continue;
+                }
+                total += static_cast<uint64_t>(st.st_size);
+                if (entry.path() != keep)
+                {
+                    files.push_back(CacheFile{entry.path(), int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, static_cast<uint64_t>(st.st_size)});
+                }
+            }
+
+            std::sort(files.begin(), files.end(), [](const CacheFile &a, const CacheFile &b)
+                      { return a.mtime < b.mtime; });
+            for (const auto &file : files)
+            {
+                if (total <= capacity)
+                {
+                    break;
+                }
+                fs::remove(file.path, error);
+                total -= file.size;
+            }
+        }
+    }
+
+    bool file_identity(const fs::path &path, FileIdentity &identity)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+        {
+            return false;
+        }
+        identity.device = static_cast<uint64_t>(st.st_dev);
+        identity.inode = static_cast<uint64_t>(st.st_ino);
+        identity.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        identity.size = static_cast<uint64_t>(st.st_size);
+        return true;
+    }
+
+    std::string result_signature(const GrepOptions &options)
+    {
+        // Length prefixed fields, so no pattern can make two different option sets look alike.
+        std::string signature;
+        auto field = [&signature](std::string_view value)
+        {
+            signature.append(std::to_string(value.size())).append(":").append(value);
+        };
+        field(options.extendedRegex ? "E" : "F");
+        field(options.ignoreCase ? "i" : "");
+        field(std::to_string(static_cast<int>(options.binary)));
+        field(options.decompress ? "z" : "");
+        field(std::to_string(options.maxCount));
+        // JSON and binary output always carry both
+        const bool labelled = options.format != OutputFormat::Text;
+        field(std::string(options.lineNumbers || labelled ? "n" : "") + (options.byteOffsets || labelled ? "b" : ""));
+        for (const auto &pattern : options.patterns)
+        {
+            field(pattern);
+        }
+        return signature;
+    }
+
+    fs::path default_cache_directory()
+    {
+        if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache != nullptr && *cache != '\0')
+        {
+            return fs::path(cache) / "simple_grep";
+        }
+        const char *home = std::getenv("HOME");
+        return fs::path(home != nullptr ? home : "/tmp") / ".cache" / "simple_grep";
+    }
+
+    ResultCache::ResultCache(fs::path directory, std::string signature, size_t capacity, unsigned workers)
+        : m_directory(std::move(directory)),
+          m_signature(std::move(signature)),
+          m_capacity(capacity),
+          m_startTime(now_nanoseconds()),
+          m_workers(workers)
+    {
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(fnv1a(m_signature)));
+        m_file = m_directory / (name + CacheExtension);
+
+        // Replaced by rename only, the mapping stays valid while other searches save.
+        m_buffer = FileBuffer(m_file);
+        if (!load(m_buffer, m_entries, m_generation))
+        {
+            m_entries.clear();
+        }
+    }
+
+    bool ResultCache::load(const FileBuffer &file, EntryMap &entries, uint64_t &generation) const
+    {
+        if (!file.is_open())
+        {
+            return false;
+        }
+        std::string_view in = file.view();
+        Header header;
+        if (!read(in, header) || std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+            header.signatureLength != m_signature.size() || in.substr(0, m_signature.size()) != m_signature)
+        {
+            return false; // a different signature with the same hash is simply overwritten
+        }
+        in.remove_prefix(m_signature.size());
+        generation = header.generation;
+
+        EntryHeader entry;
+        for (uint64_t i = 0; i < header.entryCount; ++i)
+        {
+            if (!read(in, entry) || entry.payloadLength > in.size())
+            {
+                return false;
+            }
+            entries[Key{entry.device, entry.inode}] = Entry{FileIdentity{entry.device, entry.inode, entry.mtime, entry.size},
+                                                            entry.generation, in.substr(0, entry.payloadLength)};
+            in.remove_prefix(entry.payloadLength);
+        }
+        return true;
+    }
+
+    void ResultCache::begin_search()
+    {
+        m_startTime = now_nanoseconds();
+    }
+
+    bool ResultCache::lookup(unsigned worker, const FileIdentity &identity, Result &result)
+    {
+        const Key key{identity.device, identity.inode};
+        const auto found = m_entries.find(key);
+        if (found == m_entries.end() || found->second.identity.mtime != identity.mtime || found->second.identity.size != identity.size)
+        {
+            return false;
+        }
+        if (!decode(found->second.payload, result))
+        {
+            result.clear();
+            return false;
+        }
+        m_workers[worker].used.push_back(key);
+        return true;
+    }
+
+    void ResultCache::store(unsigned worker, const FileIdentity &identity, const Result &result)
+    {
+        if (identity.mtime > m_startTime - RacyNanoseconds)
+        {
+            return;
+        }
+        WorkerState &state = m_workers[worker];
+        const size_t offset = state.payloads.size();
+        if (!encode(result, state.payloads))
+        {
+            return;
+        }
+        state.stored.push_back(StoredEntry{identity, offset, state.payloads.size() - offset});
+    }
+
+    void ResultCache::save()
+    {
+        // Every search saves what it used and stored once, the next one starts over.
+        std::vector<WorkerState> workers(m_workers.size());
+        workers.swap(m_workers);
+
+        const bool stored = std::any_of(workers.begin(), workers.end(), [](const WorkerState &state)
+                                        { return !state.stored.empty(); });
+        if (!stored)
+        {
+            // Nothing new, the file is only marked as used for the eviction of whole signatures.
+            if (std::any_of(workers.begin(), workers.end(), [](const WorkerState &state)
+                            { return !state.used.empty(); }))
+            {
+                ::utimensat(AT_FDCWD, m_file.c_str(), nullptr, 0);
+            }
+            return;
+        }
+
+        std::error_code error;
+        fs::create_directories(m_directory, error);
+        const DirectoryLock lock(m_directory);
+
+        // Whatever other searches saved since this one started is merged, not overwritten.
+        const FileBuffer current(m_file);
+        EntryMap merged;
+        uint64_t generation = 0;
+        if (!load(current, merged, generation))
+        {
+            merged.clear();
+            generation = 0;
+        }
+        generation = std::max(generation, m_generation) + 1;
+
+        for (const auto &state : workers)
+        {
+            for (const Key &key : state.used)
+            {
+                const auto found = merged.find(key);
+                const Entry &mine = m_entries.at(key);
+                if (found != merged.end() && found->second.identity.mtime == mine.identity.mtime && found->second.identity.size == mine.identity.size)
+                {
+                    found->second.generation = generation;
+                }
+            }
+            for (const auto &entry : state.stored)
+            {
+                merged[Key{entry.identity.device, entry.identity.inode}] =
+                    Entry{entry.identity, generation, std::string_view(state.payloads).substr(entry.offset, entry.length)};
+            }
+        }
+
+        // Most recently used entries first, the rest is cut off at the capacity.
+        std::vector<const Entry *> entries;
+        entries.reserve(merged.size());
+        for (const auto &item : merged)
+        {
+            entries.push_back(&item.second);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry *a, const Entry *b)
+                  { return a->generation > b->generation; });
+
+        std::string out;
+        Header header{};
+        std::memcpy(header.magic, Magic, sizeof(Magic));
+        header.generation = generation;
+        header.signatureLength = m_signature.size();
+        append(out, header);
+        out.append(m_signature);
+        for (const Entry *entry : entries)
+        {
+            if (out.size() + sizeof(EntryHeader) + entry->payload.size() > m_capacity)
+            {
+                break;
+            }
+            append(out, EntryHeader{entry->identity.device, entry->identity.inode, entry->identity.mtime,
+                                    entry->identity.size, entry->generation, entry->payload.size()});
+            out.append(entry->payload);
+            ++header.entryCount;
+        }
+        std::memcpy(&out[0], &header, sizeof(header));
+
+        // Readers only ever see a complete file.
+        const fs::path temporary = m_file.string() + ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+            stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+            if (!stream)
+            {
+                fs::remove(temporary, error);
+                throw std::runtime_error("Can not write cache file " + temporary.string());
+            }
+        }
+        fs::rename(temporary, m_file, error);
+        if (error)
+        {
+            fs::remove(temporary, error);
+            throw std::runtime_error("Can not write cache file " + m_file.string());
+        }
+
+        // The file just written becomes the table of later searches through this cache, with what they stored.
+        m_entries.clear();
+        m_buffer = FileBuffer(m_file);
+        if (!load(m_buffer, m_entries, m_generation))
+        {
+            m_entries.clear();
+        }
+        evict_files(m_directory, m_file, m_capacity);
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "file_buffer.h"
+#include "options.h"
+#include "result.h"
+
+namespace grep
+{
+    namespace fs = std::filesystem;
+
+    // What the cache knows about the content of a file without reading it.
+    struct FileIdentity
+    {
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        int64_t mtime = 0; // ns
+        uint64_t size = 0;
+    };
+
+    // False if path can not be stat'ed.
+    bool file_identity(const fs::path &path, FileIdentity &identity);
+
+    // Everything besides the file itself that decides the Result of search_in_file. Options that change
+    // which lines are found or what is recorded for them have to be part of it, output formatting must not.
+    std::string result_signature(const GrepOptions &options);
+
+    // $XDG_CACHE_HOME/simple_grep or ~/.cache/simple_grep.
+    fs::path default_cache_directory();
+
+    // Results of earlier searches with the same signature, keyed by file identity, so files that did not
+    // change since are answered without opening them. Every signature has one file in the cache directory:
+    //   header      magic, generation, entry count, signature
+    //   entries     device, inode, mtime, size, generation of the last write that used it, payload length, payload
+    //   payload     binary flag, line and match counts, per line text length and match count, matches, text
+    // The file is read when the cache is opened and rewritten by save() under a lock on the directory,
+    // merged with what concurrent searches stored meanwhile, then read again for the next search.
+    // Entries and whole signature files beyond the capacity are evicted least recently used first.
+    class ResultCache
+    {
+    public:
+        // An unusable directory gives a cache that never hits and never saves.
+        ResultCache(fs::path directory, std::string signature, size_t capacity, unsigned workers);
+
+        ResultCache(const ResultCache &) = delete;
+        ResultCache &operator=(const ResultCache &) = delete;
+
+    public:
+        // Starts a search, the files it stores are judged against this moment. A cache outlives the searches it serves.
+        void begin_search();
+
+        // Fills result from the entry of identity, the file name is left to the caller.
+        bool lookup(unsigned worker, const FileIdentity &identity, Result &result);
+
+        // Remembers the complete result of a searched file, an empty one for files without a match.
+        // Files changed within a second before the search began are left out, a later change could keep their mtime.
+        void store(unsigned worker, const FileIdentity &identity, const Result &result);
+
+        // Writes the stored results. Throws std::runtime_error if the cache file can not be written.
+        void save();
+
+    private:
+        struct Key
+        {
+            uint64_t device;
+            uint64_t inode;
+
+            bool operator==(const Key &other) const { return device == other.device && inode == other.inode; }
+        };
+
+        struct KeyHash
+        {
+            size_t operator()(const Key &key) const { return std::hash<uint64_t>()(key.inode * 0x9e3779b97f4a7c15ULL ^ key.device); }
+        };
+
+        struct Entry
+        {
+            FileIdentity identity;
+            uint64_t generation;
+            std::string_view payload;
+        };
+
+        using EntryMap = std::unordered_map<Key, Entry, KeyHash>;
+
+        struct StoredEntry
+        {
+            FileIdentity identity;
+            size_t offset; // of the payload in WorkerState::payloads
+            size_t length;
+        };
+
+        // Touched by one worker only, merged by save().
+        struct WorkerState
+        {
+            std::vector<Key> used; // entries that answered a lookup
+            std::vector<StoredEntry> stored;
+            std::string payloads;
+        };
+
+        // Reads the entries of file, false if it is missing or not a cache file of this signature.
+        bool load(const FileBuffer &file, EntryMap &entries, uint64_t &generation) const;
+
+    private:
+        fs::path m_directory;
+        fs::path m_file;
+        std::string m_signature;
+        size_t m_capacity;
+        int64_t m_startTime; // ns, set by begin_search
+        FileBuffer m_buffer;
+        EntryMap m_entries;
+        uint64_t m_generation = 0;
+        std::vector<WorkerState> m_workers;
+    };
+}
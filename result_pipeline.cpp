@@ -0,0 +1,312 @@
+#include "result_pipeline.h"
+
+#include <algorithm>
+
+namespace grep
+{
+    size_t ResultPipeline::chunk_bytes(const Result &chunk)
+    {
+        return sizeof(Result) + chunk.bytes();
+    }
+
+    bool ResultPipeline::has_room(const StreamPart &part, size_t bytes) const
+    {
+        if (m_bytes == 0 || m_bytes + bytes <= m_byteBudget)
+        {
+            return true;
+        }
+        if (m_ordered)
+        {
+            return has_room_in_order(part);
+        }
+        if (!m_hasCurrent)
+        {
+            return false;
+        }
+        // The consumer waits for the current part once its queue is empty, it must not be held back then.
+        const Stream &current = m_streams.at(m_current);
+        const Part &needed = current.parts[current.current];
+        if (part.stream == m_current && part.index == current.current)
+        {
+            return needed.chunks.empty();
+        }
+        // Nobody may be searching the needed part yet, everyone else goes ahead until it shows up.
+        return needed.chunks.empty() && !needed.started;
+    }
+
+    bool ResultPipeline::has_room_in_order(const StreamPart &part) const
+    {
+        if (!m_hasCurrent && m_order.empty())
+        {
+            return true;
+        }
+        const uint64_t neededStream = m_hasCurrent ? m_current : m_order.front();
+        auto it = m_streams.find(neededStream);
+        if (it != m_streams.end())
+        {
+            const Stream &stream = it->second;
+            const Part &needed = stream.parts[stream.current];
+            if (part.stream == neededStream && part.index == stream.current)
+            {
+                return needed.chunks.empty();
+            }
+            if (needed.started)
+            {
+                // Its producer is at work and gets through to the output.
+                return false;
+            }
+        }
+        // Nobody took on the part the output waits for yet, whoever is not blocked may have to.
+        return m_blocked >= m_producers;
+    }
+
+    ResultPipeline::Part &ResultPipeline::part_of(Stream &stream, const StreamPart &part)
+    {
+        if (stream.parts.size() != part.count)
+        {
+            // Started whole before it turned out to be split, nothing was pushed to it yet.
+            stream.parts = std::vector<Part>(part.count);
+        }
+        return stream.parts[part.index];
+    }
+
+    void ResultPipeline::push(uint64_t stream, Result chunk, bool last, ResultPool *pool)
+    {
+        push(StreamPart{stream}, std::move(chunk), last, pool);
+    }
+
+    void ResultPipeline::push(const StreamPart &part, Result chunk, bool last, ResultPool *pool)
+    {
+        const size_t bytes = chunk_bytes(chunk);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!has_room(part, bytes))
+        {
+            // The others may only wait for this one to block as well, see has_room_in_order.
+            ++m_blocked;
+            m_cvProducer.notify_all();
+            m_cvProducer.wait(lock, [&]
+                              { return has_room(part, bytes); });
+            --m_blocked;
+        }
+
+        Stream &stream = m_streams[part.stream];
+        if (stream.parts.empty() && !m_ordered)
+        {
+            m_readyStreams.push_back(part.stream);
+        }
+        Part &target = part_of(stream, part);
+        target.chunks.push_back(Chunk{std::move(chunk), last, bytes, pool});
+        target.started = true;
+        m_bytes += bytes;
+        m_cvConsumer.notify_one();
+    }
+
+    bool ResultPipeline::pop(Result &chunk)
+    {
+        ResultPool *pool = nullptr;
+        return pop(chunk, pool);
+    }
+
+    bool ResultPipeline::pop(Result &chunk, ResultPool *&pool)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            if (!m_hasCurrent)
+            {
+                m_hasCurrent = next_stream();
+            }
+            if (m_windowMoved && !m_deferred.empty())
+            {
+                resume_window(lock);
+                continue;
+            }
+
+            if (m_hasCurrent)
+            {
+                auto it = m_streams.find(m_current);
+                Stream &stream = it->second;
+                std::deque<Chunk> &chunks = stream.parts[stream.current].chunks;
+                if (!chunks.empty())
+                {
+                    Chunk next = std::move(chunks.front());
+                    chunks.pop_front();
+                    m_bytes -= next.bytes;
+                    if (next.last && ++stream.current == stream.parts.size())
+                    {
+                        m_streams.erase(it);
+                        m_hasCurrent = false;
+                    }
+                    chunk = std::move(next.result);
+                    pool = next.pool;
+                    m_cvProducer.notify_all();
+                    return true;
+                }
+                // The current part needs a chunk, its producer may wait for exactly that state.
+                m_cvProducer.notify_all();
+            }
+            else if (m_closed)
+            {
+                return false;
+            }
+
+            m_cvConsumer.wait(lock);
+        }
+    }
+
+    bool ResultPipeline::next_stream()
+    {
+        if (!m_ordered)
+        {
+            if (m_readyStreams.empty())
+            {
+                return false;
+            }
+            m_current = m_readyStreams.front();
+            m_readyStreams.pop_front();
+            return true;
+        }
+        while (!m_order.empty())
+        {
+            const uint64_t next = m_order.front();
+            auto expansion = m_expansions.find(next);
+            if (expansion != m_expansions.end())
+            {
+                m_order.pop_front();
+                m_order.insert(m_order.begin(), expansion->second.begin(), expansion->second.end());
+                m_expansions.erase(expansion);
+                continue;
+            }
+            if (m_streams.find(next) == m_streams.end())
+            {
+                return false;
+            }
+            m_order.pop_front();
+            m_current = next;
+            m_windowMoved = true;
+            return true;
+        }
+        return false;
+    }
+
+    void ResultPipeline::expand_window()
+    {
+        if (m_expansions.empty())
+        {
+            return;
+        }
+        for (size_t i = 0; i < m_order.size() && i < m_window;)
+        {
+            auto expansion = m_expansions.find(m_order[i]);
+            if (expansion == m_expansions.end())
+            {
+                ++i;
+                continue;
+            }
+            m_order.erase(m_order.begin() + i);
+            m_order.insert(m_order.begin() + i, expansion->second.begin(), expansion->second.end());
+            m_expansions.erase(expansion);
+        }
+    }
+
+    bool ResultPipeline::in_window(uint64_t stream)
+    {
+        if (m_hasCurrent && m_current == stream)
+        {
+            return true;
+        }
+        expand_window();
+        const auto end = m_order.begin() + std::min(m_window, m_order.size());
+        return std::find(m_order.begin(), end, stream) != end;
+    }
+
+    void ResultPipeline::resume_window(std::unique_lock<std::mutex> &lock)
+    {
+        m_windowMoved = false;
+        expand_window();
+        std::vector<uint64_t> resumed;
+        for (size_t i = 0; i < m_order.size() && i < m_window; ++i)
+        {
+            if (m_deferred.erase(m_order[i]) != 0)
+            {
+                resumed.push_back(m_order[i]);
+            }
+        }
+        if (resumed.empty())
+        {
+            return;
+        }
+        lock.unlock();
+        for (const uint64_t stream : resumed)
+        {
+            m_resume(stream);
+        }
+        lock.lock();
+    }
+
+    void ResultPipeline::order(std::vector<uint64_t> streams, size_t window, std::function<void(uint64_t)> resume)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ordered = true;
+        m_order.assign(streams.begin(), streams.end());
+        m_window = window;
+        m_resume = std::move(resume);
+    }
+
+    bool ResultPipeline::start(const StreamPart &part)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_ordered)
+        {
+            return true;
+        }
+        if (part.count == 1 && m_resume && !in_window(part.stream))
+        {
+            m_deferred.insert(part.stream);
+            return false;
+        }
+        m_deferred.erase(part.stream);
+        part_of(m_streams[part.stream], part).started = true;
+        // The output may be waiting for the stream to show up.
+        m_cvConsumer.notify_one();
+        return true;
+    }
+
+    void ResultPipeline::expand(uint64_t stream, std::vector<uint64_t> entries)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_expansions[stream] = std::move(entries);
+            m_windowMoved = true;
+        }
+        m_cvConsumer.notify_one();
+    }
+
+    void ResultPipeline::close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cvConsumer.notify_all();
+    }
+
+    void ResultPipeline::reopen()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = false;
+        m_ordered = false;
+        m_order.clear();
+        m_expansions.clear();
+        m_window = 0;
+        m_resume = nullptr;
+        m_deferred.clear();
+        m_windowMoved = false;
+    }
+
+    bool ResultPipeline::empty()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes == 0;
+    }
+}
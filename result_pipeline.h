@@ -0,0 +1,129 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "result.h"
+#include "result_pool.h"
+
+namespace grep
+{
+    // One of the consecutive parts of a stream, each pushed by its own producer.
+    struct StreamPart
+    {
+        uint64_t stream;
+        uint32_t index = 0;
+        uint32_t count = 1;
+    };
+
+    // Bounded hand-over of result chunks from the search workers to the output thread.
+    // Every file is a stream of chunks, the consumer takes one stream at a time from its first to its last
+    // chunk, so lines of different files are never interleaved while no file has to be buffered as a whole.
+    // A file searched in ranges is a stream of several parts, written in part order.
+    // Producers block once the queued chunks exceed the byte budget. The part being written is only
+    // held back while it still has queued chunks, so the consumer can always make progress. While that part
+    // has not pushed anything yet the budget is suspended: its producer may still be waiting for a worker
+    // that is blocked in push.
+    // Streams are written in the order their first chunk arrives, or in a fixed order set with order(): then the
+    // pipeline is a reorder buffer, streams that arrive early wait within the byte budget until every stream before
+    // them was written. A stream may stand for a directory whose entries are only known later, see expand.
+    // In order, producers announce a part with start before they search it. While the part the output waits for is
+    // started the budget holds everyone else back. While nobody has started it, all producers but the last one that
+    // is not blocked wait as well: the last one must stay free to take it on. Streams too far ahead of the output are
+    // not started at all but handed back later, so what runs ahead of a slow stream stays within a window.
+    class ResultPipeline
+    {
+    public:
+        // producers is the number of threads that push, at most all but one of them are ever blocked in order.
+        explicit ResultPipeline(size_t byteBudget, unsigned producers = 1)
+            : m_byteBudget(byteBudget),
+              m_producers(producers)
+        {
+        }
+
+    public:
+        // pool is where the consumer should give the chunk back to once it is written.
+        void push(uint64_t stream, Result chunk, bool last, ResultPool *pool = nullptr);
+        // last ends the part, every part has to push a last chunk, an empty one if it found nothing.
+        void push(const StreamPart &part, Result chunk, bool last, ResultPool *pool = nullptr);
+        // Returns false once the pipeline is closed and all chunks are consumed.
+        bool pop(Result &chunk, ResultPool *&pool);
+        bool pop(Result &chunk);
+        // Signals that no further chunks will be pushed.
+        void close();
+        // Accepts chunks again for the next search, once pop returned false. Streams are written in arrival order again.
+        void reopen();
+        // Writes streams in this order in the current search. Every stream must end with a last chunk or be expanded,
+        // an empty one for a file without a match. With resume, a stream more than window places behind the one being
+        // written is deferred by start and handed to resume once the output comes that close.
+        void order(std::vector<uint64_t> streams, size_t window = 0, std::function<void(uint64_t)> resume = nullptr);
+        // Announces that a producer takes on part, false if the stream was deferred instead: it must not be searched
+        // before resume hands it back. The parts of a split stream are always taken on. Nothing to do without order.
+        bool start(const StreamPart &part);
+        // Replaces stream in the order by entries, the streams of a directory's entries once it is listed.
+        void expand(uint64_t stream, std::vector<uint64_t> entries);
+        bool empty();
+
+        static size_t chunk_bytes(const Result &chunk);
+
+    private:
+        struct Chunk
+        {
+            Result result;
+            bool last;
+            size_t bytes;
+            ResultPool *pool;
+        };
+
+        struct Part
+        {
+            std::deque<Chunk> chunks;
+            bool started = false; // pushed a chunk
+        };
+
+        struct Stream
+        {
+            std::vector<Part> parts;
+            size_t current = 0; // part being written
+        };
+
+        bool has_room(const StreamPart &part, size_t bytes) const;
+        bool has_room_in_order(const StreamPart &part) const;
+        static Part &part_of(Stream &stream, const StreamPart &part);
+        // Picks the stream to write next, false if it has not arrived yet.
+        bool next_stream();
+        // Replaces the directories among the next window streams in order by their entries, as far as they are known.
+        void expand_window();
+        bool in_window(uint64_t stream);
+        // Hands the deferred streams that came within the window to resume, without the lock: they may be
+        // started right away.
+        void resume_window(std::unique_lock<std::mutex> &lock);
+
+    private:
+        const size_t m_byteBudget;
+        const unsigned m_producers;
+        unsigned m_blocked = 0; // producers waiting in push
+        size_t m_bytes = 0;
+        std::unordered_map<uint64_t, Stream> m_streams;
+        std::deque<uint64_t> m_readyStreams; // streams in the order their first chunk arrived
+        bool m_ordered = false;
+        std::deque<uint64_t> m_order; // with order(), the streams still to be written
+        std::unordered_map<uint64_t, std::vector<uint64_t>> m_expansions; // not reached yet by the order
+        size_t m_window = 0;
+        std::function<void(uint64_t)> m_resume; // deferral is off without it
+        std::unordered_set<uint64_t> m_deferred;
+        bool m_windowMoved = false; // the output went on or the order changed since the deferred streams were checked
+        bool m_hasCurrent = false;
+        uint64_t m_current = 0;
+        bool m_closed = false;
+        std::mutex m_mutex;
+        std::condition_variable m_cvProducer;
+        std::condition_variable m_cvConsumer;
+    };
+}
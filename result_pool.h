@@ -0,0 +1,49 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "result.h"
+
+namespace grep
+{
+    // Recycles results between one search worker and the output thread, so the arenas and arrays of a
+    // result keep their capacity instead of being allocated again for every file.
+    class ResultPool
+    {
+    public:
+        Result acquire()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_free.empty())
+            {
+                return Result();
+            }
+            Result result = std::move(m_free.back());
+            m_free.pop_back();
+            return result;
+        }
+
+        void release(Result result)
+        {
+            // Arenas grown by an exceptionally dense file are not kept around.
+            if (result.text.capacity() > MaxRetainedBytes)
+            {
+                return;
+            }
+            result.clear();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_free.size() < MaxRetainedResults)
+            {
+                m_free.push_back(std::move(result));
+            }
+        }
+
+    private:
+        static constexpr size_t MaxRetainedResults = 16;
+        static constexpr size_t MaxRetainedBytes = 1 << 20;
+
+        std::mutex m_mutex;
+        std::vector<Result> m_free;
+    };
+}
@@ -0,0 +1,171 @@
+#include "result_sink.h"
+
+#include "grep_utils.h"
+#include "structured_output.h"
+
+namespace grep
+{
+    void for_each_match(const Result &chunk, const std::function<void(const Match &)> &handle)
+    {
+        if (chunk.counted)
+        {
+            handle(Match{chunk.file_name, std::string_view(), MatchRange{nullptr, nullptr}, false, chunk.count});
+            return;
+        }
+        if (chunk.binary)
+        {
+            handle(Match{chunk.file_name, std::string_view(), MatchRange{nullptr, nullptr}, true});
+            return;
+        }
+        for (size_t line = 0; line < chunk.line_count(); ++line)
+        {
+            handle(Match{chunk.file_name, chunk.line_text(line), chunk.line_matches(line), false, 0, chunk.is_context(line), chunk.is_separated(line),
+                         chunk.lines[line].lineNumber, chunk.lines[line].byteOffset});
+        }
+    }
+
+    void WriterSink::consume(Result &chunk)
+    {
+        std::string &out = m_writer.buffer();
+        if (m_format != OutputFormat::Text)
+        {
+            if (m_format == OutputFormat::Json)
+            {
+                format_json(chunk, out, m_mode);
+            }
+            else
+            {
+                format_frames(chunk, out, m_mode, m_currentFile);
+            }
+            m_writer.commit();
+            return;
+        }
+        switch (m_mode)
+        {
+        case OutputMode::Lines:
+            format_result(chunk, out, m_color, m_written, m_labels);
+            m_written = m_written || chunk.line_count() > 0 || chunk.binary;
+            break;
+        case OutputMode::FilesWithMatches:
+            if (chunk.count > 0 || chunk.binary)
+            {
+                out += chunk.file_name;
+                out += '\n';
+            }
+            break;
+        case OutputMode::Count:
+            out += chunk.file_name;
+            out += ':';
+            out += std::to_string(chunk.count);
+            out += '\n';
+            break;
+        case OutputMode::Quiet:
+            break;
+        }
+        m_writer.commit();
+    }
+
+    void WriterSink::flush()
+    {
+        // A terminal shows results as they come, pipes and files get them in large writes.
+        if (m_writer.is_terminal())
+        {
+            m_writer.flush();
+        }
+    }
+
+    void WriterSink::finish()
+    {
+        m_writer.flush();
+    }
+
+    RingSink::RingSink(size_t capacity)
+        : m_mask([capacity]
+                 {
+                     size_t size = 1;
+                     while (size < capacity)
+                     {
+                         size <<= 1;
+                     }
+                     return size - 1; }()),
+          m_slots(new Result[m_mask + 1])
+    {
+    }
+
+    template <typename Ready>
+    void RingSink::park(std::atomic<bool> &waiting, Ready ready)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Announced before ready() is checked again, the other side either sees it or published before the check.
+        waiting.store(true);
+        m_cv.wait(lock, ready);
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    void RingSink::wake(const std::atomic<bool> &waiting)
+    {
+        if (waiting.load())
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cv.notify_all();
+        }
+    }
+
+    void RingSink::consume(Result &chunk)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        auto ready = [&]
+        { return tail - m_head.load() <= m_mask || m_cancelled.load(); };
+        if (!ready())
+        {
+            park(m_producerWaiting, ready);
+        }
+        if (m_cancelled.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        m_slots[tail & m_mask] = std::move(chunk);
+        m_tail.store(tail + 1);
+        wake(m_consumerWaiting);
+    }
+
+    void RingSink::finish()
+    {
+        m_finished.store(true);
+        wake(m_consumerWaiting);
+    }
+
+    bool RingSink::try_pop(Result &chunk)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        chunk = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1);
+        wake(m_producerWaiting);
+        return true;
+    }
+
+    bool RingSink::pop(Result &chunk)
+    {
+        while (!try_pop(chunk))
+        {
+            // Finished is published after the last chunk, so an empty ring seen afterwards stays empty.
+            if (m_finished.load())
+            {
+                return try_pop(chunk);
+            }
+            park(m_consumerWaiting, [this]
+                 { return m_head.load(std::memory_order_relaxed) != m_tail.load() || m_finished.load(); });
+        }
+        return true;
+    }
+
+    void RingSink::cancel()
+    {
+        m_cancelled.store(true);
+        wake(m_producerWaiting);
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "options.h"
+#include "output_writer.h"
+#include "result.h"
+
+namespace grep
+{
+    // One matching line as seen by a sink, the views point into the chunk it came from.
+    struct Match
+    {
+        std::string_view file;
+        std::string_view line;   // without the line break
+        MatchRange positions;    // byte offsets into line, end inclusive
+        bool binary = false;     // a matching binary file, line and positions are empty
+        size_t count = 0;        // with -l, -c or -q the matching lines of file instead of a line, see Result::count
+        bool context = false;    // a line around a match (-A, -B, -C), positions is empty
+        bool separated = false;  // the first line of a group of context lines
+        size_t lineNumber = 0;   // 1-based, 0 unless line numbers were asked for
+        size_t byteOffset = 0;   // of the line start in the file, if byte offsets were asked for
+    };
+
+    // Calls handle for every line of chunk, or once for a matching binary file or a counted result.
+    void for_each_match(const Result &chunk, const std::function<void(const Match &)> &handle);
+
+    // Receives the results of a search on the thread that runs it. The chunks of one file arrive one after
+    // the other from first to last, files are never interleaved.
+    class ResultSink
+    {
+    public:
+        virtual ~ResultSink() = default;
+
+        // The sink may keep the chunk by moving from it, otherwise it is recycled once the call returns.
+        virtual void consume(Result &chunk) = 0;
+        // Nothing else is queued right now, more may follow.
+        virtual void flush() {}
+        // The search is complete.
+        virtual void finish() {}
+        // The receiver gave up, a search that has not started yet skips everything. See ThreadManager::cancel.
+        virtual bool cancelled() const { return false; }
+    };
+
+    // Formats results like the command line tool, colored if color is set: the lines, or for the other modes
+    // the file name (-l), the file name and its count (-c) or nothing at all (-q). Groups of context lines
+    // are separated by "--" lines, labels adds line numbers or byte offsets.
+    // With format Json or Binary the same is written as JSON Lines or records instead, see structured_output.h,
+    // color and labels do not apply.
+    class WriterSink : public ResultSink
+    {
+    public:
+        WriterSink(OutputWriter &writer, bool color, OutputMode mode = OutputMode::Lines, LineLabels labels = {},
+                   OutputFormat format = OutputFormat::Text)
+            : m_writer(writer),
+              m_color(color),
+              m_mode(mode),
+              m_labels(labels),
+              m_format(format)
+        {
+        }
+
+        void consume(Result &chunk) override;
+        void flush() override;
+        void finish() override;
+
+    private:
+        OutputWriter &m_writer;
+        const bool m_color;
+        const OutputMode m_mode;
+        const LineLabels m_labels;
+        const OutputFormat m_format;
+        bool m_written = false; // a line was formatted
+        std::string m_currentFile; // of the last File record
+    };
+
+    // Hands every match to a callback, the views are only valid during the call.
+    class CallbackSink : public ResultSink
+    {
+    public:
+        explicit CallbackSink(std::function<void(const Match &)> callback)
+            : m_callback(std::move(callback))
+        {
+        }
+
+        void consume(Result &chunk) override { for_each_match(chunk, m_callback); }
+
+    private:
+        std::function<void(const Match &)> m_callback;
+    };
+
+    // Single producer, single consumer ring of whole chunks for a consumer on another thread.
+    // The search waits while the ring is full, the consumer owns every chunk it pops. Both sides go through
+    // the ring without a lock and only park on a condition variable when they have to wait.
+    // A ring serves one search: pop returns false once that search finished and the ring is drained.
+    class RingSink : public ResultSink
+    {
+    public:
+        explicit RingSink(size_t capacity); // rounded up to a power of two
+
+        void consume(Result &chunk) override;
+        void finish() override;
+
+        // Waits for the next chunk, false once the search finished and every chunk was taken.
+        bool pop(Result &chunk);
+        bool try_pop(Result &chunk);
+        // The consumer stops reading, the rest of the search is dropped instead of waiting for room.
+        void cancel();
+        bool cancelled() const override { return m_cancelled.load(std::memory_order_relaxed); }
+
+    private:
+        // Parks the calling side until ready() holds, waiting is set while it may sleep.
+        template <typename Ready>
+        void park(std::atomic<bool> &waiting, Ready ready);
+        // Wakes the other side if it is parked, after the state it waits for was published.
+        void wake(const std::atomic<bool> &waiting);
+
+    private:
+        const size_t m_mask;
+        std::unique_ptr<Result[]> m_slots;
+        alignas(64) std::atomic<size_t> m_head{0}; // next slot to pop, written by the consumer
+        alignas(64) std::atomic<size_t> m_tail{0}; // next slot to fill, written by the producer
+        std::atomic<bool> m_finished{false};
+        std::atomic<bool> m_cancelled{false};
+        std::atomic<bool> m_consumerWaiting{false};
+        std::atomic<bool> m_producerWaiting{false};
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+    };
+}
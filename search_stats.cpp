@@ -0,0 +1,134 @@
+#include "search_stats.h"
+
+#include <cstdio>
+#include <ostream>
+
+namespace grep
+{
+    namespace
+    {
+        constexpr unsigned PhaseCount = static_cast<unsigned>(Phase::Count);
+        constexpr unsigned CounterCount = static_cast<unsigned>(Counter::Count);
+
+        double seconds(uint64_t nanos)
+        {
+            return static_cast<double>(nanos) / 1e9;
+        }
+
+        void print_row(std::ostream &out, const std::string &name, const ThreadStats &stats)
+        {
+            char line[256];
+            int used = std::snprintf(line, sizeof(line), "%-10s", name.c_str());
+            for (unsigned phase = 0; phase < PhaseCount; ++phase)
+            {
+                used += std::snprintf(line + used, sizeof(line) - used, " %11.3f", seconds(stats.nanos[phase]));
+            }
+            std::snprintf(line + used, sizeof(line) - used, " %9llu %12.1f %10llu\n",
+                          static_cast<unsigned long long>(stats.counter(Counter::Files)),
+                          static_cast<double>(stats.counter(Counter::Bytes)) / (1 << 20),
+                          static_cast<unsigned long long>(stats.counter(Counter::Lines)));
+            out << line;
+        }
+
+        void print_json_thread(std::ostream &out, const std::string &name, const ThreadStats &stats)
+        {
+            out << "{\"name\":\"" << name << "\",\"seconds\":{";
+            for (unsigned phase = 0; phase < PhaseCount; ++phase)
+            {
+                out << (phase == 0 ? "" : ",") << '"' << phase_name(static_cast<Phase>(phase)) << "\":" << seconds(stats.nanos[phase]);
+            }
+            out << "},\"counters\":{";
+            for (unsigned counter = 0; counter < CounterCount; ++counter)
+            {
+                out << (counter == 0 ? "" : ",") << '"' << counter_name(static_cast<Counter>(counter)) << "\":" << stats.counters[counter];
+            }
+            out << "}}";
+        }
+    }
+
+    const char *phase_name(Phase phase)
+    {
+        static const char *const names[] = {"walk", "open", "search", "result_wait", "idle", "output", "read"};
+        return names[static_cast<unsigned>(phase)];
+    }
+
+    const char *counter_name(Counter counter)
+    {
+        static const char *const names[] = {"directories", "files", "cached_files", "bytes", "ranges", "lines", "chunks"};
+        return names[static_cast<unsigned>(counter)];
+    }
+
+    void ThreadStats::add(const ThreadStats &other)
+    {
+        for (unsigned phase = 0; phase < PhaseCount; ++phase)
+        {
+            nanos[phase] += other.nanos[phase];
+        }
+        for (unsigned counter = 0; counter < CounterCount; ++counter)
+        {
+            counters[counter] += other.counters[counter];
+        }
+    }
+
+    ThreadStats SearchStats::total() const
+    {
+        ThreadStats sum;
+        for (const auto &worker : workers)
+        {
+            sum.add(worker);
+        }
+        sum.add(output);
+        return sum;
+    }
+
+    void SearchStats::print(std::ostream &out) const
+    {
+        const ThreadStats sum = total();
+        char head[256];
+        std::snprintf(head, sizeof(head), "%.3f s wall, %zu workers, %llu directories, %llu files, %llu cached, %llu ranges, %llu chunks\n",
+                      seconds(wallNanos), workers.size(), static_cast<unsigned long long>(sum.counter(Counter::Directories)),
+                      static_cast<unsigned long long>(sum.counter(Counter::Files)), static_cast<unsigned long long>(sum.counter(Counter::CachedFiles)),
+                      static_cast<unsigned long long>(sum.counter(Counter::Ranges)), static_cast<unsigned long long>(sum.counter(Counter::Chunks)));
+        out << head;
+
+        std::snprintf(head, sizeof(head), "%-10s", "seconds");
+        out << head;
+        for (unsigned phase = 0; phase < PhaseCount; ++phase)
+        {
+            std::snprintf(head, sizeof(head), " %11s", phase_name(static_cast<Phase>(phase)));
+            out << head;
+        }
+        std::snprintf(head, sizeof(head), " %9s %12s %10s\n", "files", "MiB", "lines");
+        out << head;
+
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            print_row(out, "worker " + std::to_string(i), workers[i]);
+        }
+        print_row(out, "output", output);
+        if (hasReader)
+        {
+            print_row(out, "reader", reader);
+        }
+        print_row(out, "total", sum);
+    }
+
+    void SearchStats::print_json(std::ostream &out) const
+    {
+        out << "{\"wall_seconds\":" << seconds(wallNanos) << ",\"threads\":[";
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            print_json_thread(out, "worker " + std::to_string(i), workers[i]);
+            out << ',';
+        }
+        print_json_thread(out, "output", output);
+        if (hasReader)
+        {
+            out << ',';
+            print_json_thread(out, "reader", reader);
+        }
+        out << "],\"total\":";
+        print_json_thread(out, "total", total());
+        out << "}\n";
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace grep
+{
+    // Where a thread spends its time, every moment of a search is charged to exactly one phase.
+    enum class Phase : unsigned
+    {
+        Walk,       // listing directories
+        Open,       // stat, cache lookup, open and map
+        Search,     // matching, including the page faults of mapped files
+        ResultWait, // handing chunks to the pipeline, waiting while its budget is used up
+        Idle,       // waiting for a task or, on the output thread, for a chunk
+        Output,     // formatting and writing, or whatever the sink does
+        Read,       // opening and reading files ahead, only on the reader's I/O threads (--io-depth)
+        Count
+    };
+
+    enum class Counter : unsigned
+    {
+        Directories,
+        Files,       // opened and searched, split files once
+        CachedFiles, // answered by the result cache
+        Bytes,       // content searched
+        Ranges,      // range tasks of split files
+        Lines,       // matching lines handed on
+        Chunks,
+        Count
+    };
+
+    // Counters and phase times of one thread, only ever touched by that thread while a search runs.
+    struct alignas(64) ThreadStats
+    {
+        uint64_t nanos[static_cast<unsigned>(Phase::Count)] = {};
+        uint64_t counters[static_cast<unsigned>(Counter::Count)] = {};
+        Phase phase = Phase::Idle;
+        std::chrono::steady_clock::time_point since;
+
+        // Charges the time since the last switch to the current phase and continues in phase.
+        Phase switch_phase(Phase next)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            nanos[static_cast<unsigned>(phase)] += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count());
+            since = now;
+            const Phase previous = phase;
+            phase = next;
+            return previous;
+        }
+        uint64_t counter(Counter which) const { return counters[static_cast<unsigned>(which)]; }
+        uint64_t time(Phase which) const { return nanos[static_cast<unsigned>(which)]; }
+        void add(const ThreadStats &other);
+    };
+
+    // The instrumentation calls take a nullptr while --stats is off and compile to nothing without GREP_WITH_STATS.
+#ifdef GREP_WITH_STATS
+    constexpr bool StatsCompiledIn = true;
+
+    inline void count(ThreadStats *stats, Counter counter, uint64_t amount = 1)
+    {
+        if (stats != nullptr)
+        {
+            stats->counters[static_cast<unsigned>(counter)] += amount;
+        }
+    }
+
+    inline void start_stats(ThreadStats *stats)
+    {
+        if (stats != nullptr)
+        {
+            stats->phase = Phase::Idle;
+            stats->since = std::chrono::steady_clock::now();
+        }
+    }
+
+    inline void stop_stats(ThreadStats *stats)
+    {
+        if (stats != nullptr)
+        {
+            stats->switch_phase(Phase::Idle);
+        }
+    }
+
+    // Charges the scope to phase and returns to the enclosing phase at its end.
+    class PhaseScope
+    {
+    public:
+        PhaseScope(ThreadStats *stats, Phase phase)
+            : m_stats(stats),
+              m_previous(stats != nullptr ? stats->switch_phase(phase) : phase)
+        {
+        }
+        ~PhaseScope()
+        {
+            if (m_stats != nullptr)
+            {
+                m_stats->switch_phase(m_previous);
+            }
+        }
+
+        PhaseScope(const PhaseScope &) = delete;
+        PhaseScope &operator=(const PhaseScope &) = delete;
+
+    private:
+        ThreadStats *m_stats;
+        Phase m_previous;
+    };
+#else
+    constexpr bool StatsCompiledIn = false;
+
+    inline void count(ThreadStats *, Counter, uint64_t = 1) {}
+    inline void start_stats(ThreadStats *) {}
+    inline void stop_stats(ThreadStats *) {}
+
+    class PhaseScope
+    {
+    public:
+        PhaseScope(ThreadStats *, Phase) {}
+    };
+#endif
+
+    // Statistics of one search, per worker plus the thread that ran the output.
+    // With --io-depth the reader adds a row of its own, the sum of its I/O threads: Read, Idle while it waits for files
+    // or for loaded ones to be released, and the files and bytes it read. It is not part of the total, as the workers
+    // count the same files again, their time waiting for the reader is in their Idle.
+    struct SearchStats
+    {
+        std::vector<ThreadStats> workers;
+        ThreadStats output;
+        bool hasReader = false;
+        ThreadStats reader;
+        uint64_t wallNanos = 0;
+
+        ThreadStats total() const;
+        // Table for people, one row per thread.
+        void print(std::ostream &out) const;
+        // One JSON object with per-thread and total figures, times in seconds.
+        void print_json(std::ostream &out) const;
+    };
+
+    const char *phase_name(Phase phase);
+    const char *counter_name(Counter counter);
+}
@@ -0,0 +1,114 @@
+#include "searcher.h"
+
+#include "threadmanager.h"
+
+namespace grep
+{
+    namespace
+    {
+        constexpr size_t StreamRingChunks = 64;
+    }
+
+    struct MatchStream::State
+    {
+        RingSink ring{StreamRingChunks};
+        ThreadManager *manager = nullptr;
+        std::thread search;
+        Result chunk;
+        size_t line = 0;
+        bool reported = false; // the single match of a binary or counted chunk
+    };
+
+    MatchStream::MatchStream(std::unique_ptr<State> state)
+        : m_state(std::move(state))
+    {
+    }
+
+    MatchStream::MatchStream(MatchStream &&other) noexcept = default;
+    MatchStream &MatchStream::operator=(MatchStream &&other) noexcept
+    {
+        if (this != &other)
+        {
+            stop();
+            m_state = std::move(other.m_state);
+        }
+        return *this;
+    }
+
+    MatchStream::~MatchStream()
+    {
+        stop();
+    }
+
+    void MatchStream::stop()
+    {
+        if (m_state)
+        {
+            m_state->ring.cancel();
+            m_state->manager->cancel(m_state->ring);
+            m_state->search.join();
+            m_state.reset();
+        }
+    }
+
+    bool MatchStream::next(Match &match)
+    {
+        State &state = *m_state;
+        while (true)
+        {
+            if ((state.chunk.binary || state.chunk.counted) && !state.reported)
+            {
+                state.reported = true;
+                match = Match{state.chunk.file_name, std::string_view(), MatchRange{nullptr, nullptr}, state.chunk.binary, state.chunk.count};
+                return true;
+            }
+            if (state.line < state.chunk.line_count())
+            {
+                const size_t line = state.line++;
+                match = Match{state.chunk.file_name, state.chunk.line_text(line), state.chunk.line_matches(line), false, 0,
+                              state.chunk.is_context(line), state.chunk.is_separated(line), state.chunk.lines[line].lineNumber,
+                              state.chunk.lines[line].byteOffset};
+                return true;
+            }
+            if (!state.ring.pop(state.chunk))
+            {
+                return false;
+            }
+            state.line = 0;
+            state.reported = false;
+        }
+    }
+
+    Searcher::Searcher(const GrepOptions &options)
+        : m_manager(std::make_unique<ThreadManager>(options))
+    {
+    }
+
+    Searcher::~Searcher() = default;
+
+    bool Searcher::search(const std::string &path, ResultSink &sink)
+    {
+        return m_manager->search(path, sink);
+    }
+
+    bool Searcher::search(const std::string &path, const std::function<void(const Match &)> &callback)
+    {
+        CallbackSink sink(callback);
+        return m_manager->search(path, sink);
+    }
+
+    const SearchStats &Searcher::stats() const
+    {
+        return m_manager->stats();
+    }
+
+    MatchStream Searcher::stream(std::string path)
+    {
+        auto state = std::make_unique<MatchStream::State>();
+        MatchStream::State *shared = state.get();
+        shared->manager = m_manager.get();
+        shared->search = std::thread([this, shared, path = std::move(path)]
+                                     { m_manager->search(path, shared->ring); });
+        return MatchStream(std::move(state));
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "options.h"
+#include "result_sink.h"
+#include "search_stats.h"
+
+namespace grep
+{
+    class ThreadManager;
+
+    // Results of one search pulled one match at a time, the search runs on a thread of its own meanwhile.
+    class MatchStream
+    {
+    public:
+        MatchStream(MatchStream &&other) noexcept;
+        // Stops the search this stream was on before it takes over the other one.
+        MatchStream &operator=(MatchStream &&other) noexcept;
+        ~MatchStream(); // a stream dropped early cancels its search
+
+        // Waits for the next match, false once the search is complete. The views are valid until the next call.
+        bool next(Match &match);
+
+    private:
+        friend class Searcher;
+        struct State;
+        explicit MatchStream(std::unique_ptr<State> state);
+        // Gives up the rest of the results and waits for the search thread.
+        void stop();
+
+    private:
+        std::unique_ptr<State> m_state;
+    };
+
+    // Library entry point for embedding the search: patterns are compiled once and the worker threads are kept
+    // between searches. Matches reach the caller through a sink as views into the result chunks, nothing is
+    // copied or formatted on the way. options.path and options.color are not used, everything else applies.
+    // Searches on the same Searcher run one after the other.
+    class Searcher
+    {
+    public:
+        explicit Searcher(const GrepOptions &options);
+        ~Searcher();
+
+        Searcher(const Searcher &) = delete;
+        Searcher &operator=(const Searcher &) = delete;
+
+    public:
+        // Returns once the search of path is complete, sink is called on this thread. True if anything matched.
+        bool search(const std::string &path, ResultSink &sink);
+        bool search(const std::string &path, const std::function<void(const Match &)> &callback);
+        // Starts a search and returns at once, the Searcher has to outlive the stream.
+        MatchStream stream(std::string path);
+        // Of the last completed search, with options.stats set and GREP_WITH_STATS compiled in.
+        const SearchStats &stats() const;
+
+    private:
+        std::unique_ptr<ThreadManager> m_manager;
+    };
+}
@@ -0,0 +1,334 @@
+#include "structured_output.h"
+
+#include <array>
+#include <charconv>
+
+namespace grep
+{
+    namespace
+    {
+        // Bytes that end a run of text copied as is: control characters, the quote, the backslash and non-ASCII.
+        constexpr std::array<bool, 256> SpecialBytes = []
+        {
+            std::array<bool, 256> special{};
+            for (size_t c = 0; c < 256; ++c)
+            {
+                special[c] = c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+            }
+            return special;
+        }();
+
+        // Length of the well-formed UTF-8 sequence at p, 0 for a malformed, overlong, surrogate or cut off one.
+        size_t utf8_length(const unsigned char *p, const unsigned char *end)
+        {
+            const unsigned char lead = p[0];
+            size_t length = 0;
+            unsigned char low = 0x80;
+            unsigned char high = 0xBF; // of the second byte, the rest are always 0x80 to 0xBF
+            if (lead >= 0xC2 && lead <= 0xDF)
+            {
+                length = 2;
+            }
+            else if (lead >= 0xE0 && lead <= 0xEF)
+            {
+                length = 3;
+                low = lead == 0xE0 ? 0xA0 : 0x80;
+                high = lead == 0xED ? 0x9F : 0xBF;
+            }
+            else if (lead >= 0xF0 && lead <= 0xF4)
+            {
+                length = 4;
+                low = lead == 0xF0 ? 0x90 : 0x80;
+                high = lead == 0xF4 ? 0x8F : 0xBF;
+            }
+            if (length == 0 || static_cast<size_t>(end - p) < length || p[1] < low || p[1] > high)
+            {
+                return 0;
+            }
+            for (size_t i = 2; i < length; ++i)
+            {
+                if ((p[i] & 0xC0) != 0x80)
+                {
+                    return 0;
+                }
+            }
+            return length;
+        }
+
+        void append_base64(std::string &out, std::string_view data)
+        {
+            static constexpr char Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            const auto *p = reinterpret_cast<const unsigned char *>(data.data());
+            size_t left = data.size();
+            for (; left >= 3; p += 3, left -= 3)
+            {
+                const uint32_t bits = uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2];
+                const char quad[4] = {Digits[bits >> 18], Digits[(bits >> 12) & 63], Digits[(bits >> 6) & 63], Digits[bits & 63]};
+                out.append(quad, 4);
+            }
+            if (left > 0)
+            {
+                const uint32_t bits = uint32_t(p[0]) << 16 | (left == 2 ? uint32_t(p[1]) << 8 : 0);
+                const char quad[4] = {Digits[bits >> 18], Digits[(bits >> 12) & 63], left == 2 ? Digits[(bits >> 6) & 63] : '=', '='};
+                out.append(quad, 4);
+            }
+        }
+
+        void append_number(std::string &out, uint64_t value)
+        {
+            char digits[20];
+            out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+        }
+
+        // ,"name":"text" or, for text that is not UTF-8, ,"name_bytes":"base64".
+        void append_json_string_field(std::string &out, std::string_view name, std::string_view text)
+        {
+            out.append(",\"").append(name);
+            const size_t mark = out.size();
+            out.append("\":\"");
+            if (!append_json_text(out, text))
+            {
+                out.resize(mark);
+                out.append("_bytes\":\"");
+                append_base64(out, text);
+            }
+            out.push_back('"');
+        }
+
+        void append_json_number_field(std::string &out, std::string_view name, uint64_t value)
+        {
+            out.append(",\"").append(name).append("\":");
+            append_number(out, value);
+        }
+
+        void append_json_line(std::string &out, const Result &chunk, size_t line)
+        {
+            const bool context = chunk.is_context(line);
+            out.append(context ? "{\"type\":\"context\"" : "{\"type\":\"match\"");
+            append_json_string_field(out, "path", chunk.file_name);
+            append_json_number_field(out, "line_number", chunk.lines[line].lineNumber);
+            append_json_number_field(out, "byte_offset", chunk.lines[line].byteOffset);
+            append_json_string_field(out, "text", chunk.line_text(line));
+            if (!context)
+            {
+                out.append(",\"matches\":[");
+                bool first = true;
+                for (const auto &match : chunk.line_matches(line))
+                {
+                    out.append(first ? "{\"start\":" : ",{\"start\":");
+                    append_number(out, match.start);
+                    out.append(",\"end\":");
+                    append_number(out, match.end + 1);
+                    out.append(",\"pattern\":");
+                    append_number(out, match.pattern);
+                    out.push_back('}');
+                    first = false;
+                }
+                out.push_back(']');
+            }
+            out.append("}\n");
+        }
+
+        size_t varint_size(uint64_t value)
+        {
+            size_t size = 1;
+            for (; value >= 0x80; value >>= 7)
+            {
+                ++size;
+            }
+            return size;
+        }
+
+        void append_varint(std::string &out, uint64_t value)
+        {
+            char bytes[10];
+            size_t size = 0;
+            for (; value >= 0x80; value >>= 7)
+            {
+                bytes[size++] = static_cast<char>(value | 0x80);
+            }
+            bytes[size++] = static_cast<char>(value);
+            out.append(bytes, size);
+        }
+
+        // A record of a name, after a number if there is one. The length goes first, so it is worked out ahead.
+        void append_name_frame(std::string &out, frame::Kind kind, std::string_view name, const uint64_t *number = nullptr)
+        {
+            append_varint(out, 1 + (number != nullptr ? varint_size(*number) : 0) + name.size());
+            out.push_back(static_cast<char>(kind));
+            if (number != nullptr)
+            {
+                append_varint(out, *number);
+            }
+            out.append(name);
+        }
+
+        void append_line_frame(std::string &out, const Result &chunk, size_t line)
+        {
+            const Result::Line &entry = chunk.lines[line];
+            const MatchRange matches = chunk.line_matches(line);
+            size_t size = 1 + varint_size(entry.lineNumber) + varint_size(entry.byteOffset) + varint_size(entry.textLength) +
+                          entry.textLength + varint_size(matches.size());
+            for (const auto &match : matches)
+            {
+                size += varint_size(match.start) + varint_size(match.end + 1) + varint_size(match.pattern);
+            }
+            append_varint(out, size);
+            out.push_back(static_cast<char>(chunk.is_context(line) ? frame::Context : frame::Match));
+            append_varint(out, entry.lineNumber);
+            append_varint(out, entry.byteOffset);
+            append_varint(out, entry.textLength);
+            out.append(chunk.line_text(line));
+            append_varint(out, matches.size());
+            for (const auto &match : matches)
+            {
+                append_varint(out, match.start);
+                append_varint(out, match.end + 1);
+                append_varint(out, match.pattern);
+            }
+        }
+    }
+
+    bool append_json_text(std::string &out, std::string_view text)
+    {
+        const size_t mark = out.size();
+        const auto *p = reinterpret_cast<const unsigned char *>(text.data());
+        const auto *end = p + text.size();
+        const auto *run = p; // not yet copied
+        while (p < end)
+        {
+            if (!SpecialBytes[*p])
+            {
+                ++p;
+                continue;
+            }
+            if (*p >= 0x80)
+            {
+                const size_t length = utf8_length(p, end);
+                if (length == 0)
+                {
+                    out.resize(mark);
+                    return false;
+                }
+                p += length;
+                continue;
+            }
+            out.append(reinterpret_cast<const char *>(run), p - run);
+            switch (*p)
+            {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+            {
+                static constexpr char Hex[] = "0123456789abcdef";
+                const char escape[6] = {'\\', 'u', '0', '0', Hex[*p >> 4], Hex[*p & 15]};
+                out.append(escape, 6);
+            }
+            }
+            run = ++p;
+        }
+        out.append(reinterpret_cast<const char *>(run), p - run);
+        return true;
+    }
+
+    void format_json(const Result &chunk, std::string &out, OutputMode mode)
+    {
+        switch (mode)
+        {
+        case OutputMode::Lines:
+            if (chunk.binary)
+            {
+                out.append("{\"type\":\"binary\"");
+                append_json_string_field(out, "path", chunk.file_name);
+                out.append("}\n");
+                return;
+            }
+            for (size_t line = 0; line < chunk.line_count(); ++line)
+            {
+                append_json_line(out, chunk, line);
+            }
+            break;
+        case OutputMode::FilesWithMatches:
+            if (chunk.count > 0 || chunk.binary)
+            {
+                out.append("{\"type\":\"file\"");
+                append_json_string_field(out, "path", chunk.file_name);
+                out.append("}\n");
+            }
+            break;
+        case OutputMode::Count:
+            out.append("{\"type\":\"count\"");
+            append_json_string_field(out, "path", chunk.file_name);
+            append_json_number_field(out, "count", chunk.count);
+            out.append("}\n");
+            break;
+        case OutputMode::Quiet:
+            break;
+        }
+    }
+
+    void format_frames(const Result &chunk, std::string &out, OutputMode mode, std::string &currentFile)
+    {
+        switch (mode)
+        {
+        case OutputMode::Lines:
+            if (chunk.binary)
+            {
+                append_name_frame(out, frame::Binary, chunk.file_name);
+                return;
+            }
+            if (chunk.line_count() > 0 && chunk.file_name != currentFile)
+            {
+                append_name_frame(out, frame::File, chunk.file_name);
+                currentFile = chunk.file_name;
+            }
+            for (size_t line = 0; line < chunk.line_count(); ++line)
+            {
+                append_line_frame(out, chunk, line);
+            }
+            break;
+        case OutputMode::FilesWithMatches:
+            if (chunk.count > 0 || chunk.binary)
+            {
+                append_name_frame(out, frame::File, chunk.file_name);
+            }
+            break;
+        case OutputMode::Count:
+        {
+            const uint64_t count = chunk.count;
+            append_name_frame(out, frame::Count, chunk.file_name, &count);
+            break;
+        }
+        case OutputMode::Quiet:
+            break;
+        }
+    }
+
+    bool read_varint(std::string_view data, size_t &pos, uint64_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; pos < data.size() && shift < 64; shift += 7)
+        {
+            const unsigned char byte = static_cast<unsigned char>(data[pos++]);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (byte < 0x80)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "options.h"
+#include "result.h"
+
+namespace grep
+{
+    // JSON Lines, one object per line of a result, every line with its number and the byte offset of its start:
+    //   {"type":"match","path":"a.txt","line_number":3,"byte_offset":120,"text":"foo bar","matches":[{"start":0,"end":3,"pattern":0}]}
+    //   {"type":"context","path":"a.txt","line_number":4,"byte_offset":128,"text":"baz"}
+    //   {"type":"binary","path":"a.bin"}              a matching binary file
+    //   {"type":"file","path":"a.txt"}                -l
+    //   {"type":"count","path":"a.txt","count":2}     -c
+    // Match spans are byte offsets into the line, end exclusive. Text that is not valid UTF-8 is written as
+    // base64 under "text_bytes" instead of "text" ("path_bytes" instead of "path"), so no byte is lost or replaced.
+    // Everything is escaped straight into out.
+    void format_json(const Result &chunk, std::string &out, OutputMode mode);
+
+    // Appends text as the contents of a JSON string. False, with out unchanged, if text is not valid UTF-8.
+    bool append_json_text(std::string &out, std::string_view text);
+
+    // Compact records for pipelines that would rather not parse text. Every record is a LEB128 varint length
+    // followed by that many bytes: one kind byte and the fields, numbers as varints, strings as the raw bytes.
+    //   File     path                                             the lines that follow are from this file, also -l
+    //   Match    line number, byte offset, text length, text,
+    //            match count, per match start, end (exclusive), pattern
+    //   Context  same as Match with no matches
+    //   Binary   path                                             a matching binary file
+    //   Count    count, path                                      -c
+    // A File record is only written when the file changes, currentFile keeps track of it between calls.
+    namespace frame
+    {
+        enum Kind : uint8_t
+        {
+            File = 1,
+            Match = 2,
+            Context = 3,
+            Binary = 4,
+            Count = 5
+        };
+    }
+    void format_frames(const Result &chunk, std::string &out, OutputMode mode, std::string &currentFile);
+
+    // Reads the varint at data[pos] and advances pos past it, false if it is cut off.
+    bool read_varint(std::string_view data, size_t &pos, uint64_t &value);
+}
@@ -1,8 +1,38 @@
 #include <gtest/gtest.h>  // Google Test
+#include "case_fold.h"
+#include "decompress.h"
+#include "file_reader.h"
 #include "grep_utils.h"
 #include "grep_interface_functions.h"
+#include "literal_search.h"
+#include "output_writer.h"
+#include "path_filter.h"
+#include "regex_matcher.h"
+#include "result_cache.h"
+#include "result_pipeline.h"
+#include "searcher.h"
+#include "structured_output.h"
+#include "trigram_index.h"
+#include "work_stealing_scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <ctime>
 #include <sstream>
+#include <fstream>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <regex>
+#include <thread>
+#include <tuple>
+#ifdef GREP_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef GREP_WITH_LZMA
+#include <lzma.h>
+#endif
 
 namespace grep_tests
 {
@@ -13,8 +43,8 @@ namespace grep_tests
 
     auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
 
-    EXPECT_EQ(result.first, "arg1 arg1");
-    EXPECT_EQ(result.second, "arg2");
+    EXPECT_EQ(result.patterns, std::vector<std::string>{"arg1 arg1"});
+    EXPECT_EQ(result.path, "arg2");
   }
 
   TEST(ReadGrepArgumentsTest, LessThanTwoArguments)
@@ -24,8 +54,8 @@ namespace grep_tests
 
     auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
 
-    EXPECT_EQ(result.first, "");
-    EXPECT_EQ(result.second, "");
+    EXPECT_TRUE(result.patterns.empty());
+    EXPECT_EQ(result.path, "");
   }
 
   TEST(ReadGrepArgumentsTest, MoreThanTwoArguments)
@@ -35,8 +65,29 @@ namespace grep_tests
 
     auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
 
-    EXPECT_EQ(result.first, "");
-    EXPECT_EQ(result.second, "");
+    EXPECT_TRUE(result.patterns.empty());
+    EXPECT_EQ(result.path, "");
+  }
+
+  TEST(ReadGrepArgumentsTest, RepeatedPatternOptions)
+  {
+    const char *argv[] = {"program", "-e", "first", "-e", "second", "path"};
+    int argc = 6;
+
+    auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
+
+    EXPECT_EQ(result.patterns, (std::vector<std::string>{"first", "second"}));
+    EXPECT_EQ(result.path, "path");
+  }
+
+  TEST(ReadGrepArgumentsTest, PatternOptionWithPositionalPattern)
+  {
+    const char *argv[] = {"program", "-e", "first", "second", "path"};
+    int argc = 5;
+
+    auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
+
+    EXPECT_TRUE(result.patterns.empty());
   }
 
   namespace fs = std::filesystem;
@@ -99,6 +150,123 @@ namespace grep_tests
     EXPECT_EQ(outputBuffer.str(), expectedOutput);
   }
 
+  TEST(OutputColoredResultTest, WithoutColor)
+  {
+    grep::Result::LineMatchResults line_match_results = {
+        {"This is a test line with a match", {grep::MatchPosition(27, 31)}}};
+    grep::Result result("test_file.txt", std::move(line_match_results));
+
+    std::string out = "previous\n";
+    grep::format_result(result, out, false);
+
+    EXPECT_EQ(out, "previous\ntest_file.txt: This is a test line with a match\n");
+  }
+
+  TEST(StructuredOutputTest, JsonEscapesTextAndKeepsInvalidBytes)
+  {
+    grep::Result result("dir/a \"b\".txt");
+    result.add_line("say \"hi\"\t\\ \x01 \xc3\xa9", 0, 3, 40);
+    result.add_match(grep::MatchPosition(4, 7));
+    result.add_match(grep::MatchPosition(13, 14, 1));
+    result.add_line("next", grep::Result::Line::Context, 4, 60);
+    result.add_line("\xff\xfe" "a", 0, 5, 65);
+    result.add_match(grep::MatchPosition(2, 2));
+
+    std::string out = "previous\n";
+    grep::format_json(result, out, grep::OutputMode::Lines);
+    EXPECT_EQ(out, "previous\n"
+                   R"({"type":"match","path":"dir/a \"b\".txt","line_number":3,"byte_offset":40,"text":"say \"hi\"\t\\ \u0001 )"
+                   "\xc3\xa9"
+                   R"(","matches":[{"start":4,"end":8,"pattern":0},{"start":13,"end":15,"pattern":1}]})"
+                   "\n"
+                   R"({"type":"context","path":"dir/a \"b\".txt","line_number":4,"byte_offset":60,"text":"next"})"
+                   "\n"
+                   R"({"type":"match","path":"dir/a \"b\".txt","line_number":5,"byte_offset":65,"text_bytes":"//5h","matches":[{"start":2,"end":3,"pattern":0}]})"
+                   "\n");
+
+    // Overlong forms, surrogates and cut off sequences are not UTF-8.
+    for (const char *invalid : {"\xc0\x80", "\xe0\x80\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82"})
+    {
+      std::string text = "kept";
+      EXPECT_FALSE(grep::append_json_text(text, invalid)) << invalid;
+      EXPECT_EQ(text, "kept");
+    }
+
+    grep::Result counted("c.txt");
+    counted.counted = true;
+    counted.count = 2;
+    out.clear();
+    grep::format_json(counted, out, grep::OutputMode::Count);
+    grep::format_json(counted, out, grep::OutputMode::FilesWithMatches);
+    EXPECT_EQ(out, "{\"type\":\"count\",\"path\":\"c.txt\",\"count\":2}\n{\"type\":\"file\",\"path\":\"c.txt\"}\n");
+  }
+
+  TEST(StructuredOutputTest, FramesDecodeToTheLines)
+  {
+    grep::Result result("a.txt");
+    result.add_line(std::string(300, 'x') + "hit", 0, 1000, 70000);
+    result.add_match(grep::MatchPosition(300, 302));
+    result.add_line("after", grep::Result::Line::Context, 1001, 70304);
+
+    std::string out;
+    std::string currentFile;
+    grep::format_frames(result, out, grep::OutputMode::Lines, currentFile);
+    grep::format_frames(result, out, grep::OutputMode::Lines, currentFile); // a second chunk of the same file
+
+    std::vector<std::string> decoded;
+    std::string_view data(out);
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+      uint64_t length = 0;
+      ASSERT_TRUE(grep::read_varint(data, pos, length));
+      ASSERT_LE(pos + length, data.size());
+      std::string_view record = data.substr(pos, length);
+      pos += length;
+      size_t field = 1;
+      std::string line = std::to_string(record[0]);
+      if (record[0] == grep::frame::File)
+      {
+        decoded.push_back(line + " " + std::string(record.substr(field)));
+        continue;
+      }
+      uint64_t number = 0, offset = 0, textLength = 0, matches = 0;
+      ASSERT_TRUE(grep::read_varint(record, field, number) && grep::read_varint(record, field, offset) &&
+                  grep::read_varint(record, field, textLength));
+      line += " " + std::to_string(number) + " " + std::to_string(offset) + " " + std::to_string(textLength);
+      field += textLength;
+      ASSERT_TRUE(grep::read_varint(record, field, matches));
+      for (uint64_t i = 0; i < matches * 3; ++i)
+      {
+        uint64_t value = 0;
+        ASSERT_TRUE(grep::read_varint(record, field, value));
+        line += " " + std::to_string(value);
+      }
+      EXPECT_EQ(field, record.size());
+      decoded.push_back(line);
+    }
+    const std::vector<std::string> expected{"1 a.txt", "2 1000 70000 303 300 303 0", "3 1001 70304 5",
+                                            "2 1000 70000 303 300 303 0", "3 1001 70304 5"};
+    EXPECT_EQ(decoded, expected);
+  }
+
+  TEST(OutputWriterTest, WritesAllBuffersInOrder)
+  {
+    std::stringstream stream;
+    std::string expected;
+    {
+      grep::OutputWriter writer(stream);
+      for (int i = 0; i < 50000; ++i)
+      {
+        const std::string line = "file" + std::to_string(i) + ": some matching line\n";
+        writer.buffer().append(line);
+        writer.commit();
+        expected += line;
+      }
+    }
+    EXPECT_EQ(stream.str(), expected);
+  }
+
   TEST(SearchInFileTest, SearchMatchInFile)
   {
     grep::Result::LineMatchResults line_match_results = {
@@ -111,6 +279,624 @@ namespace grep_tests
     EXPECT_TRUE(expectedResult == actualResult);
   }
 
+  // Writes content to a fresh file in the temp directory and removes it when going out of scope.
+  class TempFile
+  {
+  public:
+    TempFile(const std::string &name, const std::string &content)
+        : m_path(fs::temp_directory_path() / name)
+    {
+      std::ofstream(m_path, std::ios::binary) << content;
+    }
+    ~TempFile() { fs::remove(m_path); }
+    const fs::path &path() const { return m_path; }
+
+  private:
+    fs::path m_path;
+  };
+
+  // Creates a fresh directory in the temp directory and removes it with all content when going out of scope.
+  class TempDir
+  {
+  public:
+    explicit TempDir(const std::string &name)
+        : m_path(fs::temp_directory_path() / name)
+    {
+      fs::remove_all(m_path);
+      fs::create_directories(m_path);
+    }
+    ~TempDir() { fs::remove_all(m_path); }
+    const fs::path &path() const { return m_path; }
+
+    void write(const fs::path &relative, const std::string &content) const
+    {
+      fs::create_directories((m_path / relative).parent_path());
+      std::ofstream(m_path / relative, std::ios::binary) << content;
+    }
+
+  private:
+    fs::path m_path;
+  };
+
+  TEST(SearchInFileTest, LastLineWithoutNewline)
+  {
+    TempFile file("grep_tests_last_line.txt", "nothing\r\nfirst hit\r\nxx\nlast hit");
+
+    grep::Result::LineMatchResults line_match_results = {
+        {"first hit\r", {grep::MatchPosition(6, 8)}},
+        {"last hit", {grep::MatchPosition(5, 7)}}};
+    grep::Result expectedResult(file.path().string(), std::move(line_match_results));
+
+    EXPECT_TRUE(expectedResult == grep::search_in_file("hit", file.path()));
+  }
+
+  TEST(SearchInFileTest, EmptyFileAndNewlinePattern)
+  {
+    TempFile empty("grep_tests_empty.txt", "");
+    TempFile lines("grep_tests_lines.txt", "a\nb\n");
+
+    EXPECT_TRUE(grep::search_in_file("a", empty.path()).empty());
+    EXPECT_TRUE(grep::search_in_file("a\nb", lines.path()).empty());
+  }
+
+  TEST(LiteralSearcherTest, KernelsAgreeWithStringFind)
+  {
+    std::string text;
+    unsigned state = 12345;
+    for (int i = 0; i < 5000; ++i)
+    {
+      state = state * 1103515245 + 12345;
+      text.push_back("abc\n"[(state >> 16) % 4]);
+    }
+    std::string_view view(text);
+
+    const grep::LiteralSearcher::Kernel kernels[] = {grep::LiteralSearcher::Kernel::Scalar,
+                                                     grep::LiteralSearcher::Kernel::Sse2,
+                                                     grep::LiteralSearcher::Kernel::Avx2};
+    for (const char *pattern : {"a", "ab", "abc", "cab", "abcabca", "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb", "abcc"})
+    {
+      for (auto kernel : kernels)
+      {
+        if (!grep::LiteralSearcher::is_supported(kernel))
+        {
+          continue;
+        }
+        grep::LiteralSearcher searcher(pattern, kernel);
+        for (size_t from = 0; from < text.size(); from += 97)
+        {
+          const char *hit = searcher.find(text.data() + from, text.data() + text.size());
+          size_t expected = view.find(pattern, from);
+          EXPECT_EQ(hit ? static_cast<size_t>(hit - text.data()) : std::string_view::npos, expected)
+              << "pattern " << pattern << " from " << from;
+        }
+      }
+    }
+  }
+
+  TEST(LiteralSearcherTest, NewlineCountingKernelsAgree)
+  {
+    // Long enough for the byte counters of every kernel to be widened more than once.
+    std::string text;
+    unsigned state = 12345;
+    for (int i = 0; i < 40000; ++i)
+    {
+      state = state * 1103515245 + 12345;
+      text.push_back((state >> 16) % 7 == 0 ? '\n' : (state >> 16) % 7 == 1 ? '\x8a' : 'x');
+    }
+    for (auto kernel : {grep::LiteralSearcher::Kernel::Scalar, grep::LiteralSearcher::Kernel::Sse2, grep::LiteralSearcher::Kernel::Avx2})
+    {
+      if (!grep::LiteralSearcher::is_supported(kernel))
+      {
+        continue;
+      }
+      for (size_t from : {0, 1, 31, 1000})
+      {
+        for (size_t to : {from, from + 1, from + 33, from + 8191, text.size()})
+        {
+          EXPECT_EQ(grep::count_newlines(text.data() + from, text.data() + to, kernel),
+                    static_cast<size_t>(std::count(text.begin() + from, text.begin() + to, '\n')));
+        }
+      }
+    }
+  }
+
+  TEST(LiteralSearcherTest, FoldingKernelsAgreeWithLowercasedText)
+  {
+    // Letters in both cases, bytes that differ from letters only in the case bit and bytes from 0x80.
+    std::string text;
+    unsigned state = 54321;
+    for (int i = 0; i < 5000; ++i)
+    {
+      state = state * 1103515245 + 12345;
+      text.push_back("aAbB@`[{\n\xc1\xe1"[(state >> 16) % 11]);
+    }
+    std::string lowered = text;
+    std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](char c)
+                   { return c >= 'A' && c <= 'Z' ? static_cast<char>(c + 32) : c; });
+
+    const grep::LiteralSearcher::Kernel kernels[] = {grep::LiteralSearcher::Kernel::Scalar,
+                                                     grep::LiteralSearcher::Kernel::Sse2,
+                                                     grep::LiteralSearcher::Kernel::Avx2};
+    for (const char *pattern : {"a", "B", "ab", "Ab@", "`a", "[b", "\xc1" "a", "aBaBaBaBaBaBaBaBaBaBaBaBaBaBaBaBaBaB", "b{"})
+    {
+      std::string folded = pattern;
+      std::transform(folded.begin(), folded.end(), folded.begin(), [](char c)
+                     { return c >= 'A' && c <= 'Z' ? static_cast<char>(c + 32) : c; });
+      for (auto kernel : kernels)
+      {
+        if (!grep::LiteralSearcher::is_supported(kernel))
+        {
+          continue;
+        }
+        grep::LiteralSearcher searcher(pattern, kernel, true);
+        for (size_t from = 0; from < text.size(); from += 97)
+        {
+          const char *hit = searcher.find(text.data() + from, text.data() + text.size());
+          EXPECT_EQ(hit ? static_cast<size_t>(hit - text.data()) : std::string::npos, lowered.find(folded, from))
+              << "pattern " << pattern << " from " << from;
+        }
+      }
+    }
+  }
+
+  TEST(ReadGrepArgumentsTest, ExtendedRegexFlag)
+  {
+    const char *argv[] = {"program", "-E", "a+b", "path"};
+    auto result = grep::read_grep_arguments(4, const_cast<char **>(argv));
+
+    EXPECT_TRUE(result.extendedRegex);
+    EXPECT_EQ(result.patterns, std::vector<std::string>{"a+b"});
+  }
+
+  TEST(ReadGrepArgumentsTest, IgnoreCaseFlag)
+  {
+    const char *argv[] = {"program", "-i", "-e", "a", "--ignore-case", "path"};
+    auto result = grep::read_grep_arguments(6, const_cast<char **>(argv));
+
+    EXPECT_TRUE(result.ignoreCase);
+    EXPECT_EQ(result.patterns, std::vector<std::string>{"a"});
+  }
+
+  TEST(ReadGrepArgumentsTest, BinaryFileOptions)
+  {
+    auto parse = [](std::vector<const char *> args)
+    {
+      args.insert(args.begin(), "program");
+      args.push_back("pattern");
+      args.push_back("path");
+      return grep::read_grep_arguments(static_cast<int>(args.size()), const_cast<char **>(args.data())).binary;
+    };
+
+    EXPECT_EQ(parse({}), grep::BinaryPolicy::Report);
+    EXPECT_EQ(parse({"-I"}), grep::BinaryPolicy::Skip);
+    EXPECT_EQ(parse({"-a"}), grep::BinaryPolicy::Text);
+    EXPECT_EQ(parse({"--binary-files=without-match"}), grep::BinaryPolicy::Skip);
+    EXPECT_EQ(parse({"--binary-files=text"}), grep::BinaryPolicy::Text);
+  }
+
+  TEST(ReadGrepArgumentsTest, OutputModes)
+  {
+    auto parse = [](std::vector<const char *> args)
+    {
+      args.insert(args.begin(), "program");
+      args.push_back("pattern");
+      args.push_back("path");
+      return grep::read_grep_arguments(static_cast<int>(args.size()), const_cast<char **>(args.data()));
+    };
+
+    EXPECT_EQ(parse({}).mode, grep::OutputMode::Lines);
+    EXPECT_EQ(parse({"-l"}).mode, grep::OutputMode::FilesWithMatches);
+    EXPECT_EQ(parse({"-c"}).mode, grep::OutputMode::Count);
+    EXPECT_EQ(parse({"-q"}).mode, grep::OutputMode::Quiet);
+    EXPECT_EQ(parse({}).maxCount, SIZE_MAX);
+    EXPECT_EQ(parse({"-m", "3"}).maxCount, 3u);
+    EXPECT_EQ(parse({"--max-count=5"}).maxCount, 5u);
+    EXPECT_EQ(parse({"-m", "3"}).path, "path");
+    EXPECT_FALSE(parse({}).lineNumbers);
+    EXPECT_TRUE(parse({"-n"}).lineNumbers);
+    EXPECT_TRUE(parse({"--line-number"}).lineNumbers);
+    EXPECT_FALSE(parse({"-n"}).byteOffsets);
+    EXPECT_TRUE(parse({"-b"}).byteOffsets);
+    EXPECT_TRUE(parse({"--byte-offset"}).byteOffsets);
+    EXPECT_EQ(parse({}).sort, grep::SortOrder::None);
+    EXPECT_EQ(parse({"--sort=path"}).sort, grep::SortOrder::Path);
+    EXPECT_EQ(parse({"--sort=path", "--sort=none"}).sort, grep::SortOrder::None);
+    EXPECT_EQ(parse({}).format, grep::OutputFormat::Text);
+    EXPECT_EQ(parse({"--json"}).format, grep::OutputFormat::Json);
+    EXPECT_EQ(parse({"--binary-output"}).format, grep::OutputFormat::Binary);
+  }
+
+  TEST(ReadGrepArgumentsTest, InvalidNumbers)
+  {
+    auto parse = [](std::vector<const char *> args)
+    {
+      args.insert(args.begin(), "program");
+      args.push_back("pattern");
+      args.push_back("path");
+      return grep::read_grep_arguments(static_cast<int>(args.size()), const_cast<char **>(args.data()));
+    };
+
+    EXPECT_EQ(parse({"--split-size=4096", "--result-budget=1000", "--cache-size=10", "-m", "0", "-A", "2", "-j", "3", "--io-depth=8"}).splitBytes, 4096u);
+    for (std::vector<const char *> args : {std::vector<const char *>{"--split-size=0"}, {"--split-size=abc"}, {"--split-size="},
+                                           {"--result-budget=12x"}, {"--cache-size=-1"}, {"-m", "many"}, {"--max-count=1.5"},
+                                           {"-A", "-1"}, {"--context=two"}, {"-j", "x"}, {"--io-depth=99999999999"},
+                                           {"--split-size=99999999999999999999999"}})
+    {
+      EXPECT_TRUE(parse(args).patterns.empty()) << args.front();
+    }
+
+    const char *argv[] = {"program", "--split-size=0", "pattern", "path"};
+    EXPECT_EQ(grep::grep(4, const_cast<char **>(argv)), 2);
+  }
+
+  TEST(ReadGrepArgumentsTest, ContextLines)
+  {
+    auto parse = [](std::vector<const char *> args)
+    {
+      args.insert(args.begin(), "program");
+      args.push_back("pattern");
+      args.push_back("path");
+      return grep::read_grep_arguments(static_cast<int>(args.size()), const_cast<char **>(args.data()));
+    };
+
+    EXPECT_EQ(parse({}).beforeContext, 0u);
+    EXPECT_EQ(parse({}).afterContext, 0u);
+    EXPECT_EQ(parse({"-A", "2"}).afterContext, 2u);
+    EXPECT_EQ(parse({"-A", "2"}).beforeContext, 0u);
+    EXPECT_EQ(parse({"--before-context=3"}).beforeContext, 3u);
+    EXPECT_EQ(parse({"-C", "4"}).beforeContext, 4u);
+    EXPECT_EQ(parse({"--context=4"}).afterContext, 4u);
+    // -A and -B win over -C in either order
+    EXPECT_EQ(parse({"-B", "1", "-C", "4"}).beforeContext, 1u);
+    EXPECT_EQ(parse({"-C", "4", "--after-context=1"}).afterContext, 1u);
+    EXPECT_EQ(parse({"-C", "4", "--after-context=1"}).beforeContext, 4u);
+    // Asking for context, even none, separates groups
+    EXPECT_FALSE(parse({}).contextGroups);
+    EXPECT_TRUE(parse({"-C", "0"}).contextGroups);
+    EXPECT_TRUE(parse({"-A", "0"}).contextGroups);
+  }
+
+  TEST(ReadGrepArgumentsTest, PatternFile)
+  {
+    TempFile patterns("grep_tests_patterns.txt", "alpha\n\nbeta\n");
+    std::string patternFile = patterns.path().string();
+    const char *argv[] = {"program", "-f", patternFile.c_str(), "-e", "gamma", "path"};
+    int argc = 6;
+
+    auto result = grep::read_grep_arguments(argc, const_cast<char **>(argv));
+
+    EXPECT_EQ(result.patterns, (std::vector<std::string>{"alpha", "", "beta", "gamma"})); // the empty line matches every line
+    EXPECT_EQ(result.path, "path");
+  }
+
+  TEST(MatcherTest, EnginesFindLeftmostLongest)
+  {
+    const std::vector<std::string> patterns = {"bcd", "abcde", "ab", "", "x\ny", "cd", "e", "ab"};
+    const std::string text = "zzabcdezz bcd cdab e";
+
+    for (auto kind : {grep::MatcherKind::PackedCompare, grep::MatcherKind::AhoCorasick})
+    {
+      auto matcher = grep::make_matcher(patterns, kind);
+      std::vector<std::tuple<size_t, size_t, size_t>> found;
+      const char *from = text.data();
+      const char *end = text.data() + text.size();
+      grep::MatchSpan match;
+      while (from < end && matcher->find(from, end, match))
+      {
+        found.emplace_back(match.begin - text.data(), match.end - text.data(), match.pattern);
+        from = match.end;
+      }
+
+      std::vector<std::tuple<size_t, size_t, size_t>> expected = {
+          {2, 7, 1}, {10, 13, 0}, {14, 16, 5}, {16, 18, 2}, {19, 20, 6}};
+      EXPECT_EQ(found, expected);
+    }
+  }
+
+  // All matches of a matcher in text as (begin, end, pattern), continuing like search_in_file after every match.
+  std::vector<std::tuple<size_t, size_t, size_t>> find_all(const grep::Matcher &matcher, const std::string &text)
+  {
+    std::vector<std::tuple<size_t, size_t, size_t>> found;
+    const char *end = text.data() + text.size();
+    const char *from = text.data();
+    grep::MatchSpan match;
+    while (from < end && matcher.find(from, end, match))
+    {
+      const char *lineBegin = static_cast<const char *>(memrchr(from, '\n', match.begin - from));
+      lineBegin = lineBegin ? lineBegin + 1 : from;
+      const char *lineEnd = static_cast<const char *>(memchr(match.begin, '\n', end - match.begin));
+      lineEnd = lineEnd ? lineEnd : end;
+      const char *next = nullptr;
+      do
+      {
+        found.emplace_back(match.begin - text.data(), match.end - text.data(), match.pattern);
+        next = match.end != match.begin ? match.end : match.end + 1;
+      } while (next < lineEnd && matcher.find_in_line(lineBegin, lineEnd, next, match));
+      from = lineEnd + 1;
+    }
+    return found;
+  }
+
+  TEST(MatcherTest, EmptyPatternMatchesEveryLine)
+  {
+    const std::string text = "zz\nab cab\n\nq";
+    for (auto kind : {grep::MatcherKind::Literal, grep::MatcherKind::PackedCompare, grep::MatcherKind::AhoCorasick})
+    {
+      auto matcher = grep::make_matcher({"", "ab"}, kind);
+      // Lines without another match get an empty one at their start, the others keep their matches.
+      EXPECT_EQ(find_all(*matcher, text), (std::vector<std::tuple<size_t, size_t, size_t>>{{0, 0, 0}, {3, 5, 1}, {7, 9, 1}, {10, 10, 0}, {11, 11, 0}}));
+    }
+
+    grep::MatchSpan match;
+    const std::string line = "zz";
+    EXPECT_TRUE(grep::make_matcher({""}, grep::MatcherKind::Regex)->find(line.data(), line.data() + line.size(), match));
+    EXPECT_TRUE(grep::make_matcher({"", "é"}, grep::MatcherKind::Auto, true)->find(line.data(), line.data() + line.size(), match));
+    EXPECT_FALSE(grep::make_matcher({""})->find(line.data(), line.data(), match));
+  }
+
+  TEST(MatcherTest, IgnoreCase)
+  {
+    using Spans = std::vector<std::tuple<size_t, size_t, size_t>>;
+    const std::string text = "Error ERROR error eRRoR warn[1] WARN[2]";
+    for (auto kind : {grep::MatcherKind::Literal, grep::MatcherKind::PackedCompare, grep::MatcherKind::AhoCorasick})
+    {
+      auto matcher = grep::make_matcher({"ERRor"}, kind, true);
+      EXPECT_EQ(find_all(*matcher, text), (Spans{{0, 5, 0}, {6, 11, 0}, {12, 17, 0}, {18, 23, 0}}));
+    }
+    for (auto kind : {grep::MatcherKind::PackedCompare, grep::MatcherKind::AhoCorasick})
+    {
+      auto matcher = grep::make_matcher({"rOR", "Warn[", "]"}, kind, true);
+      EXPECT_EQ(find_all(*matcher, text), (Spans{{2, 5, 0}, {8, 11, 0}, {14, 17, 0}, {20, 23, 0}, {24, 29, 1}, {30, 31, 2}, {32, 37, 1}, {38, 39, 2}}));
+    }
+
+    auto regex = grep::make_matcher({"e[r]+o[^x]", "w.rn\\[[0-9]\\]"}, grep::MatcherKind::Regex, true);
+    EXPECT_EQ(find_all(*regex, text), (Spans{{0, 5, 0}, {6, 11, 0}, {12, 17, 0}, {18, 23, 0}, {24, 31, 1}, {32, 39, 1}}));
+    // [^a] leaves out both cases.
+    EXPECT_TRUE(find_all(*grep::make_matcher({"x[^a]"}, grep::MatcherKind::Regex, true), "xA xa").empty());
+
+    // Letters beyond ASCII match their simple case fold variants, spans stay byte offsets into the text.
+    const std::string unicode = "CAFÉ café Σοφία ΣΟΦΊΑ straße STRASSE";
+    EXPECT_EQ(find_all(*grep::make_matcher({"Café"}, grep::MatcherKind::Auto, true), unicode), (Spans{{0, 5, 0}, {6, 11, 0}}));
+    EXPECT_EQ(find_all(*grep::make_matcher({"σοφία"}, grep::MatcherKind::Auto, true), unicode), (Spans{{12, 22, 0}, {23, 33, 0}}));
+    EXPECT_EQ(find_all(*grep::make_matcher({"CAF(É|X)", "ΣΟΦ"}, grep::MatcherKind::Regex, true), unicode),
+              (Spans{{0, 5, 0}, {6, 11, 0}, {12, 18, 1}, {23, 29, 1}}));
+    EXPECT_TRUE(find_all(*grep::make_matcher({"Café"}), unicode).empty());
+    EXPECT_EQ(grep::case_variants(U'k'), (std::vector<char32_t>{U'K', U'k', 0x212A}));
+  }
+
+  TEST(RegexMatcherTest, FindsLeftmostLongestSpans)
+  {
+    using Spans = std::vector<std::tuple<size_t, size_t, size_t>>;
+    auto spans = [](const std::vector<std::string> &patterns, const std::string &text)
+    { return find_all(*grep::make_matcher(patterns, grep::MatcherKind::Regex), text); };
+
+    EXPECT_EQ(spans({"ab+c"}, "ac abc abbbc"), (Spans{{3, 6, 0}, {7, 12, 0}}));
+    EXPECT_EQ(spans({"a|ab|abc"}, "xabcx"), (Spans{{1, 4, 0}}));
+    EXPECT_EQ(spans({"[0-9]{2,3}"}, "1 12 12345"), (Spans{{2, 4, 0}, {5, 8, 0}, {8, 10, 0}}));
+    EXPECT_EQ(spans({"^foo", "bar$"}, "foo bar\nbar foo"), (Spans{{0, 3, 0}, {4, 7, 1}}));
+    EXPECT_EQ(spans({"colou?r"}, "color colour"), (Spans{{0, 5, 0}, {6, 12, 0}}));
+    EXPECT_EQ(spans({"x*"}, "ab\nxx"), (Spans{{0, 0, 0}, {1, 1, 0}, {3, 5, 0}}));
+    EXPECT_EQ(spans({"^$"}, "a\n\nb"), (Spans{{2, 2, 0}}));
+    EXPECT_EQ(spans({"[[:digit:]]+\\.[^ ]*", "\\w+"}, "v 1.2.3 ok"), (Spans{{0, 1, 1}, {2, 7, 0}, {8, 10, 1}}));
+    EXPECT_EQ(spans({"a{,2}b", "(ab|cd)*e"}, "aaab cdabe"), (Spans{{1, 4, 0}, {5, 10, 1}}));
+    EXPECT_EQ(spans({"*a)"}, "x*a)"), (Spans{{1, 4, 0}}));
+  }
+
+  TEST(RegexMatcherTest, AgreesWithStdRegexOnWhichLinesMatch)
+  {
+    const std::vector<std::string> patterns = {"a(b|c)*d", "^[ab]+$", "(ab|ba){2,}", "c.?a", "[^abc]", "b{3}|^c", "(a|)(b|c)$"};
+    std::mt19937 random(42);
+    std::string text;
+    for (int line = 0; line < 2000; ++line)
+    {
+      const size_t length = random() % 12;
+      for (size_t i = 0; i < length; ++i)
+      {
+        text.push_back("abcd"[random() % 4]);
+      }
+      text.push_back('\n');
+    }
+
+    for (const auto &pattern : patterns)
+    {
+      const std::regex expected(pattern, std::regex::extended);
+      auto matcher = grep::make_matcher({pattern}, grep::MatcherKind::Regex);
+      std::istringstream lines(text);
+      std::string line;
+      while (std::getline(lines, line))
+      {
+        grep::MatchSpan match;
+        EXPECT_EQ(matcher->find(line.data(), line.data() + line.size(), match), std::regex_search(line, expected))
+            << pattern << " on " << line;
+      }
+    }
+  }
+
+  TEST(RegexMatcherTest, KeepsMatchingAcrossFlushesOfItsStateCache)
+  {
+    // 2^14 DFA states for the first alternative, the second one adds byte classes and so shrinks the cache.
+    const std::string pattern = "a[ab]{13}c|0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    const std::regex expected(pattern, std::regex::extended);
+    auto matcher = grep::make_matcher({pattern}, grep::MatcherKind::Regex);
+    std::mt19937 random(7);
+    for (int line = 0; line < 2000; ++line)
+    {
+      std::string text;
+      for (int i = 0; i < 40; ++i)
+      {
+        text.push_back(random() % 16 == 0 ? 'c' : "ab"[random() % 2]);
+      }
+      grep::MatchSpan match;
+      ASSERT_EQ(matcher->find(text.data(), text.data() + text.size(), match), std::regex_search(text, expected)) << text;
+    }
+  }
+
+  TEST(RegexMatcherTest, ExtractsRequiredLiterals)
+  {
+    EXPECT_EQ(grep::required_literals("^error: [0-9]+"), std::vector<std::string>{"error: "});
+    EXPECT_EQ(grep::required_literals("colou?r"), (std::vector<std::string>{"color", "colour"}));
+    EXPECT_EQ(grep::required_literals("(foo|bar)[0-9]*baz"), std::vector<std::string>{"baz"});
+    EXPECT_EQ(grep::required_literals("warn.*|fail"), (std::vector<std::string>{"fail", "warn"}));
+    EXPECT_TRUE(grep::required_literals("a*|b").empty());
+    EXPECT_TRUE(grep::required_literals("[a-z]+").empty());
+  }
+
+  TEST(RegexMatcherTest, RejectsInvalidPatterns)
+  {
+    for (const char *pattern : {"(ab", "[ab", "a{3,1}", "(a)\\1", "\\bword", "x\\"})
+    {
+      EXPECT_THROW(grep::make_matcher({pattern}, grep::MatcherKind::Regex), std::invalid_argument) << pattern;
+    }
+  }
+
+  TEST(SearchInFileTest, RegexHighlightsAndSkipsEmptyMatches)
+  {
+    TempFile file("grep_tests_regex.txt", "id=42 id=7\nnone\n\nid=\n");
+    auto matcher = grep::make_matcher({"id=[0-9]*"}, grep::MatcherKind::Regex);
+
+    grep::Result::LineMatchResults line_match_results = {
+        {"id=42 id=7", {grep::MatchPosition(0, 4), grep::MatchPosition(6, 9)}},
+        {"id=", {grep::MatchPosition(0, 2)}}};
+    EXPECT_TRUE(grep::search_in_file(*matcher, file.path()) == grep::Result(file.path().string(), line_match_results));
+
+    auto emptyMatcher = grep::make_matcher({"z*"}, grep::MatcherKind::Regex);
+    const grep::Result all = grep::search_in_file(*emptyMatcher, file.path());
+    ASSERT_EQ(all.line_count(), 4u);
+    EXPECT_EQ(all.line_text(2), "");
+    EXPECT_EQ(all.line_matches(0).size(), 0u);
+  }
+
+  TEST(SearchInFileTest, ReportsMatchingPattern)
+  {
+    TempFile file("grep_tests_multi.txt", "one two\nnone\nthree one\n");
+
+    grep::Result::LineMatchResults line_match_results = {
+        {"one two", {grep::MatchPosition(0, 2, 0), grep::MatchPosition(4, 6, 1)}},
+        {"none", {grep::MatchPosition(1, 3, 0)}},
+        {"three one", {grep::MatchPosition(6, 8, 0)}}};
+    grep::Result expectedResult(file.path().string(), std::move(line_match_results));
+
+    EXPECT_TRUE(expectedResult == grep::search_in_file(*grep::make_matcher({"one", "two"}), file.path()));
+  }
+
+  TEST(WorkStealingSchedulerTest, RunsEveryTaskOnce)
+  {
+    constexpr unsigned workers = 4;
+    constexpr int externalTasks = 1000;
+    grep::WorkStealingScheduler<int> scheduler(workers);
+    std::vector<std::atomic<int>> seen(2 * externalTasks);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < workers; ++i)
+    {
+      threads.emplace_back([&, i]
+                           {
+                             int task;
+                             while (scheduler.pop(i, task))
+                             {
+                               ++seen[task];
+                               // Tasks pushed by workers have to be finished before pop returns false.
+                               if (task < externalTasks)
+                               {
+                                 scheduler.push(i, task + externalTasks);
+                               }
+                             }
+                           });
+    }
+
+    std::vector<int> batch;
+    for (int task = 0; task < externalTasks; ++task)
+    {
+      batch.push_back(task);
+      if (batch.size() == 7)
+      {
+        scheduler.push_batch(std::move(batch));
+        batch.clear();
+      }
+    }
+    scheduler.push_batch(std::move(batch));
+    scheduler.close();
+
+    for (auto &thread : threads)
+    {
+      thread.join();
+    }
+    for (const auto &count : seen)
+    {
+      EXPECT_EQ(count, 1);
+    }
+  }
+
+  TEST(WorkStealingSchedulerTest, SpreadsALargeBatchOverSleepingWorkers)
+  {
+    constexpr unsigned workers = 8;
+    constexpr int tasks = 400;
+    grep::WorkStealingScheduler<int> scheduler(workers);
+    std::vector<std::atomic<int>> taken(workers);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < workers; ++i)
+    {
+      threads.emplace_back([&, i]
+                           {
+                             int task;
+                             while (scheduler.pop(i, task))
+                             {
+                               // Task -1 stands for a wide directory, its listing is one batch.
+                               if (task < 0)
+                               {
+                                 std::vector<int> batch(tasks);
+                                 std::iota(batch.begin(), batch.end(), 0);
+                                 scheduler.push_batch(i, std::move(batch));
+                                 continue;
+                               }
+                               ++taken[i];
+                               std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                             }
+                           });
+    }
+    // Every worker is asleep by the time the batch shows up.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    scheduler.push_batch({-1});
+    // Closing wakes everyone, so only once the batch is done.
+    auto total = [&]
+    {
+      int sum = 0;
+      for (const auto &count : taken)
+      {
+        sum += count;
+      }
+      return sum;
+    };
+    while (total() < tasks)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    scheduler.close();
+    for (auto &thread : threads)
+    {
+      thread.join();
+    }
+
+    const auto busy = std::count_if(taken.begin(), taken.end(), [](const std::atomic<int> &count)
+                                    { return count > 0; });
+    EXPECT_GT(busy, static_cast<std::ptrdiff_t>(workers / 2));
+  }
+
+  TEST(GrepTest, SingleWorker)
+  {
+    std::stringstream outputBuffer;
+
+    grep::GrepOptions options;
+    options.patterns = {"iii"};
+    options.path = "./test_assets/";
+    options.threads = 1;
+    grep::grep(std::move(options), outputBuffer);
+
+    // Colors are only used for terminals unless asked for.
+    EXPECT_EQ(outputBuffer.str(), "./test_assets/test_directory/subdir/test.txt: iiimatchiii\n");
+  }
+
   // Helper function to split string by lines
   std::vector<std::string> splitLines(const std::string &output)
   {
@@ -124,6 +910,1494 @@ namespace grep_tests
     return lines;
   }
 
+  TEST(TrigramIndexTest, NarrowsCandidatesAndUpdatesIncrementally)
+  {
+    TempDir dir("grep_tests_index");
+    dir.write("a.txt", "Hello World\n");
+    dir.write("sub/b.txt", "goodbye\nworld peace\n");
+    dir.write("c.bin", std::string("world\0", 6));
+    dir.write("e.zst", "\x28\xb5\x2f\xfd raw bytes"); // searched decoded, its raw trigrams mean nothing
+
+    grep::IndexUpdate update = grep::update_index(dir.path(), 2);
+    EXPECT_EQ(update.files, 4u);
+    EXPECT_EQ(update.reindexed, 4u);
+
+    auto index = grep::TrigramIndex::open(dir.path() / grep::IndexFileName);
+    ASSERT_TRUE(index);
+    using Paths = std::vector<std::string>;
+    // Trigrams are case folded and never span lines, binary and compressed files are always candidates.
+    EXPECT_EQ(index->candidates({{"world"}}), (Paths{"a.txt", "c.bin", "e.zst", "sub/b.txt"}));
+    EXPECT_EQ(index->candidates({{"hello"}}), (Paths{"a.txt", "c.bin", "e.zst"}));
+    EXPECT_EQ(index->candidates({{"bye\nworld"}}), (Paths{"c.bin", "e.zst", "sub/b.txt"}));
+    EXPECT_EQ(index->candidates({{"peace", "Hello"}}), (Paths{"a.txt", "c.bin", "e.zst", "sub/b.txt"}));
+    EXPECT_EQ(index->candidates({{"absent"}}), (Paths{"c.bin", "e.zst"}));
+    EXPECT_EQ(index->candidates({{"ab"}}).size(), 4u);
+    EXPECT_EQ(index->candidates({{}}).size(), 4u);
+    index.reset();
+
+    dir.write("sub/b.txt", "changed\n");
+    dir.write("d.txt", "new file\n");
+    fs::remove(dir.path() / "a.txt");
+    update = grep::update_index(dir.path(), 1);
+    EXPECT_EQ(update.files, 4u);
+    EXPECT_EQ(update.reindexed, 2u);
+    EXPECT_EQ(update.removed, 1u);
+
+    index = grep::TrigramIndex::open(dir.path() / grep::IndexFileName);
+    ASSERT_TRUE(index);
+    EXPECT_EQ(index->candidates({{"changed"}, {"new"}}), (Paths{"c.bin", "d.txt", "e.zst", "sub/b.txt"}));
+    EXPECT_EQ(index->candidates({{"peace"}}), (Paths{"c.bin", "e.zst"}));
+  }
+
+  TEST(TrigramIndexTest, ChangedFilesListsOnlyDirectoriesWithANewMtime)
+  {
+    TempDir dir("grep_tests_index_changed");
+    dir.write("a.txt", "one\n");
+    dir.write("kept/b.txt", "two\n");
+    dir.write("grown/c.txt", "three\n");
+    const auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    for (const char *path : {"a.txt", "kept", "grown"})
+    {
+      fs::last_write_time(dir.path() / path, past);
+    }
+    grep::update_index(dir.path(), 1);
+
+    auto index = grep::TrigramIndex::open(dir.path() / grep::IndexFileName);
+    ASSERT_TRUE(index);
+    using Paths = std::vector<std::string>;
+    EXPECT_TRUE(index->changed_files(dir.path(), grep::PathFilter()).empty());
+
+    dir.write("a.txt", "ONE\n"); // same size, found by its mtime
+    dir.write("root.txt", "new\n");
+    dir.write("grown/new/d.txt", "new\n");
+    dir.write("kept/unseen.txt", "new\n");
+    fs::last_write_time(dir.path() / "kept", past); // as if unchanged, so it is not listed
+    EXPECT_EQ(index->changed_files(dir.path(), grep::PathFilter()), (Paths{"a.txt", "grown/new/d.txt", "root.txt"}));
+
+    grep::GrepOptions options;
+    options.excludeDirectoryGlobs = {"grown"};
+    EXPECT_EQ(index->changed_files(dir.path(), grep::PathFilter(options)), (Paths{"a.txt", "root.txt"}));
+  }
+
+  TEST(GrepTest, IndexedSearchMatchesFullSearch)
+  {
+    TempDir dir("grep_tests_indexed_search");
+    for (int i = 0; i < 20; ++i)
+    {
+      dir.write("d" + std::to_string(i % 3) + "/f" + std::to_string(i) + ".txt", i % 4 == 0 ? "x needle 42\n" : "hay\n");
+    }
+
+    auto run = [&](const std::string &pattern, bool regex, bool useIndex)
+    {
+      std::stringstream out;
+      grep::GrepOptions options;
+      options.patterns = {pattern};
+      options.path = dir.path().string();
+      options.extendedRegex = regex;
+      options.useIndex = useIndex;
+      grep::grep(std::move(options), out);
+      std::vector<std::string> lines = splitLines(out.str());
+      std::sort(lines.begin(), lines.end());
+      return lines;
+    };
+
+    const std::string root = dir.path().string();
+    const char *missing[] = {"program", "--build-index", "grep_tests_no_such_directory"};
+    EXPECT_EQ(grep::grep(3, const_cast<char **>(missing)), 2);
+    const char *build[] = {"program", "--build-index", root.c_str()};
+    EXPECT_EQ(grep::grep(3, const_cast<char **>(build)), 0);
+    EXPECT_EQ(run("needle", false, true), run("needle", false, false));
+    EXPECT_EQ(run("need+le [0-9]+", true, true), run("need+le [0-9]+", true, false));
+    EXPECT_EQ(run("needle", false, false).size(), 5u);
+    // The index file itself is never searched.
+    EXPECT_TRUE(run("GREPIDX", false, false).empty());
+
+    // Files changed or added after the index was built are searched anyway.
+    dir.write("d1/f1.txt", "changed needle\n");
+    dir.write("d3/added.txt", "added needle\n");
+    EXPECT_EQ(run("needle", false, true), run("needle", false, false));
+    EXPECT_EQ(run("needle", false, true).size(), 7u);
+  }
+
+  TEST(ReadGrepArgumentsTest, PathFilters)
+  {
+    const char *argv[] = {"program", "--include=*.cpp", "--include=*.h", "--exclude=gen_*", "--exclude-dir=third_party", "--no-ignore", "x", "."};
+    auto result = grep::read_grep_arguments(8, const_cast<char **>(argv));
+    EXPECT_EQ(result.includeGlobs, (std::vector<std::string>{"*.cpp", "*.h"}));
+    EXPECT_EQ(result.excludeGlobs, (std::vector<std::string>{"gen_*"}));
+    EXPECT_EQ(result.excludeDirectoryGlobs, (std::vector<std::string>{"third_party"}));
+    EXPECT_FALSE(result.ignoreFiles);
+    EXPECT_EQ(result.patterns, (std::vector<std::string>{"x"}));
+  }
+
+  TEST(ReadGrepArgumentsTest, BuildIndex)
+  {
+    const char *argv[] = {"program", "--build-index", "some/dir"};
+    auto result = grep::read_grep_arguments(3, const_cast<char **>(argv));
+    EXPECT_EQ(result.buildIndex, "some/dir");
+    EXPECT_TRUE(result.patterns.empty());
+  }
+
+  TEST(ResultCacheTest, AnswersUnchangedFilesAndEvicts)
+  {
+    TempDir dir("grep_tests_result_cache");
+    dir.write("a.txt", "x\n");
+    dir.write("new.txt", "y\n");
+    const fs::path a = dir.path() / "a.txt";
+    fs::last_write_time(a, fs::file_time_type::clock::now() - std::chrono::hours(1));
+    const fs::path cacheDir = dir.path() / "cache";
+
+    grep::FileIdentity identity, fresh;
+    ASSERT_TRUE(grep::file_identity(a, identity));
+    ASSERT_TRUE(grep::file_identity(dir.path() / "new.txt", fresh));
+    grep::Result result;
+    result.binary = false;
+    result.add_line("some line");
+    result.add_match(grep::MatchPosition(0, 3, 1));
+    {
+      grep::ResultCache cache(cacheDir, "sig", 1 << 20, 2);
+      grep::Result hit;
+      EXPECT_FALSE(cache.lookup(0, identity, hit));
+      cache.store(1, identity, result);
+      cache.store(0, fresh, result); // changed within the last second, not kept
+      cache.save();
+
+      // What was saved answers the next search of the same cache, and is not written again by the next save.
+      auto cache_file = [&]
+      {
+        for (const auto &entry : fs::directory_iterator(cacheDir))
+        {
+          if (entry.path().extension() == ".cache")
+          {
+            std::ifstream stream(entry.path(), std::ios::binary);
+            return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+          }
+        }
+        return std::string();
+      };
+      const std::string saved = cache_file();
+      ASSERT_TRUE(cache.lookup(1, identity, hit));
+      EXPECT_EQ(hit, result);
+      cache.save();
+      EXPECT_EQ(cache_file(), saved);
+    }
+    {
+      grep::ResultCache cache(cacheDir, "sig", 1 << 20, 1);
+      grep::Result hit;
+      ASSERT_TRUE(cache.lookup(0, identity, hit));
+      EXPECT_EQ(hit, result);
+      EXPECT_FALSE(cache.lookup(0, fresh, hit));
+
+      grep::FileIdentity changed = identity;
+      changed.size += 1;
+      EXPECT_FALSE(cache.lookup(0, changed, hit));
+    }
+    {
+      grep::ResultCache other(cacheDir, "other signature", 1 << 20, 1);
+      grep::Result hit;
+      EXPECT_FALSE(other.lookup(0, identity, hit));
+    }
+
+    // A capacity below one entry keeps none of them, and drops the files of other signatures.
+    {
+      grep::ResultCache cache(cacheDir, "tiny", 16, 1);
+      cache.store(0, identity, result);
+      cache.save();
+    }
+    grep::ResultCache cache(cacheDir, "sig", 1 << 20, 1);
+    grep::Result hit;
+    EXPECT_FALSE(cache.lookup(0, identity, hit));
+  }
+
+  TEST(ResultCacheTest, JudgesRecentChangesAgainstEachSearch)
+  {
+    TempDir dir("grep_tests_result_cache_searches");
+    grep::FileIdentity identity;
+    identity.inode = 1;
+    identity.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         (std::chrono::system_clock::now() - std::chrono::milliseconds(900)).time_since_epoch())
+                         .count();
+    grep::Result result;
+    result.binary = false;
+    result.add_line("some line");
+
+    grep::ResultCache cache(dir.path(), "sig", 1 << 20, 1);
+    grep::Result hit;
+    cache.begin_search();
+    cache.store(0, identity, result); // changed within the second before the search began
+    cache.save();
+    EXPECT_FALSE(cache.lookup(0, identity, hit));
+
+    // The cache outlives the search, the next one no longer counts the change as recent.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    cache.begin_search();
+    cache.store(0, identity, result);
+    cache.save();
+    EXPECT_TRUE(cache.lookup(0, identity, hit));
+  }
+
+  TEST(GrepTest, CachedSearchMatchesFullSearch)
+  {
+    TempDir dir("grep_tests_cached_search");
+    for (int i = 0; i < 20; ++i)
+    {
+      dir.write("d" + std::to_string(i % 3) + "/f" + std::to_string(i) + ".txt", i % 4 == 0 ? "x needle 42\n" : "hay\n");
+    }
+    dir.write("bin.dat", std::string("needle\0", 7));
+    for (const auto &entry : fs::recursive_directory_iterator(dir.path()))
+    {
+      fs::last_write_time(entry.path(), fs::file_time_type::clock::now() - std::chrono::hours(1));
+    }
+
+    auto run = [&](bool cache)
+    {
+      std::stringstream out;
+      grep::GrepOptions options;
+      options.patterns = {"needle"};
+      options.path = dir.path().string();
+      options.color = grep::ColorMode::Always;
+      if (cache)
+      {
+        options.cacheDirectory = (fs::temp_directory_path() / "grep_tests_cached_search_cache").string();
+      }
+      grep::grep(std::move(options), out);
+      std::vector<std::string> lines = splitLines(out.str());
+      std::sort(lines.begin(), lines.end());
+      return lines;
+    };
+
+    fs::remove_all(fs::temp_directory_path() / "grep_tests_cached_search_cache");
+    const auto expected = run(false);
+    EXPECT_EQ(expected.size(), 6u);
+    EXPECT_EQ(run(true), expected);
+    EXPECT_EQ(run(true), expected);
+
+    // Rewritten files get a new mtime and size and are searched again.
+    dir.write("d0/f0.txt", "no longer\n");
+    const auto changed = run(true);
+    EXPECT_EQ(changed.size(), 5u);
+    EXPECT_EQ(run(true), changed);
+    fs::remove_all(fs::temp_directory_path() / "grep_tests_cached_search_cache");
+  }
+
+  TEST(FileReaderTest, DeliversEveryFileWithBothBackends)
+  {
+    TempDir dir("grep_tests_file_reader");
+    for (int i = 0; i < 30; ++i)
+    {
+      dir.write("f" + std::to_string(i) + ".txt", std::string(i * 100, 'a' + i % 26));
+    }
+    dir.write("large.txt", std::string(5000, 'x'));
+
+    for (const bool ioUring : {true, false})
+    {
+      std::mutex mutex;
+      std::map<std::string, std::string> delivered;
+      {
+        grep::FileReader reader(4, 4096, [&](fs::path path, std::shared_ptr<const grep::FileBuffer> file)
+                                {
+                                  std::lock_guard<std::mutex> lock(mutex);
+                                  delivered[path.filename().string()] = file ? std::string(file->view()) : "<unread>"; },
+                                ioUring);
+        for (int i = 0; i < 30; ++i)
+        {
+          reader.submit(dir.path() / ("f" + std::to_string(i) + ".txt"));
+        }
+        reader.submit(dir.path() / "large.txt");
+        reader.submit(dir.path() / "missing.txt");
+      }
+
+      ASSERT_EQ(delivered.size(), 32u);
+      for (int i = 0; i < 30; ++i)
+      {
+        EXPECT_EQ(delivered["f" + std::to_string(i) + ".txt"], std::string(i * 100, 'a' + i % 26));
+      }
+      EXPECT_EQ(delivered["large.txt"], "<unread>");
+      EXPECT_EQ(delivered["missing.txt"], "<unread>");
+    }
+  }
+
+  TEST(GrepTest, ReadAheadMatchesMappedSearch)
+  {
+    TempDir dir("grep_tests_read_ahead");
+    for (int i = 0; i < 40; ++i)
+    {
+      dir.write("d" + std::to_string(i % 5) + "/f" + std::to_string(i) + ".txt", i % 3 == 0 ? "x needle\nhay\nneedle y\n" : "hay\n");
+    }
+    dir.write("large.txt", std::string(5 << 20, 'z') + "\nneedle\n");
+
+    auto run = [&](unsigned ioDepth)
+    {
+      std::stringstream out;
+      grep::GrepOptions options;
+      options.patterns = {"needle"};
+      options.path = dir.path().string();
+      options.threads = 3;
+      options.ioDepth = ioDepth;
+      grep::grep(std::move(options), out);
+      std::vector<std::string> lines = splitLines(out.str());
+      std::sort(lines.begin(), lines.end());
+      return lines;
+    };
+
+    const auto expected = run(0);
+    EXPECT_EQ(expected.size(), 29u);
+    EXPECT_EQ(run(1), expected);
+    EXPECT_EQ(run(8), expected);
+  }
+
+  TEST(SearcherTest, ReusesWorkersAcrossSearchesAndSinks)
+  {
+    TempDir dir("grep_tests_searcher");
+    for (int i = 0; i < 30; ++i)
+    {
+      dir.write("d" + std::to_string(i % 3) + "/f" + std::to_string(i) + ".txt", i % 2 == 0 ? "x needle\nhay\nneedle needle\n" : "hay\n");
+    }
+    dir.write("bin.dat", std::string("needle\0", 7));
+
+    grep::GrepOptions options;
+    options.patterns = {"needle"};
+    options.threads = 3;
+    options.resultBudget = 512;
+    grep::Searcher searcher(options);
+
+    // file: line [start,end]... for every match, sorted, so the sinks can be compared.
+    auto describe = [](const grep::Match &match)
+    {
+      std::string text = std::string(match.file) + (match.binary ? " binary" : ": " + std::string(match.line));
+      for (const auto &position : match.positions)
+      {
+        text += " [" + std::to_string(position.start) + "," + std::to_string(position.end) + "]";
+      }
+      return text;
+    };
+
+    std::vector<std::string> viaCallback;
+    searcher.search(dir.path().string(), [&](const grep::Match &match)
+                    { viaCallback.push_back(describe(match)); });
+    std::sort(viaCallback.begin(), viaCallback.end());
+    ASSERT_EQ(viaCallback.size(), 31u);
+    EXPECT_EQ(viaCallback.front(), (dir.path() / "bin.dat").string() + " binary");
+    EXPECT_EQ(viaCallback.back(), (dir.path() / "d2/f8.txt").string() + ": x needle [2,7]");
+
+    // The same workers serve a second search.
+    std::vector<std::string> again;
+    searcher.search(dir.path().string(), [&](const grep::Match &match)
+                    { again.push_back(describe(match)); });
+    std::sort(again.begin(), again.end());
+    EXPECT_EQ(again, viaCallback);
+
+    std::vector<std::string> viaStream;
+    {
+      grep::MatchStream stream = searcher.stream(dir.path().string());
+      grep::Match match;
+      while (stream.next(match))
+      {
+        viaStream.push_back(describe(match));
+      }
+    }
+    std::sort(viaStream.begin(), viaStream.end());
+    EXPECT_EQ(viaStream, viaCallback);
+
+    // A consumer thread drains a ring, a stream dropped early does not block the searcher.
+    grep::RingSink ring(2);
+    std::vector<std::string> viaRing;
+    std::thread consumer([&]
+                         {
+                           grep::Result chunk;
+                           while (ring.pop(chunk))
+                           {
+                             grep::for_each_match(chunk, [&](const grep::Match &match)
+                                                  { viaRing.push_back(describe(match)); });
+                           } });
+    searcher.search(dir.path().string(), ring);
+    consumer.join();
+    std::sort(viaRing.begin(), viaRing.end());
+    EXPECT_EQ(viaRing, viaCallback);
+
+    {
+      grep::MatchStream stream = searcher.stream(dir.path().string());
+      grep::Match match;
+      EXPECT_TRUE(stream.next(match));
+    }
+    std::vector<std::string> afterDropped;
+    searcher.search((dir.path() / "d0/f0.txt").string(), [&](const grep::Match &match)
+                    { afterDropped.push_back(describe(match)); });
+    EXPECT_EQ(afterDropped.size(), 2u);
+
+    // A stream assigned over one that is still running stops that one first.
+    {
+      grep::MatchStream stream = searcher.stream(dir.path().string());
+      grep::Match match;
+      EXPECT_TRUE(stream.next(match));
+      stream = searcher.stream(dir.path().string());
+      std::vector<std::string> reassigned;
+      while (stream.next(match))
+      {
+        reassigned.push_back(describe(match));
+      }
+      std::sort(reassigned.begin(), reassigned.end());
+      EXPECT_EQ(reassigned, viaCallback);
+    }
+  }
+
+  TEST(RingSinkTest, WaitsWithoutSpinning)
+  {
+    auto cpuNanos = []
+    {
+      timespec now{};
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+      return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    };
+    constexpr int64_t spent = 50000000; // far below the 200 ms either side waits
+    grep::RingSink ring(2);
+
+    // The consumer waits on an empty ring, then the producer on a full one.
+    std::thread consumer([&]
+                         {
+                           grep::Result chunk;
+                           const int64_t start = cpuNanos();
+                           ASSERT_TRUE(ring.pop(chunk));
+                           EXPECT_LT(cpuNanos() - start, spent);
+                           EXPECT_EQ(chunk.file_name, "0");
+                           std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                           for (int i = 1; i < 4; ++i)
+                           {
+                             ASSERT_TRUE(ring.pop(chunk));
+                             EXPECT_EQ(chunk.file_name, std::to_string(i));
+                           }
+                           EXPECT_FALSE(ring.pop(chunk)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const int64_t start = cpuNanos();
+    for (int i = 0; i < 4; ++i)
+    {
+      grep::Result chunk(std::to_string(i));
+      ring.consume(chunk);
+    }
+    EXPECT_LT(cpuNanos() - start, spent);
+    ring.finish();
+    consumer.join();
+  }
+
+  TEST(SearcherTest, DroppedStreamCancelsItsSearch)
+  {
+    if (!grep::StatsCompiledIn)
+    {
+      GTEST_SKIP() << "built without GREP_WITH_STATS";
+    }
+    TempDir dir("grep_tests_dropped");
+    for (int i = 0; i < 400; ++i)
+    {
+      dir.write("f" + std::to_string(i) + ".txt", "needle\n");
+    }
+
+    grep::GrepOptions options;
+    options.patterns = {"needle"};
+    options.threads = 2;
+    options.resultBudget = 512;
+    options.stats = grep::StatsFormat::Json;
+    grep::Searcher searcher(options);
+    {
+      // More chunks than the stream and the pipeline hold, the search is still waiting when the stream goes.
+      grep::MatchStream stream = searcher.stream(dir.path().string());
+      grep::Match match;
+      EXPECT_TRUE(stream.next(match));
+    }
+    EXPECT_LT(searcher.stats().total().counter(grep::Counter::Files), 400u);
+  }
+
+  TEST(SearcherTest, ReportsStatsPerThread)
+  {
+    if (!grep::StatsCompiledIn)
+    {
+      GTEST_SKIP() << "built without GREP_WITH_STATS";
+    }
+    TempDir dir("grep_tests_stats");
+    for (int i = 0; i < 12; ++i)
+    {
+      dir.write("d" + std::to_string(i % 2) + "/f" + std::to_string(i) + ".txt", i % 3 == 0 ? "needle\nhay\nneedle\n" : "hay\n");
+    }
+
+    grep::GrepOptions options;
+    options.patterns = {"needle"};
+    options.threads = 2;
+    options.stats = grep::StatsFormat::Json;
+    grep::Searcher searcher(options);
+    size_t matches = 0;
+    searcher.search(dir.path().string(), [&](const grep::Match &)
+                    { ++matches; });
+
+    const grep::SearchStats &stats = searcher.stats();
+    const grep::ThreadStats total = stats.total();
+    EXPECT_EQ(stats.workers.size(), 2u);
+    EXPECT_EQ(total.counter(grep::Counter::Directories), 3u);
+    EXPECT_EQ(total.counter(grep::Counter::Files), 12u);
+    EXPECT_EQ(total.counter(grep::Counter::Lines), matches);
+    EXPECT_EQ(matches, 8u);
+    EXPECT_GT(stats.wallNanos, 0u);
+
+    // Every moment of a worker is charged to one phase, so the phases add up to about the wall time.
+    for (const auto &worker : stats.workers)
+    {
+      uint64_t charged = 0;
+      for (unsigned phase = 0; phase < static_cast<unsigned>(grep::Phase::Count); ++phase)
+      {
+        charged += worker.nanos[phase];
+      }
+      EXPECT_LE(charged, stats.wallNanos);
+      EXPECT_GT(charged, 0u);
+    }
+
+    std::stringstream json;
+    stats.print_json(json);
+    EXPECT_EQ(json.str().rfind("{\"wall_seconds\":", 0), 0u);
+    EXPECT_NE(json.str().find("\"files\":12"), std::string::npos);
+    EXPECT_FALSE(stats.hasReader);
+
+    // Read ahead files are counted by the reader as well, in a row of its own outside the total.
+    options.ioDepth = 4;
+    grep::Searcher reading(options);
+    for (int run = 0; run < 2; ++run)
+    {
+      reading.search(dir.path().string(), [](const grep::Match &) {});
+      const grep::SearchStats &readStats = reading.stats();
+      ASSERT_TRUE(readStats.hasReader);
+      EXPECT_EQ(readStats.reader.counter(grep::Counter::Files), 12u);
+      EXPECT_EQ(readStats.reader.counter(grep::Counter::Bytes), readStats.total().counter(grep::Counter::Bytes));
+      EXPECT_GT(readStats.reader.time(grep::Phase::Read), 0u);
+      EXPECT_EQ(readStats.total().counter(grep::Counter::Files), 12u);
+      std::stringstream table;
+      readStats.print(table);
+      EXPECT_NE(table.str().find("\nreader "), std::string::npos);
+    }
+  }
+
+  TEST(GlobTest, MatchesLikeGitignore)
+  {
+    struct Case
+    {
+      const char *glob;
+      const char *text;
+      bool matches;
+    };
+    const Case cases[] = {
+        {"main.cpp", "main.cpp", true}, {"main.cpp", "main.cp", false},
+        {"*.cpp", "a.cpp", true}, {"*.cpp", "dir/a.cpp", false}, {"*.cpp", "a.cpp.o", false},
+        {"test_*", "test_x", true}, {"test_*", "test_/x", false},
+        {"?.[ch]", "a.c", true}, {"?.[ch]", "a.o", false}, {"?.[!ch]", "a.o", true}, {"[a-c]x", "bx", true}, {"[a-c]x", "dx", false},
+        {"a*b*c", "axxbyyc", true}, {"a*b*c", "axxbyy", false}, {"a*c", "a/c", false},
+        {"**/build", "build", true}, {"**/build", "x/y/build", true}, {"**/build", "x/build2", false},
+        {"doc/**", "doc/a/b.txt", true}, {"doc/**", "docs/a", false},
+        {"a/**/b", "a/b", true}, {"a/**/b", "a/x/y/b", true}, {"a/**/b", "a/xb", false},
+        {"\\*.txt", "*.txt", true}, {"\\*.txt", "a.txt", false}, {"[ab", "[ab", true}};
+    for (const auto &c : cases)
+    {
+      EXPECT_EQ(grep::Glob(c.glob).matches(c.text), c.matches) << c.glob << " on " << c.text;
+    }
+
+    grep::GlobSet set;
+    for (const char *glob : {"Makefile", "*.h", "*.tar.gz", "src/gen/*", "t?st.*"})
+    {
+      set.add(glob);
+    }
+    EXPECT_TRUE(set.matches("Makefile", "x/Makefile"));
+    EXPECT_TRUE(set.matches("a.h", "x/a.h"));
+    EXPECT_TRUE(set.matches("a.tar.gz", "a.tar.gz"));
+    EXPECT_TRUE(set.matches("p.c", "src/gen/p.c"));
+    EXPECT_TRUE(set.matches("test.c", "test.c"));
+    EXPECT_FALSE(set.matches("p.c", "src/p.c"));
+    EXPECT_FALSE(set.matches("a.hpp", "a.hpp"));
+  }
+
+  TEST(GrepTest, FiltersPathsDuringWalk)
+  {
+    TempDir dir("grep_tests_filters");
+    for (const char *file : {"a.txt", "b.log", "keep.log", "sub/c.txt", "sub/deep/d.txt", "sub/deep/e.md", "build/f.txt",
+                             "node_modules/m/g.txt", ".git/objects/h.txt", "other/build/i.txt", "other/j.txt"})
+    {
+      dir.write(file, "needle\n");
+    }
+    dir.write(".gitignore", "*.log\n!keep.log\n/build/\nnode_modules/\n");
+    dir.write("sub/.gitignore", "deep/*.txt\n");
+    dir.write("other/.ignore", "j.txt\n");
+
+    auto run = [&](std::vector<std::string> include, std::vector<std::string> exclude, std::vector<std::string> excludeDirs, bool ignoreFiles)
+    {
+      grep::GrepOptions options;
+      options.patterns = {"needle"};
+      options.threads = 2;
+      options.includeGlobs = std::move(include);
+      options.excludeGlobs = std::move(exclude);
+      options.excludeDirectoryGlobs = std::move(excludeDirs);
+      options.ignoreFiles = ignoreFiles;
+
+      std::vector<std::string> searched;
+      grep::Searcher searcher(options);
+      searcher.search(dir.path().string(), [&](const grep::Match &match)
+                      { searched.push_back(fs::path(match.file).lexically_relative(dir.path()).generic_string()); });
+      std::sort(searched.begin(), searched.end());
+
+      // The sequential walk filters the same way.
+      std::vector<std::string> found;
+      grep::find_files(dir.path(), [&](fs::path path)
+                       {
+                         if (path.extension() != "" && path.filename().string()[0] != '.')
+                         {
+                           found.push_back(path.lexically_relative(dir.path()).generic_string());
+                         } },
+                       grep::PathFilter(options));
+      std::sort(found.begin(), found.end());
+      EXPECT_EQ(found, searched);
+      return searched;
+    };
+
+    // /build/ is anchored to the root, other/build stays. Rules of sub/.gitignore only apply below sub.
+    EXPECT_EQ(run({}, {}, {}, true), (std::vector<std::string>{"a.txt", "keep.log", "other/build/i.txt", "sub/c.txt", "sub/deep/e.md"}));
+    EXPECT_EQ(run({"*.txt"}, {"c.txt"}, {"other"}, true), (std::vector<std::string>{"a.txt"}));
+    EXPECT_EQ(run({}, {"*.txt"}, {"deep"}, false),
+              (std::vector<std::string>{"b.log", "keep.log"}));
+    EXPECT_EQ(run({"sub/**"}, {}, {}, false), (std::vector<std::string>{"sub/c.txt", "sub/deep/d.txt", "sub/deep/e.md"}));
+  }
+
+  TEST(FindFilesTest, SkipsSymlinks)
+  {
+    TempDir dir("grep_tests_symlinks");
+    dir.write("a.txt", "needle\n");
+    dir.write("subdir/b.txt", "needle\n");
+    fs::create_symlink(dir.path() / "a.txt", dir.path() / "link.txt");
+    fs::create_directory_symlink(dir.path() / "subdir", dir.path() / "linkdir");
+
+    std::vector<fs::path> files;
+    grep::find_files(dir.path(), file_collector(files));
+    std::sort(files.begin(), files.end());
+    EXPECT_EQ(files, (std::vector<fs::path>{dir.path() / "a.txt", dir.path() / "subdir/b.txt"}));
+
+    // A symlink given as start path is followed when it points to a file.
+    files.clear();
+    grep::find_files(dir.path() / "link.txt", file_collector(files));
+    EXPECT_EQ(files, std::vector<fs::path>{dir.path() / "link.txt"});
+  }
+
+  TEST(GrepTest, ParallelWalkSkipsSymlinks)
+  {
+    TempDir dir("grep_tests_parallel_walk");
+    for (int i = 0; i < 20; ++i)
+    {
+      dir.write("d" + std::to_string(i % 4) + "/e" + std::to_string(i % 3) + "/f" + std::to_string(i) + ".txt", "x needle\n");
+    }
+    fs::create_symlink(dir.path() / "d0", dir.path() / "linkdir");
+    fs::create_symlink(dir.path() / "d1/e1/f1.txt", dir.path() / "link.txt");
+
+    std::stringstream outputBuffer;
+
+    grep::GrepOptions options;
+    options.patterns = {"needle"};
+    options.path = dir.path().string();
+    options.threads = 3;
+    options.color = grep::ColorMode::Always;
+    grep::grep(std::move(options), outputBuffer);
+
+    std::vector<std::string> expectedLines;
+    for (int i = 0; i < 20; ++i)
+    {
+      expectedLines.push_back((dir.path() / ("d" + std::to_string(i % 4)) / ("e" + std::to_string(i % 3)) / ("f" + std::to_string(i) + ".txt")).string() +
+                              ": x " + grep::ColorStart + "needle" + grep::ColorEnd + "\n");
+    }
+    std::vector<std::string> actualLines = splitLines(outputBuffer.str());
+    std::sort(expectedLines.begin(), expectedLines.end());
+    std::sort(actualLines.begin(), actualLines.end());
+    EXPECT_EQ(actualLines, expectedLines);
+  }
+
+  TEST(GrepTest, OutputModesAndExitStatus)
+  {
+    TempDir dir("grep_tests_output_modes");
+    for (int i = 0; i < 30; ++i)
+    {
+      dir.write("d" + std::to_string(i % 3) + "/f" + std::to_string(i) + ".txt", i % 10 == 0 ? "needle\nx needle\n" : "hay\n");
+    }
+    for (const unsigned ioDepth : {0u, 4u})
+    {
+      auto run = [&](grep::OutputMode mode, const std::string &pattern, std::string &out)
+      {
+        grep::GrepOptions options;
+        options.patterns = {pattern};
+        options.path = dir.path().string();
+        options.threads = 3;
+        options.ioDepth = ioDepth;
+        options.mode = mode;
+        std::stringstream buffer;
+        const int status = grep::grep(std::move(options), buffer);
+        std::vector<std::string> lines = splitLines(buffer.str());
+        std::sort(lines.begin(), lines.end());
+        out.clear();
+        for (const auto &line : lines)
+        {
+          out += line;
+        }
+        return status;
+      };
+
+      std::string out;
+      EXPECT_EQ(run(grep::OutputMode::FilesWithMatches, "needle", out), 0);
+      std::string expected;
+      for (int i : {0, 10, 20})
+      {
+        expected += (dir.path() / ("d" + std::to_string(i % 3)) / ("f" + std::to_string(i) + ".txt")).string() + "\n";
+      }
+      EXPECT_EQ(out, expected);
+
+      EXPECT_EQ(run(grep::OutputMode::Count, "needle", out), 0);
+      EXPECT_EQ(std::count(out.begin(), out.end(), '\n'), 30);
+      EXPECT_NE(out.find((dir.path() / "d1/f10.txt").string() + ":2\n"), std::string::npos);
+      EXPECT_NE(out.find((dir.path() / "d1/f1.txt").string() + ":0\n"), std::string::npos);
+
+      EXPECT_EQ(run(grep::OutputMode::Quiet, "needle", out), 0);
+      EXPECT_EQ(out, "");
+      EXPECT_EQ(run(grep::OutputMode::Quiet, "absent", out), 1);
+      EXPECT_EQ(run(grep::OutputMode::Lines, "absent", out), 1);
+      EXPECT_EQ(run(grep::OutputMode::Lines, "hay", out), 0);
+    }
+  }
+
+  TEST(SearchInFileTest, BinaryPolicies)
+  {
+    TempFile file("grep_tests_binary.bin", std::string("header\0\x01 match\nmatch again\n", 27));
+    auto matcher = grep::make_matcher({"match"});
+
+    auto search = [&](grep::BinaryPolicy policy)
+    {
+      std::vector<grep::Result> chunks;
+      grep::ResultPool pool;
+      grep::search_in_file(*matcher, file.path(), grep::SearchOptions{SIZE_MAX, policy}, pool, [&](grep::Result chunk, bool)
+                           { chunks.push_back(std::move(chunk)); });
+      return chunks;
+    };
+
+    const auto reported = search(grep::BinaryPolicy::Report);
+    ASSERT_EQ(reported.size(), 1u);
+    EXPECT_TRUE(reported.front().binary);
+    EXPECT_TRUE(reported.front().empty());
+    std::string out;
+    grep::format_result(reported.front(), out, true);
+    EXPECT_EQ(out, "Binary file " + file.path().string() + " matches\n");
+
+    EXPECT_TRUE(search(grep::BinaryPolicy::Skip).empty());
+
+    const auto text = search(grep::BinaryPolicy::Text);
+    ASSERT_EQ(text.size(), 1u);
+    EXPECT_EQ(text.front().line_count(), 2u);
+
+    // A NUL byte beyond the probed block does not make a file binary.
+    EXPECT_FALSE(grep::is_binary(std::string(64 * 1024, 'a') + '\0'));
+    EXPECT_TRUE(grep::is_binary(std::string("a\0b", 3)));
+  }
+
+  TEST(SearchInFileTest, CountingModesAndMaxCount)
+  {
+    TempFile file("grep_tests_counting.txt", "match one\nnone\nmatch match two\nmatch three\n");
+    auto matcher = grep::make_matcher({"match"});
+
+    auto search = [&](grep::OutputMode mode, size_t maxCount, const std::atomic<bool> *cancelled = nullptr)
+    {
+      grep::SearchOptions options{SIZE_MAX};
+      options.mode = mode;
+      options.maxCount = maxCount;
+      options.cancelled = cancelled;
+      std::vector<grep::Result> chunks;
+      grep::ResultPool pool;
+      grep::search_in_file(*matcher, file.path(), options, pool, [&](grep::Result chunk, bool)
+                           { chunks.push_back(std::move(chunk)); });
+      return chunks;
+    };
+
+    auto counted = search(grep::OutputMode::Count, SIZE_MAX);
+    ASSERT_EQ(counted.size(), 1u);
+    EXPECT_TRUE(counted.front().counted);
+    EXPECT_EQ(counted.front().count, 3u);
+    EXPECT_EQ(counted.front().line_count(), 0u);
+    EXPECT_EQ(search(grep::OutputMode::Count, 2).front().count, 2u);
+    EXPECT_EQ(search(grep::OutputMode::FilesWithMatches, SIZE_MAX).front().count, 1u);
+    EXPECT_EQ(search(grep::OutputMode::Quiet, SIZE_MAX).front().count, 1u);
+
+    auto lines = search(grep::OutputMode::Lines, 2);
+    ASSERT_EQ(lines.size(), 1u);
+    EXPECT_EQ(lines.front().line_count(), 2u);
+    EXPECT_EQ(lines.front().line_text(1), "match match two");
+    EXPECT_TRUE(search(grep::OutputMode::Lines, 0).empty());
+
+    // -c reports files without a match, the other modes do not; a cancelled search stops before the first line.
+    const std::atomic<bool> cancelled{true};
+    EXPECT_EQ(search(grep::OutputMode::Count, SIZE_MAX, &cancelled).front().count, 0u);
+    EXPECT_TRUE(search(grep::OutputMode::FilesWithMatches, SIZE_MAX, &cancelled).empty());
+  }
+
+  std::string gzip_compress(const std::string &content)
+  {
+    std::string out;
+#ifdef GREP_WITH_ZLIB
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    out.resize(deflateBound(&stream, content.size()));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(content.data()));
+    stream.avail_in = static_cast<uInt>(content.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+#endif
+    return out;
+  }
+
+  std::string xz_compress(const std::string &content)
+  {
+    std::string out;
+#ifdef GREP_WITH_LZMA
+    out.resize(lzma_stream_buffer_bound(content.size()));
+    size_t size = 0;
+    lzma_easy_buffer_encode(1, LZMA_CHECK_CRC32, nullptr, reinterpret_cast<const uint8_t *>(content.data()), content.size(),
+                            reinterpret_cast<uint8_t *>(&out[0]), &size, out.size());
+    out.resize(size);
+#endif
+    return out;
+  }
+
+  TEST(SearchInFileTest, SearchesCompressedFiles)
+  {
+    // Random words, so the compressed files are large enough to be decoded on a separate thread.
+    std::mt19937 random(7);
+    const char *words[] = {"alpha", "beta", "gamma", "delta", "kappa", "omega"};
+    std::string content;
+    for (int line = 0; line < 100000; ++line)
+    {
+      for (int word = 0; word < 6; ++word)
+      {
+        content.append(words[random() % 6]).push_back(' ');
+      }
+      content.append(line % 1000 == 0 ? "needle " + std::to_string(line) + "\n" : "\n");
+    }
+    content.append("needle without line break");
+
+    TempFile plain("grep_tests_compressed.txt", content);
+    const auto matcher = grep::make_matcher({"needle"});
+    auto search = [&](const fs::path &path, bool decompress)
+    {
+      grep::Result joined;
+      grep::ResultPool pool;
+      grep::search_in_file(*matcher, path, grep::SearchOptions{4096, grep::BinaryPolicy::Report, decompress}, pool, [&](grep::Result chunk, bool)
+                           {
+                             for (size_t i = 0; i < chunk.line_count(); ++i)
+                             {
+                               joined.add_line(chunk.line_text(i));
+                               for (const auto &match : chunk.line_matches(i))
+                               {
+                                 joined.add_match(match);
+                               }
+                             }
+                             joined.binary = joined.binary || chunk.binary; });
+      return joined;
+    };
+    const grep::Result expected = search(plain.path(), true);
+    ASSERT_EQ(expected.line_count(), 101u);
+
+    const struct
+    {
+      grep::Compression compression;
+      std::string data;
+    } cases[] = {
+        {grep::Compression::Gzip, gzip_compress(content)},
+        {grep::Compression::Gzip, gzip_compress("needle small\n")}, // decoded inline
+        {grep::Compression::Gzip, gzip_compress(content.substr(0, 1000)) + gzip_compress(content.substr(1000))},
+        {grep::Compression::Xz, xz_compress(content)},
+    };
+    for (const auto &compressed : cases)
+    {
+      if (!grep::can_decompress(compressed.compression))
+      {
+        continue;
+      }
+      EXPECT_EQ(grep::detect_compression(compressed.data), compressed.compression);
+      TempFile file("grep_tests_compressed.bin", compressed.data);
+      const grep::Result result = search(file.path(), true);
+      EXPECT_FALSE(result.binary);
+      if (compressed.data.size() < 1000)
+      {
+        EXPECT_EQ(result.line_count(), 1u);
+        continue;
+      }
+      EXPECT_EQ(result, expected);
+      EXPECT_TRUE(search(file.path(), false).empty());
+
+      // A truncated file keeps what was decoded before the cut.
+      TempFile truncated("grep_tests_truncated.bin", compressed.data.substr(0, compressed.data.size() / 2));
+      const grep::Result partial = search(truncated.path(), true);
+      EXPECT_GT(partial.line_count(), 10u);
+      EXPECT_LT(partial.line_count(), 101u);
+    }
+
+    if (grep::can_decompress(grep::Compression::Zstd))
+    {
+      const grep::Result result = search("./test_assets/compressed/notes.txt.zst", true);
+      ASSERT_EQ(result.line_count(), 1u);
+      EXPECT_EQ(result.line_text(0), "the needle in zstd");
+    }
+    EXPECT_EQ(grep::detect_compression("plain text"), grep::Compression::None);
+  }
+
+  TEST(SearchInFileTest, ContextLines)
+  {
+    TempFile file("grep_tests_context.txt", "a\nmatch 1\nb\nc\nd\ne\nmatch 2\n\nmatch 3\nf\ng\n");
+    auto matcher = grep::make_matcher({"match"});
+
+    auto search = [&](const std::filesystem::path &path, size_t before, size_t after, size_t maxCount = SIZE_MAX,
+                      const std::atomic<bool> *cancelled = nullptr)
+    {
+      grep::SearchOptions options{SIZE_MAX};
+      options.decompress = true;
+      options.beforeContext = before;
+      options.afterContext = after;
+      options.contextGroups = true;
+      options.maxCount = maxCount;
+      options.cancelled = cancelled;
+      std::string out;
+      grep::ResultPool pool;
+      grep::search_in_file(*matcher, path, options, pool, [&](grep::Result chunk, bool)
+                           { grep::format_result(chunk, out, false, !out.empty()); });
+      return out;
+    };
+
+    const std::string name = file.path().string();
+    auto lines = [&](std::vector<std::string> expected)
+    {
+      std::string out;
+      for (const auto &line : expected)
+      {
+        out += line == "--" ? line : name + line;
+        out += '\n';
+      }
+      return out;
+    };
+
+    // Overlapping windows merge, a gap between them gets a separator; the empty line is a line like any other.
+    EXPECT_EQ(search(file.path(), 1, 1), lines({"- a", ": match 1", "- b", "--", "- e", ": match 2", "- ", ": match 3", "- f"}));
+    EXPECT_EQ(search(file.path(), 0, 3), lines({": match 1", "- b", "- c", "- d", "--", ": match 2", "- ", ": match 3", "- f", "- g"}));
+    EXPECT_EQ(search(file.path(), 4, 0), lines({"- a", ": match 1", "- b", "- c", "- d", "- e", ": match 2", "- ", ": match 3"}));
+    EXPECT_EQ(search(file.path(), 9, 9), search(file.path(), 20, 20));
+    // -m stops after the after context of its last match.
+    EXPECT_EQ(search(file.path(), 0, 2, 1), lines({": match 1", "- b", "- c"}));
+    // -C 0 still separates matches that are not adjacent, like GNU grep.
+    EXPECT_EQ(search(file.path(), 0, 0), lines({": match 1", "--", ": match 2", "--", ": match 3"}));
+    EXPECT_EQ(search(file.path(), 0, 1), lines({": match 1", "- b", "--", ": match 2", "- ", ": match 3", "- f"}));
+
+    // Lines before a match that lie in an earlier slice are kept aside, the result is the same as in one pass.
+    std::string big;
+    for (int i = 0; i < 200000; ++i)
+    {
+      big += i % 997 == 0 ? "match " + std::to_string(i) + "\n" : i % 13 == 0 ? "\n" : "line " + std::to_string(i) + "\n";
+    }
+    TempFile bigFile("grep_tests_context_big.txt", big);
+    const std::atomic<bool> running{false};
+    for (const auto &[before, after] : std::vector<std::pair<size_t, size_t>>{{3, 0}, {0, 3}, {600, 0}, {2, 700}})
+    {
+      const std::string whole = search(bigFile.path(), before, after);
+      EXPECT_GT(std::count(whole.begin(), whole.end(), '\n'), 200);
+      EXPECT_EQ(search(bigFile.path(), before, after, SIZE_MAX, &running), whole);
+#ifdef GREP_WITH_ZLIB
+      // Decoded blocks end in the middle of lines and windows.
+      TempFile compressed("grep_tests_context_big.gz", gzip_compress(big));
+      const std::string decoded = search(compressed.path(), before, after);
+      std::string renamed;
+      for (const auto &line : splitLines(decoded))
+      {
+        renamed += line.rfind(compressed.path().string(), 0) == 0 ? bigFile.path().string() + line.substr(compressed.path().string().size()) : line;
+      }
+      EXPECT_EQ(renamed, whole);
+#endif
+    }
+  }
+
+  TEST(SearchInFileTest, LineNumbersAndByteOffsets)
+  {
+    std::string content;
+    std::vector<std::pair<size_t, size_t>> expected; // line number and byte offset of every match
+    for (size_t i = 1; i <= 150000; ++i)
+    {
+      if (i % 1009 == 0 || i == 1)
+      {
+        expected.emplace_back(i, content.size());
+        content += "match " + std::to_string(i) + "\n";
+      }
+      else
+      {
+        content += i % 11 == 0 ? "\n" : "line " + std::to_string(i) + "\n";
+      }
+    }
+    TempFile file("grep_tests_numbers.txt", content);
+    auto matcher = grep::make_matcher({"match"});
+
+    auto search = [&](const std::filesystem::path &path, const std::atomic<bool> *cancelled, size_t before = 0)
+    {
+      grep::SearchOptions options{SIZE_MAX};
+      options.decompress = true;
+      options.lineNumbers = true;
+      options.byteOffsets = true;
+      options.beforeContext = before;
+      options.cancelled = cancelled;
+      std::vector<std::pair<size_t, size_t>> found;
+      grep::ResultPool pool;
+      grep::search_in_file(*matcher, path, options, pool, [&](grep::Result chunk, bool)
+                           {
+                             for (const auto &line : chunk.lines)
+                             {
+                               if ((line.flags & grep::Result::Line::Context) == 0)
+                               {
+                                 found.emplace_back(line.lineNumber, line.byteOffset);
+                               }
+                             } });
+      return found;
+    };
+
+    // One pass over the mapped file, line aligned slices of it, and context lines counted on the way.
+    const std::atomic<bool> running{false};
+    EXPECT_EQ(search(file.path(), nullptr), expected);
+    EXPECT_EQ(search(file.path(), &running), expected);
+    EXPECT_EQ(search(file.path(), &running, 3), expected);
+#ifdef GREP_WITH_ZLIB
+    // Decoded blocks, the line breaks of a block without a match are counted before it is reused.
+    TempFile compressed("grep_tests_numbers.gz", gzip_compress(content));
+    EXPECT_EQ(search(compressed.path(), nullptr), expected);
+#endif
+
+    // Context lines carry their own numbers, labels are printed between the name and the text.
+    TempFile small("grep_tests_numbers_small.txt", "a\nb match\nc\n");
+    grep::SearchOptions options{SIZE_MAX};
+    options.lineNumbers = true;
+    options.byteOffsets = true;
+    options.afterContext = 1;
+    std::string out;
+    grep::ResultPool pool;
+    grep::search_in_file(*matcher, small.path(), options, pool, [&](grep::Result chunk, bool)
+                         { grep::format_result(chunk, out, false, false, grep::LineLabels{true, true}); });
+    const std::string name = small.path().string();
+    EXPECT_EQ(out, name + ":2:2: b match\n" + name + "-3-10- c\n");
+  }
+
+  TEST(SearchInFileTest, RangesCoverEveryLineOnce)
+  {
+    std::string content;
+    for (int i = 0; i < 3000; ++i)
+    {
+      content += i % 7 == 0 ? "" : "line " + std::to_string(i) + (i % 3 == 0 ? " hit" : "");
+      if (i % 500 == 0)
+      {
+        content += std::string(20000, 'x') + " hit"; // longer than a range
+      }
+      content += '\n';
+    }
+    content += "hit without line break";
+    TempFile file("grep_tests_ranges.txt", content);
+    const grep::FileBuffer buffer(file.path());
+    const auto matcher = grep::make_matcher({"hit"});
+    const grep::Result expected = grep::search_in_file(*matcher, file.path());
+
+    grep::SearchOptions options;
+    options.splitBytes = 1000;
+    options.splitRanges = 50;
+    EXPECT_EQ(grep::split_count(buffer, options), 50u);
+    options.splitRanges = 1;
+    EXPECT_EQ(grep::split_count(buffer, options), 1u);
+    options.splitBytes = 0; // not accepted on the command line, still no division by zero
+    options.splitRanges = 50;
+    EXPECT_EQ(grep::split_count(buffer, options), 50u);
+
+    for (size_t count : {1, 2, 3, 7, 50, 2000})
+    {
+      grep::Result joined(file.path().string());
+      grep::ResultPool pool;
+      for (size_t part = 0; part < count; ++part)
+      {
+        size_t lastChunks = 0;
+        grep::search_file_range(*matcher, buffer, file.path(), part, count, grep::SearchOptions{512}, pool, [&](grep::Result chunk, bool last)
+                                {
+                                  lastChunks += last ? 1 : 0;
+                                  for (size_t i = 0; i < chunk.line_count(); ++i)
+                                  {
+                                    joined.add_line(chunk.line_text(i));
+                                    for (const auto &match : chunk.line_matches(i))
+                                    {
+                                      joined.add_match(match);
+                                    }
+                                  } });
+        EXPECT_EQ(lastChunks, 1u);
+      }
+      EXPECT_EQ(joined, expected) << count << " ranges";
+    }
+  }
+
+  TEST(SearchInFileTest, StreamsChunks)
+  {
+    std::string content;
+    for (int i = 0; i < 100; ++i)
+    {
+      content += "line " + std::to_string(i) + " hit\n";
+    }
+    TempFile file("grep_tests_chunks.txt", content);
+    auto matcher = grep::make_matcher({"hit"});
+
+    std::vector<size_t> chunkSizes;
+    size_t lastChunks = 0;
+    grep::Result joined(file.path().string());
+    grep::ResultPool pool;
+    EXPECT_TRUE(grep::search_in_file(*matcher, file.path(), grep::SearchOptions{100, grep::BinaryPolicy::Text}, pool, [&](grep::Result chunk, bool last)
+                                     {
+                                       chunkSizes.push_back(chunk.line_count());
+                                       lastChunks += last ? 1 : 0;
+                                       EXPECT_EQ(last, lastChunks == 1);
+                                       for (size_t line = 0; line < chunk.line_count(); ++line)
+                                       {
+                                         joined.add_line(chunk.line_text(line));
+                                         for (const auto &match : chunk.line_matches(line))
+                                         {
+                                           joined.add_match(match);
+                                         }
+                                       }
+                                       pool.release(std::move(chunk)); }));
+
+    EXPECT_GT(chunkSizes.size(), 1u);
+    EXPECT_EQ(lastChunks, 1u);
+    EXPECT_TRUE(joined == grep::search_in_file(*matcher, file.path()));
+  }
+
+  TEST(ResultPoolTest, ReusesReleasedResults)
+  {
+    grep::ResultPool pool;
+    grep::Result result = pool.acquire();
+    result.file_name = "file.txt";
+    result.add_line("some matching line");
+    result.add_match(grep::MatchPosition(5, 12));
+    const char *arena = result.text.data();
+
+    pool.release(std::move(result));
+    grep::Result reused = pool.acquire();
+    EXPECT_TRUE(reused.empty());
+    EXPECT_TRUE(reused.file_name.empty());
+    EXPECT_EQ(reused.text.data(), arena);
+  }
+
+  TEST(ResultPipelineTest, KeepsStreamsTogetherWithinBudget)
+  {
+    constexpr int producers = 4;
+    constexpr int chunksPerStream = 50;
+    const size_t chunkBytes = grep::ResultPipeline::chunk_bytes(grep::Result("f", {{"line", {grep::MatchPosition(0, 1)}}}));
+    grep::ResultPipeline pipeline(3 * chunkBytes);
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+    {
+      threads.emplace_back([&pipeline, p]
+                           {
+                             for (int i = 0; i < chunksPerStream; ++i)
+                             {
+                               pipeline.push(p, grep::Result(std::to_string(p), {{"line", {grep::MatchPosition(0, 1)}}}), i + 1 == chunksPerStream);
+                             }
+                           });
+    }
+
+    std::thread closer([&]
+                       {
+                         for (auto &thread : threads)
+                         {
+                           thread.join();
+                         }
+                         pipeline.close();
+                       });
+
+    std::vector<std::string> order;
+    grep::Result chunk;
+    while (pipeline.pop(chunk))
+    {
+      order.push_back(chunk.file_name);
+    }
+    closer.join();
+
+    ASSERT_EQ(order.size(), static_cast<size_t>(producers * chunksPerStream));
+    for (size_t i = 0; i < order.size(); i += chunksPerStream)
+    {
+      for (size_t j = i; j < i + chunksPerStream; ++j)
+      {
+        EXPECT_EQ(order[j], order[i]);
+      }
+    }
+  }
+
+  TEST(ResultPipelineTest, StitchesPartsInOrder)
+  {
+    const size_t chunkBytes = grep::ResultPipeline::chunk_bytes(grep::Result("f", {{"line", {grep::MatchPosition(0, 1)}}}));
+    grep::ResultPipeline pipeline(2 * chunkBytes);
+
+    std::vector<std::string> order;
+    std::thread consumer([&]
+                         {
+                           grep::Result chunk;
+                           while (pipeline.pop(chunk))
+                           {
+                             for (size_t i = 0; i < chunk.line_count(); ++i)
+                             {
+                               order.emplace_back(chunk.line_text(i));
+                             }
+                           } });
+
+    // One producer pushes the later parts of stream 1 first, far beyond the budget. The output waits for part 0,
+    // which only shows up afterwards, so the budget must not hold the producer back.
+    pipeline.push(grep::StreamPart{1, 2, 3}, grep::Result("f", {{"c", {}}}), true);
+    for (int i = 0; i < 10; ++i)
+    {
+      pipeline.push(grep::StreamPart{1, 1, 3}, grep::Result("f", {{"b" + std::to_string(i), {}}}), i == 9);
+    }
+    pipeline.push(2, grep::Result("g", {{"other", {}}}), true);
+    pipeline.push(grep::StreamPart{1, 0, 3}, grep::Result("f", {{"a", {}}}), false);
+    pipeline.push(grep::StreamPart{1, 0, 3}, grep::Result(), true);
+    pipeline.close();
+    consumer.join();
+
+    const std::vector<std::string> expected = {"a", "b0", "b1", "b2", "b3", "b4", "b5", "b6", "b7", "b8", "b9", "c", "other"};
+    EXPECT_EQ(order, expected);
+  }
+
+  TEST(ResultPipelineTest, ReordersStreamsByExpandedOrder)
+  {
+    const size_t chunkBytes = grep::ResultPipeline::chunk_bytes(grep::Result("f", {{"line", {grep::MatchPosition(0, 1)}}}));
+    grep::ResultPipeline pipeline(2 * chunkBytes);
+    pipeline.order({0});
+
+    std::vector<std::string> order;
+    std::thread consumer([&]
+                         {
+                           grep::Result chunk;
+                           while (pipeline.pop(chunk))
+                           {
+                             for (size_t i = 0; i < chunk.line_count(); ++i)
+                             {
+                               order.emplace_back(chunk.line_text(i));
+                             }
+                           } });
+
+    // Directory 0 holds file 1, directory 2 and file 3, directory 2 holds file 4. Everything arrives back to front,
+    // far beyond the budget, which must not hold the producer back while the next stream in order is missing.
+    pipeline.expand(0, {1, 2, 3});
+    for (int i = 0; i < 10; ++i)
+    {
+      pipeline.push(3, grep::Result("c", {{"c" + std::to_string(i), {}}}), i == 9);
+    }
+    pipeline.push(4, grep::Result(), true);
+    pipeline.expand(2, {4});
+    pipeline.push(1, grep::Result("a", {{"a", {}}}), true);
+    pipeline.close();
+    consumer.join();
+
+    const std::vector<std::string> expected = {"a", "c0", "c1", "c2", "c3", "c4", "c5", "c6", "c7", "c8", "c9"};
+    EXPECT_EQ(order, expected);
+
+    // The next search writes in arrival order again.
+    pipeline.reopen();
+    pipeline.push(7, grep::Result("g", {{"g", {}}}), true);
+    pipeline.push(5, grep::Result("e", {{"e", {}}}), true);
+    pipeline.close();
+    grep::Result chunk;
+    ASSERT_TRUE(pipeline.pop(chunk));
+    EXPECT_EQ(chunk.file_name, "g");
+  }
+
+  TEST(ResultPipelineTest, HoldsStreamsBackBehindAStalledOne)
+  {
+    const size_t chunkBytes = grep::ResultPipeline::chunk_bytes(grep::Result("f", {{"line", {grep::MatchPosition(0, 1)}}}));
+    grep::ResultPipeline pipeline(4 * chunkBytes, 3);
+    std::mutex mutex;
+    std::vector<uint64_t> resumed;
+    pipeline.order({0, 1, 2, 3, 4}, 3, [&](uint64_t stream)
+                   {
+                     std::lock_guard<std::mutex> lock(mutex);
+                     resumed.push_back(stream); });
+
+    // Stream 0 is taken on and stalls. Streams 1 and 2 are within the window and may only fill the budget,
+    // stream 3 is too far ahead to be taken on at all.
+    ASSERT_TRUE(pipeline.start(grep::StreamPart{0}));
+    EXPECT_FALSE(pipeline.start(grep::StreamPart{3}));
+    std::atomic<size_t> pushed{0};
+    std::vector<std::thread> producers;
+    for (const uint64_t stream : {1, 2})
+    {
+      ASSERT_TRUE(pipeline.start(grep::StreamPart{stream}));
+      producers.emplace_back([&, stream]
+                             {
+                               for (int i = 0; i < 20; ++i)
+                               {
+                                 pipeline.push(stream, grep::Result(std::to_string(stream), {{"line", {grep::MatchPosition(0, 1)}}}), i == 19);
+                                 ++pushed;
+                               } });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_LE(pushed * chunkBytes, 4 * chunkBytes);
+
+    std::vector<std::string> order;
+    std::thread consumer([&]
+                         {
+                           grep::Result chunk;
+                           while (pipeline.pop(chunk))
+                           {
+                             order.push_back(chunk.file_name);
+                           } });
+    pipeline.push(0, grep::Result("0", {{"line", {}}}), true);
+    for (auto &producer : producers)
+    {
+      producer.join();
+    }
+    // Once the output is on stream 1, stream 3 is within the window and handed back.
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      EXPECT_EQ(resumed, std::vector<uint64_t>{3});
+    }
+    EXPECT_TRUE(pipeline.start(grep::StreamPart{3}));
+    pipeline.push(3, grep::Result("3", {{"line", {}}}), true);
+    EXPECT_TRUE(pipeline.start(grep::StreamPart{4}));
+    pipeline.push(4, grep::Result(), true);
+    pipeline.close();
+    consumer.join();
+
+    std::vector<std::string> expected = {"0"};
+    expected.insert(expected.end(), 20, "1");
+    expected.insert(expected.end(), 20, "2");
+    expected.insert(expected.end(), {"3", ""});
+    EXPECT_EQ(order, expected);
+  }
+
+  TEST(GrepTest, SortedOutputFollowsTheWalk)
+  {
+    TempDir dir("grep_tests_sorted");
+    for (int i = 0; i < 60; ++i)
+    {
+      // Names that sort differently as whole paths than entry by entry ('.' < '/').
+      const std::string relative = std::string(i % 3 == 0 ? "a" : i % 3 == 1 ? "a.d" : "b") + "/" + (i % 4 == 0 ? "x/" : "") +
+                                   "f" + std::to_string(i % 7) + "_" + std::to_string(i);
+      std::string content;
+      for (int line = 0; line < (i % 5) * 400; ++line)
+      {
+        content += line % 3 == 0 ? "needle " + std::to_string(line) + "\n" : "hay\n";
+      }
+      dir.write(relative, content);
+    }
+
+    // Expected: every directory's entries in name order, depth first.
+    std::function<std::string(const fs::path &)> walk = [&](const fs::path &directory)
+    {
+      std::vector<fs::path> entries{fs::directory_iterator(directory), fs::directory_iterator()};
+      std::sort(entries.begin(), entries.end(), [](const fs::path &a, const fs::path &b)
+                { return a.native() < b.native(); });
+      std::string out;
+      for (const auto &entry : entries)
+      {
+        if (fs::is_directory(entry))
+        {
+          out += walk(entry);
+          continue;
+        }
+        std::ifstream in(entry);
+        for (std::string line; std::getline(in, line);)
+        {
+          if (line.find("needle") != std::string::npos)
+          {
+            out += entry.string() + ": " + line + "\n";
+          }
+        }
+      }
+      return out;
+    };
+    const std::string expected = walk(dir.path());
+    ASSERT_FALSE(expected.empty());
+
+    for (const unsigned ioDepth : {0u, 4u})
+    {
+      for (const size_t splitBytes : {size_t(32) << 20, size_t(1000)})
+      {
+        grep::GrepOptions options;
+        options.patterns = {"needle"};
+        options.path = dir.path().string();
+        options.threads = 4;
+        options.ioDepth = ioDepth;
+        options.splitBytes = splitBytes;
+        options.resultBudget = 4096;
+        options.color = grep::ColorMode::Never;
+        options.sort = grep::SortOrder::Path;
+        std::stringstream out;
+        EXPECT_EQ(grep::grep(std::move(options), out), 0);
+        EXPECT_EQ(out.str(), expected) << "io depth " << ioDepth << ", split " << splitBytes;
+      }
+    }
+  }
+
+  TEST(GrepTest, SmallResultBudget)
+  {
+    TempDir dir("grep_tests_budget");
+    for (int f = 0; f < 8; ++f)
+    {
+      std::string content;
+      for (int i = 0; i < 200; ++i)
+      {
+        content += "file " + std::to_string(f) + " line " + std::to_string(i) + " needle\n";
+      }
+      dir.write("f" + std::to_string(f) + ".txt", content);
+    }
+
+    std::stringstream outputBuffer;
+    grep::GrepOptions options;
+    options.patterns = {"needle"};
+    options.path = dir.path().string();
+    options.threads = 4;
+    options.resultBudget = 1024;
+    grep::grep(std::move(options), outputBuffer);
+
+    // Every file shows up as one block of its 200 lines in file order.
+    std::vector<std::string> lines = splitLines(outputBuffer.str());
+    ASSERT_EQ(lines.size(), 1600u);
+    for (size_t block = 0; block < lines.size(); block += 200)
+    {
+      const std::string file = lines[block].substr(0, lines[block].find(':'));
+      for (size_t i = 0; i < 200; ++i)
+      {
+        EXPECT_EQ(lines[block + i].substr(0, lines[block + i].find(':')), file);
+        EXPECT_NE(lines[block + i].find(" line " + std::to_string(i) + " "), std::string::npos);
+      }
+    }
+  }
+
+  TEST(GrepTest, SplitFileKeepsLineOrder)
+  {
+    std::string content;
+    for (int i = 0; i < 20000; ++i)
+    {
+      content += "line " + std::to_string(i) + (i % 5 == 0 ? " needle\n" : "\n");
+    }
+    TempFile file("grep_tests_split.txt", content);
+
+    auto run = [&](size_t splitBytes)
+    {
+      std::stringstream outputBuffer;
+      grep::GrepOptions options;
+      options.patterns = {"needle"};
+      options.path = file.path().string();
+      options.threads = 4;
+      options.resultBudget = 2048;
+      options.splitBytes = splitBytes;
+      grep::grep(std::move(options), outputBuffer);
+      return outputBuffer.str();
+    };
+
+    const std::string whole = run(SIZE_MAX);
+    EXPECT_EQ(splitLines(whole).size(), 4000u);
+    EXPECT_EQ(run(4096), whole);
+  }
+
   TEST(GrepTest, WithMatched)
   {
     std::stringstream outputBuffer;
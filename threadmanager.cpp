@@ -1,99 +1,551 @@
 #include "grep_utils.h"
 #include "threadmanager.h"
 
+#include <algorithm>
 #include <thread>
 #include <functional>
 #include "result.h"
+#include "case_fold.h"
+#include "regex_matcher.h"
+#include "trigram_index.h"
 #include <iostream>
 
 namespace grep
 {
-    void ThreadManager::search()
+    ThreadManager::ThreadManager(const GrepOptions &options)
+        : m_matcher(make_matcher(options.patterns, options.extendedRegex ? MatcherKind::Regex : MatcherKind::Auto, options.ignoreCase)),
+          m_patterns(options.patterns),
+          m_extendedRegex(options.extendedRegex),
+          m_ignoreCase(options.ignoreCase),
+          m_useIndex(options.useIndex),
+          m_scheduler(options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency())),
+          m_results(options.resultBudget, m_scheduler.worker_count()),
+          m_pools(m_scheduler.worker_count()),
+          m_search{std::clamp<size_t>(options.resultBudget / (4 * m_scheduler.worker_count()), 1, MaxChunkBytes), options.binary, options.decompress,
+                   options.splitBytes, m_scheduler.worker_count() > 1 ? m_scheduler.worker_count() * RangesPerWorker : 1, options.mode,
+                   options.maxCount, options.beforeContext, options.afterContext, options.contextGroups,
+                   options.lineNumbers || options.format != OutputFormat::Text,
+                   options.byteOffsets || options.format != OutputFormat::Text, &m_cancelled},
+          m_filter(options),
+          m_mode(options.mode),
+          m_sorted(options.sort == SortOrder::Path),
+          m_statsEnabled(StatsCompiledIn && options.stats != StatsFormat::None)
     {
-        std::vector<std::thread> threadPool;
+        // Cached results are whole lists of matching lines, the other modes stop early and have none,
+        // and context lines and group separators are not stored.
+        if (!options.cacheDirectory.empty() && options.mode == OutputMode::Lines && options.beforeContext == 0 && options.afterContext == 0 &&
+            !options.contextGroups)
+        {
+            m_cache = std::make_unique<ResultCache>(options.cacheDirectory, result_signature(options), options.cacheBytes,
+                                                    m_scheduler.worker_count());
+        }
+
+        // Listed files go to the reader first and reach the workers once loaded, each one held in the scheduler until then.
+        // The cache answers files without reading them, so it never reads ahead.
+        if (options.ioDepth > 0 && !m_cache)
+        {
+            m_reader = std::make_unique<FileReader>(options.ioDepth, MaxReadAheadBytes, [this](fs::path path, std::shared_ptr<const FileBuffer> file)
+                                                    {
+                                                        uint64_t stream = 0;
+                                                        if (m_sorted)
+                                                        {
+                                                            std::lock_guard<std::mutex> lock(m_readerMutex);
+                                                            auto it = m_readerStreams.find(path.native());
+                                                            stream = it->second;
+                                                            m_readerStreams.erase(it);
+                                                        }
+                                                        m_scheduler.push_batch({WalkTask::for_file(std::move(path), std::move(file), stream)});
+                                                        m_scheduler.release(); });
+            if (m_statsEnabled)
+            {
+                m_reader->collect_stats();
+            }
+        }
+
+        for (unsigned int i = 0; i < m_scheduler.worker_count(); ++i)
+        {
+            m_workers.emplace_back(&ThreadManager::work, this, i);
+        }
+    }
 
-        unsigned int numCores = std::max(1u, std::thread::hardware_concurrency());
+    ThreadManager::~ThreadManager()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_runMutex);
+            m_stopping = true;
+        }
+        m_cvRun.notify_all();
+        for (auto &thread : m_workers)
+        {
+            thread.join();
+        }
+    }
 
-        std::thread output_thread(std::bind(&ThreadManager::output_results, this));
+    bool ThreadManager::search()
+    {
+        return search(m_pathStart, *m_writerSink);
+    }
 
-        for (unsigned int i = 0; i < numCores; ++i)
+    bool ThreadManager::search(const fs::path &path, ResultSink &sink)
+    {
+        std::lock_guard<std::mutex> searchLock(m_searchMutex);
+        bool cancelled = false;
+        {
+            std::lock_guard<std::mutex> lock(m_sinkMutex);
+            m_sink = &sink;
+            cancelled = sink.cancelled();
+        }
+        bool isDirectory = false;
+        if (!resolve_start_path(path, isDirectory))
         {
-            threadPool.emplace_back(std::bind(&ThreadManager::collect, this));
+            end_search(sink);
+            return false;
         }
 
-        std::thread find_files_thread(&find_files,
-                                      m_pathStart,
-                                      [this](fs::path path)
-                                      {
-                                          std::unique_lock<std::mutex> lock(m_fileQueueMutex);
-                                          m_fileQueue.push(path);
-                                          m_cvInput.notify_all();
-                                      });
+        // The walk is seeded with the start path, every listed directory adds its entries as new tasks.
+        // With an index only its candidate files are searched and there is no walk at all.
+        std::vector<WalkTask> seeds;
+        m_rootPrefix = path_prefix(path);
+        if (m_cache)
+        {
+            m_cache->begin_search();
+        }
+        if (!m_useIndex || !isDirectory || !index_candidates(path, seeds))
+        {
+            seeds.push_back(isDirectory ? WalkTask::for_directory(path, nullptr) : WalkTask::for_file(path));
+        }
+        const auto started = std::chrono::steady_clock::now();
+        if (m_statsEnabled)
+        {
+            m_stats.workers.assign(m_scheduler.worker_count(), ThreadStats());
+            m_stats.output = ThreadStats();
+            m_stats.hasReader = m_reader != nullptr;
+            if (m_reader)
+            {
+                m_reader->take_stats(); // from here on
+            }
+        }
 
-        find_files_thread.join();
-        m_stopCollectFlag = true;
-        m_cvInput.notify_all();
+        m_cancelled = cancelled;
+        m_matched = false;
+        m_results.reopen();
+        if (m_sorted)
+        {
+            // Index candidates come in no particular order, fs::path compares them directory by directory like the walk.
+            std::sort(seeds.begin(), seeds.end(), [](const WalkTask &a, const WalkTask &b)
+                      { return a.path < b.path; });
+            std::vector<uint64_t> streams;
+            for (auto &seed : seeds)
+            {
+                seed.stream = m_nextStream++;
+                streams.push_back(seed.stream);
+            }
+            m_results.order(std::move(streams), m_scheduler.worker_count() * StreamsAheadPerWorker, [this](uint64_t stream)
+                            { resume(stream); });
+        }
+        m_scheduler.reopen();
+        m_scheduler.push_batch(std::move(seeds));
+        m_scheduler.close();
+        {
+            std::lock_guard<std::mutex> lock(m_runMutex);
+            m_finished = 0;
+            ++m_run;
+        }
+        m_cvRun.notify_all();
 
-        for (auto &thread : threadPool)
+        // The last worker to finish closes the pipeline, which ends the output on this thread.
+        output_results(sink);
+        if (m_statsEnabled)
         {
-            thread.join();
+            m_stats.wallNanos = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+            if (m_reader)
+            {
+                m_stats.reader = m_reader->take_stats();
+            }
         }
 
-        m_stopOutputFlag = true;
-        m_cvOutput.notify_one();
-        output_thread.join();
+        if (m_cache)
+        {
+            try
+            {
+                m_cache->save();
+            }
+            catch (const std::runtime_error &e)
+            {
+                std::cerr << "Warning: " << e.what() << std::endl;
+            }
+        }
+        end_search(sink);
+        return m_matched;
+    }
+
+    void ThreadManager::end_search(ResultSink &sink)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sinkMutex);
+            m_sink = nullptr;
+        }
+        sink.finish();
+    }
+
+    void ThreadManager::cancel(const ResultSink &sink)
+    {
+        std::lock_guard<std::mutex> lock(m_sinkMutex);
+        if (m_sink == &sink)
+        {
+            cancel();
+        }
     }
 
-    void ThreadManager::collect()
+    void ThreadManager::cancel()
     {
-        while (!m_fileQueue.empty() || !m_stopCollectFlag)
+        m_cancelled = true;
+        if (m_reader)
+        {
+            m_reader->drop_pending();
+        }
+    }
+
+    void ThreadManager::work(unsigned worker)
+    {
+        uint64_t run = 0;
+        while (true)
         {
-            fs::path filepath;
             {
-                std::unique_lock<std::mutex> lock(m_fileQueueMutex);
+                std::unique_lock<std::mutex> lock(m_runMutex);
+                m_cvRun.wait(lock, [&]
+                             { return m_run != run || m_stopping; });
+                if (m_stopping)
+                {
+                    return;
+                }
+                run = m_run;
+            }
+
+            ThreadStats *stats = worker_stats(worker);
+            start_stats(stats);
+            collect(worker);
+            stop_stats(stats);
 
-                m_cvInput.wait(lock, [this]
-                               { return !m_fileQueue.empty() || m_stopCollectFlag; });
+            std::lock_guard<std::mutex> lock(m_runMutex);
+            if (++m_finished == m_scheduler.worker_count())
+            {
+                m_results.close();
+            }
+        }
+    }
 
-                if (!m_fileQueue.empty())
+    bool ThreadManager::index_candidates(const fs::path &root, std::vector<WalkTask> &tasks) const
+    {
+        const auto index = TrigramIndex::open(root / IndexFileName);
+        if (!index)
+        {
+            std::cerr << "Warning: No index found in " << root << ", searching all files" << std::endl;
+            return false;
+        }
+
+        // Trigrams are ASCII case folded, only letters beyond ASCII need their variants spelled out for -i.
+        std::vector<std::vector<std::string>> alternatives;
+        for (const auto &pattern : m_patterns)
+        {
+            if (pattern.find('\n') == std::string::npos)
+            {
+                if (m_extendedRegex)
                 {
+                    alternatives.push_back(required_literals(pattern, m_ignoreCase));
+                }
+                else
+                {
+                    alternatives.push_back(m_ignoreCase && has_unicode_case(pattern) ? required_literals(regex_escape(pattern), true)
+                                                                                     : std::vector<std::string>{pattern});
+                }
+            }
+        }
+        std::vector<std::string> candidates = index->candidates(alternatives);
+        m_filter.retain_allowed(root, candidates);
+
+        // The index describes the tree as it was built, files added or changed since are searched whatever their trigrams.
+        const std::vector<std::string> changed = index->changed_files(root, m_filter);
+        if (!changed.empty())
+        {
+            std::cerr << "Warning: " << changed.size() << " files in " << root << " changed since the index was built, run --build-index to update it"
+                      << std::endl;
+            std::vector<std::string> merged;
+            std::set_union(candidates.begin(), candidates.end(), changed.begin(), changed.end(), std::back_inserter(merged));
+            candidates.swap(merged);
+        }
+        for (const auto &path : candidates)
+        {
+            tasks.push_back(WalkTask::for_file(root / path));
+        }
+        return true;
+    }
 
-                    filepath = std::move(m_fileQueue.front());
-                    m_fileQueue.pop();
+    void ThreadManager::collect(unsigned worker)
+    {
+        ThreadStats *stats = worker_stats(worker);
+        WalkTask task;
+        std::vector<WalkTask> entries;
+        // Waiting in pop is charged to Idle, every task switches to its own phases.
+        while (m_scheduler.pop(worker, task))
+        {
+            // A cancelled search drains its tasks without opening anything, only a range still ends its stream,
+            // which the output waits for, and so does every file and directory in sorted order.
+            if (m_cancelled.load(std::memory_order_relaxed))
+            {
+                if (task.range.count != 0)
+                {
+                    m_results.push(task.range, m_pools[worker].acquire(), true, &m_pools[worker]);
+                }
+                else if (m_sorted && task.isDirectory)
+                {
+                    m_results.expand(task.stream, {});
+                }
+                else if (m_sorted)
+                {
+                    m_results.push(task.stream, m_pools[worker].acquire(), true, &m_pools[worker]);
                 }
+                continue;
+            }
+            if (task.isDirectory)
+            {
+                PhaseScope walk(stats, Phase::Walk);
+                count(stats, Counter::Directories);
+                list(worker, task, entries);
+                continue;
+            }
+
+            if (task.range.count != 0)
+            {
+                PhaseScope search(stats, Phase::Search);
+                count(stats, Counter::Ranges);
+                m_results.start(task.range);
+                search_file_range(*m_matcher, *task.file, task.path, task.range.index, task.range.count, m_search, m_pools[worker],
+                                  [&](Result chunk, bool last)
+                                  { push(worker, task.range, std::move(chunk), last); });
+                continue;
             }
+            if (m_sorted && !admit(task))
+            {
+                continue;
+            }
+            const uint64_t stream = m_sorted ? task.stream : m_nextStream++;
+            if (!search_file(worker, task, stream, entries) && m_sorted)
+            {
+                // The output waits for every file in sorted order, one without a match ends its stream empty.
+                m_results.push(stream, m_pools[worker].acquire(), true, &m_pools[worker]);
+            }
+        }
+    }
+
+    bool ThreadManager::admit(WalkTask &task)
+    {
+        std::lock_guard<std::mutex> lock(m_deferredMutex);
+        if (m_results.start(StreamPart{task.stream}))
+        {
+            return true;
+        }
+        // A loaded file would hold up the reader, which may still have to load the files the output waits for.
+        task.file.reset();
+        m_scheduler.hold();
+        m_deferred.emplace(task.stream, std::move(task));
+        return false;
+    }
+
+    void ThreadManager::resume(uint64_t stream)
+    {
+        WalkTask task;
+        {
+            std::lock_guard<std::mutex> lock(m_deferredMutex);
+            auto it = m_deferred.find(stream);
+            task = std::move(it->second);
+            m_deferred.erase(it);
+        }
+        m_scheduler.push_batch({std::move(task)});
+        m_scheduler.release();
+    }
 
-            auto res = search_in_file(m_pattern, filepath);
+    void ThreadManager::list(unsigned worker, const WalkTask &task, std::vector<WalkTask> &entries)
+    {
+        // Filtered while listing, so a pruned directory never becomes a task.
+        list_directory(task.path, m_filter, m_rootPrefix, task.ignore,
+                       [this, &entries](fs::path path, bool isDirectory, const std::shared_ptr<const IgnoreLevel> &ignore)
+                       {
+                           if (!isDirectory && path.filename() == IndexFileName)
+                           {
+                               return;
+                           }
+                           if (!isDirectory && m_reader && !m_sorted)
+                           {
+                               m_scheduler.hold();
+                               m_reader->submit(std::move(path));
+                               return;
+                           }
+                           entries.push_back(isDirectory ? WalkTask::for_directory(std::move(path), ignore) : WalkTask::for_file(std::move(path))); });
+        if (!m_sorted)
+        {
+            m_scheduler.push_batch(worker, std::move(entries));
+            entries.clear();
+            return;
+        }
 
-            if (!res.empty())
+        // The entries take the directory's place in the output, in name order. They share the directory's path
+        // as prefix, so comparing whole paths compares names. Pushed in front, the walk goes depth first and
+        // the output rarely waits for a file nobody is searching yet.
+        std::sort(entries.begin(), entries.end(), [](const WalkTask &a, const WalkTask &b)
+                  { return a.path.native() < b.path.native(); });
+        const uint64_t first = m_nextStream.fetch_add(entries.size());
+        std::vector<uint64_t> streams(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            entries[i].stream = streams[i] = first + i;
+        }
+        m_results.expand(task.stream, std::move(streams));
+        if (m_reader)
+        {
+            auto files = std::stable_partition(entries.begin(), entries.end(), [](const WalkTask &entry)
+                                               { return entry.isDirectory; });
+            for (auto it = files; it != entries.end(); ++it)
             {
-                std::lock_guard<std::mutex> lock(m_resultQueueMutex);
-                m_resultQueue.push(std::move(res));
-                m_cvOutput.notify_one();
+                {
+                    std::lock_guard<std::mutex> lock(m_readerMutex);
+                    m_readerStreams.emplace(it->path.native(), it->stream);
+                }
+                m_scheduler.hold();
+                m_reader->submit(std::move(it->path));
             }
+            entries.erase(files, entries.end());
         }
+        m_scheduler.push_batch_front(worker, std::move(entries));
+        entries.clear();
     }
 
-    void ThreadManager::output_results()
+    void ThreadManager::push(unsigned worker, const StreamPart &part, Result chunk, bool last)
     {
-        while (!m_stopOutputFlag || !m_resultQueue.empty())
+        ThreadStats *stats = worker_stats(worker);
+        if (chunk.line_count() > 0 || chunk.binary || chunk.count > 0)
         {
-            Result res;
+            m_matched.store(true, std::memory_order_relaxed);
+            if (m_mode == OutputMode::Quiet)
             {
-                std::unique_lock<std::mutex> lock(m_resultQueueMutex);
-                m_cvOutput.wait(lock, [this]
-                                { return !m_resultQueue.empty() || m_stopOutputFlag; });
+                cancel();
+            }
+        }
+        count(stats, Counter::Lines, chunk.line_count());
+        count(stats, Counter::Chunks);
+        PhaseScope wait(stats, Phase::ResultWait);
+        m_results.push(part, std::move(chunk), last, &m_pools[worker]);
+    }
 
-                if (!m_resultQueue.empty())
+    bool ThreadManager::search_file(unsigned worker, WalkTask &task, uint64_t stream, std::vector<WalkTask> &entries)
+    {
+        ThreadStats *stats = worker_stats(worker);
+        ResultPool &pool = m_pools[worker];
+        PhaseScope open(stats, Phase::Open);
+
+        // Files whose identity did not change since an earlier search are not opened at all.
+        FileIdentity identity;
+        const bool cacheable = m_cache && file_identity(task.path, identity);
+        if (cacheable)
+        {
+            Result cached = pool.acquire();
+            if (m_cache->lookup(worker, identity, cached))
+            {
+                count(stats, Counter::CachedFiles);
+                if (cached.empty() && !cached.binary)
                 {
-                    res = std::move(m_resultQueue.front());
-                    m_resultQueue.pop();
+                    pool.release(std::move(cached));
+                    return false;
                 }
+                cached.file_name = task.path.string();
+                push(worker, StreamPart{stream}, std::move(cached), true);
+                return true;
+            }
+            pool.release(std::move(cached));
+        }
+
+        // Files read ahead arrive loaded, the rest (and whatever the reader passed on) are mapped here.
+        std::shared_ptr<const FileBuffer> shared = std::move(task.file);
+        FileBuffer mapped;
+        if (!shared)
+        {
+            mapped = FileBuffer(task.path);
+            if (!mapped.is_open())
+            {
+                return false;
+            }
+        }
+        const FileBuffer &file = shared ? *shared : mapped;
+        count(stats, Counter::Files);
+        count(stats, Counter::Bytes, file.size());
+
+        // Large files become one task per range, the output stitches them together in order as one stream.
+        const size_t ranges = split_count(file, m_search);
+        if (ranges > 1)
+        {
+            if (!shared)
+            {
+                shared = std::make_shared<const FileBuffer>(std::move(mapped));
+            }
+            for (uint32_t i = 0; i < ranges; ++i)
+            {
+                entries.push_back(WalkTask::for_range(task.path, StreamPart{stream, i, static_cast<uint32_t>(ranges)}, shared));
+            }
+            // In sorted order the output counts the file as started until its ranges are, this worker takes the first next.
+            if (m_sorted)
+            {
+                m_scheduler.push_batch_front(worker, std::move(entries));
+            }
+            else
+            {
+                m_scheduler.push_batch(worker, std::move(entries));
+            }
+            entries.clear();
+            return true;
+        }
+
+        // Only results that fit into a single chunk are cached, larger ones are searched again.
+        PhaseScope search(stats, Phase::Search);
+        size_t chunks = 0;
+        bool ended = false;
+        search_in_file(*m_matcher, file, task.path, m_search, pool, [&](Result chunk, bool last)
+                       {
+                           if (cacheable && chunks++ == 0 && last)
+                           {
+                               m_cache->store(worker, identity, chunk);
+                           }
+                           ended = ended || last;
+                           push(worker, StreamPart{stream}, std::move(chunk), last); });
+        if (cacheable && chunks == 0)
+        {
+            m_cache->store(worker, identity, Result());
+        }
+        return ended;
+    }
+
+    void ThreadManager::output_results(ResultSink &sink)
+    {
+        ThreadStats *stats = m_statsEnabled ? &m_stats.output : nullptr;
+        start_stats(stats);
+        Result res;
+        ResultPool *pool = nullptr;
+        while (m_results.pop(res, pool))
+        {
+            PhaseScope output(stats, Phase::Output);
+            // Empty chunks only end a stream, a range or a file in sorted order without a match.
+            if (!res.empty() || res.binary || res.counted)
+            {
+                sink.consume(res);
+            }
+            if (pool != nullptr)
+            {
+                pool->release(std::move(res));
             }
-            if (!res.empty())
+            if (m_results.empty())
             {
-                output_colored_result(res);
+                sink.flush();
             }
         }
+        stop_stats(stats);
     }
-}
\ No newline at end of file
+}
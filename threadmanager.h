@@ -1,11 +1,29 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
 #include <mutex>
 #include <string>
-#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "file_buffer.h"
+#include "file_reader.h"
+#include "matcher.h"
+#include "options.h"
+#include "output_writer.h"
+#include "path_filter.h"
+#include "result_cache.h"
+#include "result_pipeline.h"
+#include "result_pool.h"
+#include "result_sink.h"
+#include "search_stats.h"
+#include "work_stealing_scheduler.h"
 
 namespace grep
 {
@@ -13,30 +31,123 @@ namespace grep
 
     namespace fs = std::filesystem;
 
+    // A file to search or a directory to list, directories are walked by the same workers that search.
+    // A large file is searched in ranges, one task per range sharing the mapped file.
+    struct WalkTask
+    {
+        static WalkTask for_file(fs::path path, std::shared_ptr<const FileBuffer> file = nullptr, uint64_t stream = 0)
+        {
+            return WalkTask{std::move(path), false, StreamPart{0, 0, 0}, std::move(file), nullptr, stream};
+        }
+        static WalkTask for_directory(fs::path path, std::shared_ptr<const IgnoreLevel> ignore)
+        {
+            return WalkTask{std::move(path), true, StreamPart{0, 0, 0}, nullptr, std::move(ignore), 0};
+        }
+        // One range of a split file, range.stream is the file's stream.
+        static WalkTask for_range(fs::path path, StreamPart range, std::shared_ptr<const FileBuffer> file)
+        {
+            return WalkTask{std::move(path), false, range, std::move(file), nullptr, 0};
+        }
+
+        fs::path path;
+        bool isDirectory = false;
+        StreamPart range{0, 0, 0}; // count is 0 unless the task is one range of a split file
+        std::shared_ptr<const FileBuffer> file;
+        std::shared_ptr<const IgnoreLevel> ignore; // the ignore rules a directory is listed with
+        uint64_t stream = 0; // with --sort=path the place in the output, given when the parent directory is listed
+    };
+
+    // Searches with a fixed set of patterns and options. The workers are started once and wait between searches,
+    // so one manager serves any number of searches, one at a time.
     class ThreadManager
     {
     public:
-        ThreadManager(fs::path path, std::string pattern)
-            : m_pathStart(std::move(path)), m_pattern(std::move(pattern))
-        {}
+        explicit ThreadManager(const GrepOptions &options);
+        // Searches options.path into writer on search().
+        ThreadManager(GrepOptions options, OutputWriter &writer)
+            : ThreadManager(options)
+        {
+            m_pathStart = std::move(options.path);
+            const bool color = options.color == ColorMode::Always || (options.color == ColorMode::Auto && writer.is_terminal());
+            m_writerSink = std::make_unique<WriterSink>(writer, color, options.mode, LineLabels{options.lineNumbers, options.byteOffsets},
+                                                        options.format);
+        }
+        ~ThreadManager();
+
+        ThreadManager(const ThreadManager &) = delete;
+        ThreadManager &operator=(const ThreadManager &) = delete;
 
     public:
-        void search();
+        bool search();
+        // Hands the results to sink on the calling thread, returns once the search is complete.
+        // True if any file matched. With -q the search ends at the first match.
+        bool search(const fs::path &path, ResultSink &sink);
+        // Of the last search, empty unless options.stats was set and GREP_WITH_STATS compiled in.
+        const SearchStats &stats() const { return m_stats; }
+        // Stops the search writing into sink from another thread. A search still waiting for the previous one
+        // starts cancelled if sink.cancelled() is set by then.
+        void cancel(const ResultSink &sink);
 
     private:
-        void collect();
-        void output_results();
+        bool index_candidates(const fs::path &root, std::vector<WalkTask> &tasks) const;
+        void work(unsigned worker);
+        void collect(unsigned worker);
+        // Lists a directory into tasks, with --sort=path in name order and numbered as the output has to follow.
+        void list(unsigned worker, const WalkTask &task, std::vector<WalkTask> &entries);
+        // With --sort=path, false if the file is too far ahead of the output: it waits aside until resume.
+        bool admit(WalkTask &task);
+        void resume(uint64_t stream);
+        // False if nothing ended the file's stream: no last chunk was pushed and it was not split into ranges.
+        bool search_file(unsigned worker, WalkTask &task, uint64_t stream, std::vector<WalkTask> &entries);
+        void push(unsigned worker, const StreamPart &part, Result chunk, bool last);
+        void output_results(ResultSink &sink);
+        // Stops the current search: workers drop their remaining tasks and files still waiting for the reader.
+        void cancel();
+        void end_search(ResultSink &sink);
+        ThreadStats *worker_stats(unsigned worker) { return m_statsEnabled ? &m_stats.workers[worker] : nullptr; }
 
     private:
-        std::string m_pattern;
-        std::queue<fs::path> m_fileQueue;
-        fs::path m_pathStart;
-        std::queue<Result> m_resultQueue;
-        std::mutex m_resultQueueMutex;
-        std::mutex m_fileQueueMutex;
-        std::condition_variable m_cvInput;
-        std::condition_variable m_cvOutput;
-        std::atomic<bool> m_stopOutputFlag{false};
-        std::atomic<bool> m_stopCollectFlag{false};
+        static constexpr size_t MaxChunkBytes = 256 * 1024;
+        static constexpr unsigned RangesPerWorker = 4; // split files leave room for stealing when ranges differ in cost
+        static constexpr size_t MaxReadAheadBytes = 4 << 20; // larger files are mapped by the worker, not read ahead
+        static constexpr size_t StreamsAheadPerWorker = 16; // with --sort=path, how far the workers may run ahead of the output
+
+        std::unique_ptr<Matcher> m_matcher;
+        std::vector<std::string> m_patterns;
+        bool m_extendedRegex;
+        bool m_ignoreCase;
+        bool m_useIndex;
+        WorkStealingScheduler<WalkTask> m_scheduler;
+        ResultPipeline m_results;
+        std::vector<ResultPool> m_pools; // one per worker
+        SearchOptions m_search;
+        PathFilter m_filter;
+        size_t m_rootPrefix = 0; // of the current search's start directory
+        std::unique_ptr<ResultCache> m_cache; // only with --cache
+        std::unique_ptr<FileReader> m_reader; // only with --io-depth
+        std::atomic<uint64_t> m_nextStream{0};
+        const OutputMode m_mode;
+        const bool m_sorted; // --sort=path
+        std::mutex m_readerMutex;
+        std::unordered_map<std::string, uint64_t> m_readerStreams; // with --sort=path, of the files at the reader
+        std::mutex m_deferredMutex;
+        std::unordered_map<uint64_t, WalkTask> m_deferred; // with --sort=path, files too far ahead of the output
+        std::atomic<bool> m_cancelled{false}; // of the current search, read by the searches through m_search
+        std::atomic<bool> m_matched{false};   // of the current search
+        const bool m_statsEnabled;
+        SearchStats m_stats; // every thread only writes its own entry
+
+        fs::path m_pathStart;                     // the search() without arguments
+        std::unique_ptr<WriterSink> m_writerSink; // of the search() without arguments
+
+        std::mutex m_searchMutex; // one search at a time
+        std::mutex m_sinkMutex;
+        const ResultSink *m_sink = nullptr; // of the running search
+        std::mutex m_runMutex;
+        std::condition_variable m_cvRun;
+        uint64_t m_run = 0;      // bumped to start the workers on the next search
+        unsigned m_finished = 0; // workers done with the current search
+        bool m_stopping = false;
+        std::vector<std::thread> m_workers;
     };
 }
\ No newline at end of file
@@ -0,0 +1,530 @@
+#include "trigram_index.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "decompress.h"
+#include "grep_utils.h"
+
+namespace grep
+{
+    namespace
+    {
+        constexpr char Magic[8] = {'G', 'R', 'E', 'P', 'I', 'D', 'X', '2'};
+        constexpr uint32_t TrigramSpace = 1u << 24;
+        // A directory changed this close to the build may have gained entries within the same mtime tick after it was listed.
+        constexpr int64_t RacyNanoseconds = 1000000000;
+
+        struct Header
+        {
+            char magic[8];
+            int64_t builtAt;
+            uint64_t fileCount;
+            uint64_t filesOffset;
+            uint64_t directoryCount;
+            uint64_t directoriesOffset;
+            uint64_t trigramCount;
+            uint64_t trigramsOffset;
+            uint64_t postingsOffset;
+        };
+
+        int64_t mtime_of(const struct stat &st)
+        {
+            return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        int64_t now_nanoseconds()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        unsigned char fold(unsigned char c)
+        {
+            return c >= 'A' && c <= 'Z' ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+        }
+
+        // Calls add for every trigram of data that does not cross a line break.
+        template <typename Add>
+        void for_each_trigram(const char *data, size_t size, Add &&add)
+        {
+            uint32_t trigram = 0;
+            size_t run = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                const unsigned char c = static_cast<unsigned char>(data[i]);
+                if (c == '\n')
+                {
+                    run = 0;
+                    continue;
+                }
+                trigram = ((trigram << 8) | fold(c)) & (TrigramSpace - 1);
+                if (++run >= 3)
+                {
+                    add(trigram);
+                }
+            }
+        }
+
+        // Collects the distinct trigrams of one file, seen is a bitmap over all trigrams owned by one thread.
+        // Compressed files are searched decoded, the trigrams of their raw bytes say nothing, so they are left unindexed.
+        bool extract_trigrams(const fs::path &path, std::vector<uint32_t> &trigrams, std::vector<uint64_t> &seen)
+        {
+            FileBuffer file(path);
+            if (!file.is_open() || detect_compression(file.view()) != Compression::None || is_binary(file.view()))
+            {
+                return false;
+            }
+
+            for_each_trigram(file.data(), file.size(), [&](uint32_t trigram)
+                             {
+                                 uint64_t &word = seen[trigram >> 6];
+                                 const uint64_t bit = uint64_t(1) << (trigram & 63);
+                                 if ((word & bit) == 0)
+                                 {
+                                     word |= bit;
+                                     trigrams.push_back(trigram);
+                                 } });
+            for (uint32_t trigram : trigrams)
+            {
+                seen[trigram >> 6] = 0;
+            }
+            std::sort(trigrams.begin(), trigrams.end());
+            return true;
+        }
+
+        template <typename T>
+        void append(std::string &out, T value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        void write_index(const fs::path &indexFile, int64_t builtAt, const std::vector<TrigramIndex::File> &files,
+                         const std::vector<TrigramIndex::Directory> &directories, const std::vector<std::vector<uint32_t>> &trigrams)
+        {
+            std::string out(sizeof(Header), '\0');
+            Header header{};
+            std::memcpy(header.magic, Magic, sizeof(Magic));
+            header.builtAt = builtAt;
+            header.fileCount = files.size();
+            header.filesOffset = out.size();
+            for (const auto &file : files)
+            {
+                append(out, file.mtime);
+                append(out, file.size);
+                append(out, static_cast<uint32_t>(file.path.size()));
+                append(out, static_cast<uint8_t>(file.indexed ? 1 : 0));
+                out.append(file.path);
+            }
+            header.directoryCount = directories.size();
+            header.directoriesOffset = out.size();
+            for (const auto &directory : directories)
+            {
+                append(out, directory.mtime);
+                append(out, static_cast<uint32_t>(directory.path.size()));
+                out.append(directory.path);
+            }
+            out.resize((out.size() + 7) & ~size_t(7));
+
+            // Inverted by sorting (trigram, file) pairs, file ids come out sorted per trigram.
+            std::vector<uint64_t> pairs;
+            for (size_t id = 0; id < trigrams.size(); ++id)
+            {
+                for (uint32_t trigram : trigrams[id])
+                {
+                    pairs.push_back(uint64_t(trigram) << 32 | id);
+                }
+            }
+            std::sort(pairs.begin(), pairs.end());
+
+            std::string table;
+            std::string postings;
+            for (size_t i = 0; i < pairs.size();)
+            {
+                const uint32_t trigram = static_cast<uint32_t>(pairs[i] >> 32);
+                const uint64_t offset = postings.size();
+                uint32_t count = 0;
+                for (; i < pairs.size() && static_cast<uint32_t>(pairs[i] >> 32) == trigram; ++i, ++count)
+                {
+                    append(postings, static_cast<uint32_t>(pairs[i]));
+                }
+                append(table, trigram);
+                append(table, count);
+                append(table, offset);
+                ++header.trigramCount;
+            }
+
+            header.trigramsOffset = out.size();
+            out.append(table);
+            header.postingsOffset = out.size();
+            out.append(postings);
+            std::memcpy(&out[0], &header, sizeof(header));
+
+            // Readers only ever see a complete index.
+            const fs::path temporary = indexFile.string() + ".tmp" + std::to_string(::getpid());
+            {
+                std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+                stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+                if (!stream)
+                {
+                    throw std::runtime_error("Can not write index file " + temporary.string());
+                }
+            }
+            std::error_code error;
+            fs::rename(temporary, indexFile, error);
+            if (error)
+            {
+                fs::remove(temporary, error);
+                throw std::runtime_error("Can not write index file " + indexFile.string());
+            }
+        }
+    }
+
+    std::unique_ptr<TrigramIndex> TrigramIndex::open(const fs::path &indexFile)
+    {
+        auto index = std::make_unique<TrigramIndex>();
+        index->m_buffer = FileBuffer(indexFile);
+        const char *data = index->m_buffer.data();
+        const size_t size = index->m_buffer.size();
+
+        Header header;
+        if (!index->m_buffer.is_open() || size < sizeof(header))
+        {
+            return nullptr;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 || header.filesOffset > size || header.directoriesOffset > size ||
+            header.trigramsOffset > size || header.postingsOffset > size || header.trigramsOffset % 8 != 0 ||
+            header.trigramCount > (size - header.trigramsOffset) / sizeof(TrigramEntry))
+        {
+            return nullptr;
+        }
+
+        size_t pos = header.filesOffset;
+        for (uint64_t i = 0; i < header.fileCount; ++i)
+        {
+            File file;
+            uint32_t length = 0;
+            uint8_t indexed = 0;
+            if (size - pos < sizeof(file.mtime) + sizeof(file.size) + sizeof(length) + sizeof(indexed))
+            {
+                return nullptr;
+            }
+            std::memcpy(&file.mtime, data + pos, sizeof(file.mtime));
+            pos += sizeof(file.mtime);
+            std::memcpy(&file.size, data + pos, sizeof(file.size));
+            pos += sizeof(file.size);
+            std::memcpy(&length, data + pos, sizeof(length));
+            pos += sizeof(length);
+            std::memcpy(&indexed, data + pos, sizeof(indexed));
+            pos += sizeof(indexed);
+            if (size - pos < length)
+            {
+                return nullptr;
+            }
+            file.path.assign(data + pos, length);
+            file.indexed = indexed != 0;
+            pos += length;
+            index->m_files.push_back(std::move(file));
+        }
+
+        pos = header.directoriesOffset;
+        for (uint64_t i = 0; i < header.directoryCount; ++i)
+        {
+            Directory directory;
+            uint32_t length = 0;
+            if (size - pos < sizeof(directory.mtime) + sizeof(length))
+            {
+                return nullptr;
+            }
+            std::memcpy(&directory.mtime, data + pos, sizeof(directory.mtime));
+            pos += sizeof(directory.mtime);
+            std::memcpy(&length, data + pos, sizeof(length));
+            pos += sizeof(length);
+            if (size - pos < length)
+            {
+                return nullptr;
+            }
+            directory.path.assign(data + pos, length);
+            pos += length;
+            index->m_directories.push_back(std::move(directory));
+        }
+        index->m_builtAt = header.builtAt;
+
+        index->m_trigrams = reinterpret_cast<const TrigramEntry *>(data + header.trigramsOffset);
+        index->m_trigramCount = header.trigramCount;
+        index->m_postings = data + header.postingsOffset;
+        return index;
+    }
+
+    std::vector<uint32_t> TrigramIndex::files_with(uint32_t trigram) const
+    {
+        const TrigramEntry *end = m_trigrams + m_trigramCount;
+        const TrigramEntry *entry = std::lower_bound(m_trigrams, end, trigram, [](const TrigramEntry &e, uint32_t value)
+                                                     { return e.trigram < value; });
+        if (entry == end || entry->trigram != trigram ||
+            entry->offset + uint64_t(entry->count) * sizeof(uint32_t) > static_cast<uint64_t>(m_buffer.data() + m_buffer.size() - m_postings))
+        {
+            return {};
+        }
+        std::vector<uint32_t> ids(entry->count);
+        std::memcpy(ids.data(), m_postings + entry->offset, ids.size() * sizeof(uint32_t));
+        return ids;
+    }
+
+    std::vector<std::string> TrigramIndex::candidates(const std::vector<std::vector<std::string>> &alternatives) const
+    {
+        std::vector<bool> selected(m_files.size(), false);
+        auto select_all = [&selected]
+        { std::fill(selected.begin(), selected.end(), true); };
+
+        for (const auto &pattern : alternatives)
+        {
+            if (pattern.empty())
+            {
+                select_all();
+                break;
+            }
+            for (const auto &text : pattern)
+            {
+                const std::vector<uint32_t> trigrams = trigrams_of(text);
+                if (trigrams.empty())
+                {
+                    select_all(); // too short to say anything
+                    break;
+                }
+
+                std::vector<uint32_t> ids = files_with(trigrams.front());
+                std::vector<uint32_t> both;
+                for (size_t i = 1; i < trigrams.size() && !ids.empty(); ++i)
+                {
+                    const std::vector<uint32_t> other = files_with(trigrams[i]);
+                    both.clear();
+                    std::set_intersection(ids.begin(), ids.end(), other.begin(), other.end(), std::back_inserter(both));
+                    ids.swap(both);
+                }
+                for (uint32_t id : ids)
+                {
+                    if (id < selected.size())
+                    {
+                        selected[id] = true;
+                    }
+                }
+            }
+        }
+
+        std::vector<std::string> paths;
+        for (size_t id = 0; id < m_files.size(); ++id)
+        {
+            if (selected[id] || !m_files[id].indexed)
+            {
+                paths.push_back(m_files[id].path);
+            }
+        }
+        return paths;
+    }
+
+    std::vector<std::string> TrigramIndex::changed_files(const fs::path &root, const PathFilter &filter) const
+    {
+        // Files and directories are stored sorted by path, filtering keeps the order.
+        std::vector<std::string> kept;
+        for (const auto &file : m_files)
+        {
+            kept.push_back(file.path);
+        }
+        filter.retain_allowed(root, kept);
+        std::vector<std::string> changed;
+        auto file = m_files.begin();
+        for (auto &relative : kept)
+        {
+            while (file->path != relative)
+            {
+                ++file;
+            }
+            struct stat st;
+            if (::stat((root / relative).c_str(), &st) == 0 && (file->mtime != mtime_of(st) || file->size != static_cast<uint64_t>(st.st_size)))
+            {
+                changed.push_back(std::move(relative));
+            }
+        }
+
+        // Adding or removing an entry changes the mtime of its directory, so new files are only looked for in directories
+        // whose mtime changed and in the root, which the index file itself changes. New subdirectories are listed as well.
+        auto indexed = [](const auto &entries, const std::string &relative)
+        {
+            const auto entry = std::lower_bound(entries.begin(), entries.end(), relative, [](const auto &e, const std::string &value)
+                                                { return e.path < value; });
+            return entry != entries.end() && entry->path == relative;
+        };
+        std::vector<fs::path> pending{root};
+        for (const auto &directory : m_directories)
+        {
+            struct stat st;
+            const fs::path path = root / directory.path;
+            if (::stat(path.c_str(), &st) == 0 && (mtime_of(st) != directory.mtime || directory.mtime > m_builtAt - RacyNanoseconds))
+            {
+                pending.push_back(path);
+            }
+        }
+        std::vector<std::string> added;
+        while (!pending.empty())
+        {
+            const fs::path directory = std::move(pending.back());
+            pending.pop_back();
+            list_directory(directory, [&](fs::path path, bool isDirectory)
+                           {
+                               std::string relative = path.lexically_relative(root).generic_string();
+                               if (isDirectory && !indexed(m_directories, relative))
+                               {
+                                   pending.push_back(std::move(path));
+                               }
+                               else if (!isDirectory && path.filename() != IndexFileName && !indexed(m_files, relative))
+                               {
+                                   added.push_back(std::move(relative));
+                               } });
+        }
+        filter.retain_allowed(root, added);
+
+        changed.insert(changed.end(), std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+        std::sort(changed.begin(), changed.end());
+        return changed;
+    }
+
+    std::vector<uint32_t> trigrams_of(const std::string &text)
+    {
+        std::vector<uint32_t> trigrams;
+        for_each_trigram(text.data(), text.size(), [&trigrams](uint32_t trigram)
+                         { trigrams.push_back(trigram); });
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        return trigrams;
+    }
+
+    IndexUpdate update_index(const fs::path &root, unsigned threads)
+    {
+        if (!fs::is_directory(root))
+        {
+            throw std::runtime_error("Can not index " + root.string() + ", it is not a directory");
+        }
+        const fs::path indexFile = root / IndexFileName;
+
+        // Trigrams of the previous index per file, recovered from the posting lists.
+        std::unique_ptr<TrigramIndex> previous = TrigramIndex::open(indexFile);
+        std::unordered_map<std::string, size_t> previousIds;
+        std::vector<std::vector<uint32_t>> previousTrigrams;
+        if (previous)
+        {
+            previousTrigrams.resize(previous->files().size());
+            for (size_t id = 0; id < previous->files().size(); ++id)
+            {
+                previousIds.emplace(previous->files()[id].path, id);
+            }
+            for (size_t i = 0; i < previous->trigram_count(); ++i)
+            {
+                const uint32_t trigram = previous->trigram_at(i);
+                for (uint32_t id : previous->files_with(trigram))
+                {
+                    if (id < previousTrigrams.size())
+                    {
+                        previousTrigrams[id].push_back(trigram);
+                    }
+                }
+            }
+        }
+
+        // Every directory's mtime is taken before it is listed, an entry added meanwhile changes it again.
+        const int64_t builtAt = now_nanoseconds();
+        std::vector<TrigramIndex::File> files;
+        std::vector<TrigramIndex::Directory> directories;
+        std::vector<fs::path> unlisted{root};
+        while (!unlisted.empty())
+        {
+            const fs::path directory = std::move(unlisted.back());
+            unlisted.pop_back();
+            struct stat st;
+            if (directory != root && ::stat(directory.c_str(), &st) == 0)
+            {
+                directories.push_back(TrigramIndex::Directory{directory.lexically_relative(root).generic_string(), mtime_of(st)});
+            }
+            list_directory(directory, [&](fs::path path, bool isDirectory)
+                           {
+                               if (isDirectory)
+                               {
+                                   unlisted.push_back(std::move(path));
+                                   return;
+                               }
+                               struct stat st;
+                               if (path.filename() == IndexFileName || ::stat(path.c_str(), &st) != 0)
+                               {
+                                   return;
+                               }
+                               TrigramIndex::File file;
+                               file.path = path.lexically_relative(root).generic_string();
+                               file.mtime = mtime_of(st);
+                               file.size = static_cast<uint64_t>(st.st_size);
+                               files.push_back(std::move(file)); });
+        }
+        std::sort(directories.begin(), directories.end(), [](const auto &a, const auto &b)
+                  { return a.path < b.path; });
+        std::sort(files.begin(), files.end(), [](const auto &a, const auto &b)
+                  { return a.path < b.path; });
+
+        IndexUpdate update;
+        update.files = files.size();
+        std::vector<std::vector<uint32_t>> trigrams(files.size());
+        std::vector<size_t> pending;
+        size_t kept = 0;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            const auto it = previousIds.find(files[i].path);
+            if (it == previousIds.end())
+            {
+                pending.push_back(i);
+                continue;
+            }
+            ++kept;
+            const TrigramIndex::File &old = previous->files()[it->second];
+            if (old.mtime == files[i].mtime && old.size == files[i].size)
+            {
+                trigrams[i] = std::move(previousTrigrams[it->second]);
+                files[i].indexed = old.indexed;
+            }
+            else
+            {
+                pending.push_back(i);
+            }
+        }
+        update.removed = previousIds.size() - kept;
+        update.reindexed = pending.size();
+
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < std::max(1u, threads); ++t)
+        {
+            workers.emplace_back([&]
+                                 {
+                                     std::vector<uint64_t> seen(TrigramSpace / 64, 0);
+                                     for (size_t k = next++; k < pending.size(); k = next++)
+                                     {
+                                         const size_t i = pending[k];
+                                         files[i].indexed = extract_trigrams(root / files[i].path, trigrams[i], seen);
+                                     } });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        previous.reset(); // unmaps the old index before it is replaced
+        write_index(indexFile, builtAt, files, directories, trigrams);
+        return update;
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_buffer.h"
+
+namespace grep
+{
+    namespace fs = std::filesystem;
+
+    class PathFilter;
+
+    // Written to the root of an indexed tree, the walk of a search leaves it out.
+    const std::string IndexFileName = ".grep_index";
+
+    // On-disk map from trigrams to the files containing them, used to narrow the files a search has to read.
+    // Trigrams are ASCII case folded and never contain a line break, since matches never span one.
+    // The file is memory mapped and only the posting lists a query needs are touched:
+    //   header      magic, build time, file and directory counts and the offsets of the tables below
+    //   files       per file: mtime (ns), size, path length, indexed flag, path relative to the root
+    //   directories per directory below the root: mtime (ns), path length, path relative to the root
+    //   trigrams    sorted (trigram, posting count, posting offset) entries
+    //   postings    sorted file ids per trigram
+    class TrigramIndex
+    {
+    public:
+        struct File
+        {
+            std::string path; // relative to the indexed root
+            int64_t mtime = 0;
+            uint64_t size = 0;
+            bool indexed = true; // binary, compressed or unreadable files have no trigrams and are candidates of every query
+        };
+
+        struct Directory
+        {
+            std::string path; // relative to the indexed root
+            int64_t mtime = 0;
+        };
+
+        // Returns nullptr if the file does not exist or is not a valid index.
+        static std::unique_ptr<TrigramIndex> open(const fs::path &indexFile);
+
+    public:
+        const std::vector<File> &files() const { return m_files; }
+        size_t trigram_count() const { return m_trigramCount; }
+        uint32_t trigram_at(size_t i) const { return m_trigrams[i].trigram; }
+
+        // Ids of the files containing trigram, sorted.
+        std::vector<uint32_t> files_with(uint32_t trigram) const;
+
+        // Relative paths of the files that may hold a match. Every entry of alternatives is one pattern
+        // as the strings of which each match contains at least one, an empty entry matches any file.
+        std::vector<std::string> candidates(const std::vector<std::vector<std::string>> &alternatives) const;
+
+        // Relative paths, sorted, of the files below root the index can not answer for: files added since it was
+        // built and files whose mtime or size changed, of those filter lets through. No file is read, but every
+        // indexed file the filter keeps and every directory is stat'ed, so a query still costs a syscall per entry of
+        // the tree. Only the root and directories whose mtime changed, the ones that gained or lost entries, are listed.
+        std::vector<std::string> changed_files(const fs::path &root, const PathFilter &filter) const;
+
+    private:
+        struct TrigramEntry
+        {
+            uint32_t trigram;
+            uint32_t count;
+            uint64_t offset;
+        };
+
+        FileBuffer m_buffer;
+        std::vector<File> m_files;
+        std::vector<Directory> m_directories; // sorted by path
+        int64_t m_builtAt = 0;                // ns, when the walk of the build started
+        const TrigramEntry *m_trigrams = nullptr;
+        size_t m_trigramCount = 0;
+        const char *m_postings = nullptr;
+    };
+
+    struct IndexUpdate
+    {
+        size_t files = 0;
+        size_t reindexed = 0; // new or changed files that were read
+        size_t removed = 0;
+    };
+
+    // Brings root/.grep_index up to date with the tree below root. Files whose mtime and size did not change
+    // keep their trigrams from the previous index and are not read again. Throws std::runtime_error if the
+    // index can not be written.
+    IndexUpdate update_index(const fs::path &root, unsigned threads);
+
+    // Folded trigrams of text, sorted and unique.
+    std::vector<uint32_t> trigrams_of(const std::string &text);
+}
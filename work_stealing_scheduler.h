@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace grep
+{
+    // Distributes tasks over per-worker deques.
+    // Workers take tasks from the front of their own deque and, once it runs dry, steal half of the
+    // deque of another worker from the back. Idle workers sleep and are woken one per task pushed, so a
+    // producer never wakes the whole pool for a single task. A thief that keeps loot for later wakes one
+    // more, so a large batch spreads over the pool instead of staying with the first two workers.
+    // A worker finishes its current task by calling pop again, pop returns false once the scheduler
+    // is closed and neither queued nor running tasks are left.
+    // Each worker index must only be used by one thread at a time.
+    template <typename Task>
+    class WorkStealingScheduler
+    {
+    public:
+        explicit WorkStealingScheduler(unsigned workerCount)
+            : m_workers(workerCount == 0 ? 1 : workerCount)
+        {
+            for (auto &worker : m_workers)
+            {
+                worker = std::make_unique<WorkerQueue>();
+            }
+        }
+
+    public:
+        unsigned worker_count() const { return static_cast<unsigned>(m_workers.size()); }
+
+        // Hands a batch of tasks from an external producer to the next worker in round robin order.
+        void push_batch(std::vector<Task> batch)
+        {
+            if (batch.empty())
+            {
+                return;
+            }
+            push_to(*m_workers[m_nextWorker++ % m_workers.size()], std::move(batch), false);
+        }
+
+        // Adds a task found while processing another one to the deque of the calling worker.
+        void push(unsigned worker, Task task)
+        {
+            ++m_queued;
+            WorkerQueue &queue = *m_workers[worker];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+            }
+            wake(1);
+        }
+
+        void push_batch(unsigned worker, std::vector<Task> batch)
+        {
+            if (batch.empty())
+            {
+                return;
+            }
+            push_to(*m_workers[worker], std::move(batch), false);
+        }
+
+        // Adds tasks in front of the deque of the calling worker, it takes them next and in batch order. Entries of
+        // a directory pushed like this are walked depth first, thieves take the tasks furthest back in that order.
+        void push_batch_front(unsigned worker, std::vector<Task> batch)
+        {
+            if (batch.empty())
+            {
+                return;
+            }
+            push_to(*m_workers[worker], std::move(batch), true);
+        }
+
+        // Announces a task that some other stage pushes later, the workers keep waiting for it
+        // even when everything else is done. Every hold is matched by one release after the push.
+        void hold()
+        {
+            ++m_held;
+        }
+
+        void release()
+        {
+            if (--m_held == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_sleepMutex);
+                m_cvIdle.notify_all();
+            }
+        }
+
+        // Signals that no further external batches will be pushed.
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_sleepMutex);
+                m_closed = true;
+            }
+            m_cvIdle.notify_all();
+        }
+
+        // Starts another run once pop returned false on every worker, the workers may call pop again after it.
+        void reopen()
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_closed = false;
+        }
+
+        bool pop(unsigned worker, Task &task)
+        {
+            WorkerQueue &own = *m_workers[worker];
+            while (true)
+            {
+                if (try_pop(own, task) || try_steal(worker, task))
+                {
+                    return true;
+                }
+
+                // The worker only counts as idle once it found nothing, so a busy worker pays no
+                // bookkeeping between consecutive tasks.
+                if (own.running)
+                {
+                    own.running = false;
+                    --m_running;
+                }
+
+                std::unique_lock<std::mutex> lock(m_sleepMutex);
+                if (m_queued == 0 && m_closed && m_running == 0 && m_held == 0)
+                {
+                    lock.unlock();
+                    m_cvIdle.notify_all();
+                    return false;
+                }
+                if (m_queued != 0)
+                {
+                    // Tasks are in flight between a producer or thief and a deque.
+                    lock.unlock();
+                    std::this_thread::yield();
+                    continue;
+                }
+                ++m_sleeping;
+                m_cvIdle.wait(lock, [this]
+                              { return m_queued != 0 || (m_closed && m_running == 0 && m_held == 0); });
+                --m_sleeping;
+            }
+        }
+
+    private:
+        struct alignas(64) WorkerQueue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+            bool running = false; // only touched by the owning worker
+        };
+
+        // Publishes a batch at the back or the front of queue.
+        void push_to(WorkerQueue &queue, std::vector<Task> batch, bool front)
+        {
+            // Counted before publishing, so a fast consumer can never drive the count below zero.
+            const size_t count = batch.size();
+            m_queued += count;
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.insert(front ? queue.tasks.begin() : queue.tasks.end(), std::make_move_iterator(batch.begin()),
+                                   std::make_move_iterator(batch.end()));
+            }
+            wake(count);
+        }
+
+        bool try_pop(WorkerQueue &queue, Task &task)
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+            {
+                return false;
+            }
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            mark_running(queue);
+            --m_queued;
+            return true;
+        }
+
+        bool try_steal(unsigned thief, Task &task)
+        {
+            const size_t count = m_workers.size();
+            for (size_t offset = 1; offset < count; ++offset)
+            {
+                WorkerQueue &victim = *m_workers[(thief + offset) % count];
+                std::vector<Task> loot;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    const size_t take = (victim.tasks.size() + 1) / 2;
+                    for (size_t i = 0; i < take; ++i)
+                    {
+                        loot.push_back(std::move(victim.tasks.back()));
+                        victim.tasks.pop_back();
+                    }
+                }
+                if (loot.empty())
+                {
+                    continue;
+                }
+
+                WorkerQueue &own = *m_workers[thief];
+                mark_running(own);
+                task = std::move(loot.back());
+                loot.pop_back();
+                const bool kept = !loot.empty();
+                if (kept)
+                {
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    for (auto it = loot.rbegin(); it != loot.rend(); ++it)
+                    {
+                        own.tasks.push_back(std::move(*it));
+                    }
+                }
+                --m_queued;
+                if (kept)
+                {
+                    // The loot can be stolen again, by a worker that is still asleep.
+                    wake(1);
+                }
+                return true;
+            }
+            return false;
+        }
+
+        // Running is raised before queued drops, so the work never looks finished in between.
+        void mark_running(WorkerQueue &own)
+        {
+            if (!own.running)
+            {
+                own.running = true;
+                ++m_running;
+            }
+        }
+
+        // Wakes a sleeping worker for each of count tasks, as far as there are any.
+        void wake(size_t count)
+        {
+            if (m_sleeping > 0)
+            {
+                // Taking the lock orders the notification after a sleeper's check of m_queued.
+                std::lock_guard<std::mutex> lock(m_sleepMutex);
+                for (size_t i = std::min<size_t>(count, m_sleeping); i > 0; --i)
+                {
+                    m_cvIdle.notify_one();
+                }
+            }
+        }
+
+    private:
+        std::vector<std::unique_ptr<WorkerQueue>> m_workers;
+        std::atomic<size_t> m_nextWorker{0};
+        std::atomic<size_t> m_queued{0};
+        std::atomic<size_t> m_running{0};
+        std::atomic<unsigned> m_sleeping{0};
+        std::atomic<size_t> m_held{0};
+        std::mutex m_sleepMutex;
+        std::condition_variable m_cvIdle;
+        bool m_closed = false;
+    };
+}